@@ -0,0 +1,206 @@
+#include "admission.hpp"
+
+#include "digest.hpp"
+#include "protocol.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace db_proxy
+{
+    namespace
+    {
+        enum ErrorCode : uint16_t {
+            ER_CON_COUNT_ERROR            = 1040,
+            ER_TOO_MANY_USER_CONNECTIONS  = 1203,
+            ER_USER_LIMIT_REACHED         = 1226
+        };
+
+        size_t power_of_two(size_t n)
+        {
+            size_t size = 1;
+            while (size < n)
+                size <<= 1;
+            return size;
+        }
+
+        int64_t interval_of(double qps)
+        {
+            return qps > 0 ? static_cast<int64_t>(std::llround(1e9 / qps)) : 0;
+        }
+
+        size_t burst_of(const admission_options& options)
+        {
+            if (options.burst > 0)
+                return options.burst;
+            return std::max<size_t>(1, static_cast<size_t>(options.qps));
+        }
+    }
+
+    admission::admission(const admission_options& options)
+        : options_(options),
+          interval_(interval_of(options.qps)),
+          tolerance_(interval_ * static_cast<int64_t>(burst_of(options))),
+          slots_(new slot[power_of_two(std::max<size_t>(options.clients, 1))]),
+          mask_(power_of_two(std::max<size_t>(options.clients, 1)) - 1)
+    {
+    }
+
+    admission::client& admission::find(const std::string& key)
+    {
+        uint64_t hash = digest::hash(key.data(), key.size());
+        // 0 marks a free entry
+        if (hash == 0)
+            hash = 1;
+
+        const size_t home = static_cast<size_t>(hash) & mask_;
+        for (size_t i = 0; i < std::min(max_probes, mask_ + 1); i++)
+        {
+            client& c = slots_[(home + i) & mask_].c;
+            uint64_t owner = c.hash.load(std::memory_order_acquire);
+            if (owner == 0 && c.hash.compare_exchange_strong(owner, hash, std::memory_order_acq_rel))
+                return c;
+            if (owner == hash)
+                return c;
+        }
+
+        return slots_[home].c;
+    }
+
+    bool admission::raise(std::atomic<uint32_t>& value, size_t limit)
+    {
+        uint32_t n = value.load(std::memory_order_relaxed);
+        do
+        {
+            if (n >= limit)
+                return false;
+        }
+        while (!value.compare_exchange_weak(n, n + 1, std::memory_order_relaxed));
+        return true;
+    }
+
+    bool admission::open_session(client& c)
+    {
+        if (options_.max_sessions == 0)
+            return true;
+        return raise(c.sessions, options_.max_sessions);
+    }
+
+    void admission::close_session(client& c)
+    {
+        if (options_.max_sessions > 0)
+            c.sessions.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    bool admission::reserve(client& c, size_t n, clock::time_point now, clock::duration max_wait,
+                            clock::duration& wait)
+    {
+        wait = clock::duration::zero();
+        if (interval_ == 0)
+            return true;
+
+        const int64_t at = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+        const int64_t limit = std::chrono::duration_cast<std::chrono::nanoseconds>(max_wait).count();
+        const int64_t cost = interval_ * static_cast<int64_t>(n);
+
+        int64_t tat = c.tat.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            const int64_t next = std::max(tat, at) + cost;
+            const int64_t delay = next - tolerance_ - at;
+            if (delay > limit)
+                return false;
+            if (c.tat.compare_exchange_weak(tat, next, std::memory_order_relaxed))
+            {
+                if (delay > 0)
+                    wait = std::chrono::duration_cast<clock::duration>(std::chrono::nanoseconds(delay));
+                return true;
+            }
+        }
+    }
+
+    bool admission::enter(client& c, waiter& w)
+    {
+        if (options_.max_in_flight == 0)
+            return true;
+        if (c.waiting.load(std::memory_order_relaxed) == 0 && raise(c.in_flight, options_.max_in_flight))
+            return true;
+
+        std::lock_guard<std::mutex> lock(c.queue_lock);
+        // A leave() after this sees the waiter and locks the queue, one
+        // before it left a slot to take here.
+        c.waiting.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!c.first && raise(c.in_flight, options_.max_in_flight))
+        {
+            c.waiting.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        w.next_ = nullptr;
+        w.queued_ = true;
+        if (c.last)
+            c.last->next_ = &w;
+        else
+            c.first = &w;
+        c.last = &w;
+        return false;
+    }
+
+    bool admission::cancel(client& c, waiter& w)
+    {
+        std::lock_guard<std::mutex> lock(c.queue_lock);
+        if (!w.queued_)
+            return false;
+
+        waiter* previous = nullptr;
+        for (waiter* i = c.first; i != &w; i = i->next_)
+            previous = i;
+        (previous ? previous->next_ : c.first) = w.next_;
+        if (c.last == &w)
+            c.last = previous;
+        w.queued_ = false;
+        c.waiting.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void admission::leave(client& c)
+    {
+        if (options_.max_in_flight == 0)
+            return;
+
+        c.in_flight.fetch_sub(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (c.waiting.load(std::memory_order_relaxed) == 0)
+            return;
+
+        // a command which entered meanwhile may have taken the slot, its
+        // own leave() hands it on then
+        std::lock_guard<std::mutex> lock(c.queue_lock);
+        while (c.first && raise(c.in_flight, options_.max_in_flight))
+        {
+            waiter& w = *c.first;
+            c.first = w.next_;
+            if (!c.first)
+                c.last = nullptr;
+            w.queued_ = false;
+            c.waiting.fetch_sub(1, std::memory_order_relaxed);
+            w.granted();
+        }
+    }
+
+    void admission::write_session_error(std::vector<uint8_t>& out, uint8_t sequence_id) const
+    {
+        if (options_.by == admission_options::key::user)
+            My::write_err(out, sequence_id, ER_TOO_MANY_USER_CONNECTIONS, "42000",
+                          "User already has more than 'max_user_connections' active connections");
+        else
+            My::write_err(out, sequence_id, ER_CON_COUNT_ERROR, "08004", "Too many connections");
+    }
+
+    void admission::write_command_error(std::vector<uint8_t>& out, uint8_t sequence_id) const
+    {
+        My::write_err(out, sequence_id, ER_USER_LIMIT_REACHED, "42000",
+                      "Client has exceeded the query rate or in-flight limit of db-proxy");
+    }
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace db_proxy
+{
+    struct admission_options
+    {
+        enum class key {
+            // the client's address
+            ip,
+            // the user of the handshake response, the address for TLS logins
+            // the proxy does not terminate
+            user
+        };
+
+        key by = key::ip;
+        // commands per second of a client, 0 - no limit
+        double qps = 0;
+        // commands a client may send at once above the rate, 0 - max(1, qps)
+        size_t burst = 0;
+        // commands of a client waiting for their response, 0 - no limit
+        size_t max_in_flight = 0;
+        // sessions of a client, 0 - no limit
+        size_t max_sessions = 0;
+        // longest a command is held back before it is refused
+        std::chrono::milliseconds max_wait{100};
+        // clients tracked, clients past it share their entries
+        size_t clients = 16384;
+
+        bool enabled() const { return qps > 0 || max_in_flight > 0 || max_sessions > 0; }
+    };
+
+    // Limits of every client, shared by all shards without a lock.
+    //
+    // Clients are entries of a fixed open addressing table, claimed with a
+    // compare and swap of their key's hash and never given back, so a
+    // session looks its client up once and keeps the reference. When the
+    // probes run out the client shares the entry of its home slot, and so
+    // its limits, with another one.
+    //
+    // The rate is a GCRA token bucket: an entry holds the theoretical
+    // arrival time of its next command, commands move it on by the
+    // interval and are due once it is within burst intervals of now. A
+    // reservation is one compare and swap, commands which have to wait
+    // for their turn keep it while they wait. Sessions and commands in
+    // flight are counters that are only raised below their limit.
+    //
+    // Commands which find no in flight slot queue up at their client, and
+    // leave() hands the slot it frees to the first of them. The queue has a
+    // lock of its own, taken only while commands wait.
+    class admission
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        class waiter;
+
+        class client
+        {
+            friend class admission;
+
+            std::atomic<uint64_t> hash{0};
+            // theoretical arrival time, nanoseconds of clock
+            std::atomic<int64_t> tat{0};
+            std::atomic<uint32_t> in_flight{0};
+            std::atomic<uint32_t> sessions{0};
+            // commands queued for an in flight slot, first come first
+            std::atomic<uint32_t> waiting{0};
+            std::mutex queue_lock;
+            waiter* first = nullptr;
+            waiter* last = nullptr;
+        };
+
+        // A command's place in the queue of its client. leave() calls
+        // granted on its own thread with the queue locked once the slot is
+        // the command's, so granted only posts to the session's thread.
+        class waiter
+        {
+        public:
+            std::function<void()> granted;
+
+        private:
+            friend class admission;
+
+            waiter* next_ = nullptr;
+            bool queued_ = false;
+        };
+
+        explicit admission(const admission_options& options);
+
+        admission(const admission&) = delete;
+        admission& operator=(const admission&) = delete;
+
+        const admission_options& options() const { return options_; }
+
+        // the entry of key, e.g. "ip:10.0.0.1" or "user:app"
+        client& find(const std::string& key);
+
+        // false - the client has max_sessions already
+        bool open_session(client& c);
+        void close_session(client& c);
+
+        // Takes n commands off the client's rate at now. false - they would
+        // have to wait longer than max_wait, nothing was taken; otherwise
+        // wait is how long they have to be held back.
+        bool reserve(client& c, size_t n, clock::time_point now, clock::duration max_wait,
+                     clock::duration& wait);
+
+        // true - the command holds an in flight slot of the client now;
+        // false - the client has max_in_flight commands waiting already and
+        // w is queued for the next free slot.
+        bool enter(client& c, waiter& w);
+        // Takes w out of the queue. false - it was granted a slot, which the
+        // caller holds now whether granted's work has run or not. Once it
+        // returned, no thread is in w.granted any more.
+        bool cancel(client& c, waiter& w);
+        // gives the slot to the first queued command, or back
+        void leave(client& c);
+
+        // ERR packets of a refused session or command, those MySQL answers
+        // its own limits with
+        void write_session_error(std::vector<uint8_t>& out, uint8_t sequence_id) const;
+        void write_command_error(std::vector<uint8_t>& out, uint8_t sequence_id) const;
+
+    private:
+        // linear probes before a client shares its home slot
+        static constexpr size_t max_probes = 32;
+
+        struct alignas(64) slot
+        {
+            client c;
+        };
+
+        static bool raise(std::atomic<uint32_t>& value, size_t limit);
+
+        const admission_options options_;
+        // nanoseconds between two commands of a client at the rate
+        const int64_t interval_;
+        // how far ahead of now the arrival time may run
+        const int64_t tolerance_;
+        std::unique_ptr<slot[]> slots_;
+        size_t mask_;
+    };
+}
@@ -0,0 +1,496 @@
+#include "backend_pool.hpp"
+#include "parser.hpp"
+#include "protocol.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+namespace db_proxy
+{
+    namespace
+    {
+        const char native_password[] = "mysql_native_password";
+
+        // how long a backend whose login failed is passed over
+        const std::chrono::seconds failure_backoff(1);
+
+        const uint32_t client_capabilities =
+                My::CLIENT_LONG_PASSWORD | My::CLIENT_LONG_FLAG | My::CLIENT_PROTOCOL_41 |
+                My::CLIENT_TRANSACTIONS | My::CLIENT_SECURE_CONNECTION |
+                My::CLIENT_MULTI_STATEMENTS | My::CLIENT_MULTI_RESULTS |
+                My::CLIENT_PS_MULTI_RESULTS | My::CLIENT_PLUGIN_AUTH |
+                My::CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA;
+
+        boost::system::error_code protocol_error()
+        {
+            return boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+        }
+
+        // NUL terminated string at offset, advances offset past the NUL
+        std::string read_string_nul(const std::vector<uint8_t>& p, size_t& offset)
+        {
+            const auto begin = p.begin() + static_cast<std::ptrdiff_t>(std::min(offset, p.size()));
+            const auto end = std::find(begin, p.end(), 0);
+            std::string s(begin, end);
+            offset += s.size() + 1;
+            return s;
+        }
+    }
+
+    void backend_connection::async_open(const backend_config& config, handler h)
+    {
+        auto self = shared_from_this();
+        socket.async_connect(
+                    net::ip::tcp::endpoint(net::ip::make_address(config.host), config.port),
+                    [this, self, &config, h](const boost::system::error_code& error)
+        {
+            if (error)
+                return h(error);
+
+            boost::system::error_code ec;
+            socket.set_option(net::ip::tcp::no_delay(true), ec);
+
+            read_packet([this, self, &config, h](const boost::system::error_code& error)
+            {
+                if (error)
+                    return h(error);
+                handle_greeting(config, h);
+            });
+        });
+    }
+
+    void backend_connection::handle_greeting(const backend_config& config, handler h)
+    {
+        if (fail_on_err(h))
+            return;
+
+        // protocol 10: version, thread id, scramble part 1, filler,
+        // capabilities, charset, status, capabilities, scramble length,
+        // reserved, scramble part 2, auth plugin
+        size_t offset = 1;
+        server_version = read_string_nul(payload_, offset);
+        offset += 4;
+        if (payload_.empty() || payload_[0] != 10 || payload_.size() < offset + 8 + 1 + 2 + 1 + 2 + 2 + 1 + 10 + 12)
+        {
+            error_message = "unsupported handshake";
+            return h(protocol_error());
+        }
+
+        std::copy_n(&payload_[offset], 8, scramble_);
+        offset += 8 + 1;
+        uint32_t capabilities = static_cast<uint32_t>(My::read_int<2>(&payload_[offset]));
+        offset += 2 + 1 + 2;
+        capabilities |= static_cast<uint32_t>(My::read_int<2>(&payload_[offset])) << 16;
+        offset += 2 + 1 + 10;
+        std::copy_n(&payload_[offset], 12, scramble_ + 8);
+
+        if (!(capabilities & My::CLIENT_PROTOCOL_41))
+        {
+            error_message = "backend does not speak protocol 4.1";
+            return h(protocol_error());
+        }
+
+        const auto token = My::native_password_token(config.password, scramble_);
+
+        out_.clear();
+        My::PacketWriter w(out_);
+        w.begin(static_cast<uint8_t>(sequence_id_ + 1));
+        w.int_n<4>(client_capabilities & capabilities);
+        w.int_n<4>(My::max_payload_length);
+        w.int_n<1>(config.charset);
+        w.zeros(23);
+        w.string_nul(config.user);
+        w.lenenc(token.size());
+        w.bytes(token.data(), token.size());
+        w.string_nul(native_password);
+        w.finish();
+
+        charset = config.charset;
+
+        auto self = shared_from_this();
+        write_packet([this, self, &config, h](const boost::system::error_code& error)
+        {
+            if (error)
+                return h(error);
+            read_packet([this, self, &config, h](const boost::system::error_code& error)
+            {
+                if (error)
+                    return h(error);
+                handle_auth_result(config, h, false);
+            });
+        });
+    }
+
+    void backend_connection::handle_auth_result(const backend_config& config, handler h, bool switched)
+    {
+        if (fail_on_err(h))
+            return;
+
+        if (!payload_.empty() && payload_[0] == My::OK_PACKET)
+            return h(boost::system::error_code());
+
+        // auth switch request: plugin name and a fresh scramble
+        if (!switched && !payload_.empty() && payload_[0] == My::EOF_PACKET)
+        {
+            size_t offset = 1;
+            const std::string plugin = read_string_nul(payload_, offset);
+            if (plugin == native_password && payload_.size() >= offset + My::scramble_length)
+            {
+                std::copy_n(&payload_[offset], static_cast<size_t>(My::scramble_length), scramble_);
+                const auto token = My::native_password_token(config.password, scramble_);
+
+                out_.clear();
+                My::PacketWriter w(out_);
+                w.begin(static_cast<uint8_t>(sequence_id_ + 1));
+                w.bytes(token.data(), token.size());
+                w.finish();
+
+                auto self = shared_from_this();
+                write_packet([this, self, &config, h](const boost::system::error_code& error)
+                {
+                    if (error)
+                        return h(error);
+                    read_packet([this, self, &config, h](const boost::system::error_code& error)
+                    {
+                        if (error)
+                            return h(error);
+                        handle_auth_result(config, h, true);
+                    });
+                });
+                return;
+            }
+
+            error_message = "unsupported auth plugin " + plugin;
+            return h(protocol_error());
+        }
+
+        error_message = "unexpected packet during authentication";
+        h(protocol_error());
+    }
+
+    void backend_connection::async_command(uint8_t command, const std::string& argument, handler h)
+    {
+        out_.clear();
+        My::PacketWriter w(out_);
+        w.begin(0);
+        w.int_n<1>(command);
+        w.string(argument);
+        w.finish();
+
+        auto self = shared_from_this();
+        write_packet([this, self, h](const boost::system::error_code& error)
+        {
+            if (error)
+                return h(error);
+            read_packet([this, self, h](const boost::system::error_code& error)
+            {
+                if (error)
+                    return h(error);
+                if (fail_on_err(h))
+                    return;
+                if (payload_.empty() || payload_[0] != My::OK_PACKET)
+                {
+                    error_message = "unexpected response";
+                    return h(protocol_error());
+                }
+                h(boost::system::error_code());
+            });
+        });
+    }
+
+    void backend_connection::async_prepare(const std::string& key, const std::string& text, prepare_handler h)
+    {
+        out_.clear();
+        My::PacketWriter w(out_);
+        // closing a statement has no response, the closes simply go ahead
+        // of the prepare
+        if (statements.size() >= max_statements)
+        {
+            for (const auto& statement : statements)
+            {
+                w.begin(0);
+                w.int_n<1>(My::COM_STMT_CLOSE);
+                w.int_n<4>(statement.second);
+                w.finish();
+            }
+            statements.clear();
+        }
+        w.begin(0);
+        w.int_n<1>(My::COM_STMT_PREPARE);
+        w.string(text);
+        w.finish();
+        response.clear();
+
+        auto self = shared_from_this();
+        write_packet([this, self, key, h](const boost::system::error_code& error)
+        {
+            if (error)
+                return h(error, 0);
+            read_packet([this, self, key, h](const boost::system::error_code& error)
+            {
+                if (error)
+                    return h(error, 0);
+
+                response.insert(response.end(), header_, header_ + My::header_size);
+                response.insert(response.end(), payload_.begin(), payload_.end());
+                if (fail_on_err([h](const boost::system::error_code& error) { h(error, 0); }))
+                    return;
+
+                // status, statement id, columns, params, filler, warnings
+                if (payload_.size() < 12 || payload_[0] != My::OK_PACKET)
+                {
+                    error_message = "unexpected response";
+                    return h(protocol_error(), 0);
+                }
+                const auto id = static_cast<uint32_t>(My::read_int<4>(&payload_[1]));
+                const auto columns = static_cast<size_t>(My::read_int<2>(&payload_[5]));
+                const auto params = static_cast<size_t>(My::read_int<2>(&payload_[7]));
+
+                // each list of definitions ends with an EOF, the connection
+                // does not ask for CLIENT_DEPRECATE_EOF
+                const size_t definitions = (params ? params + 1 : 0) + (columns ? columns + 1 : 0);
+                read_definitions(definitions, [this, self, key, id, h](const boost::system::error_code& error)
+                {
+                    if (error)
+                        return h(error, 0);
+                    statements[key] = id;
+                    h(boost::system::error_code(), id);
+                });
+            });
+        });
+    }
+
+    void backend_connection::read_definitions(size_t n, handler h)
+    {
+        if (n == 0)
+            return h(boost::system::error_code());
+
+        auto self = shared_from_this();
+        read_packet([this, self, n, h](const boost::system::error_code& error)
+        {
+            if (error)
+                return h(error);
+            response.insert(response.end(), header_, header_ + My::header_size);
+            response.insert(response.end(), payload_.begin(), payload_.end());
+            read_definitions(n - 1, h);
+        });
+    }
+
+    void backend_connection::read_packet(handler h)
+    {
+        auto self = shared_from_this();
+        net::async_read(socket, net::buffer(header_),
+                        [this, self, h](const boost::system::error_code& error, size_t)
+        {
+            if (error)
+                return h(error);
+
+            sequence_id_ = header_[3];
+            payload_.resize(static_cast<size_t>(My::read_int<3>(header_)));
+            net::async_read(socket, net::buffer(payload_),
+                            [self, h](const boost::system::error_code& error, size_t)
+            {
+                h(error);
+            });
+        });
+    }
+
+    void backend_connection::write_packet(handler h)
+    {
+        auto self = shared_from_this();
+        net::async_write(socket, net::buffer(out_),
+                         [self, h](const boost::system::error_code& error, size_t)
+        {
+            h(error);
+        });
+    }
+
+    bool backend_connection::fail_on_err(const handler& h)
+    {
+        if (payload_.empty() || payload_[0] != My::ERR_PACKET)
+            return false;
+
+        // code, '#', sql state, message
+        error_message = payload_.size() > 9 ? std::string(payload_.begin() + 9, payload_.end()) : "error";
+        h(protocol_error());
+        return true;
+    }
+
+    void backend_pool::acquire(acquire_handler h)
+    {
+        if (!idle_.empty())
+        {
+            auto c = std::move(idle_.front());
+            idle_.pop_front();
+            // stops watching the idle connection
+            c->socket.cancel();
+            net::post(ios_, [h, c] { h(boost::system::error_code(), c); });
+            return;
+        }
+
+        waiters_.push_back(std::move(h));
+
+        if (total_ < config_.max_connections)
+            open_connection();
+    }
+
+    void backend_pool::release(connection_ptr c, bool reset)
+    {
+        if (!reset)
+        {
+            make_idle(std::move(c));
+            return;
+        }
+
+        c->async_command(My::COM_RESET_CONNECTION, std::string(),
+                         [this, c](const boost::system::error_code& error)
+        {
+            if (error)
+            {
+                discard(c);
+                return;
+            }
+            // the schema survives a reset, the character set and prepared
+            // statements do not
+            c->charset = config_.charset;
+            c->statements.clear();
+            make_idle(c);
+        });
+    }
+
+    void backend_pool::discard(connection_ptr c)
+    {
+        boost::system::error_code ignored;
+        c->socket.close(ignored);
+        total_--;
+
+        // a waiter would otherwise wait for a release which never comes
+        if (!waiters_.empty() && total_ < config_.max_connections)
+            open_connection();
+    }
+
+    void backend_pool::retarget(const std::string& host, unsigned short port)
+    {
+        config_.host = host;
+        config_.port = port;
+        target_++;
+        failed_ = false;
+
+        // their watches see the socket closed and leave them alone
+        std::deque<connection_ptr> idle;
+        idle.swap(idle_);
+        for (auto& c : idle)
+            discard(c);
+    }
+
+    void backend_pool::open_connection()
+    {
+        total_++;
+
+        auto c = std::make_shared<backend_connection>(ios_);
+        c->target = target_;
+        c->async_open(config_, [this, c](const boost::system::error_code& error)
+        {
+            if (error)
+            {
+                std::cerr << "Backend login failed: " << error.message();
+                if (!c->error_message.empty())
+                    std::cerr << " (" << c->error_message << ')';
+                std::cerr << std::endl;
+
+                total_--;
+                failed_ = true;
+                failed_at_ = std::chrono::steady_clock::now();
+                // fail the oldest waiter instead of retrying a broken backend
+                if (!waiters_.empty())
+                {
+                    auto h = std::move(waiters_.front());
+                    waiters_.pop_front();
+                    net::post(ios_, [h, error] { h(error, nullptr); });
+                }
+                // each of the others gets an attempt of its own, without
+                // one they would wait for a release which never comes
+                if (!waiters_.empty() && total_ < config_.max_connections)
+                    open_connection();
+                return;
+            }
+
+            // opened for the backend before a retarget()
+            if (c->target != target_)
+            {
+                discard(c);
+                return;
+            }
+
+            server_version_ = c->server_version;
+            failed_ = false;
+            make_idle(c);
+        });
+    }
+
+    bool backend_pool::available() const
+    {
+        return !failed_ || std::chrono::steady_clock::now() - failed_at_ >= failure_backoff;
+    }
+
+    void backend_pool::make_idle(connection_ptr c)
+    {
+        if (c->target != target_)
+        {
+            discard(std::move(c));
+            return;
+        }
+
+        if (!waiters_.empty())
+        {
+            auto h = std::move(waiters_.front());
+            waiters_.pop_front();
+            net::post(ios_, [h, c] { h(boost::system::error_code(), c); });
+            return;
+        }
+
+        const uint64_t generation = ++c->generation;
+        idle_.push_back(c);
+
+        // An idle connection must stay silent, anything readable means the
+        // backend closed it (wait_timeout, restart) and it is dropped.
+        std::weak_ptr<backend_connection> weak = c;
+        c->socket.async_wait(net::socket_base::wait_read,
+                             [this, weak, generation](const boost::system::error_code& error)
+        {
+            auto c = weak.lock();
+            if (error == net::error::operation_aborted || !c || c->generation != generation)
+                return;
+
+            auto it = std::find(idle_.begin(), idle_.end(), c);
+            if (it == idle_.end())
+                return;
+
+            idle_.erase(it);
+            discard(c);
+        });
+    }
+
+    backend_group::backend_group(net::io_context& ios, const backend_config& primary,
+                                 const std::vector<backend_config>& replicas)
+        : primary_(ios, primary)
+    {
+        for (const auto& config : replicas)
+            replicas_.emplace_back(new backend_pool(ios, config));
+    }
+
+    backend_pool* backend_group::replica()
+    {
+        const size_t n = replicas_.size();
+        const size_t start = next_++ % n;
+
+        backend_pool* best = nullptr;
+        for (size_t i = 0; i < n; i++)
+        {
+            backend_pool* candidate = replicas_[(start + i) % n].get();
+            if (candidate->available() && (!best || candidate->outstanding() < best->outstanding()))
+                best = candidate;
+        }
+        return best;
+    }
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace net = boost::asio;
+
+namespace db_proxy
+{
+    struct backend_config
+    {
+        std::string host;
+        unsigned short port = 0;
+        std::string user;
+        std::string password;
+        // connections per shard
+        size_t max_connections = 1;
+        // utf8_general_ci
+        uint8_t charset = 33;
+    };
+
+    // Backend connection logged in with the proxy's own credentials.
+    class backend_connection : public std::enable_shared_from_this<backend_connection>
+    {
+    public:
+        using handler = std::function<void(const boost::system::error_code&)>;
+        using prepare_handler = std::function<void(const boost::system::error_code&, uint32_t)>;
+
+        // statements kept prepared on a connection before they are all
+        // closed to make room
+        static const size_t max_statements = 256;
+
+        explicit backend_connection(net::io_context& ios) : socket(ios)
+        {
+        }
+
+        // Connects and authenticates with mysql_native_password.
+        void async_open(const backend_config& config, handler h);
+
+        // Sends a command and waits for its OK. An ERR completes with
+        // protocol_error and its message in error_message.
+        void async_command(uint8_t command, const std::string& argument, handler h);
+
+        // Prepares text and remembers its statement id under key in
+        // statements. The response packets are left in response; an ERR
+        // completes with protocol_error.
+        void async_prepare(const std::string& key, const std::string& text, prepare_handler h);
+
+        net::ip::tcp::socket socket;
+        std::string server_version;
+        std::string error_message;
+        // session state the connection is currently in
+        std::string schema;
+        uint8_t charset = 0;
+        // bumped every time the connection becomes idle
+        uint64_t generation = 0;
+        // backend_pool::retarget() count when the connection was opened
+        uint64_t target = 0;
+        // statement ids of the statement cache's texts prepared here
+        std::unordered_map<std::string, uint32_t> statements;
+        // packets of the last async_prepare() response, headers included
+        std::vector<uint8_t> response;
+
+    private:
+        void read_packet(handler h);
+        void write_packet(handler h);
+        void read_definitions(size_t n, handler h);
+        void handle_greeting(const backend_config& config, handler h);
+        void handle_auth_result(const backend_config& config, handler h, bool switched);
+        bool fail_on_err(const handler& h);
+
+        uint8_t header_[4] = {0};
+        std::vector<uint8_t> payload_;
+        std::vector<uint8_t> out_;
+        uint8_t sequence_id_ = 0;
+        uint8_t scramble_[20] = {0};
+    };
+
+    // Authenticated backend connections of one shard. Connections are lent
+    // to client sessions and come back when the session no longer needs
+    // them; all calls are made from the shard's thread.
+    class backend_pool
+    {
+    public:
+        using connection_ptr = std::shared_ptr<backend_connection>;
+        using acquire_handler = std::function<void(const boost::system::error_code&, connection_ptr)>;
+
+        backend_pool(net::io_context& ios, const backend_config& config)
+            : ios_(ios), config_(config)
+        {
+        }
+
+        backend_pool(const backend_pool&) = delete;
+        backend_pool& operator=(const backend_pool&) = delete;
+
+        // Completes with an idle connection, opens a new one while below the
+        // limit, otherwise waits for a connection to be released.
+        void acquire(acquire_handler h);
+
+        // Returns a connection. With reset the session state left by the
+        // client is cleared with COM_RESET_CONNECTION first.
+        void release(connection_ptr c, bool reset);
+
+        // Drops a connection in an unknown protocol state.
+        void discard(connection_ptr c);
+
+        // New connections go to host:port. Idle ones to the old backend are
+        // closed, lent ones when they come back; sessions keep theirs.
+        void retarget(const std::string& host, unsigned short port);
+
+        // version reported by the backend, empty until the first login
+        const std::string& server_version() const { return server_version_; }
+
+        const backend_config& config() const { return config_; }
+
+        // connections lent out or being opened plus sessions waiting for one
+        size_t outstanding() const { return total_ - idle_.size() + waiters_.size(); }
+
+        // false for a while after a login failed
+        bool available() const;
+
+    private:
+        void open_connection();
+        void make_idle(connection_ptr c);
+
+        net::io_context& ios_;
+        backend_config config_;
+        std::deque<connection_ptr> idle_;
+        std::deque<acquire_handler> waiters_;
+        size_t total_ = 0;
+        // bumped by retarget()
+        uint64_t target_ = 0;
+        std::string server_version_;
+        std::chrono::steady_clock::time_point failed_at_;
+        bool failed_ = false;
+    };
+
+    // The backends of one shard: the primary and its replicas, each with a
+    // pool of its own. Reads that may see slightly stale data go to the
+    // replica with the fewest requests outstanding, everything else to the
+    // primary.
+    class backend_group
+    {
+    public:
+        backend_group(net::io_context& ios, const backend_config& primary,
+                      const std::vector<backend_config>& replicas);
+
+        backend_group(const backend_group&) = delete;
+        backend_group& operator=(const backend_group&) = delete;
+
+        backend_pool& primary() { return primary_; }
+
+        bool has_replicas() const { return !replicas_.empty(); }
+
+        // least loaded replica, ties are taken in turns; nullptr while
+        // none is available
+        backend_pool* replica();
+
+    private:
+        backend_pool primary_;
+        std::vector<std::unique_ptr<backend_pool>> replicas_;
+        size_t next_ = 0;
+    };
+}
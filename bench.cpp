@@ -0,0 +1,755 @@
+#include <boost/asio.hpp>
+
+#include "backend_pool.hpp"
+#include "fake_server.hpp"
+#include "metrics.hpp"
+#include "parser.hpp"
+#include "protocol.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace net = boost::asio;
+
+namespace db_proxy
+{
+    using bench_clock = std::chrono::steady_clock;
+
+    struct load_options
+    {
+        std::string host = "127.0.0.1";
+        // the proxy
+        unsigned short port = 0;
+        // the server behind it, for a baseline run first. 0 - no baseline
+        unsigned short direct_port = 0;
+        std::string user = "bench";
+        std::string password;
+        size_t connections = 16;
+        size_t threads = 1;
+        std::chrono::seconds duration{10};
+        // not measured, connections log in and warm up
+        std::chrono::seconds warmup{1};
+        // oltp, large, mixed, prepared or trace
+        std::string mix = "oltp";
+        std::string trace;
+        size_t large_rows = 10000;
+        // process whose CPU time is charged to the queries, 0 - none
+        int proxy_pid = 0;
+    };
+
+    namespace
+    {
+        const char* const log_records[] = {
+            "Execute query: ",
+            "Prepare statement: ",
+            "Execute prepared statement: ",
+            "Execute unknown prepared statement ",
+            "Deallocate prepared statement: "
+        };
+
+        bool starts_with(const std::string& s, const char* prefix)
+        {
+            return s.compare(0, std::char_traits<char>::length(prefix), prefix) == 0;
+        }
+
+        // Queries of a trace: the query log the proxy writes, of which only
+        // the complete queries are replayed, or a file of one query per line.
+        std::vector<std::string> read_trace(const std::string& path)
+        {
+            std::ifstream in(path);
+            if (!in)
+                throw std::runtime_error("can't open trace " + path);
+
+            std::vector<std::string> lines;
+            bool proxy_log = false;
+            for (std::string line; std::getline(in, line);)
+            {
+                proxy_log = proxy_log || starts_with(line, log_records[0]);
+                lines.push_back(std::move(line));
+            }
+
+            std::vector<std::string> queries;
+            if (!proxy_log)
+            {
+                for (auto& line : lines)
+                {
+                    if (!line.empty())
+                        queries.push_back(std::move(line));
+                }
+                return queries;
+            }
+
+            // a record runs until the next one, queries may span lines
+            bool in_query = false;
+            for (auto& line : lines)
+            {
+                bool record = false;
+                for (const char* prefix : log_records)
+                    record = record || starts_with(line, prefix);
+
+                if (!record)
+                {
+                    if (in_query)
+                        queries.back() += '\n' + line;
+                    continue;
+                }
+
+                in_query = starts_with(line, log_records[0]);
+                if (in_query)
+                    queries.push_back(line.substr(std::char_traits<char>::length(log_records[0])));
+            }
+
+            // the log cuts long queries and marks them with "..."
+            std::vector<std::string> complete;
+            for (auto& q : queries)
+            {
+                if (q.size() < 3 || q.compare(q.size() - 3, 3, "...") != 0)
+                    complete.push_back(std::move(q));
+            }
+            return complete;
+        }
+
+        // Statements the connections send round and round.
+        std::vector<std::string> make_workload(const load_options& options)
+        {
+            if (options.mix == "trace")
+            {
+                auto queries = read_trace(options.trace);
+                if (queries.empty())
+                    throw std::runtime_error("no queries in " + options.trace);
+                return queries;
+            }
+
+            // ORM style: every statement is prepared, executed once and
+            // closed again, the parameters are random ids
+            if (options.mix == "prepared")
+            {
+                std::vector<std::string> statements(10, "SELECT c FROM sbtest1 WHERE id=?");
+                statements.push_back("SELECT c FROM sbtest1 WHERE id BETWEEN ? AND ? LIMIT 100");
+                statements.push_back("UPDATE sbtest1 SET k=k+1 WHERE id=?");
+                return statements;
+            }
+
+            const std::string large = "SELECT c FROM sbtest1 LIMIT " + std::to_string(options.large_rows);
+            if (options.mix == "large")
+                return {large};
+            if (options.mix != "oltp" && options.mix != "mixed")
+                throw std::runtime_error("unknown mix " + options.mix);
+
+            // sysbench oltp_read_write alike transactions, every tenth
+            // followed by a large SELECT in the mixed one
+            std::minstd_rand random(42);
+            std::uniform_int_distribution<int> id(1, 1000000);
+            std::vector<std::string> statements;
+            for (size_t t = 0; t < 100; t++)
+            {
+                statements.push_back("BEGIN");
+                for (int i = 0; i < 10; i++)
+                    statements.push_back("SELECT c FROM sbtest1 WHERE id=" + std::to_string(id(random)));
+                const int from = id(random);
+                statements.push_back("SELECT c FROM sbtest1 WHERE id BETWEEN " + std::to_string(from) +
+                                     " AND " + std::to_string(from + 99) + " LIMIT 100");
+                statements.push_back("UPDATE sbtest1 SET k=k+1 WHERE id=" + std::to_string(id(random)));
+                statements.push_back("COMMIT");
+                if (options.mix == "mixed" && t % 10 == 9)
+                    statements.push_back(large);
+            }
+            return statements;
+        }
+
+        // user plus system time of this process
+        std::chrono::microseconds own_cpu_time()
+        {
+#if defined(_WIN32)
+            FILETIME created, exited, kernel, user;
+            GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+            const auto ticks = [](const FILETIME& t)
+            {
+                return (static_cast<uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime;
+            };
+            return std::chrono::microseconds((ticks(kernel) + ticks(user)) / 10);
+#else
+            rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+                   std::chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+#endif
+        }
+
+        // utime + stime of /proc/pid/stat, -1 when there is none
+        std::chrono::microseconds process_cpu_time(int pid)
+        {
+#if defined(__linux__)
+            std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+            std::string stat;
+            if (pid > 0 && std::getline(in, stat))
+            {
+                // the command name may contain spaces, fields count from its end
+                std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+                std::string skip;
+                for (int i = 3; i < 14; i++)
+                    fields >> skip;
+                uint64_t utime = 0, stime = 0;
+                fields >> utime >> stime;
+                return std::chrono::microseconds((utime + stime) * 1000000 / static_cast<uint64_t>(sysconf(_SC_CLK_TCK)));
+            }
+#else
+            (void)pid;
+#endif
+            return std::chrono::microseconds(-1);
+        }
+    }
+
+    // Queries of the connections of one thread, only that thread records.
+    struct load_stats
+    {
+        latency_histogram latency;
+        uint64_t errors = 0;
+        uint64_t bytes = 0;
+        uint64_t failed_logins = 0;
+    };
+
+    // Sends the workload one statement at a time, each after the whole
+    // response to the previous one, until the deadline. Prepared ones
+    // count as one query from the prepare to the end of the execute's
+    // response; the close goes out with the next prepare.
+    class load_connection : public std::enable_shared_from_this<load_connection>
+    {
+    public:
+        load_connection(net::io_context& ios, const backend_config& config,
+                        const std::vector<std::string>& workload, size_t first, bool prepared,
+                        bench_clock::time_point measure_from, bench_clock::time_point deadline,
+                        load_stats& stats)
+            : connection_(std::make_shared<backend_connection>(ios)),
+              config_(config),
+              workload_(workload),
+              next_(first),
+              prepared_(prepared),
+              random_(static_cast<std::minstd_rand::result_type>(first + 1)),
+              measure_from_(measure_from),
+              deadline_(deadline),
+              stats_(stats),
+              in_(16 * 1024)
+        {
+        }
+
+        void start()
+        {
+            auto self = shared_from_this();
+            connection_->async_open(config_, [this, self](const boost::system::error_code& error)
+            {
+                if (error)
+                {
+                    std::cerr << "Login failed: " << error.message();
+                    if (!connection_->error_message.empty())
+                        std::cerr << " (" << connection_->error_message << ')';
+                    std::cerr << std::endl;
+                    stats_.failed_logins++;
+                    return;
+                }
+
+                boost::system::error_code ec;
+                connection_->socket.set_option(net::ip::tcp::no_delay(true), ec);
+                send_next();
+            });
+        }
+
+    private:
+        void send_next()
+        {
+            if (bench_clock::now() >= deadline_)
+            {
+                quit();
+                return;
+            }
+
+            const std::string& statement = workload_[next_++ % workload_.size()];
+            out_.clear();
+            My::PacketWriter w(out_);
+            if (prepared_)
+            {
+                // closing has no response
+                if (statement_id_ != 0)
+                {
+                    w.begin(0);
+                    w.int_n<1>(My::COM_STMT_CLOSE);
+                    w.int_n<4>(statement_id_);
+                    w.finish();
+                    statement_id_ = 0;
+                }
+                params_ = static_cast<size_t>(std::count(statement.begin(), statement.end(), '?'));
+            }
+            w.begin(0);
+            w.int_n<1>(prepared_ ? My::COM_STMT_PREPARE : My::COM_QUERY);
+            w.string(statement);
+            w.finish();
+
+            tracker_.start(prepared_ ? My::COM_STMT_PREPARE : My::COM_QUERY);
+            framer_ = My::PacketFramer();
+            received_ = 0;
+            sent_at_ = bench_clock::now();
+
+            write();
+        }
+
+        void send_execute()
+        {
+            std::uniform_int_distribution<uint64_t> id(1, 1000000);
+
+            out_.clear();
+            My::PacketWriter w(out_);
+            w.begin(0);
+            w.int_n<1>(My::COM_STMT_EXECUTE);
+            w.int_n<4>(statement_id_);
+            // no cursor, one iteration
+            w.int_n<1>(0);
+            w.int_n<4>(1);
+            if (params_ > 0)
+            {
+                // NULL bitmap, types bound, BIGINTs
+                w.zeros((params_ + 7) / 8);
+                w.int_n<1>(1);
+                for (size_t i = 0; i < params_; i++)
+                    w.int_n<2>(My::MYSQL_TYPE_LONGLONG);
+                for (size_t i = 0; i < params_; i++)
+                    w.int_n<8>(id(random_));
+            }
+            w.finish();
+
+            tracker_.start(My::COM_STMT_EXECUTE);
+            framer_ = My::PacketFramer();
+            executing_ = true;
+
+            write();
+        }
+
+        void write()
+        {
+            net::async_write(connection_->socket, net::buffer(out_),
+                             std::bind(&load_connection::handle_write,
+                                       shared_from_this(),
+                                       std::placeholders::_1));
+        }
+
+        void handle_write(const boost::system::error_code& error)
+        {
+            if (!error)
+                read();
+            else
+                fail(error);
+        }
+
+        void read()
+        {
+            connection_->socket.async_read_some(net::buffer(in_),
+                                                std::bind(&load_connection::handle_read,
+                                                          shared_from_this(),
+                                                          std::placeholders::_1,
+                                                          std::placeholders::_2));
+        }
+
+        void handle_read(const boost::system::error_code& error, size_t bytes_transferred)
+        {
+            if (error)
+            {
+                fail(error);
+                return;
+            }
+
+            received_ += bytes_transferred;
+            bool done = false;
+            framer_.feed(in_.data(), bytes_transferred, [&](const My::PacketFramer::Packet& packet)
+            {
+                // status, statement id of PREPARE_OK
+                if (prepared_ && !executing_ && statement_id_ == 0 &&
+                    packet.head_size >= 1 + 4 && packet.head[0] == My::OK_PACKET)
+                    statement_id_ = static_cast<uint32_t>(My::read_int<4>(packet.head + 1));
+                done = done || tracker_.on_packet(packet);
+            });
+
+            if (!done)
+            {
+                read();
+                return;
+            }
+
+            if (prepared_ && !executing_ && !tracker_.error())
+            {
+                send_execute();
+                return;
+            }
+            executing_ = false;
+
+            if (sent_at_ >= measure_from_)
+            {
+                const auto us = std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now() - sent_at_);
+                stats_.latency.record(static_cast<uint64_t>(us.count()));
+                stats_.bytes += received_;
+                if (tracker_.error())
+                    stats_.errors++;
+            }
+
+            send_next();
+        }
+
+        void quit()
+        {
+            out_.clear();
+            My::PacketWriter w(out_);
+            w.begin(0);
+            w.int_n<1>(My::COM_QUIT);
+            w.finish();
+
+            auto self = shared_from_this();
+            net::async_write(connection_->socket, net::buffer(out_),
+                             [this, self](const boost::system::error_code&, size_t)
+            {
+                boost::system::error_code ec;
+                connection_->socket.close(ec);
+            });
+        }
+
+        void fail(const boost::system::error_code& error)
+        {
+            std::cerr << "Connection lost: " << error.message() << std::endl;
+            stats_.errors++;
+        }
+
+        std::shared_ptr<backend_connection> connection_;
+        const backend_config& config_;
+        const std::vector<std::string>& workload_;
+        size_t next_;
+        const bool prepared_;
+        std::minstd_rand random_;
+        const bench_clock::time_point measure_from_;
+        const bench_clock::time_point deadline_;
+        load_stats& stats_;
+
+        std::vector<uint8_t> out_;
+        std::vector<uint8_t> in_;
+        My::PacketFramer framer_;
+        My::ResponseTracker tracker_;
+        size_t received_ = 0;
+        bench_clock::time_point sent_at_;
+
+        // prepared statements: the current one, its parameters and whether
+        // it is being executed
+        uint32_t statement_id_ = 0;
+        size_t params_ = 0;
+        bool executing_ = false;
+    };
+
+    struct load_result
+    {
+        histogram_snapshot latency;
+        uint64_t errors = 0;
+        uint64_t bytes = 0;
+        uint64_t failed_logins = 0;
+        double seconds = 0;
+        std::chrono::microseconds own_cpu{0};
+        // -1 - not measured
+        std::chrono::microseconds proxy_cpu{-1};
+    };
+
+    // Runs the workload against port with options.connections connections
+    // spread over options.threads threads, one io_context each.
+    load_result run_load(const load_options& options, unsigned short port,
+                         const std::vector<std::string>& workload, bool through_proxy)
+    {
+        backend_config config;
+        config.host = options.host;
+        config.port = port;
+        config.user = options.user;
+        config.password = options.password;
+
+        const size_t threads = std::max<size_t>(1, std::min(options.threads, options.connections));
+        std::vector<std::unique_ptr<net::io_context>> contexts;
+        std::vector<std::unique_ptr<load_stats>> stats;
+        for (size_t i = 0; i < threads; i++)
+        {
+            contexts.emplace_back(new net::io_context(1));
+            stats.emplace_back(new load_stats);
+        }
+
+        const auto start = bench_clock::now();
+        const auto measure_from = start + options.warmup;
+        const auto deadline = measure_from + options.duration;
+
+        for (size_t i = 0; i < options.connections; i++)
+        {
+            const size_t t = i % threads;
+            // connections start spread over the workload
+            std::make_shared<load_connection>(*contexts[t], config, workload,
+                                              i * workload.size() / options.connections,
+                                              options.mix == "prepared",
+                                              measure_from, deadline, *stats[t])->start();
+        }
+
+        // the measured part only begins after the warmup, so does the CPU time
+        std::chrono::microseconds own_cpu{0}, proxy_cpu{-1};
+        std::thread sampler([&]
+        {
+            std::this_thread::sleep_until(measure_from);
+            own_cpu = own_cpu_time();
+            if (through_proxy && options.proxy_pid > 0)
+                proxy_cpu = process_cpu_time(options.proxy_pid);
+            std::this_thread::sleep_until(deadline);
+            own_cpu = own_cpu_time() - own_cpu;
+            if (proxy_cpu.count() >= 0)
+                proxy_cpu = process_cpu_time(options.proxy_pid) - proxy_cpu;
+        });
+
+        std::vector<std::thread> workers;
+        for (auto& ios : contexts)
+            workers.emplace_back([&ios] { ios->run(); });
+        for (auto& w : workers)
+            w.join();
+        sampler.join();
+
+        load_result result;
+        for (auto& s : stats)
+        {
+            result.latency.add(s->latency);
+            result.errors += s->errors;
+            result.bytes += s->bytes;
+            result.failed_logins += s->failed_logins;
+        }
+        result.seconds = std::chrono::duration<double>(options.duration).count();
+        result.own_cpu = own_cpu;
+        result.proxy_cpu = proxy_cpu;
+        return result;
+    }
+
+    void print_header()
+    {
+        std::cout << std::left << std::setw(8) << "target" << std::right
+                  << std::setw(12) << "queries"
+                  << std::setw(11) << "qps"
+                  << std::setw(10) << "p50 ms"
+                  << std::setw(10) << "p99 ms"
+                  << std::setw(10) << "p999 ms"
+                  << std::setw(10) << "MB/s"
+                  << std::setw(8) << "errors"
+                  << std::setw(13) << "bench us/q"
+                  << std::setw(13) << "proxy us/q" << '\n';
+    }
+
+    void print_result(const char* target, const load_result& r)
+    {
+        const double queries = static_cast<double>(r.latency.count);
+        const auto ms = [&](double q) { return static_cast<double>(r.latency.value_at(q)) / 1000; };
+        const auto per_query = [&](std::chrono::microseconds cpu)
+        {
+            return queries > 0 ? static_cast<double>(cpu.count()) / queries : 0.0;
+        };
+
+        std::cout << std::left << std::setw(8) << target << std::right << std::fixed
+                  << std::setw(12) << r.latency.count
+                  << std::setw(11) << std::setprecision(0) << queries / r.seconds
+                  << std::setw(10) << std::setprecision(3) << ms(0.5)
+                  << std::setw(10) << ms(0.99)
+                  << std::setw(10) << ms(0.999)
+                  << std::setw(10) << std::setprecision(1) << static_cast<double>(r.bytes) / r.seconds / (1 << 20)
+                  << std::setw(8) << r.errors
+                  << std::setw(13) << std::setprecision(2) << per_query(r.own_cpu);
+        if (r.proxy_cpu.count() >= 0)
+            std::cout << std::setw(13) << per_query(r.proxy_cpu);
+        else
+            std::cout << std::setw(13) << "-";
+        std::cout << '\n';
+
+        if (r.failed_logins > 0)
+            std::cout << "  " << r.failed_logins << " connections failed to log in\n";
+    }
+
+    void print_overhead(const load_result& direct, const load_result& proxy)
+    {
+        const auto qps = [](const load_result& r) { return static_cast<double>(r.latency.count) / r.seconds; };
+        const auto delta_ms = [&](double q)
+        {
+            return (static_cast<double>(proxy.latency.value_at(q)) - static_cast<double>(direct.latency.value_at(q))) / 1000;
+        };
+
+        std::cout << std::fixed << std::setprecision(3)
+                  << "overhead: p50 " << std::showpos << delta_ms(0.5)
+                  << " ms, p99 " << delta_ms(0.99)
+                  << " ms, p999 " << delta_ms(0.999) << " ms, qps " << std::setprecision(1);
+        if (qps(direct) > 0)
+            std::cout << (qps(proxy) / qps(direct) - 1) * 100 << '%';
+        std::cout << std::noshowpos << '\n';
+    }
+}
+
+class BenchOptions {
+private:
+    int argc_;
+    char **argv_;
+public:
+    std::string     command;
+    // server
+    std::string     bind_host = "127.0.0.1";
+    unsigned short  bind_port = 3306;
+    size_t          threads = 1;
+    db_proxy::fake_server_options server;
+    // run
+    db_proxy::load_options load;
+
+    BenchOptions(int argc, char **argv) : argc_(argc), argv_(argv) {
+    }
+
+    // false - something required is missing
+    bool parse() {
+        if(argc_ < 2)
+            return false;
+        command = argv_[1];
+
+        for(int i = 2; i < argc_; i++) {
+            std::string arg = argv_[i];
+
+            if(arg == "--bind-host")
+                bind_host = argv_[++i];
+            if(arg == "--bind-port")
+                bind_port = static_cast<unsigned short>(std::stoi(argv_[++i]));
+            if(arg == "--threads") {
+                threads = static_cast<size_t>(std::max(1, std::stoi(argv_[++i])));
+                load.threads = threads;
+            }
+            if(arg == "--rows")
+                server.rows = static_cast<size_t>(std::max(0, std::stoi(argv_[++i])));
+            if(arg == "--row-size")
+                server.row_size = static_cast<size_t>(std::max(0, std::stoi(argv_[++i])));
+            if(arg == "--host")
+                load.host = argv_[++i];
+            if(arg == "--port")
+                load.port = static_cast<unsigned short>(std::stoi(argv_[++i]));
+            if(arg == "--direct-port")
+                load.direct_port = static_cast<unsigned short>(std::stoi(argv_[++i]));
+            if(arg == "--user")
+                load.user = argv_[++i];
+            if(arg == "--password")
+                load.password = argv_[++i];
+            if(arg == "--connections")
+                load.connections = static_cast<size_t>(std::max(1, std::stoi(argv_[++i])));
+            if(arg == "--duration")
+                load.duration = std::chrono::seconds(std::max(1, std::stoi(argv_[++i])));
+            if(arg == "--warmup")
+                load.warmup = std::chrono::seconds(std::max(0, std::stoi(argv_[++i])));
+            if(arg == "--mix")
+                load.mix = argv_[++i];
+            if(arg == "--trace") {
+                load.trace = argv_[++i];
+                load.mix = "trace";
+            }
+            if(arg == "--large-rows")
+                load.large_rows = static_cast<size_t>(std::max(0, std::stoi(argv_[++i])));
+            if(arg == "--proxy-pid")
+                load.proxy_pid = std::stoi(argv_[++i]);
+        }
+
+        if(command == "server")
+            return true;
+        if(command == "run")
+            return load.port != 0;
+        return false;
+    }
+
+    void help() {
+        std::cout << "Usage: " << argv_[0] << " server|run [options]" << '\n';
+        std::cout << "  server - fake MySQL server, logs in anyone and answers SELECTs with LIMIT rows\n";
+        std::cout << "    --bind-host [arg]" << "\t Address to listen on. Default: " << bind_host << '\n';
+        std::cout << "    --bind-port [arg]" << "\t Port to listen on. Default: " << bind_port << '\n';
+        std::cout << "    --threads [arg]" << "\t Threads serving the connections. Default: " << threads << '\n';
+        std::cout << "    --rows [arg]" << "\t\t Rows of a SELECT without LIMIT. Default: " << server.rows << '\n';
+        std::cout << "    --row-size [arg]" << "\t Bytes per row. Default: " << server.row_size << '\n';
+        std::cout << "  run - load through the proxy, and first straight to the server with --direct-port\n";
+        std::cout << "    --host [arg]" << "\t\t Host of the proxy and the server. Default: " << load.host << '\n';
+        std::cout << "    --port arg" << "\t\t Port of the proxy\n";
+        std::cout << "    --direct-port [arg]" << "\t Port of the server, for the baseline run. Default: none\n";
+        std::cout << "    --user [arg]" << "\t\t Default: " << load.user << '\n';
+        std::cout << "    --password [arg]" << "\t Default: empty\n";
+        std::cout << "    --connections [arg]" << "\t Default: " << load.connections << '\n';
+        std::cout << "    --threads [arg]" << "\t Client threads. Default: " << load.threads << '\n';
+        std::cout << "    --duration [arg]" << "\t Measured seconds per run. Default: " << load.duration.count() << '\n';
+        std::cout << "    --warmup [arg]" << "\t Seconds before measuring. Default: " << load.warmup.count() << '\n';
+        std::cout << "    --mix [arg]" << "\t\t oltp - sysbench like transactions, large - SELECTs of --large-rows rows, mixed - both, prepared - point selects and updates each prepared, executed and closed. Default: " << load.mix << '\n';
+        std::cout << "    --trace arg" << "\t\t Replay the queries of a proxy log or of a file with one per line\n";
+        std::cout << "    --large-rows [arg]" << "\t Default: " << load.large_rows << '\n';
+        std::cout << "    --proxy-pid [arg]" << "\t Charge the CPU time of this process to the proxy's queries (Linux)\n";
+    }
+};
+
+int main(int argc, char** argv)
+{
+    BenchOptions options(argc, argv);
+
+    if (!options.parse()) {
+        options.help();
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        if (options.command == "server")
+        {
+            net::io_context ios;
+            db_proxy::fake_server server(ios, options.bind_host, options.bind_port, options.server);
+            server.start();
+
+            net::signal_set signals(ios, SIGINT, SIGTERM);
+            signals.async_wait([&ios](const boost::system::error_code&, int)
+            {
+                ios.stop();
+            });
+
+            std::vector<std::thread> threads;
+            for (size_t i = 1; i < options.threads; i++)
+                threads.emplace_back([&ios] { ios.run(); });
+            ios.run();
+            for (auto& t : threads)
+                t.join();
+
+            std::cout << "statements prepared: " << server.prepares() << ", executed: " << server.executes() << '\n';
+            return EXIT_SUCCESS;
+        }
+
+        const auto workload = db_proxy::make_workload(options.load);
+
+        db_proxy::print_header();
+        std::unique_ptr<db_proxy::load_result> direct;
+        if (options.load.direct_port != 0)
+        {
+            direct.reset(new db_proxy::load_result(
+                    db_proxy::run_load(options.load, options.load.direct_port, workload, false)));
+            db_proxy::print_result("direct", *direct);
+        }
+
+        const auto proxy = db_proxy::run_load(options.load, options.load.port, workload, true);
+        db_proxy::print_result("proxy", proxy);
+
+        if (direct)
+            db_proxy::print_overhead(*direct, proxy);
+    }
+    catch(std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return EXIT_SUCCESS;
+}
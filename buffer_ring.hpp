@@ -0,0 +1,158 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <array>
+#include <cstdint>
+
+#include "memory_pool.hpp"
+
+namespace net = boost::asio;
+
+namespace db_proxy
+{
+    enum { max_pipeline_depth = 16 };
+
+    // Ring of I/O buffers for one relay direction. A read fills the slot
+    // after the last filled one while the earlier slots are still being
+    // written, and all filled slots go out in one gathered write.
+    //
+    // Slots borrow their buffers from the shard's buffer_pool only while they
+    // hold data, so an idle direction owns no buffer at all. The size of the
+    // next buffer adapts to the stream: it grows while reads fill a buffer
+    // completely and shrinks back when they use only a small part of it.
+    class buffer_ring
+    {
+    public:
+        // Buffer sequence over the gathered slots. Holds no storage of its
+        // own, so passing it to async_write does not allocate.
+        class const_buffers
+        {
+        public:
+            const_buffers(const net::const_buffer* first, size_t count)
+                : first_(first), count_(count)
+            {
+            }
+
+            const net::const_buffer* begin() const { return first_; }
+            const net::const_buffer* end() const { return first_ + count_; }
+
+        private:
+            const net::const_buffer* first_;
+            size_t count_;
+        };
+
+        buffer_ring(buffer_pool& pool, size_t depth)
+            : pool_(pool), depth_(depth)
+        {
+        }
+
+        ~buffer_ring()
+        {
+            for (auto& s : slots_)
+            {
+                if (s.data)
+                    pool_.deallocate(s.data, s.size_class);
+            }
+        }
+
+        buffer_ring(const buffer_ring&) = delete;
+        buffer_ring& operator=(const buffer_ring&) = delete;
+
+        size_t depth() const { return depth_; }
+        size_t filled() const { return filled_; }
+        bool empty() const { return filled_ == 0; }
+        bool full() const { return filled_ == depth_; }
+
+        // Free slot for the next read, must not be called when full().
+        net::mutable_buffer prepare()
+        {
+            slot& s = slots_[tail()];
+            if (!s.data)
+            {
+                s.size_class = size_class_;
+                s.data = pool_.allocate(s.size_class);
+            }
+            return net::buffer(s.data, buffer_pool::class_size(s.size_class));
+        }
+
+        // Marks the prepared slot as holding size bytes and returns them.
+        uint8_t* commit(size_t size)
+        {
+            slot& s = slots_[tail()];
+            s.size = size;
+            filled_++;
+
+            const size_t capacity = buffer_pool::class_size(s.size_class);
+            if (size == capacity && size_class_ + 1 < buffer_pool::classes)
+                size_class_++;
+            else if (size < capacity / 4 && size_class_ > 0)
+                size_class_--;
+
+            return s.data;
+        }
+
+        // Gives back the slot of the last commit(), whose bytes were used
+        // up in place instead of being written.
+        void drop_last()
+        {
+            filled_--;
+            slot& s = slots_[tail()];
+            pool_.deallocate(s.data, s.size_class);
+            s.data = nullptr;
+        }
+
+        // All filled slots in order, they stay owned by the write until
+        // release(). The first skip bytes, written already, are left out.
+        const_buffers gather(size_t skip = 0)
+        {
+            writing_ = filled_;
+            size_t count = 0;
+            for (size_t i = 0; i < writing_; i++)
+            {
+                const slot& s = slots_[(head_ + i) % depth_];
+                if (skip >= s.size)
+                {
+                    skip -= s.size;
+                    continue;
+                }
+                gather_[count++] = net::buffer(s.data + skip, s.size - skip);
+                skip = 0;
+            }
+            return const_buffers(gather_.data(), count);
+        }
+
+        // Returns the buffers of the last gather() to the pool.
+        void release()
+        {
+            for (size_t i = 0; i < writing_; i++)
+            {
+                slot& s = slots_[head_];
+                pool_.deallocate(s.data, s.size_class);
+                s.data = nullptr;
+                head_ = (head_ + 1) % depth_;
+            }
+            filled_ -= writing_;
+            writing_ = 0;
+        }
+
+    private:
+        struct slot
+        {
+            uint8_t* data = nullptr;
+            size_t size = 0;
+            size_t size_class = 0;
+        };
+
+        size_t tail() const { return (head_ + filled_) % depth_; }
+
+        buffer_pool& pool_;
+        const size_t depth_;
+        std::array<slot, max_pipeline_depth> slots_;
+        std::array<net::const_buffer, max_pipeline_depth> gather_;
+        size_t head_ = 0;
+        size_t filled_ = 0;
+        size_t writing_ = 0;
+        size_t size_class_ = 0;
+    };
+}
@@ -0,0 +1,221 @@
+#include "capture.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <system_error>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace db_proxy
+{
+    const char capture_log::magic[8] = {'D', 'B', 'P', 'X', 'C', 'A', 'P', '1'};
+
+    namespace
+    {
+        size_t aligned(size_t size)
+        {
+            return (size + capture_log::alignment - 1) & ~size_t(capture_log::alignment - 1);
+        }
+
+        std::system_error last_error(const std::string& what)
+        {
+            return std::system_error(errno, std::generic_category(), what);
+        }
+    }
+
+#if !defined(_WIN32)
+
+    capture_log::capture_log(const std::string& path, size_t capacity)
+        : capacity_(aligned(std::max(capacity, sizeof(file_header)))),
+          start_(std::chrono::steady_clock::now())
+    {
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+            throw last_error("can't create capture " + path);
+
+        // blocks are allocated now, a full disk would otherwise be a
+        // SIGBUS on some write into the mapping
+#if defined(__linux__)
+        const int error = ::posix_fallocate(fd_, 0, static_cast<off_t>(capacity_));
+        if (error != 0)
+        {
+            ::close(fd_);
+            throw std::system_error(error, std::generic_category(), "can't allocate capture " + path);
+        }
+#else
+        if (::ftruncate(fd_, static_cast<off_t>(capacity_)) != 0)
+        {
+            const auto e = last_error("can't allocate capture " + path);
+            ::close(fd_);
+            throw e;
+        }
+#endif
+
+        void* data = ::mmap(nullptr, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (data == MAP_FAILED)
+        {
+            const auto e = last_error("can't map capture " + path);
+            ::close(fd_);
+            throw e;
+        }
+        data_ = static_cast<uint8_t*>(data);
+
+        file_header header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.record_header_size = sizeof(record_header);
+        header.start = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count());
+        std::memcpy(data_, &header, sizeof(header));
+        end_.store(aligned(sizeof(header)), std::memory_order_relaxed);
+    }
+
+    capture_log::~capture_log()
+    {
+        // the unused rest of the file goes, a dropped record leaves at most
+        // its own zeros before the end
+        const size_t used = std::min(end_.load(std::memory_order_relaxed), capacity_);
+        ::munmap(data_, capacity_);
+        if (::ftruncate(fd_, static_cast<off_t>(used)) != 0)
+            std::cerr << "Error: can't truncate the capture: " << std::strerror(errno) << std::endl;
+        ::close(fd_);
+
+        if (const uint64_t n = dropped())
+            std::cerr << "Capture full, " << n << " records dropped" << std::endl;
+    }
+
+    void capture_log::append(uint64_t session, record_type type, const void* data, size_t size)
+    {
+        const size_t total = aligned(sizeof(record_header) + size);
+        const size_t at = end_.fetch_add(total, std::memory_order_relaxed);
+        if (at + total > capacity_)
+        {
+            if (dropped_.fetch_add(1, std::memory_order_relaxed) == 0)
+                std::cerr << "Capture full, further records are dropped" << std::endl;
+            return;
+        }
+
+        record_header header{};
+        header.size = static_cast<uint32_t>(size);
+        header.session = session;
+        header.time = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start_).count());
+
+        uint8_t* record = data_ + at;
+        std::memcpy(record + 1, reinterpret_cast<const uint8_t*>(&header) + 1, sizeof(header) - 1);
+        if (size > 0)
+            std::memcpy(record + sizeof(header), data, size);
+        // the record is complete once it has a type
+        __atomic_store_n(record, static_cast<uint8_t>(type), __ATOMIC_RELEASE);
+    }
+
+    capture_reader::capture_reader(const std::string& path)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw last_error("can't open capture " + path);
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+        {
+            const auto e = last_error("can't open capture " + path);
+            ::close(fd);
+            throw e;
+        }
+        size_ = static_cast<size_t>(st.st_size);
+
+        if (size_ > 0)
+        {
+            void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                const auto e = last_error("can't map capture " + path);
+                ::close(fd);
+                throw e;
+            }
+            data_ = static_cast<const uint8_t*>(data);
+            ::madvise(data, size_, MADV_SEQUENTIAL);
+        }
+        ::close(fd);
+
+        if (size_ < sizeof(capture_log::file_header) ||
+            std::memcmp(header().magic, capture_log::magic, sizeof(capture_log::magic)) != 0 ||
+            header().version != capture_log::version ||
+            header().record_header_size != sizeof(capture_log::record_header))
+        {
+            if (data_)
+                ::munmap(const_cast<uint8_t*>(data_), size_);
+            throw std::runtime_error(path + " is no capture of this version");
+        }
+
+        reset();
+    }
+
+    capture_reader::~capture_reader()
+    {
+        ::munmap(const_cast<uint8_t*>(data_), size_);
+    }
+
+#else
+
+    capture_log::capture_log(const std::string&, size_t)
+    {
+        throw std::runtime_error("traffic capture is not supported on this platform");
+    }
+
+    capture_log::~capture_log()
+    {
+    }
+
+    void capture_log::append(uint64_t, record_type, const void*, size_t)
+    {
+    }
+
+    capture_reader::capture_reader(const std::string&)
+    {
+        throw std::runtime_error("traffic capture is not supported on this platform");
+    }
+
+    capture_reader::~capture_reader()
+    {
+    }
+
+#endif
+
+    const capture_log::file_header& capture_reader::header() const
+    {
+        return *reinterpret_cast<const capture_log::file_header*>(data_);
+    }
+
+    bool capture_reader::next(record& r)
+    {
+        capture_log::record_header header;
+        if (size_ - offset_ < sizeof(header))
+            return false;
+        std::memcpy(&header, data_ + offset_, sizeof(header));
+        if (header.type == 0 || size_ - offset_ - sizeof(header) < header.size)
+            return false;
+
+        r.type = static_cast<capture_log::record_type>(header.type);
+        r.session = header.session;
+        r.time = header.time;
+        r.data = data_ + offset_ + sizeof(header);
+        r.size = header.size;
+
+        offset_ = std::min(size_, offset_ + aligned(sizeof(header) + header.size));
+        return true;
+    }
+
+    void capture_reader::reset()
+    {
+        offset_ = aligned(sizeof(capture_log::file_header));
+    }
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace db_proxy
+{
+    // Binary log of everything the parsers of all sessions are fed, for
+    // db-proxy-replay to run the same calls through a parser offline.
+    //
+    // The file is a header followed by records, each a record_header, its
+    // payload and padding to 8 bytes, integers in host byte order:
+    //
+    //   file_header   magic "DBPXCAP1", version, capture start
+    //   record_header type, payload size, session, nanoseconds since start
+    //
+    // It is mapped into memory at its full capacity up front. Writers of
+    // any thread reserve their bytes with one atomic add and copy the
+    // record in; the type goes in last, so a record of type 0 ends the log
+    // of a process that did not close it. Records past the capacity are
+    // dropped and counted.
+    //
+    // POSIX only, elsewhere opening a capture throws.
+    class capture_log
+    {
+    public:
+        enum record_type : uint8_t
+        {
+            // Parser created, session ids are never reused
+            session_open = 1,
+            // Parser destroyed
+            session_close,
+            // arguments of the Parser calls of the same names
+            parse_client,
+            parse_server,
+            parse_server_head,
+            // 8 bytes: size
+            server_relayed,
+            // 8 bytes: rows
+            response_done,
+            skip_handshake,
+            classify_queries,
+            tls_terminated
+        };
+
+        struct file_header
+        {
+            char magic[8];
+            uint32_t version;
+            // of a record_header
+            uint32_t record_header_size;
+            // system_clock nanoseconds since the epoch record times count from
+            uint64_t start;
+        };
+
+        struct record_header
+        {
+            uint8_t type;
+            uint8_t reserved[3];
+            uint32_t size;
+            uint64_t session;
+            uint64_t time;
+        };
+
+        static const char magic[8];
+        enum { version = 1, alignment = 8 };
+
+        // capacity - bytes the file may grow to. Throws std::system_error
+        // when the file can't be created or mapped.
+        capture_log(const std::string& path, size_t capacity);
+        ~capture_log();
+
+        capture_log(const capture_log&) = delete;
+        capture_log& operator=(const capture_log&) = delete;
+
+        uint64_t new_session() { return next_session_.fetch_add(1, std::memory_order_relaxed); }
+
+        void append(uint64_t session, record_type type, const void* data, size_t size);
+        void append(uint64_t session, record_type type, uint64_t value)
+        {
+            append(session, type, &value, sizeof(value));
+        }
+
+        uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    private:
+        int fd_ = -1;
+        uint8_t* data_ = nullptr;
+        size_t capacity_ = 0;
+        std::chrono::steady_clock::time_point start_;
+        std::atomic<size_t> end_{0};
+        std::atomic<uint64_t> next_session_{1};
+        std::atomic<uint64_t> dropped_{0};
+    };
+
+    // Records of a capture file in the order they were reserved in, which
+    // is the order of the calls of each session.
+    class capture_reader
+    {
+    public:
+        struct record
+        {
+            capture_log::record_type type;
+            uint64_t session;
+            // nanoseconds since the start of the capture
+            uint64_t time;
+            const uint8_t* data;
+            size_t size;
+        };
+
+        // Maps the whole file. Throws std::system_error when it can't be
+        // read and std::runtime_error when it is no capture.
+        explicit capture_reader(const std::string& path);
+        ~capture_reader();
+
+        capture_reader(const capture_reader&) = delete;
+        capture_reader& operator=(const capture_reader&) = delete;
+
+        const capture_log::file_header& header() const;
+
+        // false at the end of the records; a truncated last one ends them too
+        bool next(record& r);
+
+        // rewinds to the first record
+        void reset();
+
+        size_t size() const { return size_; }
+
+    private:
+        const uint8_t* data_ = nullptr;
+        size_t size_ = 0;
+        size_t offset_ = 0;
+    };
+}
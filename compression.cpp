@@ -0,0 +1,189 @@
+#include "compression.hpp"
+#include "protocol.hpp"
+
+#include <zlib.h>
+
+#include <stdexcept>
+
+namespace db_proxy {
+
+namespace My {
+
+namespace {
+
+// zlib state of the calling thread, reset for every compressed packet
+class Deflater {
+public:
+    ~Deflater() {
+        if(level_ != unset)
+            deflateEnd(&stream_);
+    }
+
+    z_stream &get(int level) {
+        if(level_ != level) {
+            if(level_ != unset)
+                deflateEnd(&stream_);
+            stream_ = z_stream();
+            if(deflateInit(&stream_, level) != Z_OK)
+                throw std::runtime_error("deflateInit failed");
+            level_ = level;
+        }
+        else
+            deflateReset(&stream_);
+        return stream_;
+    }
+
+private:
+    static const int unset = -2;
+
+    z_stream stream_ = z_stream();
+    int level_ = unset;
+};
+
+class Inflater {
+public:
+    ~Inflater() {
+        if(ready_)
+            inflateEnd(&stream_);
+    }
+
+    z_stream &get() {
+        if(!ready_) {
+            if(inflateInit(&stream_) != Z_OK)
+                throw std::runtime_error("inflateInit failed");
+            ready_ = true;
+        }
+        else
+            inflateReset(&stream_);
+        return stream_;
+    }
+
+private:
+    z_stream stream_ = z_stream();
+    bool ready_ = false;
+};
+
+void write_header(uint8_t *p, size_t length, uint8_t sequence_id, size_t uncompressed) {
+    p[0] = static_cast<uint8_t>(length);
+    p[1] = static_cast<uint8_t>(length >> 8);
+    p[2] = static_cast<uint8_t>(length >> 16);
+    p[3] = sequence_id;
+    p[4] = static_cast<uint8_t>(uncompressed);
+    p[5] = static_cast<uint8_t>(uncompressed >> 8);
+    p[6] = static_cast<uint8_t>(uncompressed >> 16);
+}
+
+void store(const uint8_t *data, size_t size, uint8_t sequence_id, std::vector<uint8_t> &out) {
+    const size_t start = out.size();
+    out.resize(start + compressed_header_size + size);
+    write_header(&out[start], size, sequence_id, 0);
+    std::copy(data, data + size, out.begin() + static_cast<std::ptrdiff_t>(start + compressed_header_size));
+}
+
+} // namespace
+
+bool Decompressor::feed(const uint8_t *data, size_t size, std::vector<uint8_t> &out) {
+    while(size > 0) {
+        // whole compressed packets inside the read are inflated in place
+        if(partial_.empty() && size >= compressed_header_size) {
+            const size_t length = static_cast<size_t>(read_int<3>(data));
+            if(size >= compressed_header_size + length) {
+                if(!unpack(data, out))
+                    return false;
+                data += compressed_header_size + length;
+                size -= compressed_header_size + length;
+                continue;
+            }
+        }
+
+        size_t wanted = compressed_header_size;
+        if(partial_.size() >= compressed_header_size)
+            wanted += static_cast<size_t>(read_int<3>(partial_.data()));
+
+        const size_t n = std::min(size, wanted - partial_.size());
+        partial_.insert(partial_.end(), data, data + n);
+        data += n;
+        size -= n;
+
+        if(partial_.size() >= compressed_header_size &&
+           partial_.size() == compressed_header_size + static_cast<size_t>(read_int<3>(partial_.data()))) {
+            if(!unpack(partial_.data(), out))
+                return false;
+            partial_.clear();
+        }
+    }
+
+    return true;
+}
+
+bool Decompressor::unpack(const uint8_t *packet, std::vector<uint8_t> &out) {
+    const size_t length = static_cast<size_t>(read_int<3>(packet));
+    const size_t uncompressed = static_cast<size_t>(read_int<3>(packet + 4));
+    const uint8_t *payload = packet + compressed_header_size;
+
+    sequence_id_ = packet[3];
+    packets_++;
+
+    if(uncompressed == 0) {
+        out.insert(out.end(), payload, payload + length);
+        return true;
+    }
+
+    thread_local Inflater inflater;
+    z_stream &stream = inflater.get();
+
+    const size_t start = out.size();
+    out.resize(start + uncompressed);
+
+    stream.next_in = const_cast<Bytef*>(payload);
+    stream.avail_in = static_cast<uInt>(length);
+    stream.next_out = &out[start];
+    stream.avail_out = static_cast<uInt>(uncompressed);
+
+    const int result = inflate(&stream, Z_FINISH);
+    return result == Z_STREAM_END && stream.avail_out == 0;
+}
+
+void compress_packets(const uint8_t *data, size_t size, int level,
+                      uint8_t &sequence_id, std::vector<uint8_t> &out) {
+    thread_local Deflater deflater;
+
+    while(size > 0) {
+        const size_t part = std::min<size_t>(size, max_payload_length);
+
+        if(part < min_compress_length) {
+            store(data, part, sequence_id++, out);
+        }
+        else {
+            z_stream &stream = deflater.get(level);
+
+            const size_t bound = deflateBound(&stream, static_cast<uLong>(part));
+            const size_t start = out.size();
+            out.resize(start + compressed_header_size + bound);
+
+            stream.next_in = const_cast<Bytef*>(data);
+            stream.avail_in = static_cast<uInt>(part);
+            stream.next_out = &out[start + compressed_header_size];
+            stream.avail_out = static_cast<uInt>(bound);
+
+            const int result = deflate(&stream, Z_FINISH);
+            const size_t length = bound - stream.avail_out;
+
+            if(result != Z_STREAM_END || length >= part || length > max_payload_length) {
+                out.resize(start);
+                store(data, part, sequence_id++, out);
+            }
+            else {
+                out.resize(start + compressed_header_size + length);
+                write_header(&out[start], length, sequence_id++, part);
+            }
+        }
+
+        data += part;
+        size -= part;
+    }
+}
+
+} // namespace My
+
+} // namespace db_proxy
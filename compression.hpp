@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace db_proxy {
+
+namespace My {
+
+    // Compressed protocol of CLIENT_COMPRESS. Packets travel inside
+    // compressed packets: payload length (3), sequence id (1) and
+    // uncompressed length (3), then a zlib stream, or the bytes as they are
+    // when the uncompressed length is 0. Each compressed packet is a stream
+    // of its own, so every thread keeps one zlib state for all sessions.
+    enum { compressed_header_size = 7, min_compress_length = 50 };
+
+    // Splits the compressed packets of a peer and inflates them.
+    class Decompressor {
+    public:
+        // Appends the contents of every compressed packet completed by
+        // data[0..size) to out. false - the stream is corrupt.
+        bool feed(const uint8_t *data, size_t size, std::vector<uint8_t> &out);
+
+        // of the last complete compressed packet
+        uint8_t sequence_id() const { return sequence_id_; }
+
+        // complete compressed packets so far
+        uint64_t packets() const { return packets_; }
+
+    private:
+        bool unpack(const uint8_t *packet, std::vector<uint8_t> &out);
+
+        // a compressed packet split between reads
+        std::vector<uint8_t> partial_;
+        uint8_t sequence_id_ = 0;
+        uint64_t packets_ = 0;
+    };
+
+    // Appends data[0..size) to out as compressed packets numbered from
+    // sequence_id on, which is left at the next number. Parts shorter than
+    // min_compress_length or that don't shrink go uncompressed. level is a
+    // zlib level.
+    void compress_packets(const uint8_t *data, size_t size, int level,
+                          uint8_t &sequence_id, std::vector<uint8_t> &out);
+
+} // namespace My
+
+} // namespace db_proxy
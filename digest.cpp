@@ -0,0 +1,465 @@
+#include "digest.hpp"
+#include "sql_scan.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace db_proxy
+{
+    namespace digest
+    {
+        namespace
+        {
+            enum token {
+                none,
+                word,
+                literal,
+                op,
+                open,
+                close,
+                comma,
+                dot,
+                other
+            };
+
+            using namespace sql::scan;
+
+            // Tokens are separated by a single blank, except inside calls,
+            // lists and qualified names: 1 where the blank goes.
+            struct blank_table
+            {
+                uint8_t between[other + 1][other + 1];
+
+                constexpr blank_table() : between()
+                {
+                    for (int prev = word; prev <= other; prev++)
+                    {
+                        for (int t = none; t <= other; t++)
+                        {
+                            const bool blank = prev != open && prev != dot &&
+                                               t != close && t != comma && t != dot &&
+                                               !(t == open && prev == word);
+                            between[prev][t] = blank ? 1 : 0;
+                        }
+                    }
+                }
+            };
+
+            constexpr blank_table blanks;
+
+            // nested lists the collapsing keeps track of
+            const size_t max_depth = 16;
+
+            bool is_op(uint8_t c)
+            {
+                return classes.of[c] == c_op;
+            }
+
+            char to_lower(uint8_t c)
+            {
+                return static_cast<char>(c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+            }
+
+            // Copies the identifier or keyword at p lowercased as far as
+            // room allows, returns its length in the query.
+            size_t copy_word(const uint8_t* p, size_t size, char* out, size_t room)
+            {
+                size_t i = 0;
+#if defined(__SSE2__)
+                // 16 bytes at a time: classify, lowercase and store them all,
+                // the bytes past the word are overwritten later
+                const __m128i bit = _mm_set1_epi8(0x20);
+                while (i + 16 <= size && i < room)
+                {
+                    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+                    const __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                                        _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_add_epi8(v, _mm_and_si128(upper, bit)));
+
+                    const unsigned mask = word_mask(v);
+                    if (mask != 0xffff)
+                        return i + static_cast<size_t>(__builtin_ctz(~mask));
+                    i += 16;
+                }
+#endif
+                for (; i < size && is_word(p[i]); i++)
+                {
+                    if (i < room)
+                        out[i] = to_lower(p[i]);
+                }
+                return i;
+            }
+
+            // "?" or "?, ?, ..."
+            bool is_literal_list(const char* p, size_t size)
+            {
+                if (size == 0 || p[0] != '?')
+                    return false;
+                for (size_t i = 1; i < size; i += 3)
+                {
+                    if (i + 3 > size || p[i] != ',' || p[i + 1] != ' ' || p[i + 2] != '?')
+                        return false;
+                }
+                return true;
+            }
+        }
+
+        size_t normalise(const uint8_t* query, size_t size, char* out)
+        {
+            size_t o = 0;
+            size_t i = 0;
+            token prev = none;
+            size_t depth = 0;
+            size_t opened[max_depth];
+
+            auto begin = [&](token t)
+            {
+                if (blanks.between[prev][t])
+                    out[o++] = ' ';
+                prev = t;
+            };
+
+            auto skip_line = [&]()
+            {
+                const void* eol = std::memchr(query + i, '\n', size - i);
+                i = eol ? static_cast<size_t>(static_cast<const uint8_t*>(eol) - query) + 1 : size;
+            };
+
+            auto literal_value = [&]()
+            {
+                // the next element of a list of literals is not written, the
+                // list is "(?" until it closes as "(...)"
+                if (prev == comma && depth > 0 && depth <= max_depth &&
+                    o == opened[depth - 1] + 3 && out[o - 2] == '?')
+                {
+                    o--;
+                    prev = literal;
+                    return;
+                }
+                begin(literal);
+                out[o++] = '?';
+            };
+
+            while (i < size && o < max_text)
+            {
+                const uint8_t c = query[i];
+                const uint8_t next = i + 1 < size ? query[i + 1] : 0;
+
+                switch (classes.of[c])
+                {
+                case c_space:
+                    while (++i < size && is_space(query[i]))
+                        ;
+                    break;
+                case c_letter:
+                {
+                    begin(word);
+                    const size_t room = max_text - std::min(o, max_text);
+                    const size_t n = copy_word(query + i, size - i, out + o, room);
+                    o += std::min(n, room);
+                    i += n;
+                }
+                    break;
+                case c_variable:
+                {
+                    // user and system variables
+                    begin(word);
+                    while (i < size && query[i] == '@' && o < max_text)
+                        out[o++] = static_cast<char>(query[i++]);
+                    const size_t room = max_text - std::min(o, max_text);
+                    const size_t n = copy_word(query + i, size - i, out + o, room);
+                    o += std::min(n, room);
+                    i += n;
+                }
+                    break;
+                case c_digit:
+                    literal_value();
+                    i += number_length(query + i, size - i);
+                    break;
+                case c_quote:
+                    literal_value();
+                    i += 1 + skip_quoted(query + i + 1, size - i - 1, c);
+                    break;
+                case c_placeholder:
+                    literal_value();
+                    i++;
+                    break;
+                case c_backtick:
+                {
+                    // quoted identifiers keep their case
+                    begin(word);
+                    const size_t n = 1 + skip_quoted(query + i + 1, size - i - 1, c);
+                    const size_t kept = std::min(n, max_text - std::min(o, max_text));
+                    std::memcpy(out + o, query + i, kept);
+                    o += kept;
+                    i += n;
+                }
+                    break;
+                case c_hash:
+                    skip_line();
+                    break;
+                case c_op:
+                    if (c == '-' && next == '-' && (i + 2 >= size || is_space(query[i + 2])))
+                    {
+                        skip_line();
+                        break;
+                    }
+                    if (c == '/' && next == '*')
+                    {
+                        i += 2;
+                        while (i < size)
+                        {
+                            const void* star = std::memchr(query + i, '*', size - i);
+                            if (!star)
+                            {
+                                i = size;
+                                break;
+                            }
+                            i = static_cast<size_t>(static_cast<const uint8_t*>(star) - query) + 1;
+                            if (i < size && query[i] == '/')
+                            {
+                                i++;
+                                break;
+                            }
+                        }
+                        break;
+                    }
+                    // a sign in front of a number is part of the literal
+                    if ((c == '-' || c == '+') && (is_digit(next) || next == '.') &&
+                        (prev == none || prev == op || prev == open || prev == comma))
+                    {
+                        literal_value();
+                        i += 1 + number_length(query + i + 1, size - i - 1);
+                        break;
+                    }
+
+                    begin(op);
+                    do
+                    {
+                        out[o++] = static_cast<char>(query[i++]);
+                    }
+                    while (i < size && o < max_text && is_op(query[i]) &&
+                           !((query[i] == '-' || query[i] == '+') && i + 1 < size && is_digit(query[i + 1])) &&
+                           !(query[i] == '-' && i + 1 < size && query[i + 1] == '-') &&
+                           !(query[i] == '/' && i + 1 < size && query[i + 1] == '*'));
+                    break;
+                case c_open:
+                    begin(open);
+                    if (depth < max_depth)
+                        opened[depth] = o;
+                    depth++;
+                    out[o++] = '(';
+                    i++;
+                    break;
+                case c_close:
+                {
+                    begin(close);
+                    i++;
+
+                    const size_t start = depth > 0 && depth <= max_depth ? opened[depth - 1] : o;
+                    if (depth > 0)
+                        depth--;
+
+                    if (start < o && is_literal_list(out + start + 1, o - start - 1))
+                    {
+                        // IN (1, 2, 3) and VALUES (1, 2), (3, 4) rows
+                        o = start;
+                        if (o >= 7 && std::memcmp(out + o - 7, "(...), ", 7) == 0)
+                            o -= 2;
+                        else
+                        {
+                            std::memcpy(out + o, "(...)", 5);
+                            o += 5;
+                        }
+                    }
+                    else
+                        out[o++] = ')';
+                }
+                    break;
+                case c_comma:
+                    begin(comma);
+                    out[o++] = ',';
+                    i++;
+                    break;
+                case c_dot:
+                    if (is_digit(next) && prev != word && prev != close)
+                    {
+                        literal_value();
+                        i += number_length(query + i, size - i);
+                        break;
+                    }
+                    begin(dot);
+                    out[o++] = '.';
+                    i++;
+                    break;
+                default:
+                    begin(other);
+                    out[o++] = static_cast<char>(c);
+                    i++;
+                    break;
+                }
+            }
+
+            o = std::min(o, max_text);
+            while (o > 0 && out[o - 1] == ';')
+                o--;
+            while (o > 0 && out[o - 1] == ' ')
+                o--;
+            return o;
+        }
+
+        uint64_t hash(const char* text, size_t size)
+        {
+            const uint64_t k = 0xff51afd7ed558ccdULL;
+            uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+
+            for (; size >= 8; text += 8, size -= 8)
+            {
+                uint64_t w;
+                std::memcpy(&w, text, 8);
+                h = (h ^ w) * k;
+                h ^= h >> 32;
+            }
+            if (size > 0)
+            {
+                uint64_t w = 0;
+                std::memcpy(&w, text, size);
+                h = (h ^ w) * k;
+            }
+
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ULL;
+            h ^= h >> 33;
+            return h;
+        }
+    }
+
+    void digest_table::histogram::record(uint64_t us)
+    {
+        uint32_t& count = counts[layout::index_of(us)];
+        if (count == UINT32_MAX)
+        {
+            for (uint32_t& c : counts)
+                c /= 2;
+        }
+        count++;
+    }
+
+    void digest_table::histogram::add(const histogram& other)
+    {
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            const uint64_t sum = uint64_t(counts[i]) + other.counts[i];
+            counts[i] = static_cast<uint32_t>(std::min<uint64_t>(sum, UINT32_MAX));
+        }
+    }
+
+    void digest_table::set_capacity(size_t capacity)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        capacity_ = capacity;
+        entries_.clear();
+        entries_.reserve(capacity);
+
+        // at most half full
+        size_t slots = 1;
+        while (slots < capacity * 2)
+            slots <<= 1;
+        index_.assign(capacity ? slots : 0, empty);
+        mask_ = slots - 1;
+    }
+
+    void digest_table::record(uint64_t hash, const std::string& text, uint64_t first_byte_us, uint64_t latency_us,
+                              uint64_t rows, uint64_t bytes, bool error)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (capacity_ == 0)
+            return;
+
+        size_t slot = find(hash);
+        if (index_[slot] == empty)
+        {
+            size_t position = entries_.size();
+            if (position < capacity_)
+                entries_.emplace_back();
+            else
+            {
+                // the least called of a few entries spread over the table
+                position = static_cast<size_t>(hash >> 32) % capacity_;
+                for (size_t k = 1; k < eviction_samples; k++)
+                {
+                    const size_t candidate = (static_cast<size_t>(hash >> 32) + k * 977) % capacity_;
+                    if (entries_[candidate].calls < entries_[position].calls)
+                        position = candidate;
+                }
+
+                erase_index(find(entries_[position].hash));
+                evictions_++;
+                slot = find(hash);
+            }
+
+            entry& e = entries_[position];
+            e.hash = hash;
+            e.text.assign(text);
+            e.calls = e.errors = e.total_us = e.max_us = e.max_first_byte_us = e.rows = e.bytes = 0;
+            e.first_byte = histogram();
+            e.response = histogram();
+            index_[slot] = static_cast<uint32_t>(position);
+        }
+
+        entry& e = entries_[index_[slot]];
+        e.calls++;
+        e.errors += error ? 1 : 0;
+        e.total_us += latency_us;
+        e.max_us = std::max(e.max_us, latency_us);
+        e.max_first_byte_us = std::max(e.max_first_byte_us, first_byte_us);
+        e.first_byte.record(first_byte_us);
+        e.response.record(latency_us);
+        e.rows += rows;
+        e.bytes += bytes;
+    }
+
+    void digest_table::copy(std::vector<entry>& out) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out.insert(out.end(), entries_.begin(), entries_.end());
+    }
+
+    uint64_t digest_table::evictions() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return evictions_;
+    }
+
+    size_t digest_table::find(uint64_t hash) const
+    {
+        size_t slot = static_cast<size_t>(hash) & mask_;
+        while (index_[slot] != empty && entries_[index_[slot]].hash != hash)
+            slot = (slot + 1) & mask_;
+        return slot;
+    }
+
+    void digest_table::erase_index(size_t slot)
+    {
+        // shift later entries of the probe sequence back into the hole
+        index_[slot] = empty;
+        size_t hole = slot;
+        for (size_t i = (slot + 1) & mask_; index_[i] != empty; i = (i + 1) & mask_)
+        {
+            const size_t home = static_cast<size_t>(entries_[index_[i]].hash) & mask_;
+            const bool movable = hole <= i ? (home <= hole || home > i) : (home <= hole && home > i);
+            if (movable)
+            {
+                index_[hole] = index_[i];
+                index_[i] = empty;
+                hole = i;
+            }
+        }
+    }
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "histogram.hpp"
+
+namespace db_proxy
+{
+    // Statement fingerprints: literals become '?', lists of them "(...)",
+    // comments go away, case is folded and tokens are spaced the same way
+    // however the client wrote them, so
+    //   SELECT * FROM t WHERE id IN (1, 2,3) -- x
+    //   select *  from t where id in(4)
+    // both become "select * from t where id in(...)".
+    namespace digest
+    {
+        // longer fingerprints are cut, like max_digest_length of MySQL
+        const size_t max_text = 1024;
+        // normalise() may write this far past max_text
+        const size_t slack = 16;
+
+        // Writes the fingerprint of query[0..size) to out, which must hold
+        // max_text + slack bytes, and returns its length. One pass, no
+        // allocation.
+        size_t normalise(const uint8_t* query, size_t size, char* out);
+
+        uint64_t hash(const char* text, size_t size);
+    }
+
+    // The most expensive fingerprints of one shard. The shard's thread is
+    // the only writer, the lock is there for the readers. A new fingerprint
+    // in a full table replaces the least called of a few sampled ones, so
+    // frequent statements stay and one-off ones take turns.
+    class digest_table
+    {
+    public:
+        // Latencies of one fingerprint, coarser than latency_histogram to
+        // stay small: a bucket is within 25% of the values in it. A bucket
+        // about to overflow halves them all, the quantiles stay.
+        struct histogram
+        {
+            using layout = hdr_buckets<3, 33>;
+
+            std::array<uint32_t, layout::count> counts{};
+
+            void record(uint64_t us);
+            void add(const histogram& other);
+
+            uint64_t value_at(double quantile, uint64_t max) const
+            {
+                return layout::value_at(counts.data(), quantile, max);
+            }
+        };
+
+        struct entry
+        {
+            uint64_t hash = 0;
+            std::string text;
+            uint64_t calls = 0;
+            uint64_t errors = 0;
+            uint64_t total_us = 0;
+            uint64_t max_us = 0;
+            uint64_t max_first_byte_us = 0;
+            uint64_t rows = 0;
+            uint64_t bytes = 0;
+            // command to the first response byte and to the last one
+            histogram first_byte;
+            histogram response;
+        };
+
+        // 0 - no fingerprints are kept. Set before the shard runs.
+        void set_capacity(size_t capacity);
+
+        bool enabled() const { return capacity_ > 0; }
+
+        void record(uint64_t hash, const std::string& text, uint64_t first_byte_us, uint64_t latency_us,
+                    uint64_t rows, uint64_t bytes, bool error);
+
+        // appends the entries to out
+        void copy(std::vector<entry>& out) const;
+
+        uint64_t evictions() const;
+
+    private:
+        static constexpr size_t eviction_samples = 8;
+        static constexpr uint32_t empty = UINT32_MAX;
+
+        // slot of the index where hash is or would be
+        size_t find(uint64_t hash) const;
+        void erase_index(size_t slot);
+
+        mutable std::mutex mutex_;
+        size_t capacity_ = 0;
+        std::vector<entry> entries_;
+        // open addressing, linear probing: positions in entries_
+        std::vector<uint32_t> index_;
+        size_t mask_ = 0;
+        uint64_t evictions_ = 0;
+    };
+}
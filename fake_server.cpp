@@ -0,0 +1,394 @@
+#include "fake_server.hpp"
+#include "parser.hpp"
+#include "protocol.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace db_proxy
+{
+    namespace
+    {
+        const uint32_t server_capabilities =
+                My::CLIENT_LONG_PASSWORD | My::CLIENT_LONG_FLAG | My::CLIENT_CONNECT_WITH_DB |
+                My::CLIENT_PROTOCOL_41 | My::CLIENT_TRANSACTIONS | My::CLIENT_SECURE_CONNECTION |
+                My::CLIENT_MULTI_STATEMENTS | My::CLIENT_MULTI_RESULTS | My::CLIENT_PS_MULTI_RESULTS |
+                My::CLIENT_PLUGIN_AUTH | My::CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA;
+
+        const uint16_t status = My::SERVER_STATUS_AUTOCOMMIT;
+
+        // utf8_general_ci
+        const uint8_t charset = 33;
+
+        enum { read_chunk = 4096, ER_NOT_SUPPORTED_YET = 1235, ER_UNKNOWN_STMT = 1243 };
+
+        bool starts_with_word(const uint8_t* p, size_t size, const char* word)
+        {
+            const size_t n = std::strlen(word);
+            if (size < n)
+                return false;
+            for (size_t i = 0; i < n; i++)
+            {
+                if (std::toupper(p[i]) != word[i])
+                    return false;
+            }
+            return size == n || !std::isalnum(p[n]);
+        }
+
+        // Row count of the last LIMIT [offset,] count of a statement.
+        bool find_limit(const uint8_t* p, size_t size, size_t& rows)
+        {
+            bool found = false;
+            for (size_t i = 0; i + 5 <= size; i++)
+            {
+                if ((i > 0 && std::isalnum(p[i - 1])) || !starts_with_word(p + i, size - i, "LIMIT"))
+                    continue;
+
+                size_t j = i + 5;
+                size_t value = 0;
+                bool digits = false;
+                for (;;)
+                {
+                    while (j < size && std::isspace(p[j]))
+                        j++;
+                    value = 0;
+                    digits = false;
+                    for (; j < size && std::isdigit(p[j]); j++)
+                    {
+                        value = value * 10 + static_cast<size_t>(p[j] - '0');
+                        digits = true;
+                    }
+                    while (j < size && std::isspace(p[j]))
+                        j++;
+                    if (!digits || j >= size || p[j] != ',')
+                        break;
+                    j++;
+                }
+
+                if (digits)
+                {
+                    rows = value;
+                    found = true;
+                }
+            }
+            return found;
+        }
+    }
+
+    // Reads whole command packets and answers each of them in order, the
+    // answers to a pipelined batch go out in one write.
+    class fake_server::connection : public std::enable_shared_from_this<connection>
+    {
+    public:
+        connection(fake_server& server, net::ip::tcp::socket socket)
+            : server_(server), socket_(std::move(socket)), options_(server.options_), row_(server.row_)
+        {
+        }
+
+        void start()
+        {
+            uint8_t scramble[My::scramble_length];
+            My::make_scramble(scramble);
+
+            My::PacketWriter w(out_);
+            w.begin(0);
+            w.int_n<1>(10);
+            w.string_nul("5.7.0-db-proxy-bench");
+            w.int_n<4>(1);
+            w.bytes(scramble, 8);
+            w.int_n<1>(0);
+            w.int_n<2>(server_capabilities & 0xffff);
+            w.int_n<1>(charset);
+            w.int_n<2>(status);
+            w.int_n<2>(server_capabilities >> 16);
+            w.int_n<1>(My::scramble_length + 1);
+            w.zeros(10);
+            w.bytes(scramble + 8, My::scramble_length - 8);
+            w.int_n<1>(0);
+            w.string_nul("mysql_native_password");
+            w.finish();
+
+            write();
+        }
+
+    private:
+        void read()
+        {
+            const size_t used = in_.size();
+            in_.resize(used + read_chunk);
+
+            socket_.async_read_some(net::buffer(in_.data() + used, read_chunk),
+                                    std::bind(&connection::handle_read,
+                                              shared_from_this(),
+                                              std::placeholders::_1,
+                                              std::placeholders::_2,
+                                              used));
+        }
+
+        void handle_read(const boost::system::error_code& error, size_t bytes_transferred, size_t used)
+        {
+            if (error)
+                return;
+            in_.resize(used + bytes_transferred);
+
+            size_t offset = 0;
+            while (in_.size() - offset >= My::header_size)
+            {
+                const size_t length = static_cast<size_t>(My::read_int<3>(&in_[offset]));
+                if (in_.size() - offset < My::header_size + length)
+                    break;
+
+                if (!answer(&in_[offset + My::header_size], length))
+                    return;
+                offset += My::header_size + length;
+            }
+            in_.erase(in_.begin(), in_.begin() + static_cast<std::ptrdiff_t>(offset));
+
+            if (out_.empty())
+                read();
+            else
+                write();
+        }
+
+        void write()
+        {
+            net::async_write(socket_, net::buffer(out_),
+                             std::bind(&connection::handle_write,
+                                       shared_from_this(),
+                                       std::placeholders::_1));
+        }
+
+        void handle_write(const boost::system::error_code& error)
+        {
+            if (error)
+                return;
+            out_.clear();
+            read();
+        }
+
+        // Appends the answer to one packet, false - the client quit.
+        bool answer(const uint8_t* payload, size_t length)
+        {
+            // the handshake response, whatever it says
+            if (!logged_in_)
+            {
+                logged_in_ = true;
+                My::write_ok(out_, 2, status);
+                return true;
+            }
+
+            if (length == 0)
+                return true;
+
+            switch (payload[0])
+            {
+            case My::COM_QUIT:
+                return false;
+            case My::COM_QUERY:
+                if (starts_with_word(payload + 1, length - 1, "SELECT"))
+                {
+                    size_t rows = options_.rows;
+                    find_limit(payload + 1, length - 1, rows);
+                    write_result(rows);
+                }
+                else
+                    My::write_ok(out_, 1, status);
+                break;
+            case My::COM_PING:
+            case My::COM_INIT_DB:
+            case My::COM_STMT_RESET:
+                My::write_ok(out_, 1, status);
+                break;
+            case My::COM_RESET_CONNECTION:
+                statements_.clear();
+                My::write_ok(out_, 1, status);
+                break;
+            case My::COM_STMT_PREPARE:
+                prepare(payload + 1, length - 1);
+                break;
+            case My::COM_STMT_EXECUTE:
+                execute(payload, length);
+                break;
+            case My::COM_STMT_CLOSE:
+                if (length >= 1 + 4)
+                    statements_.erase(static_cast<uint32_t>(My::read_int<4>(payload + 1)));
+                break;
+            case My::COM_STMT_SEND_LONG_DATA:
+                break;
+            default:
+                My::write_err(out_, 1, ER_NOT_SUPPORTED_YET, "42000", "not supported by the fake server");
+                break;
+            }
+            return true;
+        }
+
+        // A parameter per '?', a SELECT has the column of write_result().
+        void prepare(const uint8_t* text, size_t size)
+        {
+            server_.prepares_.fetch_add(1, std::memory_order_relaxed);
+
+            statement s;
+            s.params = static_cast<uint16_t>(std::count(text, text + size, '?'));
+            s.select = starts_with_word(text, size, "SELECT");
+            s.rows = options_.rows;
+            find_limit(text, size, s.rows);
+
+            const uint32_t id = next_statement_id_++;
+            statements_[id] = s;
+
+            My::PacketWriter w(out_);
+            uint8_t sequence_id = 1;
+            w.begin(sequence_id++);
+            w.int_n<1>(My::OK_PACKET);
+            w.int_n<4>(id);
+            w.int_n<2>(s.select ? 1 : 0);
+            w.int_n<2>(s.params);
+            w.int_n<1>(0);
+            w.int_n<2>(0);
+            w.finish();
+
+            if (s.params > 0)
+            {
+                for (uint16_t i = 0; i < s.params; i++)
+                    write_column(sequence_id++, "?");
+                write_eof(sequence_id++);
+            }
+            if (s.select)
+            {
+                write_column(sequence_id++, "c");
+                write_eof(sequence_id++);
+            }
+        }
+
+        void execute(const uint8_t* payload, size_t length)
+        {
+            server_.executes_.fetch_add(1, std::memory_order_relaxed);
+
+            auto it = length >= 1 + 4 ? statements_.find(static_cast<uint32_t>(My::read_int<4>(payload + 1)))
+                                      : statements_.end();
+            if (it == statements_.end())
+                My::write_err(out_, 1, ER_UNKNOWN_STMT, "HY000", "Unknown prepared statement handler");
+            else if (it->second.select)
+                write_result(it->second.rows, true);
+            else
+                My::write_ok(out_, 1, status);
+        }
+
+        // one VARCHAR column named c, rows in the binary protocol for
+        // prepared statements
+        void write_result(size_t rows, bool binary = false)
+        {
+            My::PacketWriter w(out_);
+            uint8_t sequence_id = 1;
+
+            w.begin(sequence_id++);
+            w.lenenc(1);
+            w.finish();
+
+            write_column(sequence_id++, "c");
+            write_eof(sequence_id++);
+
+            for (size_t i = 0; i < rows; i++)
+            {
+                w.begin(sequence_id++);
+                // 0x00, then the NULL bitmap of one column and its 2 bits offset
+                if (binary)
+                    w.zeros(2);
+                w.lenenc(row_.size());
+                w.string(row_);
+                w.finish();
+            }
+
+            write_eof(sequence_id);
+        }
+
+        void write_column(uint8_t sequence_id, const char* name)
+        {
+            My::PacketWriter w(out_);
+            w.begin(sequence_id);
+            w.lenenc(3);
+            w.string("def");
+            w.lenenc(0);
+            w.lenenc(0);
+            w.lenenc(0);
+            w.lenenc(std::strlen(name));
+            w.string(name);
+            w.lenenc(0);
+            w.lenenc(0x0c);
+            w.int_n<2>(charset);
+            w.int_n<4>(row_.size() * 3);
+            w.int_n<1>(My::MYSQL_TYPE_VAR_STRING);
+            w.int_n<2>(0);
+            w.int_n<1>(0);
+            w.zeros(2);
+            w.finish();
+        }
+
+        void write_eof(uint8_t sequence_id)
+        {
+            My::PacketWriter w(out_);
+            w.begin(sequence_id);
+            w.int_n<1>(My::EOF_PACKET);
+            w.int_n<2>(0);
+            w.int_n<2>(status);
+            w.finish();
+        }
+
+        struct statement
+        {
+            uint16_t params = 0;
+            bool select = false;
+            size_t rows = 0;
+        };
+
+        fake_server& server_;
+        net::ip::tcp::socket socket_;
+        const fake_server_options& options_;
+        const std::string& row_;
+        std::vector<uint8_t> in_;
+        std::vector<uint8_t> out_;
+        bool logged_in_ = false;
+        std::unordered_map<uint32_t, statement> statements_;
+        uint32_t next_statement_id_ = 1;
+    };
+
+    fake_server::fake_server(net::io_context& ios, const std::string& host, unsigned short port,
+                             const fake_server_options& options)
+        : ios_(ios),
+          acceptor_(ios, net::ip::tcp::endpoint(net::ip::make_address(host), port)),
+          options_(options),
+          // a row is a single packet
+          row_(std::min<size_t>(options.row_size, My::max_payload_length - 9), 'x')
+    {
+    }
+
+    void fake_server::start()
+    {
+        acceptor_.async_accept(ios_,
+                               std::bind(&fake_server::handle_accept,
+                                         this,
+                                         std::placeholders::_1,
+                                         std::placeholders::_2));
+    }
+
+    void fake_server::handle_accept(const boost::system::error_code& error, net::ip::tcp::socket socket)
+    {
+        if (!error)
+        {
+            boost::system::error_code ec;
+            socket.set_option(net::ip::tcp::no_delay(true), ec);
+            std::make_shared<connection>(*this, std::move(socket))->start();
+        }
+        else if (error == net::error::operation_aborted)
+            return;
+        else
+            std::cerr << "Error: " << error.message() << std::endl;
+
+        start();
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace net = boost::asio;
+
+namespace db_proxy
+{
+    struct fake_server_options
+    {
+        // rows of a SELECT without a LIMIT
+        size_t rows = 1;
+        // bytes in the single column of every row
+        size_t row_size = 100;
+    };
+
+    // MySQL server stand-in for benchmarks. It logs in anyone, answers a
+    // SELECT with a canned result set of LIMIT rows, or options.rows
+    // without one, and anything else with an OK; nothing is stored. The
+    // same goes for prepared statements, whose parameters are ignored.
+    // Every connection is served by whichever thread runs ios.
+    class fake_server
+    {
+    public:
+        fake_server(net::io_context& ios, const std::string& host, unsigned short port,
+                    const fake_server_options& options);
+
+        fake_server(const fake_server&) = delete;
+        fake_server& operator=(const fake_server&) = delete;
+
+        void start();
+
+        // statements prepared and executed on all connections so far
+        uint64_t prepares() const { return prepares_.load(std::memory_order_relaxed); }
+        uint64_t executes() const { return executes_.load(std::memory_order_relaxed); }
+
+    private:
+        class connection;
+
+        void handle_accept(const boost::system::error_code& error, net::ip::tcp::socket socket);
+
+        net::io_context& ios_;
+        net::ip::tcp::acceptor acceptor_;
+        fake_server_options options_;
+        // the column value of every row
+        std::string row_;
+        std::atomic<uint64_t> prepares_{0};
+        std::atomic<uint64_t> executes_{0};
+    };
+}
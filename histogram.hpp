@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace db_proxy
+{
+    // Bucket layout of the HDR style histograms of microseconds. Values
+    // below 2^bits get a bucket each, every power of two above is split into
+    // 2^(bits - 1), so a bucket is within 2^(1 - bits) of the values in it.
+    // Values past the last of the powers count as the last bucket.
+    template<unsigned bits, unsigned powers>
+    struct hdr_buckets
+    {
+        static const size_t sub_buckets = size_t(1) << bits;
+        static const size_t count = sub_buckets + powers * (sub_buckets / 2);
+
+        static size_t index_of(uint64_t us)
+        {
+            if (us < sub_buckets)
+                return static_cast<size_t>(us);
+
+            // keep the top bits, the first of them is always set
+            const unsigned shift = highest_bit(us) - (bits - 1);
+            const size_t half = sub_buckets / 2;
+            const size_t index = sub_buckets + (shift - 1) * half + static_cast<size_t>((us >> shift) - half);
+            return std::min(index, count - 1);
+        }
+
+        // largest value counted in the bucket
+        static uint64_t highest_value(size_t index)
+        {
+            if (index < sub_buckets)
+                return index;
+
+            const size_t half = sub_buckets / 2;
+            const unsigned shift = static_cast<unsigned>((index - sub_buckets) / half + 1);
+            const uint64_t top = (index - sub_buckets) % half + half;
+            return ((top + 1) << shift) - 1;
+        }
+
+        // Microseconds at quantile of counts[0..count), at most the bucket
+        // width above the exact value and never more than max.
+        template<typename Count>
+        static uint64_t value_at(const Count* counts, double quantile, uint64_t max)
+        {
+            uint64_t total = 0;
+            for (size_t i = 0; i < count; i++)
+                total += counts[i];
+            if (total == 0)
+                return 0;
+
+            const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(quantile * total)));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < count; i++)
+            {
+                seen += counts[i];
+                if (seen >= rank)
+                    return std::min(highest_value(i), max);
+            }
+            return max;
+        }
+
+    private:
+        static unsigned highest_bit(uint64_t v)
+        {
+#if defined(__GNUC__)
+            return 63 - static_cast<unsigned>(__builtin_clzll(v));
+#else
+            unsigned bit = 0;
+            while (v >>= 1)
+                bit++;
+            return bit;
+#endif
+        }
+    };
+}
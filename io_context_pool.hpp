@@ -0,0 +1,179 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include "admission.hpp"
+#include "capture.hpp"
+#include "memory_pool.hpp"
+#include "metrics.hpp"
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace net = boost::asio;
+
+namespace db_proxy
+{
+    // One io_context per worker thread. Every session lives on exactly one
+    // shard, so its handlers never run concurrently and need no locking.
+    class io_context_pool
+    {
+    public:
+        enum class balance {
+            round_robin,
+            least_loaded
+        };
+
+        struct shard
+        {
+            // declared before ios: pending sessions are destroyed with ios
+            std::atomic<size_t> sessions{0};
+            size_t index = 0;
+            // per-thread memory, only used from the shard's own thread
+            slab session_slab;
+            buffer_pool buffers;
+            // written by the shard's thread only, read by the metrics server
+            traffic_metrics metrics;
+            // shared by all shards, nullptr - traffic is not captured
+            capture_log* capture = nullptr;
+            // shared by all shards, nullptr - clients are not limited
+            admission* limits = nullptr;
+            net::io_context ios{1};
+        };
+
+        // Keeps shard load accounting in sync with session lifetime.
+        class load_guard
+        {
+        public:
+            explicit load_guard(shard& s) : shard_(&s)
+            {
+                shard_->sessions.fetch_add(1, std::memory_order_relaxed);
+            }
+            ~load_guard()
+            {
+                shard_->sessions.fetch_sub(1, std::memory_order_relaxed);
+            }
+            load_guard(const load_guard&) = delete;
+            load_guard& operator=(const load_guard&) = delete;
+        private:
+            shard* shard_;
+        };
+
+        explicit io_context_pool(size_t size, balance policy = balance::round_robin)
+            : policy_(policy)
+        {
+            if (size == 0)
+                throw std::runtime_error("io_context_pool size is 0");
+
+            for (size_t i = 0; i < size; i++)
+            {
+                shards_.emplace_back(new shard);
+                shards_.back()->index = i;
+                work_.emplace_back(net::make_work_guard(shards_.back()->ios));
+            }
+        }
+
+        io_context_pool(const io_context_pool&) = delete;
+        io_context_pool& operator=(const io_context_pool&) = delete;
+
+        ~io_context_pool()
+        {
+            stop();
+            join();
+        }
+
+        size_t size() const { return shards_.size(); }
+
+        shard& at(size_t index) { return *shards_[index]; }
+
+        shard& next()
+        {
+            if (policy_ == balance::least_loaded)
+            {
+                shard* best = shards_.front().get();
+                for (auto& s : shards_)
+                {
+                    if (s->sessions.load(std::memory_order_relaxed) <
+                        best->sessions.load(std::memory_order_relaxed))
+                        best = s.get();
+                }
+                return *best;
+            }
+
+            return *shards_[next_.fetch_add(1, std::memory_order_relaxed) % shards_.size()];
+        }
+
+        // Starts one thread per shard, optionally pinned to cpu (first_cpu + index).
+        void run(bool pin, size_t first_cpu = 0)
+        {
+            for (auto& s : shards_)
+            {
+                shard* sh = s.get();
+                threads_.emplace_back([sh, pin, first_cpu]
+                {
+                    if (pin)
+                        pin_to_cpu(first_cpu + sh->index);
+                    sh->ios.run();
+                });
+            }
+        }
+
+        void stop()
+        {
+            for (auto& w : work_)
+                w.reset();
+            for (auto& s : shards_)
+                s->ios.stop();
+        }
+
+        void join()
+        {
+            for (auto& t : threads_)
+            {
+                if (t.joinable())
+                    t.join();
+            }
+            threads_.clear();
+        }
+
+        static size_t hardware_threads()
+        {
+            const auto n = std::thread::hardware_concurrency();
+            return n == 0 ? 1 : n;
+        }
+
+    private:
+        static void pin_to_cpu(size_t cpu)
+        {
+            cpu %= hardware_threads();
+#if defined(_WIN32)
+            SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+#elif defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+            (void)cpu;
+#endif
+        }
+
+        using work_guard = net::executor_work_guard<net::io_context::executor_type>;
+
+        std::vector<std::unique_ptr<shard>> shards_;
+        std::vector<work_guard> work_;
+        std::vector<std::thread> threads_;
+        std::atomic<size_t> next_{0};
+        balance policy_;
+    };
+}
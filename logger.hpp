@@ -1,11 +1,100 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <fstream>
 
+class Logger;
+
+// One log record. The text is formatted on the calling thread into a
+// reused per-thread buffer and handed to the logger in one piece when the
+// record goes out of scope, so records of concurrent sessions never
+// interleave.
+class LogRecord {
+    class Buffer : public std::streambuf {
+        std::string &text_;
+    protected:
+        int_type overflow(int_type c) override {
+            if(!traits_type::eq_int_type(c, traits_type::eof()))
+                text_.push_back(traits_type::to_char_type(c));
+            return traits_type::not_eof(c);
+        }
+        std::streamsize xsputn(const char *s, std::streamsize n) override {
+            text_.append(s, static_cast<size_t>(n));
+            return n;
+        }
+    public:
+        explicit Buffer(std::string &text) : text_(text) {}
+    };
+
+    struct Scratch {
+        std::string text;
+        Buffer buffer{text};
+        std::ostream stream{&buffer};
+        bool busy = false;
+    };
+
+    Logger *logger_;
+    Scratch *scratch_ = nullptr;
+    // a record built while formatting another one can't share the buffer
+    std::unique_ptr<Scratch> own_;
+
+public:
+    explicit LogRecord(Logger &logger);
+    LogRecord(LogRecord &&other) noexcept
+        : logger_(other.logger_), scratch_(other.scratch_), own_(std::move(other.own_)) {
+        other.scratch_ = nullptr;
+    }
+    LogRecord(const LogRecord&) = delete;
+    LogRecord& operator=(const LogRecord&) = delete;
+    ~LogRecord();
+
+    template<typename T>
+    LogRecord& operator<<(const T &arg) {
+        if(scratch_)
+            scratch_->stream << arg;
+        return *this;
+    }
+
+    // text is appended as it is, without a trip through the stream
+    LogRecord& operator<<(std::string_view text) {
+        if(scratch_)
+            scratch_->text.append(text.data(), text.size());
+        return *this;
+    }
+    LogRecord& operator<<(const std::string &text) {
+        return *this << std::string_view(text);
+    }
+    LogRecord& operator<<(const char *text) {
+        return *this << std::string_view(text);
+    }
+    LogRecord& operator<<(char c) {
+        if(scratch_)
+            scratch_->text.push_back(c);
+        return *this;
+    }
+
+    // support for endl, etc...
+    LogRecord& operator<<(std::ostream& (*os)(std::ostream&)) {
+        if(scratch_)
+            scratch_->stream << os;
+        return *this;
+    }
+};
+
 class Logger{
     std::ostream &stream_;
     std::mutex m_;
@@ -23,7 +112,32 @@ public:
     }
     std::ostream& raw_stream() const { return stream_; }
 
-    Logger& log() { return *this; }
+    LogRecord log() { return LogRecord(*this); }
+
+    // false - records are not even formatted
+    virtual bool enabled() const { return true; }
+
+    // Longest text of a record written whole, longer ones are cut.
+    virtual size_t max_record() const { return SIZE_MAX; }
+
+    // Writes one complete record.
+    virtual void write(const char *data, size_t size) {
+        std::lock_guard<std::mutex> l(m_);
+        stream_.write(data, static_cast<std::streamsize>(size));
+    }
+
+    // Appends the text of a record kept in compact form.
+    using Formatter = void (*)(const char *data, size_t size, std::string &text);
+
+    // Writes a record kept in a compact form until it is formatted,
+    // asynchronous loggers do that on their writer thread.
+    virtual void write_deferred(Formatter format, const char *data, size_t size) {
+        // reused, formatting doesn't allocate once it has grown
+        thread_local std::string text;
+        text.clear();
+        format(data, size, text);
+        write(text.data(), text.size());
+    }
 
     template<typename T>
     Logger& operator<<(const T &arg) {
@@ -38,6 +152,35 @@ public:
         return *this;
     }
 };
+
+inline LogRecord::LogRecord(Logger &logger) : logger_(&logger) {
+    if(!logger.enabled())
+        return;
+
+    thread_local Scratch scratch;
+    if(scratch.busy) {
+        own_.reset(new Scratch);
+        scratch_ = own_.get();
+    }
+    else
+        scratch_ = &scratch;
+
+    scratch_->busy = true;
+    scratch_->text.clear();
+}
+
+inline LogRecord::~LogRecord() {
+    if(!scratch_)
+        return;
+
+    logger_->write(scratch_->text.data(), scratch_->text.size());
+    scratch_->busy = false;
+
+    // don't keep the memory of one huge query for the thread's lifetime
+    if(scratch_->text.capacity() > (1 << 20))
+        std::string().swap(scratch_->text);
+}
+
 class NullStream : public std::ostream {
 public:
     NullStream() : std::ostream( nullptr) {}
@@ -47,6 +190,10 @@ class NullLogger : public Logger {
     NullStream null;
 public:
     NullLogger(): Logger(null) {}
+
+    bool enabled() const override { return false; }
+
+    void write_deferred(Formatter, const char*, size_t) override {}
 };
 
 class FileLogger : public Logger {
@@ -60,6 +207,223 @@ public:
     }
 };
 
+// File logger which keeps file I/O off the calling threads. Every thread
+// appends whole records to its own lock-free single producer ring and one
+// background thread collects the rings into large sequential writes.
+class AsyncFileLogger : public Logger {
+public:
+    enum class Overflow {
+        // the record is lost and counted, the caller never waits
+        drop,
+        // the caller waits for the writer to make room
+        block
+    };
+
+    enum { max_threads = 256 };
+
+    AsyncFileLogger(const std::string& filename, Overflow overflow = Overflow::drop, size_t ring_size = 1 << 20)
+        : Logger(file_), overflow_(overflow), ring_size_(round_up(ring_size)), id_(next_id()) {
+        // batches are large already, the stream must not split them
+        file_.rdbuf()->pubsetbuf(nullptr, 0);
+        file_.open(filename, std::ios::binary);
+        writer_ = std::thread([this] { run(); });
+    }
+
+    ~AsyncFileLogger() override {
+        stop_.store(true, std::memory_order_release);
+        writer_.join();
+    }
+
+    void write(const char *data, size_t size) override {
+        // a record may take a quarter of the ring, longer ones are cut
+        static const char cut[] = " ...\n";
+        const bool too_long = size > max_record();
+
+        Ring *ring = local_ring();
+        if(!ring || !push(*ring, 0,
+                          {{data, too_long ? max_record() - (sizeof(cut) - 1) : size},
+                           {cut, too_long ? sizeof(cut) - 1 : 0}}))
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    size_t max_record() const override { return ring_size_ / 4 - sizeof(uint32_t); }
+
+    void write_deferred(Formatter format, const char *data, size_t size) override {
+        // a compact record can't be cut
+        Ring *ring = local_ring();
+        if(!ring || sizeof(format) + size > max_record() ||
+           !push(*ring, deferred, {{reinterpret_cast<const char*>(&format), sizeof(format)}, {data, size}}))
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    // Bytes of length prefixed records. head and tail only grow, the
+    // producer owns head, the writer owns tail.
+    struct Ring {
+        Ring(size_t size, std::thread::id owner) : data(new char[size]), mask(size - 1), thread(owner) {}
+
+        std::unique_ptr<char[]> data;
+        size_t mask;
+        std::thread::id thread;
+        alignas(64) std::atomic<size_t> head{0};
+        alignas(64) std::atomic<size_t> tail{0};
+    };
+
+    using Piece = std::pair<const char*, size_t>;
+
+    // length flag of records which still need their Formatter
+    static const uint32_t deferred = 0x80000000u;
+
+    static size_t round_up(size_t size) {
+        size_t n = 4096;
+        while(n < size)
+            n <<= 1;
+        return n;
+    }
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> id{0};
+        return ++id;
+    }
+
+    Ring* local_ring() {
+        struct Cache {
+            uint64_t owner = 0;
+            Ring *ring = nullptr;
+        };
+        thread_local Cache cache;
+
+        if(cache.owner == id_)
+            return cache.ring;
+
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+
+        const size_t count = ring_count_.load(std::memory_order_relaxed);
+        Ring *ring = nullptr;
+        for(size_t i = 0; i < count && !ring; i++) {
+            if(rings_[i]->thread == std::this_thread::get_id())
+                ring = rings_[i].get();
+        }
+
+        if(!ring) {
+            if(count == max_threads)
+                return nullptr;
+            rings_[count].reset(new Ring(ring_size_, std::this_thread::get_id()));
+            ring = rings_[count].get();
+            ring_count_.store(count + 1, std::memory_order_release);
+        }
+
+        cache.owner = id_;
+        cache.ring = ring;
+        return ring;
+    }
+
+    void copy_in(Ring &ring, size_t at, const char *data, size_t size) {
+        const size_t offset = at & ring.mask;
+        const size_t first = std::min(size, ring.mask + 1 - offset);
+        std::memcpy(ring.data.get() + offset, data, first);
+        std::memcpy(ring.data.get(), data + first, size - first);
+    }
+
+    void copy_out(const Ring &ring, size_t at, char *data, size_t size) const {
+        const size_t offset = at & ring.mask;
+        const size_t first = std::min(size, ring.mask + 1 - offset);
+        std::memcpy(data, ring.data.get() + offset, first);
+        std::memcpy(data + first, ring.data.get(), size - first);
+    }
+
+    bool push(Ring &ring, uint32_t flags, std::initializer_list<Piece> pieces) {
+        size_t size = 0;
+        for(const auto &piece : pieces)
+            size += piece.second;
+
+        const uint32_t length = static_cast<uint32_t>(size) | flags;
+        const size_t needed = sizeof(length) + size;
+
+        const size_t head = ring.head.load(std::memory_order_relaxed);
+        while(head + needed - ring.tail.load(std::memory_order_acquire) > ring.mask + 1) {
+            if(overflow_ == Overflow::drop || stop_.load(std::memory_order_relaxed))
+                return false;
+            std::this_thread::yield();
+        }
+
+        size_t at = head;
+        copy_in(ring, at, reinterpret_cast<const char*>(&length), sizeof(length));
+        at += sizeof(length);
+        for(const auto &piece : pieces) {
+            copy_in(ring, at, piece.first, piece.second);
+            at += piece.second;
+        }
+        ring.head.store(head + needed, std::memory_order_release);
+        return true;
+    }
+
+    void drain(Ring &ring, std::string &batch, std::string &compact) {
+        size_t tail = ring.tail.load(std::memory_order_relaxed);
+        const size_t head = ring.head.load(std::memory_order_acquire);
+
+        while(tail != head) {
+            uint32_t length = 0;
+            copy_out(ring, tail, reinterpret_cast<char*>(&length), sizeof(length));
+            const size_t size = length & ~deferred;
+
+            if(length & deferred) {
+                Formatter format = nullptr;
+                copy_out(ring, tail + sizeof(length), reinterpret_cast<char*>(&format), sizeof(format));
+                compact.resize(size - sizeof(format));
+                copy_out(ring, tail + sizeof(length) + sizeof(format), &compact[0], compact.size());
+                format(compact.data(), compact.size(), batch);
+            }
+            else {
+                const size_t offset = batch.size();
+                batch.resize(offset + size);
+                copy_out(ring, tail + sizeof(length), &batch[offset], size);
+            }
+            tail += sizeof(length) + size;
+        }
+
+        ring.tail.store(tail, std::memory_order_release);
+    }
+
+    void run() {
+        std::string batch;
+        batch.reserve(ring_size_);
+        std::string compact;
+
+        for(;;) {
+            const bool stopping = stop_.load(std::memory_order_acquire);
+
+            const size_t count = ring_count_.load(std::memory_order_acquire);
+            for(size_t i = 0; i < count; i++)
+                drain(*rings_[i], batch, compact);
+
+            if(const uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed))
+                batch += "Log writer fell behind, " + std::to_string(dropped) + " records dropped\n";
+
+            if(!batch.empty()) {
+                file_.write(batch.data(), static_cast<std::streamsize>(batch.size()));
+                batch.clear();
+            }
+            else if(stopping)
+                break;
+            else
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    std::ofstream file_;
+    Overflow overflow_;
+    size_t ring_size_;
+    uint64_t id_;
+    // taken once per thread, when it logs for the first time
+    std::mutex rings_mutex_;
+    std::array<std::unique_ptr<Ring>, max_threads> rings_;
+    std::atomic<size_t> ring_count_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<bool> stop_{false};
+    std::thread writer_;
+};
+
 using LoggerPtr = std::shared_ptr<Logger>;
 
 class LoggerRegistry {
@@ -104,6 +468,15 @@ public:
         return logger;
     }
 
+    LoggerPtr create_async_file(const std::string& logger_name, const std::string &filename,
+                                AsyncFileLogger::Overflow overflow = AsyncFileLogger::Overflow::drop) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto logger = std::make_shared<AsyncFileLogger>(filename, overflow);
+        loggers_[logger_name] = logger;
+        return logger;
+    }
+
     static LoggerRegistry& instance() {
         static LoggerRegistry instance;
         return instance;
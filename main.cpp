@@ -1,291 +1,2992 @@
 #include <boost/asio.hpp>
 
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string_view>
+
 #include "debug.hpp"
 #include "parser.hpp"
+#include "compression.hpp"
+#include "tls.hpp"
 #include "logger.hpp"
+#include "io_context_pool.hpp"
+#include "splice_pipe.hpp"
+#include "uring.hpp"
+#include "buffer_ring.hpp"
+#include "backend_pool.hpp"
+#include "pooled_session.hpp"
+#include "query_cache.hpp"
+#include "metrics_server.hpp"
+#include "upgrade.hpp"
+
+#if defined(DB_PROXY_COROUTINES) && !defined(BOOST_ASIO_HAS_CO_AWAIT)
+#error "DB_PROXY_COROUTINES needs a C++20 compiler and Boost 1.70 or newer"
+#endif
+
+namespace net = boost::asio;
+
+namespace db_proxy
+{
+#if defined(DB_PROXY_COROUTINES)
+    // Runs work on pool; whoever waits for it resumes on its own executor.
+    template<typename Work, typename CompletionToken>
+    auto async_run(net::thread_pool& pool, Work work, CompletionToken&& token)
+    {
+        return net::async_initiate<CompletionToken, void()>(
+                    [&pool](auto handler, Work work)
+                    {
+                        auto guard = net::make_work_guard(handler);
+                        net::post(pool, [work = std::move(work), handler = std::move(handler),
+                                         guard = std::move(guard)]() mutable
+                        {
+                            work();
+                            net::post(guard.get_executor(), std::move(handler));
+                        });
+                    },
+                    token, std::move(work));
+    }
+#endif
+
+    enum class relay_mode {
+        copy,
+        // server to client bytes bypass user space through splice(2), Linux only
+        splice,
+        // both directions go through the shard's io_uring, Linux only
+        uring
+    };
+
+    struct session_options
+    {
+        relay_mode relay = relay_mode::copy;
+        // buffers per direction, reading the next one overlaps writing the previous
+        size_t pipeline_depth = 4;
+        // reading stops when this many buffers wait to be written...
+        size_t high_watermark = 4;
+        // ...and resumes once the writer has brought it down to this many
+        size_t low_watermark = 2;
+        // Threads compressing responses for clients that ask for
+        // CLIENT_COMPRESS, which the backend then never hears of. 0 - the
+        // client and the backend negotiate compression between them.
+        size_t compress_threads = 0;
+        // zlib level of the compressed responses
+        int compress_level = 6;
+        // receive buffers of every shard's io_uring
+        unsigned uring_buffers = 256;
+    };
+
+    class session : public std::enable_shared_from_this<session>
+    {
+    public:
+
+        using ptr_type = std::shared_ptr<session>;
+
+        // compress_workers - nullptr, compression is not offloaded;
+        // ring - the shard's io_uring for relay_mode::uring;
+        // tls - nullptr, the proxy doesn't terminate TLS
+        session(io_context_pool::shard& shard, net::ip::tcp::socket client_socket,
+                const session_options& options, net::thread_pool* compress_workers = nullptr,
+                uring* ring = nullptr, tls_context* tls = nullptr)
+            : client_socket_(std::move(client_socket)),
+              server_socket_(shard.ios),
+              client_ring_(shard.buffers, options.pipeline_depth),
+              server_ring_(shard.buffers, options.pipeline_depth),
+              high_watermark_(options.high_watermark),
+              low_watermark_(options.low_watermark),
+              compress_workers_(compress_workers),
+              compress_level_(options.compress_level),
+              tls_(tls),
+              metrics_(shard.metrics),
+              limits_(shard.limits),
+              limit_commands_(shard.limits && options.relay == relay_mode::copy &&
+                              (shard.limits->options().qps > 0 || shard.limits->options().max_in_flight > 0)),
+              admission_timer_(shard.ios),
+#if defined(DB_PROXY_COROUTINES)
+              server_room_(shard.ios),
+              server_data_(shard.ios),
+              client_room_(shard.ios),
+              client_data_(shard.ios),
+#endif
+              load_(shard)
+        {
+            parser_.set_capture(shard.capture);
+            parser_.set_metrics(&shard.metrics);
+            // runs on the thread of the leave() which freed the slot
+            waiter_.granted = [this] {
+                net::post(client_socket_.get_executor(), std::bind(&session::handle_in_flight_granted, shared_from_this()));
+            };
+#if defined(__linux__)
+            if (options.relay == relay_mode::splice)
+                pipe_.reset(new splice_pipe);
+#endif
+#if defined(DB_PROXY_HAS_IO_URING)
+            ring_ = ring;
+#else
+            (void)ring;
+#endif
+        }
+
+        ~session()
+        {
+            // the leave() which granted the last slot may still be returning
+            // from waiter_.granted
+            if (client_)
+                limits_->cancel(*client_, waiter_);
+        }
+
+        net::ip::tcp::socket& client_socket()
+        {
+            return client_socket_;
+        }
+
+        net::ip::tcp::socket& server_socket()
+        {
+            return server_socket_;
+        }
+
+        void start(const net::ip::tcp::endpoint& endpoint)
+        {
+            // a client over its sessions gets no greeting, just the error
+#if defined(DB_PROXY_COROUTINES)
+            if (limits_ && limits_->options().by == admission_options::key::ip && !admit_session(address_key()))
+            {
+                net::co_spawn(client_socket_.get_executor(), refuse_session(shared_from_this(), 0), net::detached);
+                return;
+            }
+
+            net::co_spawn(server_socket_.get_executor(), run(shared_from_this(), endpoint), net::detached);
+#else
+            if (limits_ && limits_->options().by == admission_options::key::ip && !admit_session(address_key()))
+            {
+                refuse_session(0);
+                return;
+            }
+
+            server_socket_.async_connect(
+                        endpoint,
+                        std::bind(&session::handle_server_connect,
+                                  shared_from_this(),
+                                  std::placeholders::_1));
+#endif
+        }
+
+#if !defined(DB_PROXY_COROUTINES)
+        void handle_server_connect(const boost::system::error_code& error)
+        {
+            if (!error)
+            {
+                if (connected())
+                {
+                    read_server();
+                    read_client();
+                }
+            }
+            else
+                close();
+        }
+#endif
+
+    private:
+        // false - the io_uring relay took the session over
+        bool connected()
+        {
+            // a response or a query may go out in several writes, none of
+            // them may wait for the ACK of the previous one
+            boost::system::error_code nodelay_error;
+            server_socket_.set_option(net::ip::tcp::no_delay(true), nodelay_error);
+
+#if defined(DB_PROXY_HAS_IO_URING)
+            if (ring_)
+            {
+                // io_uring fails requests on non-blocking sockets with
+                // EAGAIN instead of waiting for them
+                boost::system::error_code ec;
+                client_socket_.native_non_blocking(false, ec);
+                server_socket_.native_non_blocking(false, ec);
+                uring_receive(true);
+                uring_receive(false);
+                return false;
+            }
+#endif
+            // synchronous reads after a readiness wait must not block
+            client_socket_.non_blocking(true);
+            server_socket_.non_blocking(true);
+#if defined(__linux__)
+            if (pipe_)
+            {
+                client_socket_.native_non_blocking(true);
+                server_socket_.native_non_blocking(true);
+            }
+#endif
+            return true;
+        }
+
+#if defined(DB_PROXY_COROUTINES)
+        // Coroutine relay: every direction is a reader and a writer loop
+        // around its ring, each a coroutine which lives as long as the
+        // session. Their frames, and those of the operations they await,
+        // come from Asio's per thread recycling allocator; the session is
+        // held once per loop instead of once per handler. A writer sleeps
+        // until its reader hands it something, a reader at the high
+        // watermark until its writer has made room; closing the session
+        // wakes them all.
+        class wakeup
+        {
+        public:
+            explicit wakeup(net::io_context& ios) : timer_(ios, net::steady_timer::time_point::max()) {}
+
+            net::awaitable<void> wait()
+            {
+                boost::system::error_code ec;
+                waiting_ = true;
+                co_await timer_.async_wait(net::redirect_error(net::use_awaitable, ec));
+                waiting_ = false;
+            }
+
+            void notify()
+            {
+                if (waiting_)
+                    timer_.cancel();
+            }
+
+        private:
+            // never expires, cancelling it wakes the waiter
+            net::steady_timer timer_;
+            bool waiting_ = false;
+        };
+
+        net::awaitable<void> run(ptr_type self, net::ip::tcp::endpoint endpoint)
+        {
+            boost::system::error_code ec;
+            co_await server_socket_.async_connect(endpoint, net::redirect_error(net::use_awaitable, ec));
+            if (ec)
+            {
+                close();
+                co_return;
+            }
+
+            // the io_uring relay stays on completion handlers, its
+            // completions come from the ring and not from an Asio operation
+            if (!connected())
+                co_return;
+
+            if (tls_ && !co_await login(self, endpoint))
+            {
+                close();
+                co_return;
+            }
+
+            const auto executor = server_socket_.get_executor();
+#if defined(__linux__)
+            if (pipe_)
+                net::co_spawn(executor, splice_server(self), net::detached);
+            else
+#endif
+            {
+                net::co_spawn(executor, read_server(self), net::detached);
+                net::co_spawn(executor, write_client(self), net::detached);
+            }
+            net::co_spawn(executor, read_client(self), net::detached);
+            net::co_spawn(executor, write_server(self), net::detached);
+        }
+
+        // Copy relay: each direction is a ring of buffers. The reader takes
+        // the next slot as soon as one is free and stops at the high
+        // watermark until the ring is drained down to the low one. It
+        // writes what it read itself, without waiting, the way async_write
+        // starts; only what the peer can't take at once, and what has to be
+        // compressed or inflated first, is left to the writer loop.
+        net::awaitable<void> read_server(ptr_type)
+        {
+            boost::system::error_code ec;
+            for (;;)
+            {
+                if (server_ring_.filled() >= high_watermark_)
+                {
+                    while (server_ring_.filled() > low_watermark_ && client_socket_.is_open())
+                        co_await server_room_.wait();
+                    if (!client_socket_.is_open())
+                        break;
+                    continue;
+                }
+
+                // An idle direction waits for data without holding a buffer.
+                size_t bytes_transferred = 0;
+                if (server_tls_)
+                    bytes_transferred = co_await read_tls(server_socket_, *server_tls_, server_ring_, ec);
+                else if (server_ring_.empty())
+                {
+                    co_await server_socket_.async_wait(net::socket_base::wait_read,
+                                                       net::redirect_error(net::use_awaitable, ec));
+                    if (!ec)
+                    {
+                        bytes_transferred = server_socket_.read_some(server_ring_.prepare(), ec);
+                        if (ec == net::error::would_block)
+                            continue;
+                    }
+                }
+                else
+                    bytes_transferred = co_await server_socket_.async_read_some(
+                                server_ring_.prepare(), net::redirect_error(net::use_awaitable, ec));
+                if (ec)
+                    break;
+
+                uint8_t* data = server_ring_.commit(bytes_transferred);
+                if (!greeting_seen_)
+                {
+                    greeting_seen_ = true;
+                    compression_offered_ = compress_workers_ && offer_compression(data, bytes_transferred);
+                }
+
+                parser_.parse_server(data, bytes_transferred);
+
+                if (in_flight_ && !parser_.response_pending())
+                {
+                    in_flight_ = false;
+                    limits_->leave(*client_);
+                }
+
+                if (client_writing_)
+                    continue;
+                if (compressing_)
+                {
+                    client_writing_ = true;
+                    server_data_.notify();
+                }
+                else if (!write_ring(client_socket_, client_tls_.get(), server_ring_, client_written_, client_writing_,
+                                     server_data_))
+                    break;
+            }
+            close();
+        }
+
+        // Writes the ring to a peer as far as it takes it without waiting.
+        // The rest is the writer loop's, woken for it. false - the peer is gone.
+        static bool write_ring(net::ip::tcp::socket& socket, tls_connection* tls, buffer_ring& ring,
+                               size_t& written, bool& writing, wakeup& writer)
+        {
+            boost::system::error_code ec;
+            const buffer_ring::const_buffers buffers = ring.gather(written);
+            const size_t n = write_some(socket, tls, buffers, ec);
+            if (ec && ec != net::error::would_block)
+                return false;
+
+            written += n;
+            if (n == net::buffer_size(buffers))
+            {
+                written = 0;
+                ring.release();
+                return true;
+            }
+
+            writing = true;
+            writer.notify();
+            return true;
+        }
+
+        // TLS links go through OpenSSL on the socket, which stays
+        // non-blocking; a call that can't go on says whether the socket has
+        // to become readable or writable first. Once the kernel encrypts what
+        // a link sends (kTLS) the relay writes to the socket itself, which
+        // gathers the ring into one write instead of one record per buffer.
+        static net::socket_base::wait_type ready_for(tls_connection::status status)
+        {
+            return status == tls_connection::want_write ? net::socket_base::wait_write : net::socket_base::wait_read;
+        }
+
+        // Like socket.write_some(). Calls on a closed socket fail before
+        // OpenSSL gets to its descriptor, which may be someone else's by now.
+        template<typename ConstBufferSequence>
+        static size_t write_some(net::ip::tcp::socket& socket, tls_connection* tls,
+                                 const ConstBufferSequence& buffers, boost::system::error_code& ec)
+        {
+            if (!tls || tls->kernel_send())
+                return socket.write_some(buffers, ec);
+            if (!socket.is_open())
+            {
+                ec = net::error::bad_descriptor;
+                return 0;
+            }
+
+            size_t written = 0;
+            for (auto b = net::buffer_sequence_begin(buffers); b != net::buffer_sequence_end(buffers); ++b)
+            {
+                size_t n = 0;
+                const tls_connection::status status = tls->write(b->data(), b->size(), n);
+                written += n;
+                if (status == tls_connection::failed)
+                {
+                    ec = net::error::connection_reset;
+                    break;
+                }
+                if (status != tls_connection::done || n < b->size())
+                {
+                    ec = net::error::would_block;
+                    break;
+                }
+            }
+            return written;
+        }
+
+        // Like net::async_write().
+        template<typename ConstBufferSequence>
+        static net::awaitable<void> write_all(net::ip::tcp::socket& socket, tls_connection* tls,
+                                              ConstBufferSequence buffers, boost::system::error_code& ec)
+        {
+            if (!tls || tls->kernel_send())
+            {
+                co_await net::async_write(socket, buffers, net::redirect_error(net::use_awaitable, ec));
+                co_return;
+            }
+
+            for (auto b = net::buffer_sequence_begin(buffers); b != net::buffer_sequence_end(buffers); ++b)
+            {
+                net::const_buffer rest = *b;
+                while (rest.size() > 0)
+                {
+                    if (!socket.is_open())
+                    {
+                        ec = net::error::bad_descriptor;
+                        co_return;
+                    }
+
+                    size_t n = 0;
+                    const tls_connection::status status = tls->write(rest.data(), rest.size(), n);
+                    rest += n;
+                    if (status == tls_connection::failed)
+                    {
+                        ec = net::error::connection_reset;
+                        co_return;
+                    }
+                    if (status != tls_connection::done)
+                    {
+                        co_await socket.async_wait(ready_for(status), net::redirect_error(net::use_awaitable, ec));
+                        if (ec)
+                            co_return;
+                    }
+                }
+            }
+        }
+
+        // Like socket.async_read_some(), but the records OpenSSL holds
+        // already are read before waiting.
+        static net::awaitable<size_t> read_some(net::ip::tcp::socket& socket, tls_connection& tls,
+                                                net::mutable_buffer buffer, boost::system::error_code& ec)
+        {
+            for (;;)
+            {
+                if (!socket.is_open())
+                {
+                    ec = net::error::bad_descriptor;
+                    co_return 0;
+                }
+
+                size_t n = 0;
+                const tls_connection::status status = tls.read(buffer.data(), buffer.size(), n);
+                if (status == tls_connection::done)
+                    co_return n;
+                // close_notify, or anything else that ends the link
+                if (status == tls_connection::failed)
+                {
+                    ec = net::error::eof;
+                    co_return 0;
+                }
+
+                co_await socket.async_wait(ready_for(status), net::redirect_error(net::use_awaitable, ec));
+                if (ec)
+                    co_return 0;
+            }
+        }
+
+        // The next chunk of a TLS direction into its ring. An idle direction
+        // waits for data without holding a buffer, like a plain one.
+        static net::awaitable<size_t> read_tls(net::ip::tcp::socket& socket, tls_connection& tls, buffer_ring& ring,
+                                               boost::system::error_code& ec)
+        {
+            if (ring.empty() && !tls.pending())
+            {
+                co_await socket.async_wait(net::socket_base::wait_read, net::redirect_error(net::use_awaitable, ec));
+                if (ec)
+                    co_return 0;
+            }
+            co_return co_await read_some(socket, tls, ring.prepare(), ec);
+        }
+
+        static net::awaitable<bool> handshake(net::ip::tcp::socket& socket, tls_connection& tls)
+        {
+            boost::system::error_code ec;
+            for (;;)
+            {
+                const tls_connection::status status = tls.handshake();
+                if (status == tls_connection::done)
+                    co_return true;
+                if (status == tls_connection::failed)
+                    co_return false;
+
+                co_await socket.async_wait(ready_for(status), net::redirect_error(net::use_awaitable, ec));
+                if (ec)
+                    co_return false;
+            }
+        }
+
+        // One whole packet of the login, header included. Nothing after it
+        // is read, a TLS handshake may follow it on the socket.
+        static net::awaitable<bool> read_packet(net::ip::tcp::socket& socket, tls_connection* tls,
+                                                std::vector<uint8_t>& packet)
+        {
+            boost::system::error_code ec;
+            packet.resize(My::header_size);
+            size_t filled = 0;
+            for (;;)
+            {
+                if (filled == packet.size())
+                {
+                    if (packet.size() > My::header_size)
+                        co_return true;
+                    const size_t length = static_cast<size_t>(My::read_int<3>(packet.data()));
+                    if (length == 0)
+                        co_return true;
+                    packet.resize(My::header_size + length);
+                }
+
+                const net::mutable_buffer rest(packet.data() + filled, packet.size() - filled);
+                if (tls)
+                    filled += co_await read_some(socket, *tls, rest, ec);
+                else
+                    filled += co_await socket.async_read_some(rest, net::redirect_error(net::use_awaitable, ec));
+                if (ec)
+                    co_return false;
+            }
+        }
+
+        // TLS termination. The proxy relays the login packet by packet: the
+        // greeting offers CLIENT_SSL, an SSLRequest gets the handshake, and
+        // the backend gets an SSLRequest of the proxy's and a handshake of
+        // its own if its link is TLS too. Client and backend then count the
+        // login's packets from different sequence ids when only one of them
+        // sent an SSLRequest, the proxy renumbers them until the server has
+        // answered with OK or ERR. The parser sees them as the client does.
+        // false - the session is over.
+        net::awaitable<bool> login(ptr_type self, net::ip::tcp::endpoint endpoint)
+        {
+            boost::system::error_code ec;
+            std::vector<uint8_t> packet;
+
+            // the greeting, or the ERR of a server that won't have the client
+            if (!co_await read_packet(server_socket_, nullptr, packet))
+                co_return false;
+            bool backend_offers_tls = false;
+            const bool greeting = offer_tls(packet.data(), packet.size(), backend_offers_tls);
+            greeting_seen_ = true;
+            parser_.parse_server(packet.data(), packet.size());
+            co_await write_all(client_socket_, nullptr, net::buffer(packet), ec);
+            if (ec)
+                co_return false;
+            if (!greeting)
+                co_return true;
+
+            const bool backend_tls = tls_->options().backend;
+            if (backend_tls && !backend_offers_tls)
+            {
+                std::cerr << "Backend offers no TLS" << std::endl;
+                co_return false;
+            }
+
+            // an SSLRequest, or the handshake response in the clear
+            if (!co_await read_packet(client_socket_, nullptr, packet))
+                co_return false;
+            parser_.parse_client(packet.data(), packet.size());
+
+            const bool client_tls = packet.size() == My::header_size + 32 && packet[3] == 1 &&
+                                    (My::read_int<4>(packet.data() + My::header_size) & My::CLIENT_SSL);
+            if (client_tls)
+            {
+                parser_.tls_terminated();
+                client_tls_ = tls_->accept(client_socket_.native_handle());
+                if (!client_tls_ || !co_await handshake(client_socket_, *client_tls_))
+                    co_return false;
+
+                (client_tls_->resumed() ? metrics_.tls_resumed : metrics_.tls_full).add();
+                if (client_tls_->kernel_send())
+                    metrics_.ktls_send.add();
+                if (client_tls_->kernel_receive())
+                    metrics_.ktls_receive.add();
+
+                if (!co_await read_packet(client_socket_, client_tls_.get(), packet))
+                    co_return false;
+                parser_.parse_client(packet.data(), packet.size());
+            }
+            else if (tls_->options().required)
+            {
+                refusals_.clear();
+                tls_context::write_insecure_error(refusals_, static_cast<uint8_t>(packet[3] + 1));
+                co_await write_all(client_socket_, nullptr, net::buffer(refusals_), ec);
+                co_return false;
+            }
+
+            if (limits_ && !client_ && parser_.login_seen())
+            {
+                const std::string& user = parser_.user();
+                if (!admit_session(user.empty() ? address_key() : "user:" + user))
+                {
+                    co_await refuse_session(self, static_cast<uint8_t>(packet[3] + 1));
+                    co_return false;
+                }
+            }
+
+            // capabilities, max packet size, character set and filler of a
+            // protocol 4.1 handshake response
+            if (packet.size() < My::header_size + 32)
+                co_return false;
+
+            // A password the client sent encrypted would reach a plaintext
+            // backend link in the clear, such logins are refused, whether the
+            // client offers the password or the server asks for it.
+            const bool plaintext_backend = client_tls && !backend_tls;
+            if (plaintext_backend && sends_cleartext_password(packet.data(), packet.size()))
+            {
+                refusals_.clear();
+                tls_context::write_cleartext_password_error(refusals_, static_cast<uint8_t>(packet[3] + 1));
+                co_await write_all(client_socket_, client_tls_.get(), net::buffer(refusals_), ec);
+                co_return false;
+            }
+
+            uint8_t* capabilities = packet.data() + My::header_size;
+            uint32_t flags = static_cast<uint32_t>(My::read_int<4>(capabilities));
+            flags = backend_tls ? flags | My::CLIENT_SSL : flags & ~uint32_t(My::CLIENT_SSL);
+            for (size_t i = 0; i < 4; i++)
+                capabilities[i] = static_cast<uint8_t>(flags >> (8 * i));
+
+            if (backend_tls)
+            {
+                // the SSLRequest is the start of the handshake response
+                std::vector<uint8_t> request(packet.begin(), packet.begin() + My::header_size + 32);
+                request[0] = 32;
+                request[1] = 0;
+                request[2] = 0;
+                request[3] = 1;
+                co_await write_all(server_socket_, nullptr, net::buffer(request), ec);
+                if (ec)
+                    co_return false;
+
+                server_tls_ = tls_->connect(server_socket_.native_handle(), endpoint.address().to_string());
+                if (!server_tls_ || !co_await handshake(server_socket_, *server_tls_))
+                {
+                    std::cerr << "TLS handshake with the backend failed" << std::endl;
+                    co_return false;
+                }
+            }
+
+            const int shift = (backend_tls ? 1 : 0) - (client_tls ? 1 : 0);
+            for (;;)
+            {
+                packet[3] = static_cast<uint8_t>(packet[3] + shift);
+                co_await write_all(server_socket_, server_tls_.get(), net::buffer(packet), ec);
+                if (ec)
+                    co_return false;
+
+                // the server's turn until it wants something of the client;
+                // caching_sha2's fast auth success 0x01 0x03 is followed by OK
+                for (;;)
+                {
+                    if (!co_await read_packet(server_socket_, server_tls_.get(), packet))
+                        co_return false;
+                    packet[3] = static_cast<uint8_t>(packet[3] - shift);
+                    if (plaintext_backend && asks_cleartext_password(packet.data(), packet.size()))
+                    {
+                        refusals_.clear();
+                        tls_context::write_cleartext_password_error(refusals_, packet[3]);
+                        co_await write_all(client_socket_, client_tls_.get(), net::buffer(refusals_), ec);
+                        co_return false;
+                    }
+                    parser_.parse_server(packet.data(), packet.size());
+                    co_await write_all(client_socket_, client_tls_.get(), net::buffer(packet), ec);
+                    if (ec)
+                        co_return false;
+
+                    const uint8_t* payload = packet.data() + My::header_size;
+                    const size_t size = packet.size() - My::header_size;
+                    if (size > 0 && (payload[0] == My::OK_PACKET || payload[0] == My::ERR_PACKET))
+                        co_return true;
+                    if (!(size > 1 && payload[0] == 0x01 && payload[1] == 0x03))
+                        break;
+                }
+
+                if (!co_await read_packet(client_socket_, client_tls_.get(), packet))
+                    co_return false;
+                parser_.parse_client(packet.data(), packet.size());
+            }
+        }
+
+        net::awaitable<void> write_client(ptr_type)
+        {
+            boost::system::error_code ec;
+            for (;;)
+            {
+                if (!client_writing_)
+                {
+                    if (!client_socket_.is_open())
+                        break;
+                    co_await server_data_.wait();
+                    continue;
+                }
+
+                if (!server_ring_.empty())
+                {
+                    // a chunk begun plain is finished plain
+                    if (compressing_ && client_written_ == 0)
+                        co_await compress_client(ec);
+                    else
+                        co_await write_all(client_socket_, client_tls_.get(), server_ring_.gather(client_written_), ec);
+                    client_written_ = 0;
+                    if (ec)
+                        break;
+                    server_ring_.release();
+                    server_room_.notify();
+                }
+                else if (!refusals_.empty())
+                {
+                    // ERRs of refused commands, after what the server sent before
+                    refusal_out_.swap(refusals_);
+                    co_await write_all(client_socket_, client_tls_.get(), net::buffer(refusal_out_), ec);
+                    refusal_out_.clear();
+                    if (ec)
+                        break;
+                }
+                else
+                    client_writing_ = false;
+            }
+            close();
+        }
+
+        net::awaitable<void> read_client(ptr_type self)
+        {
+            boost::system::error_code ec;
+            for (;;)
+            {
+                if (client_ring_.filled() >= high_watermark_ || server_pending_.size() >= max_inflated_pending)
+                {
+                    while ((client_ring_.filled() > low_watermark_ || server_pending_.size() >= max_inflated_pending) &&
+                           client_socket_.is_open())
+                        co_await client_room_.wait();
+                    if (!client_socket_.is_open())
+                        break;
+                    continue;
+                }
+
+                size_t bytes_transferred = 0;
+                if (client_tls_)
+                    bytes_transferred = co_await read_tls(client_socket_, *client_tls_, client_ring_, ec);
+                else if (client_ring_.empty())
+                {
+                    co_await client_socket_.async_wait(net::socket_base::wait_read,
+                                                       net::redirect_error(net::use_awaitable, ec));
+                    if (!ec)
+                    {
+                        bytes_transferred = client_socket_.read_some(client_ring_.prepare(), ec);
+                        if (ec == net::error::would_block)
+                            continue;
+                    }
+                }
+                else
+                    bytes_transferred = co_await client_socket_.async_read_some(
+                                client_ring_.prepare(), net::redirect_error(net::use_awaitable, ec));
+                if (ec)
+                    break;
+
+                uint8_t* data = client_ring_.commit(bytes_transferred);
+
+                // after the login a compressing client sends compressed packets only
+                if (compress_requested_ && parser_.handshake_done())
+                {
+                    if (!inflate_client(data, bytes_transferred))
+                        break;
+                    if (!server_writing_ && !server_pending_.empty())
+                    {
+                        server_writing_ = true;
+                        client_data_.notify();
+                    }
+                    continue;
+                }
+
+                if (!login_seen_)
+                {
+                    login_seen_ = true;
+                    compress_requested_ = compression_offered_ && accept_compression(data, bytes_transferred);
+                }
+
+                const bool idle = !parser_.response_pending();
+                parser_.parse_client(data, bytes_transferred);
+
+                if (limits_ && !client_ && parser_.login_seen())
+                {
+                    const std::string& user = parser_.user();
+                    if (!admit_session(user.empty() ? address_key() : "user:" + user))
+                    {
+                        // the handshake response goes no further; a TLS
+                        // client can't be told in plain text
+                        client_ring_.drop_last();
+                        if (!user.empty())
+                            co_await refuse_session(self, 2);
+                        break;
+                    }
+                }
+
+                // new commands wait in the ring until they are admitted
+                if (limit_commands_ && client_ && parser_.commands() != commands_)
+                {
+                    const size_t n = static_cast<size_t>(parser_.commands() - commands_);
+                    commands_ = parser_.commands();
+                    held_ = true;
+                    refusable_ = n == 1 && idle && parser_.response_pending() &&
+                                 single_packet(data, bytes_transferred);
+                    if (!co_await admit_commands(n))
+                        break;
+                }
+
+                if (!server_writing_ && !client_ring_.empty() &&
+                    !write_ring(server_socket_, server_tls_.get(), client_ring_, server_written_, server_writing_,
+                                client_data_))
+                    break;
+            }
+            close();
+        }
+
+        net::awaitable<void> write_server(ptr_type)
+        {
+            boost::system::error_code ec;
+            for (;;)
+            {
+                if (!server_writing_)
+                {
+                    if (!client_socket_.is_open())
+                        break;
+                    co_await client_data_.wait();
+                    continue;
+                }
+
+                // the plain bytes the ring still holds from the login go
+                // before the inflated ones, which never go through the ring
+                if (!client_ring_.empty() && !held_)
+                {
+                    co_await write_all(server_socket_, server_tls_.get(), client_ring_.gather(server_written_), ec);
+                    server_written_ = 0;
+                    if (ec)
+                        break;
+                    client_ring_.release();
+                    client_room_.notify();
+                }
+                else if (!server_pending_.empty())
+                {
+                    server_out_.swap(server_pending_);
+                    co_await net::async_write(server_socket_, net::buffer(server_out_),
+                                              net::redirect_error(net::use_awaitable, ec));
+                    server_out_.clear();
+                    if (ec)
+                        break;
+                    client_room_.notify();
+                }
+                else
+                    server_writing_ = false;
+            }
+            close();
+        }
+
+#if defined(__linux__)
+        // Splice relay: the parser only peeks at the head of a chunk when it
+        // needs it, the chunk itself goes server -> pipe -> client in kernel.
+        net::awaitable<void> splice_server(ptr_type)
+        {
+            boost::system::error_code ec;
+            const int from = server_socket_.native_handle();
+            for (;;)
+            {
+                co_await server_socket_.async_wait(net::socket_base::wait_read,
+                                                   net::redirect_error(net::use_awaitable, ec));
+                if (ec)
+                    break;
+
+                if (const size_t wanted = parser_.peek_size())
+                {
+                    const ssize_t n = ::recv(from, peek_data_, std::min<size_t>(wanted, sizeof(peek_data_)),
+                                             MSG_PEEK | MSG_DONTWAIT);
+                    if (n <= 0)
+                    {
+                        if (spurious_wakeup(n))
+                            continue;
+                        break;
+                    }
+
+                    parser_.parse_server_head(peek_data_, static_cast<size_t>(n));
+                }
+
+                const ssize_t n = pipe_->fill(from);
+                if (n <= 0)
+                {
+                    if (spurious_wakeup(n))
+                        continue;
+                    break;
+                }
+                parser_.server_relayed(static_cast<size_t>(n));
+
+                if (!co_await drain_pipe())
+                    break;
+            }
+            close();
+        }
+
+        // false - the client is gone
+        net::awaitable<bool> drain_pipe()
+        {
+            boost::system::error_code ec;
+            while (pipe_->pending() > 0)
+            {
+                if (pipe_->drain(client_socket_.native_handle()) < 0)
+                {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        co_return false;
+
+                    co_await client_socket_.async_wait(net::socket_base::wait_write,
+                                                       net::redirect_error(net::use_awaitable, ec));
+                    if (ec)
+                        co_return false;
+                }
+            }
+            co_return true;
+        }
+
+        static bool spurious_wakeup(ssize_t result)
+        {
+            return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+#endif
+#else
+        void read_server()
+        {
+#if defined(__linux__)
+            if (pipe_)
+            {
+                server_socket_.async_wait(
+                            net::socket_base::wait_read,
+                            std::bind(&session::handle_server_readable,
+                                      shared_from_this(),
+                                      std::placeholders::_1));
+                return;
+            }
+#endif
+            server_reading_ = true;
+
+            // An idle direction waits for data without holding a buffer.
+            if (server_ring_.empty())
+            {
+                server_socket_.async_wait(
+                            net::socket_base::wait_read,
+                            std::bind(&session::handle_server_ready,
+                                      shared_from_this(),
+                                      std::placeholders::_1));
+                return;
+            }
+
+            server_socket_.async_read_some(
+                        server_ring_.prepare(),
+                        std::bind(&session::handle_server_read,
+                                  shared_from_this(),
+                                  std::placeholders::_1,
+                                  std::placeholders::_2));
+        }
+
+        void handle_server_ready(const boost::system::error_code& error)
+        {
+            if (error)
+            {
+                server_reading_ = false;
+                close();
+                return;
+            }
+
+            boost::system::error_code ec;
+            const size_t bytes_transferred = server_socket_.read_some(server_ring_.prepare(), ec);
+            if (ec == net::error::would_block)
+            {
+                read_server();
+                return;
+            }
+
+            handle_server_read(ec, bytes_transferred);
+        }
+
+        void read_client()
+        {
+            client_reading_ = true;
+
+            if (client_ring_.empty())
+            {
+                client_socket_.async_wait(
+                            net::socket_base::wait_read,
+                            std::bind(&session::handle_client_ready,
+                                      shared_from_this(),
+                                      std::placeholders::_1));
+                return;
+            }
+
+            client_socket_.async_read_some(
+                        client_ring_.prepare(),
+                        std::bind(&session::handle_client_read,
+                                  shared_from_this(),
+                                  std::placeholders::_1,
+                                  std::placeholders::_2));
+        }
+
+        void handle_client_ready(const boost::system::error_code& error)
+        {
+            if (error)
+            {
+                client_reading_ = false;
+                close();
+                return;
+            }
+
+            boost::system::error_code ec;
+            const size_t bytes_transferred = client_socket_.read_some(client_ring_.prepare(), ec);
+            if (ec == net::error::would_block)
+            {
+                read_client();
+                return;
+            }
+
+            handle_client_read(ec, bytes_transferred);
+        }
+
+#if defined(__linux__)
+        // Splice relay: the parser only peeks at the head of a chunk when it
+        // needs it, the chunk itself goes server -> pipe -> client in kernel.
+        void handle_server_readable(const boost::system::error_code& error)
+        {
+            if (error)
+            {
+                close();
+                return;
+            }
+
+            const int from = server_socket_.native_handle();
+
+            if (const size_t wanted = parser_.peek_size())
+            {
+                const ssize_t n = ::recv(from, peek_data_, std::min<size_t>(wanted, sizeof(peek_data_)),
+                                         MSG_PEEK | MSG_DONTWAIT);
+                if (n <= 0)
+                {
+                    handle_splice_error(n);
+                    return;
+                }
+
+                parser_.parse_server_head(peek_data_, static_cast<size_t>(n));
+            }
+
+            const ssize_t n = pipe_->fill(from);
+            if (n <= 0)
+            {
+                handle_splice_error(n);
+                return;
+            }
+            parser_.server_relayed(static_cast<size_t>(n));
+
+            drain_pipe();
+        }
+
+        void drain_pipe()
+        {
+            while (pipe_->pending() > 0)
+            {
+                if (pipe_->drain(client_socket_.native_handle()) < 0)
+                {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        client_socket_.async_wait(
+                                    net::socket_base::wait_write,
+                                    std::bind(&session::handle_client_writable,
+                                              shared_from_this(),
+                                              std::placeholders::_1));
+                    }
+                    else
+                        close();
+                    return;
+                }
+            }
+
+            read_server();
+        }
+
+        void handle_client_writable(const boost::system::error_code& error)
+        {
+            if (!error)
+                drain_pipe();
+            else
+                close();
+        }
+
+        void handle_splice_error(ssize_t result)
+        {
+            // spurious wakeup, wait for the server again
+            if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                read_server();
+            else
+                close();
+        }
+#endif
+#endif
+
+#if defined(DB_PROXY_HAS_IO_URING)
+        // io_uring relay: a multishot receive per direction fills buffers of
+        // the shard's ring, every chunk is parsed and written out of the same
+        // registered buffer. The receive is cancelled at the high watermark
+        // and started again once the writes are down to the low one.
+        struct uring_chunk
+        {
+            uint16_t id;
+            uint32_t offset;
+            uint32_t size;
+        };
+
+        struct uring_direction
+        {
+            // received and not written yet, the one at head is being written
+            std::vector<uring_chunk> chunks;
+            size_t head = 0;
+            // multishot receive in flight, 0 - none
+            uint64_t receive = 0;
+            bool writing = false;
+            // receiving waits for the writes to catch up
+            bool paused = false;
+
+            size_t pending() const { return chunks.size() - head; }
+        };
+
+        uring_direction& uring_from(bool from_server)
+        {
+            return from_server ? from_server_ : from_client_;
+        }
+
+        void uring_receive(bool from_server)
+        {
+            net::ip::tcp::socket& source = from_server ? server_socket_ : client_socket_;
+            uring_from(from_server).receive =
+                    ring_->receive(source.native_handle(),
+                                   std::bind(&session::handle_uring_receive,
+                                             shared_from_this(),
+                                             from_server,
+                                             std::placeholders::_1,
+                                             std::placeholders::_2));
+        }
+
+        void handle_uring_receive(bool from_server, int result, uint32_t flags)
+        {
+            uring_direction& d = uring_from(from_server);
+            const bool more = (flags & IORING_CQE_F_MORE) != 0;
+            if (!more)
+                d.receive = 0;
+
+            if (result > 0)
+            {
+                const uint16_t id = uring::buffer_id(flags);
+                if (closed_)
+                {
+                    ring_->recycle(id);
+                    return;
+                }
+
+                const uint8_t* data = ring_->buffer(id);
+                if (from_server)
+                    parser_.parse_server(data, static_cast<size_t>(result));
+                else
+                    parser_.parse_client(data, static_cast<size_t>(result));
+
+                d.chunks.push_back(uring_chunk{id, 0, static_cast<uint32_t>(result)});
+                if (!d.writing)
+                    uring_send(from_server);
+
+                if (!d.paused && d.pending() >= high_watermark_)
+                {
+                    d.paused = true;
+                    if (more)
+                        ring_->cancel(d.receive);
+                }
+
+                // the kernel may end a multishot receive on its own
+                if (!more && !d.paused)
+                    uring_receive(from_server);
+                return;
+            }
+
+            if (closed_)
+                return;
+
+            if (result == -ECANCELED)
+                uring_resume(from_server);
+            else if (result == -ENOBUFS)
+            {
+                // the writes of this session may give buffers back first
+                d.paused = true;
+                ring_->wait_buffer(std::bind(&session::uring_resume,
+                                             shared_from_this(),
+                                             from_server));
+            }
+            else
+                close();
+        }
+
+        // Starts receiving again unless the direction is still too far behind.
+        void uring_resume(bool from_server)
+        {
+            uring_direction& d = uring_from(from_server);
+            if (closed_ || d.receive != 0 || d.pending() > low_watermark_)
+                return;
+
+            d.paused = false;
+            uring_receive(from_server);
+        }
+
+        void uring_send(bool from_server)
+        {
+            uring_direction& d = uring_from(from_server);
+            net::ip::tcp::socket& target = from_server ? client_socket_ : server_socket_;
+            const uring_chunk& c = d.chunks[d.head];
+
+            d.writing = true;
+            ring_->send(target.native_handle(), ring_->buffer(c.id) + c.offset, c.size,
+                        std::bind(&session::handle_uring_send,
+                                  shared_from_this(),
+                                  from_server,
+                                  std::placeholders::_1));
+        }
+
+        void handle_uring_send(bool from_server, int result)
+        {
+            uring_direction& d = uring_from(from_server);
+            d.writing = false;
+
+            if (result <= 0 || closed_)
+            {
+                // nothing of this direction is in flight any more
+                for (size_t i = d.head; i < d.chunks.size(); i++)
+                    ring_->recycle(d.chunks[i].id);
+                d.chunks.clear();
+                d.head = 0;
+                close();
+                return;
+            }
+
+            uring_chunk& c = d.chunks[d.head];
+            if (static_cast<uint32_t>(result) < c.size)
+            {
+                c.offset += static_cast<uint32_t>(result);
+                c.size -= static_cast<uint32_t>(result);
+            }
+            else
+            {
+                ring_->recycle(c.id);
+                if (++d.head == d.chunks.size())
+                {
+                    d.chunks.clear();
+                    d.head = 0;
+                }
+            }
+
+            if (d.pending() > 0)
+                uring_send(from_server);
+
+            if (d.paused)
+                uring_resume(from_server);
+        }
+#endif
+
+#if !defined(DB_PROXY_COROUTINES)
+        // Copy relay: each direction is a ring of buffers. The next read is
+        // issued as soon as a slot is free, so it overlaps the write of the
+        // previous chunks, and stops at the high watermark until the peer
+        // has drained the ring down to the low one.
+        void handle_server_read(const boost::system::error_code& error,
+                            const size_t& bytes_transferred)
+        {
+            server_reading_ = false;
+
+            if (!error)
+            {
+                uint8_t* data = server_ring_.commit(bytes_transferred);
+                if (!greeting_seen_)
+                {
+                    greeting_seen_ = true;
+                    compression_offered_ = compress_workers_ && offer_compression(data, bytes_transferred);
+                }
+
+                parser_.parse_server(data, bytes_transferred);
+
+                if (in_flight_ && !parser_.response_pending())
+                {
+                    in_flight_ = false;
+                    limits_->leave(*client_);
+                }
+
+                if (!client_writing_)
+                    write_client();
+
+                if (server_ring_.filled() < high_watermark_)
+                    read_server();
+            }
+            else
+                close();
+        }
+
+        void write_client()
+        {
+            client_writing_ = true;
+
+            if (compressing_)
+            {
+                compress_client();
+                return;
+            }
+
+            async_write(client_socket_,
+                        server_ring_.gather(),
+                        std::bind(&session::handle_client_write,
+                                  shared_from_this(),
+                                  std::placeholders::_1));
+        }
+
+        void handle_client_write(const boost::system::error_code& error)
+        {
+            client_writing_ = false;
+
+            if (!error)
+            {
+                server_ring_.release();
+                refusal_out_.clear();
+
+                if (!server_ring_.empty())
+                    write_client();
+                else if (!refusals_.empty())
+                    write_refusals();
+
+                if (!server_reading_ && server_ring_.filled() <= low_watermark_)
+                    read_server();
+            }
+            else
+                close();
+        }
+
+        void handle_client_read(const boost::system::error_code& error,
+                  const size_t& bytes_transferred)
+        {
+            client_reading_ = false;
+
+            if (!error)
+            {
+                uint8_t* data = client_ring_.commit(bytes_transferred);
+
+                // after the login a compressing client sends compressed packets only
+                if (compress_requested_ && parser_.handshake_done())
+                {
+                    if (!inflate_client(data, bytes_transferred))
+                    {
+                        close();
+                        return;
+                    }
+
+                    if (!server_writing_ && !server_pending_.empty())
+                        write_server();
+                    if (server_pending_.size() < max_inflated_pending)
+                        read_client();
+                    return;
+                }
+
+                if (!login_seen_)
+                {
+                    login_seen_ = true;
+                    compress_requested_ = compression_offered_ && accept_compression(data, bytes_transferred);
+                }
+
+                const bool idle = !parser_.response_pending();
+                parser_.parse_client(data, bytes_transferred);
+
+                if (limits_ && !client_ && parser_.login_seen())
+                {
+                    const std::string& user = parser_.user();
+                    if (!admit_session(user.empty() ? address_key() : "user:" + user))
+                    {
+                        // the handshake response goes no further; a TLS
+                        // client can't be told in plain text
+                        client_ring_.drop_last();
+                        if (user.empty())
+                            close();
+                        else
+                            refuse_session(2);
+                        return;
+                    }
+                }
+
+                // new commands wait in the ring until they are admitted
+                if (limit_commands_ && client_ && parser_.commands() != commands_)
+                {
+                    const size_t n = static_cast<size_t>(parser_.commands() - commands_);
+                    commands_ = parser_.commands();
+                    held_ = true;
+                    refusable_ = n == 1 && idle && parser_.response_pending() &&
+                                 single_packet(data, bytes_transferred);
+                    admit_commands(n);
+                    return;
+                }
+
+                if (!server_writing_)
+                    write_server();
+
+                if (client_ring_.filled() < high_watermark_)
+                    read_client();
+            }
+            else
+                close();
+        }
+
+        void write_server()
+        {
+            server_writing_ = true;
+
+            // inflated client bytes, they never go through the ring; the
+            // plain bytes the ring still holds from the login go first
+            if (client_ring_.empty())
+            {
+                server_out_.swap(server_pending_);
+                async_write(server_socket_,
+                            net::buffer(server_out_),
+                            std::bind(&session::handle_server_write,
+                                      shared_from_this(),
+                                      std::placeholders::_1));
+                return;
+            }
+
+            async_write(server_socket_,
+                        client_ring_.gather(),
+                        std::bind(&session::handle_server_write,
+                                  shared_from_this(),
+                                  std::placeholders::_1));
+        }
+
+        void handle_server_write(const boost::system::error_code& error)
+        {
+            server_writing_ = false;
+
+            if (!error)
+            {
+                if (!server_out_.empty())
+                    server_out_.clear();
+                else
+                    client_ring_.release();
+
+                if (held_)
+                    return;
+
+                if (!client_ring_.empty() || !server_pending_.empty())
+                    write_server();
+
+                if (!client_reading_ && client_ring_.filled() <= low_watermark_ &&
+                    server_pending_.size() < max_inflated_pending)
+                    read_client();
+            }
+            else
+                close();
+        }
+#endif
+
+        // Admission control. Sessions count against their client's limit
+        // when they start, by address, or with the handshake response, by
+        // user. With the copy relay a chunk of the client bearing new
+        // commands stays in the ring, and reading stops, until the rate
+        // and the client's commands in flight admit them. A session holds
+        // at most one in flight slot, for as long as the server owes it a
+        // response. A chunk which is one whole command sent after the last
+        // response was complete is refused with an ERR once it would have
+        // to wait longer than max_wait; anything else, e.g. pipelined
+        // commands, is only held back.
+        std::string address_key()
+        {
+            boost::system::error_code ec;
+            return "ip:" + client_socket_.remote_endpoint(ec).address().to_string();
+        }
+
+        // false - the client has too many sessions already
+        bool admit_session(const std::string& key)
+        {
+            client_ = &limits_->find(key);
+            if (limits_->open_session(*client_))
+            {
+                session_counted_ = true;
+                return true;
+            }
+
+            metrics_.refused_sessions.add();
+            return false;
+        }
+
+        static bool single_packet(const uint8_t* data, size_t size)
+        {
+            return size >= My::header_size && data[3] == 0 &&
+                   static_cast<size_t>(My::read_int<3>(data)) + My::header_size == size;
+        }
+
+#if defined(DB_PROXY_COROUTINES)
+        net::awaitable<void> refuse_session(ptr_type, uint8_t sequence_id)
+        {
+            refusals_.clear();
+            limits_->write_session_error(refusals_, sequence_id);
+
+            boost::system::error_code ec;
+            co_await write_all(client_socket_, client_tls_.get(), net::buffer(refusals_), ec);
+            close();
+        }
+
+        // false - the session was closed while the commands waited
+        net::awaitable<bool> admit_commands(size_t n)
+        {
+            const admission::clock::time_point now = admission::clock::now();
+            const admission::clock::duration max_wait = limits_->options().max_wait;
+            admission_deadline_ = now + max_wait;
+            delayed_ = false;
+
+            admission::clock::duration wait;
+            if (!limits_->reserve(*client_, n, now, refusable_ ? max_wait : admission::clock::duration::max(), wait))
+            {
+                refuse_commands();
+                co_return true;
+            }
+
+            boost::system::error_code ec;
+            if (wait > admission::clock::duration::zero())
+            {
+                if (!delayed_)
+                {
+                    delayed_ = true;
+                    metrics_.delayed_commands.add();
+                }
+
+                admission_timer_.expires_after(wait);
+                co_await admission_timer_.async_wait(net::redirect_error(net::use_awaitable, ec));
+                if (ec || !client_socket_.is_open())
+                    co_return false;
+            }
+
+            if (!in_flight_ && parser_.response_pending())
+            {
+                if (limits_->enter(*client_, waiter_))
+                    in_flight_ = true;
+                else
+                {
+                    if (!delayed_)
+                    {
+                        delayed_ = true;
+                        metrics_.delayed_commands.add();
+                    }
+
+                    // the leave() of another command hands its slot over and
+                    // cancels the wait, the timer only ends it at the deadline
+                    queued_ = true;
+                    admission::clock::time_point until = refusable_ ? admission_deadline_ : admission::clock::time_point::max();
+                    while (queued_)
+                    {
+                        admission_timer_.expires_at(until);
+                        co_await admission_timer_.async_wait(net::redirect_error(net::use_awaitable, ec));
+                        if (!client_socket_.is_open())
+                            co_return false;
+                        if (!queued_ || ec)
+                            continue;
+
+                        if (limits_->cancel(*client_, waiter_))
+                        {
+                            queued_ = false;
+                            refuse_commands();
+                            co_return true;
+                        }
+                        // a slot granted meanwhile is on its way to handle_in_flight_granted
+                        until = admission::clock::time_point::max();
+                    }
+                }
+            }
+
+            held_ = false;
+            co_return true;
+        }
+#else
+        void refuse_session(uint8_t sequence_id)
+        {
+            refusals_.clear();
+            limits_->write_session_error(refusals_, sequence_id);
+            async_write(client_socket_,
+                        net::buffer(refusals_),
+                        std::bind(&session::handle_session_refused,
+                                  shared_from_this(),
+                                  std::placeholders::_1));
+        }
+
+        void handle_session_refused(const boost::system::error_code&)
+        {
+            close();
+        }
+
+        void admit_commands(size_t n)
+        {
+            const admission::clock::time_point now = admission::clock::now();
+            const admission::clock::duration max_wait = limits_->options().max_wait;
+            admission_deadline_ = now + max_wait;
+            delayed_ = false;
+
+            admission::clock::duration wait;
+            if (!limits_->reserve(*client_, n, now, refusable_ ? max_wait : admission::clock::duration::max(), wait))
+            {
+                refuse_commands();
+                return;
+            }
+
+            if (wait > admission::clock::duration::zero())
+                delay_commands(now + wait);
+            else
+                enter_commands();
+        }
+
+        void delay_commands(admission::clock::time_point until)
+        {
+            if (!delayed_)
+            {
+                delayed_ = true;
+                metrics_.delayed_commands.add();
+            }
+
+            admission_timer_.expires_at(until);
+            admission_timer_.async_wait(std::bind(&session::handle_admission_timer,
+                                                  shared_from_this(),
+                                                  ++admission_wait_,
+                                                  std::placeholders::_1));
+        }
+
+        void handle_admission_timer(unsigned wait, const boost::system::error_code& error)
+        {
+            if (error || !client_socket_.is_open() || wait != admission_wait_)
+                return;
+
+            if (!queued_)
+            {
+                enter_commands();
+                return;
+            }
+
+            // a slot granted meanwhile is on its way to handle_in_flight_granted
+            if (limits_->cancel(*client_, waiter_))
+            {
+                queued_ = false;
+                refuse_commands();
+            }
+        }
+
+        void enter_commands()
+        {
+            if (!in_flight_ && parser_.response_pending())
+            {
+                if (!limits_->enter(*client_, waiter_))
+                {
+                    // the leave() of another command hands its slot over,
+                    // the timer only refuses the commands at the deadline
+                    queued_ = true;
+                    delay_commands(refusable_ ? admission_deadline_ : admission::clock::time_point::max());
+                    return;
+                }
+                in_flight_ = true;
+            }
+
+            resume_commands();
+        }
+
+        void resume_commands()
+        {
+            held_ = false;
+            if (!server_writing_)
+                write_server();
+            if (!client_reading_ && client_ring_.filled() < high_watermark_)
+                read_client();
+        }
+#endif
+
+        void refuse_commands()
+        {
+            metrics_.refused_commands.add();
+            held_ = false;
+            client_ring_.drop_last();
+
+            // the ERR is the response the parser waits for
+            const size_t used = refusals_.size();
+            limits_->write_command_error(refusals_, 1);
+            parser_.parse_server(refusals_.data() + used, refusals_.size() - used);
+
+#if defined(DB_PROXY_COROUTINES)
+            if (!client_writing_)
+            {
+                client_writing_ = true;
+                server_data_.notify();
+            }
+#else
+            // after what the server sent before
+            if (!client_writing_ && server_ring_.empty())
+                write_refusals();
+
+            if (!server_writing_ && !client_ring_.empty())
+                write_server();
+            if (!client_reading_ && client_ring_.filled() < high_watermark_)
+                read_client();
+#endif
+        }
+
+#if !defined(DB_PROXY_COROUTINES)
+        void write_refusals()
+        {
+            client_writing_ = true;
+            refusal_out_.swap(refusals_);
+            async_write(client_socket_,
+                        net::buffer(refusal_out_),
+                        std::bind(&session::handle_client_write,
+                                  shared_from_this(),
+                                  std::placeholders::_1));
+        }
+#endif
+
+        // the slot a leave() handed over to the queued commands
+        void handle_in_flight_granted()
+        {
+            queued_ = false;
+            const bool open = client_socket_.is_open();
+            if (open && !in_flight_ && parser_.response_pending())
+                in_flight_ = true;
+            else
+                limits_->leave(*client_);
+            if (!open)
+                return;
+
+#if defined(DB_PROXY_COROUTINES)
+            admission_timer_.cancel();
+#else
+            ++admission_wait_;
+            admission_timer_.cancel();
+            resume_commands();
+#endif
+        }
+
+        void release_limits()
+        {
+            // a granted slot is left by handle_in_flight_granted
+            if (queued_ && limits_->cancel(*client_, waiter_))
+                queued_ = false;
+            if (in_flight_)
+            {
+                in_flight_ = false;
+                limits_->leave(*client_);
+            }
+            if (session_counted_)
+            {
+                session_counted_ = false;
+                limits_->close_session(*client_);
+            }
+            admission_timer_.cancel();
+        }
+
+        // CLIENT_COMPRESS offload. The greeting keeps offering zlib, but
+        // not zstd, and the proxy takes the client's request for it out of
+        // the handshake response: the backend speaks plain packets, the
+        // client compressed ones once the login is done.
+        static bool offer_compression(uint8_t* data, size_t size)
+        {
+            uint8_t* capabilities = greeting_capabilities(data, size);
+            if (!capabilities)
+                return false;
+
+            const uint32_t flags = static_cast<uint32_t>(My::read_int<2>(capabilities)) |
+                                   static_cast<uint32_t>(My::read_int<2>(capabilities + 5)) << 16;
+            if (!(flags & My::CLIENT_COMPRESS))
+                return false;
+
+            const uint32_t offered = flags & ~My::CLIENT_ZSTD_COMPRESSION_ALGORITHM;
+            capabilities[5] = static_cast<uint8_t>(offered >> 16);
+            capabilities[6] = static_cast<uint8_t>(offered >> 24);
+            return true;
+        }
+
+        // Lower half of the capabilities of a protocol 10 greeting, the
+        // upper half is 5 bytes further. nullptr - no such greeting, e.g. an ERR.
+        static uint8_t* greeting_capabilities(uint8_t* data, size_t size)
+        {
+            // version, thread id, scramble part 1, filler, capabilities,
+            // charset, status, capabilities
+            if (size < My::header_size + 1)
+                return nullptr;
+            const size_t length = static_cast<size_t>(My::read_int<3>(data));
+            uint8_t* p = data + My::header_size;
+            uint8_t* end = p + std::min(length, size - My::header_size);
+            if (p[0] != 10)
+                return nullptr;
+
+            uint8_t* version_end = std::find(p + 1, end, 0);
+            if (end - version_end < 1 + 4 + 8 + 1 + 2 + 1 + 2 + 2)
+                return nullptr;
+
+            return version_end + 1 + 4 + 8 + 1;
+        }
+
+        // Offers clients CLIENT_SSL whether the backend does or not, offered
+        // says if it does. false - no greeting, nothing was changed.
+        static bool offer_tls(uint8_t* data, size_t size, bool& offered)
+        {
+            uint8_t* capabilities = greeting_capabilities(data, size);
+            if (!capabilities)
+                return false;
+
+            offered = (My::read_int<2>(capabilities) & My::CLIENT_SSL) != 0;
+            capabilities[1] |= static_cast<uint8_t>(My::CLIENT_SSL >> 8);
+            return true;
+        }
+
+        // the plugins whose clients send the password itself over TLS
+        static bool cleartext_plugin(const uint8_t* name, const uint8_t* end)
+        {
+            const std::string_view plugin(reinterpret_cast<const char*>(name),
+                                          static_cast<size_t>(std::find(name, end, 0) - name));
+            return plugin == "mysql_clear_password" || plugin == "sha256_password";
+        }
+
+        // A handshake response of such a plugin, its auth data is the password.
+        static bool sends_cleartext_password(const uint8_t* data, size_t size)
+        {
+            // capabilities, max packet size, character set, filler, user
+            const uint8_t* p = data + My::header_size;
+            const uint8_t* end = data + size;
+            const uint32_t flags = static_cast<uint32_t>(My::read_int<4>(p));
+            if (!(flags & My::CLIENT_PLUGIN_AUTH))
+                return false;
+            p = std::find(p + 32, end, 0);
+            if (p == end)
+                return false;
+            p++;
+
+            uint64_t length = 0;
+            if (flags & My::CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA)
+            {
+                const size_t n = My::read_lenenc(p, static_cast<size_t>(end - p), length);
+                if (n == 0)
+                    return false;
+                p += n;
+            }
+            else if (flags & My::CLIENT_SECURE_CONNECTION)
+            {
+                if (p == end)
+                    return false;
+                length = *p++;
+            }
+            else
+                length = static_cast<uint64_t>(std::find(p, end, 0) - p) + 1;
+            if (length > static_cast<uint64_t>(end - p))
+                return false;
+            p += length;
+
+            if (flags & My::CLIENT_CONNECT_WITH_DB)
+            {
+                p = std::find(p, end, 0);
+                if (p == end)
+                    return false;
+                p++;
+            }
+            return cleartext_plugin(p, end);
+        }
+
+        // A server's request for the password itself: caching_sha2's
+        // "perform full authentication" 0x01 0x04, or an auth switch to a
+        // plugin of cleartext_plugin().
+        static bool asks_cleartext_password(const uint8_t* data, size_t size)
+        {
+            const uint8_t* payload = data + My::header_size;
+            const size_t length = size - My::header_size;
+            if (length > 1 && payload[0] == 0x01 && payload[1] == 0x04)
+                return true;
+            return length > 1 && payload[0] == My::EOF_PACKET && cleartext_plugin(payload + 1, data + size);
+        }
+
+        static bool accept_compression(uint8_t* data, size_t size)
+        {
+            // the handshake response, a TLS one is out of reach
+            if (size < My::header_size + 4 || data[3] != 1)
+                return false;
+
+            uint8_t* p = data + My::header_size;
+            const uint32_t flags = static_cast<uint32_t>(My::read_int<4>(p));
+            if ((flags & My::CLIENT_SSL) || !(flags & My::CLIENT_COMPRESS))
+                return false;
+
+            const uint32_t stripped = flags & ~(My::CLIENT_COMPRESS | My::CLIENT_ZSTD_COMPRESSION_ALGORITHM);
+            for (size_t i = 0; i < 4; i++)
+                p[i] = static_cast<uint8_t>(stripped >> (8 * i));
+            return true;
+        }
+
+        // false - the client sent something else than compressed packets
+        bool inflate_client(const uint8_t* data, size_t size)
+        {
+            metrics_.compressed_client_bytes.add(size);
+
+            const size_t used = server_pending_.size();
+            const bool valid = decompressor_.feed(data, size, server_pending_);
+            client_ring_.drop_last();
+            if (!valid)
+                return false;
+
+            // the compressed packets of a response continue the sequence of
+            // the command's ones
+            sequence_id_ = static_cast<uint8_t>(decompressor_.sequence_id() + 1);
+            compressing_ = true;
+
+            parser_.parse_client(server_pending_.data() + used, server_pending_.size() - used);
+            return true;
+        }
+
+        // Deflates the ring's chunks on a worker, the ring keeps them until
+        // the compressed copy is written.
+#if defined(DB_PROXY_COROUTINES)
+        net::awaitable<void> compress_client(boost::system::error_code& ec)
+        {
+            const buffer_ring::const_buffers buffers = server_ring_.gather();
+            const uint64_t packets = decompressor_.packets();
+            uint8_t next = sequence_id_;
+
+            co_await async_run(*compress_workers_, [this, &buffers, &next]
+            {
+                client_out_.clear();
+                for (const auto& b : buffers)
+                    My::compress_packets(static_cast<const uint8_t*>(b.data()), b.size(),
+                                         compress_level_, next, client_out_);
+            }, net::use_awaitable);
+
+            // unless the client began another command meanwhile
+            if (decompressor_.packets() == packets)
+                sequence_id_ = next;
+
+            metrics_.compressed_server_bytes.add(client_out_.size());
+            co_await net::async_write(client_socket_, net::buffer(client_out_),
+                                      net::redirect_error(net::use_awaitable, ec));
+        }
+#else
+        void compress_client()
+        {
+            const buffer_ring::const_buffers buffers = server_ring_.gather();
+            const uint8_t sequence_id = sequence_id_;
+            const uint64_t packets = decompressor_.packets();
+
+            auto self = shared_from_this();
+            net::post(*compress_workers_, [this, self, buffers, sequence_id, packets]
+            {
+                uint8_t next = sequence_id;
+                client_out_.clear();
+                for (const auto& b : buffers)
+                    My::compress_packets(static_cast<const uint8_t*>(b.data()), b.size(),
+                                         compress_level_, next, client_out_);
+
+                net::post(client_socket_.get_executor(), [this, self, next, packets]
+                {
+                    // unless the client began another command meanwhile
+                    if (decompressor_.packets() == packets)
+                        sequence_id_ = next;
+
+                    metrics_.compressed_server_bytes.add(client_out_.size());
+                    async_write(client_socket_,
+                                net::buffer(client_out_),
+                                std::bind(&session::handle_client_write,
+                                          self,
+                                          std::placeholders::_1));
+                });
+            });
+        }
+#endif
+
+        void close()
+        {
+            if (limits_)
+                release_limits();
+
+#if defined(DB_PROXY_HAS_IO_URING)
+            if (ring_)
+            {
+                // Requests in flight hold on to the sockets, shutting them
+                // down completes the requests. The sockets are closed with
+                // the session once the last completion has let it go.
+                if (closed_)
+                    return;
+                closed_ = true;
+
+                boost::system::error_code ec;
+                client_socket_.shutdown(net::socket_base::shutdown_both, ec);
+                server_socket_.shutdown(net::socket_base::shutdown_both, ec);
+                if (from_server_.receive)
+                    ring_->cancel(from_server_.receive);
+                if (from_client_.receive)
+                    ring_->cancel(from_client_.receive);
+                return;
+            }
+#endif
+            // close_notify goes out while the descriptor is still the session's
+            if (client_socket_.is_open())
+            {
+                if (client_tls_)
+                    client_tls_->shutdown();
+                client_socket_.close();
+            }
+
+            if (server_socket_.is_open())
+            {
+                if (server_tls_)
+                    server_tls_->shutdown();
+                server_socket_.close();
+            }
+
+#if defined(DB_PROXY_COROUTINES)
+            server_room_.notify();
+            server_data_.notify();
+            client_room_.notify();
+            client_data_.notify();
+#endif
+        }
+
+        net::ip::tcp::socket client_socket_;
+        net::ip::tcp::socket server_socket_;
+
+        buffer_ring client_ring_;
+        buffer_ring server_ring_;
+        const size_t high_watermark_;
+        const size_t low_watermark_;
+#if !defined(DB_PROXY_COROUTINES)
+        bool client_reading_ = false;
+        bool server_reading_ = false;
+#endif
+        bool client_writing_ = false;
+        bool server_writing_ = false;
+#if defined(DB_PROXY_COROUTINES)
+        // of the ring a writer loop goes on with, its reader wrote them
+        size_t client_written_ = 0;
+        size_t server_written_ = 0;
+#endif
+
+#if defined(__linux__)
+        std::unique_ptr<splice_pipe> pipe_;
+        uint8_t peek_data_[16] = {0};
+#endif
+#if defined(DB_PROXY_HAS_IO_URING)
+        uring* ring_ = nullptr;
+        uring_direction from_server_;
+        uring_direction from_client_;
+        bool closed_ = false;
+#endif
+
+        // reading from the client pauses at this many inflated bytes
+        static const size_t max_inflated_pending = 1 << 20;
+
+        net::thread_pool* compress_workers_;
+        const int compress_level_;
+        // nullptr - no TLS termination
+        tls_context* tls_;
+        // the proxy's ends of TLS links, nullptr - the link is plain
+        std::unique_ptr<tls_connection> client_tls_;
+        std::unique_ptr<tls_connection> server_tls_;
+        traffic_metrics& metrics_;
+        bool greeting_seen_ = false;
+        bool login_seen_ = false;
+        bool compression_offered_ = false;
+        // the client asked for compression, the backend was not told
+        bool compress_requested_ = false;
+        // the client sent compressed packets, responses get compressed too
+        bool compressing_ = false;
+        My::Decompressor decompressor_;
+        // of the next compressed response packet
+        uint8_t sequence_id_ = 0;
+        // inflated client bytes waiting for the server and being written to it
+        std::vector<uint8_t> server_pending_;
+        std::vector<uint8_t> server_out_;
+        // compressed response being written to the client
+        std::vector<uint8_t> client_out_;
+
+        // nullptr - clients are not limited
+        admission* limits_;
+        // commands are admitted one chunk at a time
+        const bool limit_commands_;
+        // nullptr - the session has no client yet
+        admission::client* client_ = nullptr;
+        bool session_counted_ = false;
+        bool in_flight_ = false;
+        // the last chunk of the client ring waits to be admitted
+        bool held_ = false;
+        bool refusable_ = false;
+        bool delayed_ = false;
+        // the held chunk is queued for an in flight slot
+        bool queued_ = false;
+        admission::waiter waiter_;
+#if !defined(DB_PROXY_COROUTINES)
+        // numbers the timer's waits, one that fired late is past
+        unsigned admission_wait_ = 0;
+#endif
+        admission::clock::time_point admission_deadline_;
+        net::steady_timer admission_timer_;
+        // of the parser, the ones admitted
+        uint64_t commands_ = 0;
+        // ERRs of refused commands waiting for the client and being written
+        std::vector<uint8_t> refusals_;
+        std::vector<uint8_t> refusal_out_;
+
+#if defined(DB_PROXY_COROUTINES)
+        // the server ring has room for the server reader, data for the
+        // client writer; the same for the client ring
+        wakeup server_room_;
+        wakeup server_data_;
+        wakeup client_room_;
+        wakeup client_data_;
+#endif
+
+        io_context_pool::load_guard load_;
+        My::Parser parser_;
+    };
+
+    struct listen_options
+    {
+        int backlog = net::socket_base::max_listen_connections;
+        // one SO_REUSEPORT acceptor per worker thread instead of a single one
+        bool reuse_port = false;
+        // connections accepted per wakeup, the rest is drained without waiting
+        size_t accept_batch = 1;
+        // bound and listening already, taken over from the process being
+        // upgraded instead of opening new ones
+        std::vector<int> inherited;
+    };
+
+#if defined(SO_REUSEPORT)
+    using reuse_port = net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+    class server
+    {
+        struct listener
+        {
+            listener(net::io_context& ios, io_context_pool::shard* owner)
+                : acceptor(ios), shard(owner)
+            {
+            }
+
+            net::ip::tcp::acceptor acceptor;
+            // nullptr - sessions are spread over the whole pool
+            io_context_pool::shard* shard;
+        };
+
+    public:
+
+        server(net::io_context& io_service, io_context_pool& pool,
+              const std::string& local_host, unsigned short local_port,
+              const std::string& server_host, unsigned short server_port,
+              const listen_options& options = listen_options(),
+              const session_options& session = session_options(),
+              const pool_options& backend = pool_options(),
+              const cache_options& cache = cache_options(),
+              const tls_options& tls = tls_options())
+        : io_service_(io_service),
+          pool_(pool),
+          local_endpoint_(net::ip::make_address_v4(local_host), local_port),
+          options_(options),
+          session_options_(session),
+          pool_options_(backend),
+          cache_options_(cache),
+          targets_(pool.size(), net::ip::tcp::endpoint(net::ip::make_address(server_host), server_port))
+        {
+#if !defined(__linux__)
+            if (session_options_.relay == relay_mode::splice)
+                throw std::runtime_error("splice relay is supported only on Linux");
+#endif
+            if (session_options_.pipeline_depth > max_pipeline_depth)
+                throw std::runtime_error("pipeline depth is limited to " + std::to_string(max_pipeline_depth));
+            if (session_options_.high_watermark > session_options_.pipeline_depth ||
+                session_options_.low_watermark >= session_options_.high_watermark)
+                throw std::runtime_error("watermarks must satisfy low < high <= pipeline depth");
 
-namespace net = boost::asio;
+            if (tls.enabled())
+            {
+#if !defined(DB_PROXY_COROUTINES)
+                throw std::runtime_error("TLS termination needs the build with DB_PROXY_COROUTINES");
+#endif
+                // the login is relayed packet by packet, the records are
+                // decrypted on the thread that relays them
+                if (session_options_.relay != relay_mode::copy)
+                    throw std::runtime_error("TLS termination needs the copy relay");
+                if (session_options_.compress_threads > 0)
+                    throw std::runtime_error("TLS termination is not supported with compression offload");
+                if (pool_options_.size > 0)
+                    throw std::runtime_error("TLS termination is not supported with connection pooling");
+                tls_.reset(new tls_context(tls));
 
-namespace db_proxy
-{
-    enum { max_data_length = 8192 }; // 8KB
+#if defined(SIGPIPE)
+                // OpenSSL writes to a peer that may have gone away without MSG_NOSIGNAL
+                std::signal(SIGPIPE, SIG_IGN);
+#endif
+            }
 
-    class session : public std::enable_shared_from_this<session>
-    {
-    public:
+            // pooled sessions have a relay of their own
+            if (session_options_.relay == relay_mode::uring && pool_options_.size == 0)
+                open_urings();
 
-        using ptr_type = std::shared_ptr<session>;
+            if (session_options_.compress_threads > 0)
+            {
+                // responses have to pass through user space to be compressed
+                if (session_options_.relay != relay_mode::copy)
+                    throw std::runtime_error("compression offload needs the copy relay");
+                // the pool greets clients itself and offers no compression
+                if (pool_options_.size > 0)
+                    throw std::runtime_error("compression offload is not supported with connection pooling");
+                compress_workers_.reset(new net::thread_pool(session_options_.compress_threads));
+            }
+
+            if (pool_options_.size > 0)
+            {
+                // every shard pools its own share of the backend connections
+                backend_config config;
+                config.host = server_host;
+                config.port = server_port;
+                config.user = pool_options_.user;
+                config.password = pool_options_.password;
+                config.max_connections = (pool_options_.size + pool_.size() - 1) / pool_.size();
+
+                // replicas take the same credentials and as many connections
+                std::vector<backend_config> replicas;
+                for (const auto& address : pool_options_.replicas)
+                {
+                    replicas.push_back(config);
+                    replicas.back().host = address.first;
+                    replicas.back().port = address.second;
+                }
+
+                for (size_t i = 0; i < pool_.size(); i++)
+                    backend_groups_.emplace_back(new backend_group(pool_.at(i).ios, config, replicas));
+            }
+            else if (!pool_options_.replicas.empty())
+                throw std::runtime_error("replicas need connection pooling");
+
+            if (cache_options_.max_bytes > 0)
+            {
+                // results are captured and replayed by the pooled sessions
+                if (backend_groups_.empty())
+                    throw std::runtime_error("the query cache needs connection pooling");
+                if (cache_options_.patterns.empty())
+                    throw std::runtime_error("the query cache needs at least one pattern");
+
+                for (size_t i = 0; i < pool_.size(); i++)
+                    caches_.emplace_back(new query_cache(cache_options_, cache_options_.max_bytes / pool_.size()));
+            }
 
-        session(net::io_context& ios)
-            : client_socket_(ios), server_socket_(ios)
+            if (pool_options_.statements > 0)
+            {
+                // statement ids are mapped by the pooled sessions
+                if (backend_groups_.empty())
+                    throw std::runtime_error("the statement cache needs connection pooling");
+
+                for (size_t i = 0; i < pool_.size(); i++)
+                    statement_caches_.emplace_back(new statement_cache(pool_options_.statements));
+            }
+
+            if (!options_.inherited.empty())
+                adopt(options_.inherited);
+            if (listeners_.empty())
+                listeners_ = open_listeners(local_endpoint_);
+        }
+
+        bool accept_connections()
         {
+            try
+            {
+                for (auto& l : listeners_)
+                    accept_connection(*l);
+            }
+            catch(std::exception& e)
+            {
+                std::cerr << "server exception: " << e.what() << std::endl;
+                return false;
+            }
+
+            return true;
         }
 
-        net::ip::tcp::socket& client_socket()
+        // Listens on host:port instead, called from the main thread. The new
+        // sockets accept before the old ones close. When they can't be
+        // opened, e.g. the port is taken, it throws and nothing changes.
+        void rebind(const std::string& host, unsigned short port)
         {
-            return client_socket_;
+            const net::ip::tcp::endpoint endpoint(net::ip::make_address_v4(host), port);
+            if (endpoint == local_endpoint_)
+                return;
+
+            auto listeners = open_listeners(endpoint);
+            for (auto& l : listeners)
+                accept_connection(*l);
+
+            stop_accepting();
+            for (auto& l : listeners_)
+                retired_listeners_.push_back(std::move(l));
+            listeners_ = std::move(listeners);
+            local_endpoint_ = endpoint;
         }
 
-        net::ip::tcp::socket& server_socket()
+        // New sessions and pooled connections go to host:port, called from
+        // the main thread. Every shard switches on its own thread; sessions
+        // keep the backend they are connected to.
+        void retarget(const std::string& host, unsigned short port)
         {
-            return server_socket_;
+            const net::ip::tcp::endpoint endpoint(net::ip::make_address(host), port);
+            for (size_t i = 0; i < pool_.size(); i++)
+            {
+                net::post(pool_.at(i).ios, [this, i, endpoint, host, port]
+                {
+                    targets_[i] = endpoint;
+                    if (!backend_groups_.empty())
+                        backend_groups_[i]->primary().retarget(host, port);
+                });
+            }
         }
 
-        void start(const std::string& server_host, unsigned short server_port)
+        // the listening sockets, to hand over to a new process
+        std::vector<int> listening_sockets() const
         {
-            server_socket_.async_connect(
-                        net::ip::tcp::endpoint(
-                            net::ip::make_address(server_host),
-                            server_port),
-                        std::bind(&session::handle_server_connect,
-                                  shared_from_this(),
-                                  std::placeholders::_1));
+            std::vector<int> sockets;
+            for (auto& l : listeners_)
+                sockets.push_back(static_cast<int>(l->acceptor.native_handle()));
+            return sockets;
         }
 
-        void handle_server_connect(const boost::system::error_code& error)
+        // Closes the listening sockets, called from the main thread. Every
+        // one is closed by the thread that accepts on it; sessions go on.
+        void stop_accepting()
         {
-            if (!error)
+            for (auto& l : listeners_)
             {
-                std::cout << "Client connected from " << client_socket_.local_endpoint().address() << '\n';
-                server_socket_.async_read_some(
-                            net::buffer(server_data_, max_data_length),
-                            std::bind(&session::handle_server_read,
-                                      shared_from_this(),
-                                      std::placeholders::_1,
-                                      std::placeholders::_2));
+                listener* closing = l.get();
+                net::post(closing->acceptor.get_executor(), [closing]
+                {
+                    boost::system::error_code ignored;
+                    closing->acceptor.close(ignored);
+                });
+            }
+        }
 
-                client_socket_.async_read_some(
-                            net::buffer(client_data_, max_data_length),
-                            std::bind(&session::handle_client_read,
-                                      shared_from_this(),
-                                      std::placeholders::_1,
-                                      std::placeholders::_2));
-                }
-            else
-                close();
+        // sessions of all shards, pooled ones included
+        size_t sessions()
+        {
+            size_t n = 0;
+            for (size_t i = 0; i < pool_.size(); i++)
+                n += pool_.at(i).sessions.load(std::memory_order_relaxed);
+            return n;
         }
 
     private:
-        void handle_server_read(const boost::system::error_code& error,
-                            const size_t& bytes_transferred)
+
+        std::vector<std::unique_ptr<listener>> open_listeners(const net::ip::tcp::endpoint& endpoint)
         {
-            if (!error)
+            std::vector<std::unique_ptr<listener>> listeners;
+            if (options_.reuse_port)
             {
-                parser_.parse(server_data_, bytes_transferred);
-
-                async_write(client_socket_,
-                            net::buffer(server_data_, bytes_transferred),
-                            std::bind(&session::handle_client_write,
-                                      shared_from_this(),
-                                      std::placeholders::_1));
+#if defined(SO_REUSEPORT)
+                // The kernel load balances new connections between the sockets,
+                // so every shard accepts its own sessions without handoff.
+                for (size_t i = 0; i < pool_.size(); i++)
+                {
+                    auto& shard = pool_.at(i);
+                    listeners.emplace_back(new listener(shard.ios, &shard));
+                    open(listeners.back()->acceptor, endpoint);
+                }
+#else
+                throw std::runtime_error("SO_REUSEPORT is not supported on this platform");
+#endif
             }
             else
-                close();
-        }
-
-        void handle_client_write(const boost::system::error_code& error)
-        {
-            if (!error)
             {
-                server_socket_.async_read_some(
-                            net::buffer(server_data_, max_data_length),
-                            std::bind(&session::handle_server_read,
-                                      shared_from_this(),
-                                      std::placeholders::_1,
-                                      std::placeholders::_2));
+                listeners.emplace_back(new listener(io_service_, nullptr));
+                open(listeners.back()->acceptor, endpoint);
             }
-            else
-                close();
+            return listeners;
         }
 
-        void handle_client_read(const boost::system::error_code& error,
-                  const size_t& bytes_transferred)
+        // Accepts on the sockets of the process being upgraded. One socket
+        // per shard keeps its shard, any other number spreads the sessions
+        // over the pool.
+        void adopt(const std::vector<int>& sockets)
         {
-            if (!error)
+            const bool per_shard = options_.reuse_port && sockets.size() == pool_.size();
+            for (size_t i = 0; i < sockets.size(); i++)
             {
-                parser_.parse(client_data_, bytes_transferred);
+                io_context_pool::shard* shard = per_shard ? &pool_.at(i) : nullptr;
+                listeners_.emplace_back(new listener(shard ? shard->ios : io_service_, shard));
+                auto& acceptor = listeners_.back()->acceptor;
+                acceptor.assign(net::ip::tcp::v4(), sockets[i]);
+                if (options_.accept_batch > 1)
+                    acceptor.non_blocking(true);
+            }
 
-                async_write(server_socket_,
-                            net::buffer(client_data_,bytes_transferred),
-                            std::bind(&session::handle_server_write,
-                                      shared_from_this(),
-                                      std::placeholders::_1));
+            // the new binary may be configured to listen elsewhere
+            const auto bound = listeners_.front()->acceptor.local_endpoint();
+            if (bound != local_endpoint_)
+            {
+                std::cerr << "Taken over sockets listen on " << bound << ", listening on "
+                          << local_endpoint_ << " instead" << std::endl;
+                listeners_.clear();
             }
-            else
-                close();
         }
 
-        void handle_server_write(const boost::system::error_code& error)
+        // One io_uring per shard, or back to the copy relay when the kernel
+        // can't do what the io_uring relay needs.
+        void open_urings()
         {
-            if (!error)
+#if defined(DB_PROXY_HAS_IO_URING)
+            try
             {
-                client_socket_.async_read_some(
-                            net::buffer(client_data_,max_data_length),
-                            std::bind(&session::handle_client_read,
-                                      shared_from_this(),
-                                      std::placeholders::_1,
-                                      std::placeholders::_2));
+                for (size_t i = 0; i < pool_.size(); i++)
+                    urings_.emplace_back(new uring(pool_.at(i).ios, uring_entries, session_options_.uring_buffers));
+
+                // a write to a peer that has gone away raises SIGPIPE, the
+                // ring's writes have no MSG_NOSIGNAL
+                std::signal(SIGPIPE, SIG_IGN);
+                return;
             }
-            else
-                close();
+            catch(std::exception& e)
+            {
+                std::cerr << "io_uring unavailable: " << e.what() << ", using the copy relay" << std::endl;
+                urings_.clear();
+            }
+#else
+            std::cerr << "io_uring is supported only on Linux, using the copy relay" << std::endl;
+#endif
+            session_options_.relay = relay_mode::copy;
         }
 
-        void close()
+        uring* shard_uring(io_context_pool::shard& shard)
         {
-            std::lock_guard<std::mutex> lock(mutex_);
-
-            if (client_socket_.is_open())
-                client_socket_.close();
-
-            if (server_socket_.is_open())
-                server_socket_.close();
+#if defined(DB_PROXY_HAS_IO_URING)
+            if (!urings_.empty())
+                return urings_[shard.index].get();
+#else
+            (void)shard;
+#endif
+            return nullptr;
         }
 
-        net::ip::tcp::socket client_socket_;
-        net::ip::tcp::socket server_socket_;
+        void open(net::ip::tcp::acceptor& acceptor, const net::ip::tcp::endpoint& endpoint)
+        {
+            acceptor.open(endpoint.protocol());
+            acceptor.set_option(net::ip::tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+            if (options_.reuse_port)
+                acceptor.set_option(reuse_port(true));
+#endif
+            acceptor.bind(endpoint);
+            acceptor.listen(options_.backlog);
 
-        uint8_t client_data_[max_data_length] = {0};
-        uint8_t server_data_[max_data_length] = {0};
+            // only affects the synchronous accepts used to drain a batch
+            if (options_.accept_batch > 1)
+                acceptor.non_blocking(true);
+        }
 
-        std::mutex mutex_;
-        My::Parser parser_;
-    };
+        io_context_pool::shard& target(listener& l)
+        {
+            return l.shard ? *l.shard : pool_.next();
+        }
 
-    class server
-    {
-    public:
+        void accept_connection(listener& l)
+        {
+            // The socket is created directly on the target shard so both
+            // sockets of a session are serviced by the same thread.
+            auto& shard = target(l);
 
-        server(net::io_context& io_service,
-              const std::string& local_host, unsigned short local_port,
-              const std::string& server_host, unsigned short server_port)
-        : io_service_(io_service),
-          localhost_address(net::ip::make_address_v4(local_host)),
-          server_(io_service_,net::ip::tcp::endpoint(localhost_address,local_port)),
-          server_port_(server_port),
-          server_host_(server_host)
-        {}
+            l.acceptor.async_accept(shard.ios,
+                                    std::bind(&server::handle_accept,
+                                              this,
+                                              std::ref(l),
+                                              std::ref(shard),
+                                              std::placeholders::_1,
+                                              std::placeholders::_2));
+        }
 
-        bool accept_connections()
+        void handle_accept(listener& l, io_context_pool::shard& shard,
+                           const boost::system::error_code& error,
+                           net::ip::tcp::socket socket)
         {
-            try
+            if (!error)
             {
-                session_ = std::make_shared<session>(io_service_);
+                start_session(shard, std::move(socket));
+
+                for (size_t i = 1; i < options_.accept_batch; i++)
+                {
+                    auto& next = target(l);
+                    boost::system::error_code ec;
+                    auto pending = l.acceptor.accept(next.ios, ec);
+                    if (ec)
+                        break;
+
+                    start_session(next, std::move(pending));
+                }
 
-                server_.async_accept(session_->client_socket(),
-                                       std::bind(&server::handle_accept,
-                                                 this,
-                                                 std::placeholders::_1));
+                try
+                {
+                    accept_connection(l);
+                }
+                catch(std::exception& e)
+                {
+                    std::cerr << "server exception: " << e.what() << std::endl;
+                    std::cerr << "Failure during call to accept." << std::endl;
+                }
             }
-            catch(std::exception& e)
+            else if (error != net::error::operation_aborted)
             {
-                std::cerr << "server exception: " << e.what() << std::endl;
-                return false;
+               std::cerr << "Error: " << error.message() << std::endl;
             }
-
-            return true;
         }
 
-    private:
-
-        void handle_accept(const boost::system::error_code& error)
+        void start_session(io_context_pool::shard& shard, net::ip::tcp::socket socket)
         {
-            if (!error)
+            // The session is created on the shard's thread, which owns the
+            // slab it is allocated from.
+            net::dispatch(shard.ios, [this, &shard, socket = std::move(socket)]() mutable
             {
-                session_->start(server_host_,server_port_);
+                boost::system::error_code ec;
+                socket.set_option(net::ip::tcp::no_delay(true), ec);
 
-                if (!accept_connections())
+                if (!backend_groups_.empty())
                 {
-                    std::cerr << "Failure during call to accept." << std::endl;
+                    start_pooled_session(shard, std::move(socket));
+                    return;
+                }
+
+                session::ptr_type new_session;
+                try
+                {
+                    new_session = std::allocate_shared<session>(slab_allocator<session>(shard.session_slab),
+                                                                shard, std::move(socket), session_options_,
+                                                                compress_workers_.get(), shard_uring(shard), tls_.get());
+                }
+                catch(std::exception& e)
+                {
+                    // e.g. out of file descriptors for the splice pipe, drop the client
+                    std::cerr << "session exception: " << e.what() << std::endl;
+                    return;
                 }
+
+                new_session->start(targets_[shard.index]);
+            });
+        }
+
+        void start_pooled_session(io_context_pool::shard& shard, net::ip::tcp::socket socket)
+        {
+            pooled_session::ptr_type new_session;
+            try
+            {
+                new_session = std::allocate_shared<pooled_session>(slab_allocator<pooled_session>(shard.session_slab),
+                                                                   shard, std::move(socket),
+                                                                   *backend_groups_[shard.index], pool_options_,
+                                                                   caches_.empty() ? nullptr : caches_[shard.index].get(),
+                                                                   statement_caches_.empty() ? nullptr : statement_caches_[shard.index].get());
+                new_session->start();
             }
-            else
+            catch(std::exception& e)
             {
-               std::cerr << "Error: " << error.message() << std::endl;
+                std::cerr << "session exception: " << e.what() << std::endl;
             }
         }
 
         net::io_context& io_service_;
-        net::ip::address_v4 localhost_address;
-        net::ip::tcp::acceptor server_;
-        session::ptr_type session_;
-        unsigned short server_port_;
-        std::string server_host_;
+        io_context_pool& pool_;
+        net::ip::tcp::endpoint local_endpoint_;
+        listen_options options_;
+        session_options session_options_;
+        // nullptr unless compression is offloaded
+        std::unique_ptr<net::thread_pool> compress_workers_;
+        // nullptr unless the proxy terminates TLS
+        std::unique_ptr<tls_context> tls_;
+#if defined(DB_PROXY_HAS_IO_URING)
+        // submission queue entries of every ring
+        static const unsigned uring_entries = 1024;
+        // one per shard, empty unless the io_uring relay is used
+        std::vector<std::unique_ptr<uring>> urings_;
+#endif
+        pool_options pool_options_;
+        cache_options cache_options_;
+        std::vector<std::unique_ptr<listener>> listeners_;
+        // replaced by rebind(), kept until their aborted accepts have run
+        std::vector<std::unique_ptr<listener>> retired_listeners_;
+        // one per shard, empty unless pooling is enabled
+        std::vector<std::unique_ptr<backend_group>> backend_groups_;
+        // one per shard, empty unless caching is enabled
+        std::vector<std::unique_ptr<query_cache>> caches_;
+        // one per shard, empty unless statements are cached
+        std::vector<std::unique_ptr<statement_cache>> statement_caches_;
+        // backend of new sessions, one per shard, written on its thread
+        std::vector<net::ip::tcp::endpoint> targets_;
     };
 }
 
 class CmdOptions {
 private:
-    int argc_;
-    char **argv_;
+    std::string program_;
+    // the --config file's options followed by the command line's
+    std::vector<std::string> args_;
+
+    const std::string& value(size_t& i) {
+        if(i + 1 >= args_.size())
+            throw std::runtime_error(args_[i] + " needs a value");
+        return args_[++i];
+    }
+
+    // Options in command line syntax separated by whitespace, # comments
+    // to the end of the line.
+    static std::vector<std::string> read_config(const std::string& path) {
+        std::ifstream file(path);
+        if(!file)
+            throw std::runtime_error("can't read config " + path);
+
+        std::vector<std::string> tokens;
+        std::string line;
+        while(std::getline(file, line)) {
+            std::istringstream words(line.substr(0, line.find('#')));
+            std::string word;
+            while(words >> word)
+                tokens.push_back(word);
+        }
+        return tokens;
+    }
 public:
     unsigned short  bind_port = 8080;
     unsigned short  remote_port = 0;
     std::string     bind_host = "127.0.0.1";
     std::string     remote_host = "";
+    size_t          threads = 1;
+    unsigned short  metrics_port = 0;
+    size_t          digests = 1000;
+    std::string     config;
+    std::string     upgrade_socket;
+    size_t          drain_timeout = 0;
+    std::string     capture;
+    size_t          capture_size = 1024;
+    bool            least_loaded = false;
+    db_proxy::listen_options listen;
+    db_proxy::session_options session;
+    db_proxy::pool_options pool;
+    db_proxy::cache_options cache;
+    db_proxy::admission_options limits;
+    db_proxy::tls_options tls;
+    AsyncFileLogger::Overflow log_overflow = AsyncFileLogger::Overflow::drop;
 
-    CmdOptions(int argc, char **argv) : argc_(argc), argv_(argv) {
+    CmdOptions(int argc, char **argv) : program_(argv[0]), args_(argv + 1, argv + argc) {
     }
 
+    // throws std::runtime_error for a config file that can't be read or an
+    // option without its value
     bool parse() {
-        for(int i = 1; i < argc_; i++) {
-            std::string arg = argv_[i];
+        bool high_set = false, low_set = false;
+
+        // the command line wins, its options come last
+        for(size_t i = 0; i + 1 < args_.size(); i++) {
+            if(args_[i] == "--config") {
+                config = args_[i + 1];
+                std::vector<std::string> file = read_config(config);
+                args_.insert(args_.begin(), file.begin(), file.end());
+                break;
+            }
+        }
+
+        for(size_t i = 0; i < args_.size(); i++) {
+            const std::string& arg = args_[i];
 
             if(arg == "--remote-port")
-                remote_port = static_cast<unsigned short>(std::stoi(argv_[++i]));
+                remote_port = static_cast<unsigned short>(std::stoi(value(i)));
             if(arg == "--bind-port")
-                remote_port = static_cast<unsigned short>(std::stoi(argv_[++i]));
+                bind_port = static_cast<unsigned short>(std::stoi(value(i)));
             if(arg == "--bind-host")
-                bind_host = argv_[++i];
+                bind_host = value(i);
             if(arg == "--remote-host")
-                remote_host = argv_[++i];
+                remote_host = value(i);
+            if(arg == "--threads") {
+                int n = std::stoi(value(i));
+                threads = n > 0 ? static_cast<size_t>(n) : db_proxy::io_context_pool::hardware_threads();
+            }
+            if(arg == "--least-loaded")
+                least_loaded = true;
+            if(arg == "--reuseport")
+                listen.reuse_port = true;
+            if(arg == "--backlog")
+                listen.backlog = std::stoi(value(i));
+            if(arg == "--accept-batch")
+                listen.accept_batch = static_cast<size_t>(std::max(1, std::stoi(value(i))));
+            if(arg == "--splice")
+                session.relay = db_proxy::relay_mode::splice;
+            if(arg == "--io-uring")
+                session.relay = db_proxy::relay_mode::uring;
+            if(arg == "--uring-buffers")
+                session.uring_buffers = static_cast<unsigned>(std::max(1, std::stoi(value(i))));
+            if(arg == "--pipeline-depth")
+                session.pipeline_depth = static_cast<size_t>(std::max(1, std::stoi(value(i))));
+            if(arg == "--high-watermark") {
+                session.high_watermark = static_cast<size_t>(std::stoi(value(i)));
+                high_set = true;
+            }
+            if(arg == "--low-watermark") {
+                session.low_watermark = static_cast<size_t>(std::stoi(value(i)));
+                low_set = true;
+            }
+            if(arg == "--compress-threads")
+                session.compress_threads = static_cast<size_t>(std::max(0, std::stoi(value(i))));
+            if(arg == "--compress-level")
+                session.compress_level = std::min(9, std::max(1, std::stoi(value(i))));
+            if(arg == "--pool-size")
+                pool.size = static_cast<size_t>(std::max(0, std::stoi(value(i))));
+            if(arg == "--pool-user")
+                pool.user = value(i);
+            if(arg == "--pool-password")
+                pool.password = value(i);
+            if(arg == "--pool-mode") {
+                std::string mode = value(i);
+                pool.mode = mode == "session" ? db_proxy::pool_mode::session : db_proxy::pool_mode::transaction;
+            }
+            if(arg == "--replica") {
+                // host:port, a missing port is left 0 and reported as missing
+                std::string address = value(i);
+                const size_t colon = address.rfind(':');
+                if(colon == std::string::npos)
+                    pool.replicas.emplace_back(address, 0);
+                else
+                    pool.replicas.emplace_back(address.substr(0, colon),
+                                               static_cast<unsigned short>(std::stoi(address.substr(colon + 1))));
+            }
+            if(arg == "--stmt-cache")
+                pool.statements = static_cast<size_t>(std::max(0, std::stoi(value(i))));
+            if(arg == "--cache-size")
+                cache.max_bytes = static_cast<size_t>(std::max(0, std::stoi(value(i)))) << 20;
+            if(arg == "--cache-ttl")
+                cache.ttl = std::chrono::milliseconds(std::max(0, std::stoi(value(i))));
+            if(arg == "--cache-pattern")
+                cache.patterns.push_back(value(i));
+            if(arg == "--metrics-port")
+                metrics_port = static_cast<unsigned short>(std::stoi(value(i)));
+            if(arg == "--digests")
+                digests = static_cast<size_t>(std::max(0, std::stoi(value(i))));
+            if(arg == "--capture")
+                capture = value(i);
+            if(arg == "--capture-size")
+                capture_size = static_cast<size_t>(std::max(1, std::stoi(value(i))));
+            if(arg == "--limit-by") {
+                std::string key = value(i);
+                limits.by = key == "user" ? db_proxy::admission_options::key::user : db_proxy::admission_options::key::ip;
+            }
+            if(arg == "--limit-qps")
+                limits.qps = std::max(0.0, std::stod(value(i)));
+            if(arg == "--limit-burst")
+                limits.burst = static_cast<size_t>(std::max(0, std::stoi(value(i))));
+            if(arg == "--limit-in-flight")
+                limits.max_in_flight = static_cast<size_t>(std::max(0, std::stoi(value(i))));
+            if(arg == "--limit-sessions")
+                limits.max_sessions = static_cast<size_t>(std::max(0, std::stoi(value(i))));
+            if(arg == "--limit-wait")
+                limits.max_wait = std::chrono::milliseconds(std::max(0, std::stoi(value(i))));
+            if(arg == "--limit-clients")
+                limits.clients = static_cast<size_t>(std::max(1, std::stoi(value(i))));
+            if(arg == "--tls-cert")
+                tls.certificate = value(i);
+            if(arg == "--tls-key")
+                tls.key = value(i);
+            if(arg == "--tls-session-cache")
+                tls.session_cache = static_cast<size_t>(std::max(0, std::stoi(value(i))));
+            if(arg == "--tls-no-tickets")
+                tls.tickets = false;
+            if(arg == "--tls-no-ktls")
+                tls.ktls = false;
+            if(arg == "--tls-required")
+                tls.required = true;
+            if(arg == "--backend-tls")
+                tls.backend = true;
+            if(arg == "--backend-ca")
+                tls.backend_ca = value(i);
+            if(arg == "--config")
+                value(i);
+            if(arg == "--upgrade-socket")
+                upgrade_socket = value(i);
+            if(arg == "--drain-timeout")
+                drain_timeout = static_cast<size_t>(std::max(0, std::stoi(value(i))));
+            if(arg == "--log-overflow") {
+                std::string policy = value(i);
+                log_overflow = policy == "block" ? AsyncFileLogger::Overflow::block : AsyncFileLogger::Overflow::drop;
+            }
             if(arg == "--help") {
                 help();
                 return true;
             }
         }
 
+        // watermarks follow the depth unless given explicitly
+        if(!high_set)
+            session.high_watermark = session.pipeline_depth;
+        if(!low_set)
+            session.low_watermark = session.high_watermark / 2;
+
         return required_missing();
     }
 
     bool required_missing() {
-        return remote_host.empty() || remote_port == 0;
+        for(const auto &replica : pool.replicas) {
+            if(replica.first.empty() || replica.second == 0)
+                return true;
+        }
+        return remote_host.empty() || remote_port == 0 || (pool.size > 0 && pool.user.empty());
     }
 
     void help() {
-        std::cout << "Usage: " << argv_[0] << " [options]" << '\n';
+        std::cout << "Usage: " << program_ << " [options]" << '\n';
         std::cout << "  Options:\n";
         std::cout << "    --remote-port arg" << "\t Remote DB port\n";
         std::cout << "    --remote-host arg" << "\t Remote DB host\n";
         std::cout << "    --bind-port [arg]" << "\t Local port to listen. Default: " << bind_port << '\n';
         std::cout << "    --bind-host [arg]" << "\t Local adress to listen.  Default: " << bind_host << '\n';
+        std::cout << "    --threads [arg]" << "\t Worker threads, one io_context per core. 0 - all cores. Default: " << threads << '\n';
+        std::cout << "    --least-loaded" << "\t Assign sessions to the least loaded thread instead of round-robin\n";
+        std::cout << "    --reuseport" << "\t\t One SO_REUSEPORT listening socket per thread\n";
+        std::cout << "    --backlog [arg]" << "\t Listen backlog. Default: " << listen.backlog << '\n';
+        std::cout << "    --accept-batch [arg]" << "\t Connections accepted per wakeup. Default: " << listen.accept_batch << '\n';
+        std::cout << "    --splice" << "\t\t Relay server responses with splice(2), bypassing user space (Linux only)\n";
+        std::cout << "    --io-uring" << "\t\t Relay both directions through a per-thread io_uring, the copy relay when unavailable (Linux 6.0+)\n";
+        std::cout << "    --uring-buffers [arg]" << " 16KB receive buffers of every thread's io_uring. Default: " << session.uring_buffers << '\n';
+        std::cout << "    --pipeline-depth [arg]" << " Buffers in flight per direction. Default: " << session.pipeline_depth << '\n';
+        std::cout << "    --high-watermark [arg]" << " Buffered chunks at which reading pauses. Default: pipeline depth\n";
+        std::cout << "    --low-watermark [arg]" << "\t Buffered chunks at which reading resumes. Default: high watermark / 2\n";
+        std::cout << "    --compress-threads [arg]" << " Threads compressing for clients that ask for compression, the backend gets plain packets. 0 - compression is left to the backend. Default: " << session.compress_threads << '\n';
+        std::cout << "    --compress-level [arg]" << " zlib level of compressed responses, 1-9. Default: " << session.compress_level << '\n';
+        std::cout << "    --pool-size [arg]" << "\t Backend connections shared by all clients, rounded up per thread. 0 - no pooling. Default: " << pool.size << '\n';
+        std::cout << "    --pool-user arg" << "\t User the pool logs in with, clients must log in with the same credentials\n";
+        std::cout << "    --pool-password [arg]" << " Password of the pool user\n";
+        std::cout << "    --pool-mode [arg]" << "\t transaction - backends return to the pool between transactions, session - once the client leaves. Default: transaction\n";
+        std::cout << "    --replica arg" << "\t Replica host:port for autocommit SELECTs, needs pooling in transaction mode, may be repeated\n";
+        std::cout << "    --stmt-cache [arg]" << "\t Prepared statements cached per thread and shared by all clients, needs pooling. 0 - no cache. Default: " << pool.statements << '\n';
+        std::cout << "    --cache-size [arg]" << "\t Query result cache in MB, needs pooling. 0 - no cache. Default: " << (cache.max_bytes >> 20) << '\n';
+        std::cout << "    --cache-ttl [arg]" << "\t Milliseconds a cached result is served. Default: " << cache.ttl.count() << '\n';
+        std::cout << "    --cache-pattern arg" << "\t Regular expression for SELECTs to cache, may be repeated\n";
+        std::cout << "    --metrics-port [arg]" << "\t Port on 127.0.0.1 serving Prometheus metrics at /metrics. 0 - none. Default: " << metrics_port << '\n';
+        std::cout << "    --digests [arg]" << "\t Statement fingerprints kept per thread, the top ones by time are served at /digests. 0 - none. Default: " << digests << '\n';
+        std::cout << "    --capture arg" << "\t Record everything the parsers see into this file, for db-proxy-replay\n";
+        std::cout << "    --capture-size [arg]" << "\t MB the capture file may grow to, later traffic is not recorded. Default: " << capture_size << '\n';
+        std::cout << "    --limit-by [arg]" << "\t What a client is: ip - its address, user - the user it logs in as, TLS logins the proxy does not terminate by address. Default: ip\n";
+        std::cout << "    --limit-qps [arg]" << "\t Commands per second of a client, the excess waits or is refused. 0 - no limit. Default: " << limits.qps << '\n';
+        std::cout << "    --limit-burst [arg]" << "\t Commands a client may send at once above the rate. Default: the rate\n";
+        std::cout << "    --limit-in-flight [arg]" << " Commands of a client waiting for a response. 0 - no limit. Default: " << limits.max_in_flight << '\n';
+        std::cout << "    --limit-sessions [arg]" << "\t Sessions of a client. 0 - no limit. Default: " << limits.max_sessions << '\n';
+        std::cout << "    --limit-wait [arg]" << "\t Milliseconds a command waits for the limits before it is refused. Default: " << limits.max_wait.count() << '\n';
+        std::cout << "    --limit-clients [arg]" << "\t Clients the limits are kept for, more share them. Default: " << limits.clients << '\n';
+        std::cout << "    --tls-cert arg" << "\t PEM certificate chain the proxy terminates clients' TLS with\n";
+        std::cout << "    --tls-key [arg]" << "\t PEM private key. Default: in the certificate file\n";
+        std::cout << "    --tls-session-cache [arg]" << " TLS sessions kept for resumption by id. 0 - none. Default: " << tls.session_cache << '\n';
+        std::cout << "    --tls-no-tickets" << "\t Resume TLS sessions by id only, without session tickets\n";
+        std::cout << "    --tls-no-ktls" << "\t\t Encrypt in user space even where the kernel can (kTLS, Linux)\n";
+        std::cout << "    --tls-required" << "\t Refuse clients that log in without TLS\n";
+        std::cout << "    --backend-tls" << "\t\t TLS to the backend too, plaintext otherwise\n";
+        std::cout << "    --backend-ca [arg]" << "\t CA file the backend's certificate and address are verified with. Default: not verified\n";
+        std::cout << "    --config arg" << "\t\t File with options in command line syntax, # comments. Re-read with the command line on SIGHUP\n";
+        std::cout << "    --upgrade-socket arg" << "\t Unix socket the listening sockets are handed to a new process over, taken from a process there at start\n";
+        std::cout << "    --drain-timeout [arg]" << "\t Seconds sessions may run on after a handover before they are closed. 0 - until they end. Default: " << drain_timeout << '\n';
+        std::cout << "    --log-overflow [arg]" << "\t When the log writer falls behind: drop - lose records, block - wait for it. Default: drop\n";
     }
 };
 
-static net::io_context ios;
+namespace
+{
+    // Re-reads the command line and the --config file. The backend and the
+    // bind address change in place, other options take a binary upgrade.
+    void reload(int argc, char** argv, CmdOptions& running, db_proxy::server& server)
+    {
+        try
+        {
+            CmdOptions fresh(argc, argv);
+            if (fresh.parse())
+            {
+                std::cerr << "Reload: required options missing, nothing changed" << std::endl;
+                return;
+            }
+
+            if (fresh.remote_host != running.remote_host || fresh.remote_port != running.remote_port)
+            {
+                server.retarget(fresh.remote_host, fresh.remote_port);
+                running.remote_host = fresh.remote_host;
+                running.remote_port = fresh.remote_port;
+                std::cout << "Reload: backend " << running.remote_host << ':' << running.remote_port << std::endl;
+            }
+
+            if (fresh.bind_host != running.bind_host || fresh.bind_port != running.bind_port)
+            {
+                server.rebind(fresh.bind_host, fresh.bind_port);
+                running.bind_host = fresh.bind_host;
+                running.bind_port = fresh.bind_port;
+                std::cout << "Reload: listening on " << running.bind_host << ':' << running.bind_port << std::endl;
+            }
+        }
+        catch(std::exception& e)
+        {
+            std::cerr << "Reload failed: " << e.what() << std::endl;
+        }
+    }
+
+    // Files the process taken over from goes on writing. They are moved
+    // aside with .old appended, not truncated by the new process.
+    std::vector<std::string> written_files(const CmdOptions& options)
+    {
+        std::vector<std::string> files{"db-proxy.log"};
+        if (!options.capture.empty())
+            files.push_back(options.capture);
+        return files;
+    }
 
-BOOL WINAPI CtrlHandler(DWORD dwCtrlType) {
-    switch (dwCtrlType)
+    // Stops ios once the sessions left after a handover have ended, or
+    // closes them at the deadline.
+    void drain(net::io_context& ios, net::steady_timer& timer, db_proxy::server& server,
+               std::chrono::steady_clock::time_point deadline)
     {
-    case CTRL_BREAK_EVENT:
-    case CTRL_CLOSE_EVENT:
-    case CTRL_C_EVENT:
-        if(!ios.stopped())
+        timer.expires_after(std::chrono::milliseconds(100));
+        timer.async_wait([&ios, &timer, &server, deadline](const boost::system::error_code& error)
+        {
+            if (error)
+                return;
+
+            const size_t sessions = server.sessions();
+            if (sessions == 0)
+                std::cout << "Upgrade: sessions drained" << std::endl;
+            else if (std::chrono::steady_clock::now() >= deadline)
+                std::cout << "Upgrade: drain timeout, closing " << sessions << " sessions" << std::endl;
+            else
+            {
+                drain(ios, timer, server, deadline);
+                return;
+            }
             ios.stop();
-        return TRUE;
-    default:
-        return FALSE;
+        });
     }
-
 }
+
 int main(int argc, char** argv)
 {
-    SetConsoleCtrlHandler(CtrlHandler, TRUE);
-
-    auto logger = LoggerRegistry::instance().create_file("logger", "db-proxy.log");
-
     CmdOptions options(argc, argv);
 
-    bool res = options.parse();
+    bool res;
+    try
+    {
+        res = options.parse();
+    }
+    catch(std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
 
     if (res) {
         std::cout << "Missed required options\n\n";
@@ -293,19 +2994,161 @@ int main(int argc, char** argv)
         return EXIT_FAILURE;
     }
 
+#if defined(DB_PROXY_HAS_UPGRADE)
+    // taken over before the log is opened, see written_files()
+    std::unique_ptr<db_proxy::takeover> predecessor;
+    if (!options.upgrade_socket.empty())
+    {
+        try
+        {
+            predecessor.reset(new db_proxy::takeover(options.upgrade_socket));
+        }
+        catch(std::exception& e)
+        {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        options.listen.inherited = predecessor->sockets();
+        if (options.listen.inherited.empty())
+            predecessor.reset();
+        else
+        {
+            for (const auto& file : written_files(options))
+                std::rename(file.c_str(), (file + ".old").c_str());
+            std::cout << "Upgrade: took over " << options.listen.inherited.size() << " listening sockets" << std::endl;
+        }
+    }
+#else
+    if (!options.upgrade_socket.empty())
+    {
+        std::cerr << "Error: binary upgrade is not supported on this platform" << std::endl;
+        return EXIT_FAILURE;
+    }
+#endif
+
+    auto logger = LoggerRegistry::instance().create_async_file("logger", "db-proxy.log", options.log_overflow);
+
     try
     {
-        db_proxy::server server(ios,
+        // outlives the sessions of the pool, which record until they close
+        std::unique_ptr<db_proxy::capture_log> capture;
+        if (!options.capture.empty())
+            capture.reset(new db_proxy::capture_log(options.capture, options.capture_size << 20));
+
+        std::unique_ptr<db_proxy::admission> limits;
+        if (options.limits.enabled())
+            limits.reset(new db_proxy::admission(options.limits));
+
+        // outlives ios: accepts still queued there own sockets of the shards
+        db_proxy::io_context_pool pool(options.threads,
+                                       options.least_loaded ? db_proxy::io_context_pool::balance::least_loaded
+                                                            : db_proxy::io_context_pool::balance::round_robin);
+
+        for (size_t i = 0; i < pool.size(); i++)
+        {
+            pool.at(i).metrics.digests.set_capacity(options.digests);
+            pool.at(i).capture = capture.get();
+            pool.at(i).limits = limits.get();
+        }
+
+        net::io_context ios;
+
+        net::signal_set signals(ios, SIGINT, SIGTERM);
+#if defined(SIGBREAK)
+        signals.add(SIGBREAK);
+#endif
+        signals.async_wait([&ios](const boost::system::error_code&, int)
+        {
+            ios.stop();
+        });
+
+        db_proxy::server server(ios, pool,
                                 options.bind_host, options.bind_port,
-                                options.remote_host, options.remote_port);
+                                options.remote_host, options.remote_port,
+                                options.listen, options.session, options.pool, options.cache, options.tls);
 
         server.accept_connections();
 
+#if defined(DB_PROXY_HAS_UPGRADE)
+        // the old process stops accepting and gives up the metrics port
+        if (predecessor)
+        {
+            predecessor->ready();
+            predecessor.reset();
+        }
+#endif
+
+        // scrapes are served by the main thread, apart from the shards
+        std::unique_ptr<db_proxy::metrics_server> metrics;
+        if (options.metrics_port != 0)
+        {
+            metrics.reset(new db_proxy::metrics_server(ios, pool, "127.0.0.1", options.metrics_port, options.digests));
+            metrics->start();
+        }
+
+        // after a handover the sessions left run to their end
+        bool draining = false;
+        net::steady_timer drain_timer(ios);
+
+#if defined(DB_PROXY_HAS_UPGRADE)
+        std::unique_ptr<db_proxy::upgrade_listener> upgrades;
+        if (!options.upgrade_socket.empty())
+        {
+            upgrades.reset(new db_proxy::upgrade_listener(ios, options.upgrade_socket,
+                                                          [&server] { return server.listening_sockets(); },
+                                                          [&]
+            {
+                draining = true;
+                server.stop_accepting();
+                if (metrics)
+                    metrics->stop();
+
+                std::cout << "Upgrade: handed over, draining " << server.sessions() << " sessions" << std::endl;
+                const auto deadline = options.drain_timeout > 0
+                        ? std::chrono::steady_clock::now() + std::chrono::seconds(options.drain_timeout)
+                        : std::chrono::steady_clock::time_point::max();
+                drain(ios, drain_timer, server, deadline);
+            }));
+            upgrades->start();
+        }
+#endif
+
+#if defined(SIGHUP)
+        net::signal_set reloads(ios, SIGHUP);
+        std::function<void()> wait_reload = [&]
+        {
+            reloads.async_wait([&](const boost::system::error_code& error, int)
+            {
+                if (error)
+                    return;
+                if (draining)
+                    std::cerr << "Reload ignored while draining" << std::endl;
+                else
+                    reload(argc, argv, options, server);
+                wait_reload();
+            });
+        };
+        wait_reload();
+#endif
+
+        pool.run(options.threads > 1);
         ios.run();
+
+        pool.stop();
+        pool.join();
     }
     catch(std::exception& e)
     {
       std::cerr << "Error: " << e.what() << std::endl;
+#if defined(DB_PROXY_HAS_UPGRADE)
+      // the old process goes on serving, with its files
+      if (predecessor)
+      {
+          for (const auto& file : written_files(options))
+              std::rename((file + ".old").c_str(), file.c_str());
+      }
+#endif
       return 1;
     }
 
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+namespace db_proxy
+{
+    // Free list of equally sized blocks. Not thread safe: every shard owns
+    // its own slabs and only touches them from its thread.
+    class slab
+    {
+    public:
+        slab(size_t max_free = 1024) : max_free_(max_free)
+        {
+        }
+
+        ~slab()
+        {
+            for (void* p : free_)
+                ::operator delete(p);
+        }
+
+        slab(const slab&) = delete;
+        slab& operator=(const slab&) = delete;
+
+        void* allocate(size_t size)
+        {
+            // the first allocation fixes the block size
+            if (block_size_ == 0)
+                block_size_ = size;
+
+            if (size == block_size_ && !free_.empty())
+            {
+                void* p = free_.back();
+                free_.pop_back();
+                return p;
+            }
+
+            return ::operator new(size);
+        }
+
+        void deallocate(void* p, size_t size)
+        {
+            if (size == block_size_ && free_.size() < max_free_)
+                free_.push_back(p);
+            else
+                ::operator delete(p);
+        }
+
+    private:
+        std::vector<void*> free_;
+        size_t block_size_ = 0;
+        size_t max_free_;
+    };
+
+    // Standard allocator over a slab, meant for std::allocate_shared so the
+    // object and its control block come from the slab in one block.
+    template<typename T>
+    class slab_allocator
+    {
+    public:
+        using value_type = T;
+
+        explicit slab_allocator(slab& s) : slab_(&s)
+        {
+        }
+
+        template<typename U>
+        slab_allocator(const slab_allocator<U>& other) : slab_(other.get_slab())
+        {
+        }
+
+        T* allocate(size_t n)
+        {
+            return static_cast<T*>(slab_->allocate(n * sizeof(T)));
+        }
+
+        void deallocate(T* p, size_t n)
+        {
+            slab_->deallocate(p, n * sizeof(T));
+        }
+
+        slab* get_slab() const { return slab_; }
+
+        template<typename U>
+        bool operator==(const slab_allocator<U>& other) const { return slab_ == other.get_slab(); }
+
+        template<typename U>
+        bool operator!=(const slab_allocator<U>& other) const { return slab_ != other.get_slab(); }
+
+    private:
+        slab* slab_;
+    };
+
+    // I/O buffers in a few power of four size classes, one slab per class.
+    class buffer_pool
+    {
+    public:
+        enum { classes = 4, min_size = 1024 }; // 1KB, 4KB, 16KB, 64KB
+
+        // keeps at most ~max_free_bytes of unused buffers per class
+        explicit buffer_pool(size_t max_free_bytes = 4 * 1024 * 1024)
+            : slabs_{{max_free_bytes / class_size(0)},
+                     {max_free_bytes / class_size(1)},
+                     {max_free_bytes / class_size(2)},
+                     {max_free_bytes / class_size(3)}}
+        {
+        }
+
+        static size_t class_size(size_t size_class)
+        {
+            return size_t(min_size) << (2 * size_class);
+        }
+
+        uint8_t* allocate(size_t size_class)
+        {
+            return static_cast<uint8_t*>(slabs_[size_class].allocate(class_size(size_class)));
+        }
+
+        void deallocate(uint8_t* p, size_t size_class)
+        {
+            slabs_[size_class].deallocate(p, class_size(size_class));
+        }
+
+    private:
+        slab slabs_[classes];
+    };
+}
@@ -0,0 +1,179 @@
+#include "metrics.hpp"
+
+#include "parser.hpp"
+
+#include <algorithm>
+
+namespace db_proxy
+{
+    namespace
+    {
+        const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+        void write_seconds(std::ostream& out, uint64_t us)
+        {
+            out << static_cast<double>(us) / 1e6;
+        }
+
+        void write_summary(std::ostream& out, const char* name, const char* help,
+                           const std::array<histogram_snapshot, traffic_metrics::kinds>& histograms)
+        {
+            out << "# HELP " << name << ' ' << help << '\n';
+            out << "# TYPE " << name << " summary\n";
+
+            for (size_t k = 0; k < histograms.size(); k++)
+            {
+                const auto& h = histograms[k];
+                if (h.count == 0)
+                    continue;
+
+                const char* statement = traffic_metrics::kind_name(k);
+                for (double q : quantiles)
+                {
+                    out << name << "{statement=\"" << statement << "\",quantile=\"" << q << "\"} ";
+                    write_seconds(out, h.value_at(q));
+                    out << '\n';
+                }
+                out << name << "{statement=\"" << statement << "\",quantile=\"1\"} ";
+                write_seconds(out, h.max);
+                out << '\n';
+
+                out << name << "_sum{statement=\"" << statement << "\"} ";
+                write_seconds(out, h.sum);
+                out << '\n';
+                out << name << "_count{statement=\"" << statement << "\"} " << h.count << '\n';
+            }
+        }
+
+        void write_by_command(std::ostream& out, const char* name, const char* help,
+                              const std::array<uint64_t, 256>& values)
+        {
+            out << "# HELP " << name << ' ' << help << '\n';
+            out << "# TYPE " << name << " counter\n";
+
+            for (size_t c = 0; c < values.size(); c++)
+            {
+                if (values[c] == 0)
+                    continue;
+
+                out << name << "{command=\"";
+                if (const char* command = My::command_name(static_cast<uint8_t>(c)))
+                    out << command;
+                else
+                    out << "0x" << std::hex << c << std::dec;
+                out << "\"} " << values[c] << '\n';
+            }
+        }
+    }
+
+    const char* traffic_metrics::kind_name(size_t k)
+    {
+        switch (k)
+        {
+        case query:
+            return "query";
+        case prepare:
+            return "prepare";
+        case execute:
+            return "execute";
+        default:
+            return "other";
+        }
+    }
+
+    void histogram_snapshot::add(const latency_histogram& h)
+    {
+        for (size_t i = 0; i < counts.size(); i++)
+            counts[i] += h.count(i);
+        count += h.count();
+        sum += h.sum();
+        max = std::max(max, h.max());
+    }
+
+    uint64_t histogram_snapshot::value_at(double quantile) const
+    {
+        // the buckets are read one by one while the shards keep recording,
+        // so count may be a bit off from their total
+        return latency_histogram::layout::value_at(counts.data(), quantile, max);
+    }
+
+    void metrics_snapshot::add(const traffic_metrics& m)
+    {
+        client_bytes += m.client_bytes.load();
+        server_bytes += m.server_bytes.load();
+        compressed_client_bytes += m.compressed_client_bytes.load();
+        compressed_server_bytes += m.compressed_server_bytes.load();
+        client_packets += m.client_packets.load();
+        server_packets += m.server_packets.load();
+
+        for (size_t c = 0; c < commands.size(); c++)
+        {
+            commands[c] += m.commands[c].load();
+            errors[c] += m.errors[c].load();
+        }
+        rows += m.rows.load();
+
+        for (size_t k = 0; k < traffic_metrics::kinds; k++)
+        {
+            first_byte[k].add(m.first_byte[k]);
+            response[k].add(m.response[k]);
+        }
+
+        refused_sessions += m.refused_sessions.load();
+        refused_commands += m.refused_commands.load();
+        delayed_commands += m.delayed_commands.load();
+        tls_full += m.tls_full.load();
+        tls_resumed += m.tls_resumed.load();
+        ktls_send += m.ktls_send.load();
+        ktls_receive += m.ktls_receive.load();
+    }
+
+    void metrics_snapshot::write(std::ostream& out) const
+    {
+        out << "# HELP db_proxy_bytes_total Bytes relayed.\n";
+        out << "# TYPE db_proxy_bytes_total counter\n";
+        out << "db_proxy_bytes_total{direction=\"client_to_server\"} " << client_bytes << '\n';
+        out << "db_proxy_bytes_total{direction=\"server_to_client\"} " << server_bytes << '\n';
+
+        out << "# HELP db_proxy_compressed_bytes_total Bytes on the client link of sessions the proxy compresses for.\n";
+        out << "# TYPE db_proxy_compressed_bytes_total counter\n";
+        out << "db_proxy_compressed_bytes_total{direction=\"client_to_server\"} " << compressed_client_bytes << '\n';
+        out << "db_proxy_compressed_bytes_total{direction=\"server_to_client\"} " << compressed_server_bytes << '\n';
+
+        out << "# HELP db_proxy_packets_total Protocol packets seen by the parser.\n";
+        out << "# TYPE db_proxy_packets_total counter\n";
+        out << "db_proxy_packets_total{direction=\"client_to_server\"} " << client_packets << '\n';
+        out << "db_proxy_packets_total{direction=\"server_to_client\"} " << server_packets << '\n';
+
+        write_by_command(out, "db_proxy_commands_total", "Commands sent by clients.", commands);
+        write_by_command(out, "db_proxy_errors_total", "Commands answered with an ERR packet.", errors);
+
+        out << "# HELP db_proxy_rows_total Result set rows sent to clients.\n";
+        out << "# TYPE db_proxy_rows_total counter\n";
+        out << "db_proxy_rows_total " << rows << '\n';
+
+        write_summary(out, "db_proxy_first_byte_seconds",
+                      "Time from a command to the first byte of its response.", first_byte);
+        write_summary(out, "db_proxy_response_seconds",
+                      "Time from a command to the last byte of its response.", response);
+
+        out << "# HELP db_proxy_admission_refused_total Sessions and commands refused by the client limits.\n";
+        out << "# TYPE db_proxy_admission_refused_total counter\n";
+        out << "db_proxy_admission_refused_total{what=\"session\"} " << refused_sessions << '\n';
+        out << "db_proxy_admission_refused_total{what=\"command\"} " << refused_commands << '\n';
+
+        out << "# HELP db_proxy_admission_delayed_total Commands held back by the client limits.\n";
+        out << "# TYPE db_proxy_admission_delayed_total counter\n";
+        out << "db_proxy_admission_delayed_total " << delayed_commands << '\n';
+
+        out << "# HELP db_proxy_tls_handshakes_total TLS handshakes with clients, full or resuming a session.\n";
+        out << "# TYPE db_proxy_tls_handshakes_total counter\n";
+        out << "db_proxy_tls_handshakes_total{mode=\"full\"} " << tls_full << '\n';
+        out << "db_proxy_tls_handshakes_total{mode=\"resumed\"} " << tls_resumed << '\n';
+
+        out << "# HELP db_proxy_ktls_links_total TLS links to clients whose records the kernel encrypts or decrypts.\n";
+        out << "# TYPE db_proxy_ktls_links_total counter\n";
+        out << "db_proxy_ktls_links_total{direction=\"send\"} " << ktls_send << '\n';
+        out << "db_proxy_ktls_links_total{direction=\"receive\"} " << ktls_receive << '\n';
+    }
+}
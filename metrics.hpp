@@ -0,0 +1,145 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "digest.hpp"
+#include "histogram.hpp"
+
+namespace db_proxy
+{
+    // A counter with a single writer. The increment is a relaxed load and
+    // store instead of a locked add; other threads may read it any time.
+    class counter
+    {
+    public:
+        void add(uint64_t n = 1)
+        {
+            value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        uint64_t load() const { return value_.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> value_{0};
+    };
+
+    // HDR style histogram of microseconds with a single writer. Values below
+    // 64 get a bucket each, every power of two above is split into 32, so a
+    // bucket is within 3% of the values in it. Larger than ~19 hours counts
+    // as the last bucket.
+    class latency_histogram
+    {
+    public:
+        using layout = hdr_buckets<6, 30>;
+        static const size_t buckets = layout::count;
+
+        void record(uint64_t us)
+        {
+            buckets_[layout::index_of(us)].add();
+            count_.add();
+            sum_.add(us);
+            if (us > max_.load(std::memory_order_relaxed))
+                max_.store(us, std::memory_order_relaxed);
+        }
+
+        uint64_t count(size_t index) const { return buckets_[index].load(); }
+        uint64_t count() const { return count_.load(); }
+        uint64_t sum() const { return sum_.load(); }
+        uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+    private:
+        std::array<counter, buckets> buckets_;
+        counter count_;
+        counter sum_;
+        std::atomic<uint64_t> max_{0};
+    };
+
+    // Traffic of the sessions of one shard, written by the shard's thread.
+    struct traffic_metrics
+    {
+        // statements latencies are recorded for
+        enum kind {
+            query,
+            prepare,
+            execute,
+            other,
+            kinds
+        };
+
+        static const char* kind_name(size_t k);
+
+        counter client_bytes;
+        counter server_bytes;
+        // the same on the client link of sessions the proxy compresses for
+        counter compressed_client_bytes;
+        counter compressed_server_bytes;
+        // packets the parser framed, relays that bypass it count bytes only
+        counter client_packets;
+        counter server_packets;
+        // by command byte
+        std::array<counter, 256> commands;
+        std::array<counter, 256> errors;
+        // rows of the result sets relayed to clients
+        counter rows;
+        // command to the first response byte and to the last one
+        std::array<latency_histogram, kinds> first_byte;
+        std::array<latency_histogram, kinds> response;
+        // queries and executed statements by fingerprint
+        digest_table digests;
+        // admission control: refused sessions and commands, commands held back
+        counter refused_sessions;
+        counter refused_commands;
+        counter delayed_commands;
+        // TLS handshakes with clients, full and resuming a session, and
+        // links the kernel encrypts (kTLS) by direction
+        counter tls_full;
+        counter tls_resumed;
+        counter ktls_send;
+        counter ktls_receive;
+    };
+
+    struct histogram_snapshot
+    {
+        std::vector<uint64_t> counts = std::vector<uint64_t>(latency_histogram::buckets);
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+
+        void add(const latency_histogram& h);
+
+        // microseconds, at most the bucket width above the exact value
+        uint64_t value_at(double quantile) const;
+    };
+
+    // Sum of the metrics of all shards, taken by a thread that only reads.
+    struct metrics_snapshot
+    {
+        uint64_t client_bytes = 0;
+        uint64_t server_bytes = 0;
+        uint64_t compressed_client_bytes = 0;
+        uint64_t compressed_server_bytes = 0;
+        uint64_t client_packets = 0;
+        uint64_t server_packets = 0;
+        std::array<uint64_t, 256> commands{};
+        std::array<uint64_t, 256> errors{};
+        uint64_t rows = 0;
+        std::array<histogram_snapshot, traffic_metrics::kinds> first_byte;
+        std::array<histogram_snapshot, traffic_metrics::kinds> response;
+        uint64_t refused_sessions = 0;
+        uint64_t refused_commands = 0;
+        uint64_t delayed_commands = 0;
+        uint64_t tls_full = 0;
+        uint64_t tls_resumed = 0;
+        uint64_t ktls_send = 0;
+        uint64_t ktls_receive = 0;
+
+        void add(const traffic_metrics& m);
+
+        // Prometheus text exposition format
+        void write(std::ostream& out) const;
+    };
+}
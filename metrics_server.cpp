@@ -0,0 +1,208 @@
+#include "metrics_server.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+
+namespace db_proxy
+{
+    // One request per connection, the answer is followed by a close.
+    class metrics_server::connection : public std::enable_shared_from_this<connection>
+    {
+    public:
+        connection(net::ip::tcp::socket socket, metrics_server& server)
+            : socket_(std::move(socket)),
+              request_(max_request),
+              server_(server)
+        {
+        }
+
+        void start()
+        {
+            net::async_read_until(socket_, request_, "\r\n\r\n",
+                                  std::bind(&connection::handle_read,
+                                            shared_from_this(),
+                                            std::placeholders::_1));
+        }
+
+    private:
+        static const size_t max_request = 8192;
+
+        void handle_read(const boost::system::error_code& error)
+        {
+            if (error)
+                return;
+
+            std::istream in(&request_);
+            std::string method, target;
+            in >> method >> target;
+
+            if (method != "GET")
+                respond("405 Method Not Allowed", "");
+            else if (target == "/metrics")
+                respond("200 OK", server_.render());
+            else if (target == "/digests")
+                respond("200 OK", server_.render_digests());
+            else
+                respond("404 Not Found", "");
+        }
+
+        void respond(const char* status, const std::string& body)
+        {
+            std::ostringstream out;
+            out << "HTTP/1.1 " << status << "\r\n"
+                << "Content-Type: text/plain; version=0.0.4\r\n"
+                << "Content-Length: " << body.size() << "\r\n"
+                << "Connection: close\r\n\r\n"
+                << body;
+            response_ = out.str();
+
+            net::async_write(socket_, net::buffer(response_),
+                             std::bind(&connection::handle_write,
+                                       shared_from_this(),
+                                       std::placeholders::_1));
+        }
+
+        void handle_write(const boost::system::error_code&)
+        {
+            boost::system::error_code ec;
+            socket_.shutdown(net::ip::tcp::socket::shutdown_both, ec);
+        }
+
+        net::ip::tcp::socket socket_;
+        net::streambuf request_;
+        std::string response_;
+        metrics_server& server_;
+    };
+
+    metrics_server::metrics_server(net::io_context& ios, io_context_pool& pool,
+                                   const std::string& host, unsigned short port,
+                                   size_t max_digests)
+        : ios_(ios),
+          pool_(pool),
+          acceptor_(ios, net::ip::tcp::endpoint(net::ip::make_address(host), port)),
+          max_digests_(max_digests)
+    {
+    }
+
+    void metrics_server::start()
+    {
+        acceptor_.async_accept(ios_,
+                               std::bind(&metrics_server::handle_accept,
+                                         this,
+                                         std::placeholders::_1,
+                                         std::placeholders::_2));
+    }
+
+    void metrics_server::stop()
+    {
+        boost::system::error_code ignored;
+        acceptor_.close(ignored);
+    }
+
+    void metrics_server::handle_accept(const boost::system::error_code& error, net::ip::tcp::socket socket)
+    {
+        if (error)
+        {
+            if (error != net::error::operation_aborted)
+                std::cerr << "metrics: " << error.message() << std::endl;
+            return;
+        }
+
+        std::make_shared<connection>(std::move(socket), *this)->start();
+        start();
+    }
+
+    std::string metrics_server::render()
+    {
+        metrics_snapshot total;
+        for (size_t i = 0; i < pool_.size(); i++)
+            total.add(pool_.at(i).metrics);
+
+        std::ostringstream out;
+        total.write(out);
+
+        uint64_t evictions = 0;
+        for (size_t i = 0; i < pool_.size(); i++)
+            evictions += pool_.at(i).metrics.digests.evictions();
+        out << "# HELP db_proxy_digest_evictions_total Fingerprints dropped from full digest tables.\n";
+        out << "# TYPE db_proxy_digest_evictions_total counter\n";
+        out << "db_proxy_digest_evictions_total " << evictions << '\n';
+
+        out << "# HELP db_proxy_sessions Client sessions per worker thread.\n";
+        out << "# TYPE db_proxy_sessions gauge\n";
+        for (size_t i = 0; i < pool_.size(); i++)
+            out << "db_proxy_sessions{thread=\"" << i << "\"} "
+                << pool_.at(i).sessions.load(std::memory_order_relaxed) << '\n';
+
+        return out.str();
+    }
+
+    std::string metrics_server::render_digests()
+    {
+        std::vector<digest_table::entry> entries;
+        for (size_t i = 0; i < pool_.size(); i++)
+            pool_.at(i).metrics.digests.copy(entries);
+
+        // every shard keeps its own table, the same statement may be in all
+        std::unordered_map<uint64_t, size_t> merged;
+        size_t kept = 0;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            auto& e = entries[i];
+            auto it = merged.find(e.hash);
+            if (it == merged.end())
+            {
+                merged.emplace(e.hash, kept);
+                if (kept != i)
+                    entries[kept] = std::move(e);
+                kept++;
+                continue;
+            }
+
+            auto& total = entries[it->second];
+            total.calls += e.calls;
+            total.errors += e.errors;
+            total.total_us += e.total_us;
+            total.max_us = std::max(total.max_us, e.max_us);
+            total.max_first_byte_us = std::max(total.max_first_byte_us, e.max_first_byte_us);
+            total.first_byte.add(e.first_byte);
+            total.response.add(e.response);
+            total.rows += e.rows;
+            total.bytes += e.bytes;
+        }
+        entries.resize(kept);
+
+        std::sort(entries.begin(), entries.end(), [](const digest_table::entry& a, const digest_table::entry& b)
+        {
+            return a.total_us > b.total_us;
+        });
+        if (entries.size() > max_digests_)
+            entries.resize(max_digests_);
+
+        std::ostringstream out;
+        out << "digest\tcalls\terrors\ttotal_ms\tavg_us\tp50_us\tp99_us\tmax_us"
+               "\tfirst_byte_p50_us\tfirst_byte_p99_us\trows\tbytes\ttext\n";
+        for (const auto& e : entries)
+        {
+            out << std::hex << std::setw(16) << std::setfill('0') << e.hash << std::dec << std::setfill(' ')
+                << '\t' << e.calls
+                << '\t' << e.errors
+                << '\t' << std::fixed << std::setprecision(3) << static_cast<double>(e.total_us) / 1000
+                << '\t' << (e.calls ? e.total_us / e.calls : 0)
+                << '\t' << e.response.value_at(0.5, e.max_us)
+                << '\t' << e.response.value_at(0.99, e.max_us)
+                << '\t' << e.max_us
+                << '\t' << e.first_byte.value_at(0.5, e.max_first_byte_us)
+                << '\t' << e.first_byte.value_at(0.99, e.max_first_byte_us)
+                << '\t' << e.rows
+                << '\t' << e.bytes
+                << '\t' << e.text << '\n';
+        }
+
+        return out.str();
+    }
+}
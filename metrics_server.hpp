@@ -0,0 +1,45 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include "io_context_pool.hpp"
+
+#include <string>
+
+namespace net = boost::asio;
+
+namespace db_proxy
+{
+    // Serves the metrics of all shards over HTTP: /metrics in the Prometheus
+    // text format, /digests as a table of the most expensive statements.
+    // Runs on its own io_context, apart from the shards: every request sums
+    // their counters without stopping them.
+    class metrics_server
+    {
+    public:
+        // max_digests - rows of the /digests table
+        metrics_server(net::io_context& ios, io_context_pool& pool,
+                       const std::string& host, unsigned short port,
+                       size_t max_digests);
+
+        metrics_server(const metrics_server&) = delete;
+        metrics_server& operator=(const metrics_server&) = delete;
+
+        void start();
+        // stops accepting, scrapes in progress are answered
+        void stop();
+
+    private:
+        class connection;
+
+        void handle_accept(const boost::system::error_code& error, net::ip::tcp::socket socket);
+
+        std::string render();
+        std::string render_digests();
+
+        net::io_context& ios_;
+        io_context_pool& pool_;
+        net::ip::tcp::acceptor acceptor_;
+        size_t max_digests_;
+    };
+}
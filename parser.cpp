@@ -1,3 +1,5 @@
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
 #include "parser.hpp"
@@ -8,115 +10,935 @@ namespace db_proxy {
 
 namespace My {
 
+namespace {
+
+// what ResponseTracker reads of a packet: the status flags of an OK packet
+const size_t response_head = 22;
+
+// what of a statement and its parameters goes into the log
+const size_t max_text_log = 16 * 1024;
+const size_t max_params_log = 256;
+const size_t max_value_log = 256;
+
+// the longest statement the log and the fingerprints take the start of
+const size_t max_digest_source = 64 * 1024;
+
+// What log_execute reads of a COM_STMT_EXECUTE: command, statement id,
+// flags, iteration count, a parameter count, then the null bitmap, the
+// new-params-bound flag and the types of as many parameters as
+// COM_STMT_PREPARE_OK can announce, and the values that go into the log.
+const size_t max_statement_params = 0xffff;
+// what MySQL accepts with CLIENT_QUERY_ATTRIBUTES on top of the parameters
+const size_t max_query_attributes = 32;
+const size_t max_execute_log = 1 + 4 + 1 + 4 + 9 + (max_statement_params + max_query_attributes + 7) / 8 + 1 +
+                               (max_statement_params + max_query_attributes) * 2 +
+                               max_params_log * (9 + max_value_log);
+
+// handshake response: capabilities, max packet size, charset, filler, then
+// the user name, which MySQL limits to 32 characters of up to 4 bytes
+const size_t login_fixed = 4 + 4 + 1 + 23;
+const size_t max_user = 128;
+
+// COM_STMT_EXECUTE flag, the parameter count is sent with query attributes
+const uint8_t PARAMETER_COUNT_AVAILABLE = 0x08;
+
+enum ValueKind : uint8_t {
+    VALUE,
+    NULL_VALUE,
+    LONG_DATA
+};
+
+// Compact execute record, formatted on the log writer's thread:
+//   u32 text size, u32 full text size, text,
+//   u32 parameter count, u32 parameters recorded,
+//   per parameter u16 type, u8 kind, u32 full size, u32 size, bytes
+class RecordWriter {
+    std::string &out_;
+public:
+    explicit RecordWriter(std::string &out) : out_(out) {
+        out_.clear();
+    }
+
+    template<typename T>
+    void put(T v) {
+        out_.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    void bytes(const void *data, size_t size) {
+        out_.append(static_cast<const char*>(data), size);
+    }
+
+    size_t position() const { return out_.size(); }
+
+    template<typename T>
+    void patch(size_t at, T v) {
+        std::memcpy(&out_[at], &v, sizeof(v));
+    }
+};
+
+class RecordReader {
+    const char *data_;
+    size_t size_;
+    size_t offset_ = 0;
+public:
+    RecordReader(const char *data, size_t size) : data_(data), size_(size) {}
+
+    template<typename T>
+    T get() {
+        T v = T();
+        if(offset_ + sizeof(v) <= size_)
+            std::memcpy(&v, data_ + offset_, sizeof(v));
+        offset_ += sizeof(v);
+        return v;
+    }
+
+    const uint8_t* bytes(size_t size) {
+        const uint8_t *p = reinterpret_cast<const uint8_t*>(data_ + std::min(offset_, size_));
+        offset_ += size;
+        return p;
+    }
+
+    bool ok() const { return offset_ <= size_; }
+};
+
+// Prefix and content size of a binary protocol value at data[0..size),
+// false if not even its length is there. The content may go on past size.
+bool binary_value(uint8_t type, const uint8_t *data, size_t size, size_t &prefix, size_t &length) {
+    prefix = 0;
+
+    switch(type) {
+    case MYSQL_TYPE_NULL:
+        length = 0;
+        break;
+    case MYSQL_TYPE_TINY:
+        length = 1;
+        break;
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_YEAR:
+        length = 2;
+        break;
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_FLOAT:
+        length = 4;
+        break;
+    case MYSQL_TYPE_LONGLONG:
+    case MYSQL_TYPE_DOUBLE:
+        length = 8;
+        break;
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_NEWDATE:
+    case MYSQL_TYPE_DATETIME:
+    case MYSQL_TYPE_DATETIME2:
+    case MYSQL_TYPE_TIMESTAMP:
+    case MYSQL_TYPE_TIMESTAMP2:
+    case MYSQL_TYPE_TIME:
+    case MYSQL_TYPE_TIME2:
+        // the length byte is kept, the formatter needs it
+        if(size < 1)
+            return false;
+        length = 1 + data[0];
+        break;
+    default:
+    {
+        uint64_t n = 0;
+        prefix = read_lenenc(data, size, n);
+        if(prefix == 0)
+            return false;
+        length = static_cast<size_t>(n);
+    }
+        break;
+    }
+
+    return true;
+}
+
+void append_quoted(const uint8_t *data, size_t size, size_t length, std::string &text) {
+    static const char hex[] = "0123456789abcdef";
+
+    text += '\'';
+    for(size_t i = 0; i < size; i++) {
+        const uint8_t c = data[i];
+        if(c == '\'' || c == '\\') {
+            text += '\\';
+            text += static_cast<char>(c);
+        }
+        else if(c < 32 || c == 127) {
+            text += "\\x";
+            text += hex[c >> 4];
+            text += hex[c & 15];
+        }
+        else
+            text += static_cast<char>(c);
+    }
+    text += '\'';
+
+    if(size < length)
+        text += "...(" + std::to_string(length) + " bytes)";
+}
+
+void format_value(uint16_t type_flags, const uint8_t *p, size_t size, size_t length, std::string &text) {
+    const bool is_unsigned = (type_flags & 0x8000) != 0;
+    char buf[64];
+    buf[0] = 0;
+
+    switch(type_flags & 0xff) {
+    case MYSQL_TYPE_NULL:
+        text += "NULL";
+        return;
+    case MYSQL_TYPE_TINY:
+        if(size < 1) break;
+        std::snprintf(buf, sizeof(buf), "%d", is_unsigned ? int(p[0]) : int(int8_t(p[0])));
+        break;
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_YEAR:
+        if(size < 2) break;
+        std::snprintf(buf, sizeof(buf), "%d", is_unsigned ? int(read_int<2>(p)) : int(int16_t(read_int<2>(p))));
+        break;
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+        if(size < 4) break;
+        std::snprintf(buf, sizeof(buf), "%lld", is_unsigned ? (long long)read_int<4>(p) : (long long)int32_t(read_int<4>(p)));
+        break;
+    case MYSQL_TYPE_LONGLONG:
+        if(size < 8) break;
+        if(is_unsigned)
+            std::snprintf(buf, sizeof(buf), "%llu", (unsigned long long)read_int<8>(p));
+        else
+            std::snprintf(buf, sizeof(buf), "%lld", (long long)int64_t(read_int<8>(p)));
+        break;
+    case MYSQL_TYPE_FLOAT:
+    {
+        if(size < 4) break;
+        float f;
+        std::memcpy(&f, p, sizeof(f));
+        std::snprintf(buf, sizeof(buf), "%.9g", double(f));
+    }
+        break;
+    case MYSQL_TYPE_DOUBLE:
+    {
+        if(size < 8) break;
+        double d;
+        std::memcpy(&d, p, sizeof(d));
+        std::snprintf(buf, sizeof(buf), "%.17g", d);
+    }
+        break;
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_NEWDATE:
+    case MYSQL_TYPE_DATETIME:
+    case MYSQL_TYPE_DATETIME2:
+    case MYSQL_TYPE_TIMESTAMP:
+    case MYSQL_TYPE_TIMESTAMP2:
+    {
+        // length, year, month, day, hour, minute, second, microseconds
+        const size_t n = size > 0 ? std::min<size_t>(p[0], size - 1) : 0;
+        const unsigned year = n >= 4 ? unsigned(read_int<2>(p + 1)) : 0;
+        const unsigned month = n >= 4 ? p[3] : 0, day = n >= 4 ? p[4] : 0;
+        const unsigned hour = n >= 7 ? p[5] : 0, minute = n >= 7 ? p[6] : 0, second = n >= 7 ? p[7] : 0;
+        int w = std::snprintf(buf, sizeof(buf), "'%04u-%02u-%02u", year, month, day);
+        if(n >= 7)
+            w += std::snprintf(buf + w, sizeof(buf) - w, " %02u:%02u:%02u", hour, minute, second);
+        if(n >= 11)
+            w += std::snprintf(buf + w, sizeof(buf) - w, ".%06u", unsigned(read_int<4>(p + 8)));
+        std::snprintf(buf + w, sizeof(buf) - w, "'");
+    }
+        break;
+    case MYSQL_TYPE_TIME:
+    case MYSQL_TYPE_TIME2:
+    {
+        // length, negative, days, hour, minute, second, microseconds
+        const size_t n = size > 0 ? std::min<size_t>(p[0], size - 1) : 0;
+        const bool negative = n >= 8 && p[1];
+        const unsigned long hours = n >= 8 ? read_int<4>(p + 2) * 24 + p[6] : 0;
+        const unsigned minute = n >= 8 ? p[7] : 0, second = n >= 8 ? p[8] : 0;
+        int w = std::snprintf(buf, sizeof(buf), "'%s%02lu:%02u:%02u", negative ? "-" : "", hours, minute, second);
+        if(n >= 12)
+            w += std::snprintf(buf + w, sizeof(buf) - w, ".%06u", unsigned(read_int<4>(p + 9)));
+        std::snprintf(buf + w, sizeof(buf) - w, "'");
+    }
+        break;
+    case MYSQL_TYPE_DECIMAL:
+    case MYSQL_TYPE_NEWDECIMAL:
+        text.append(reinterpret_cast<const char*>(p), size);
+        return;
+    default:
+        append_quoted(p, size, length, text);
+        return;
+    }
+
+    text += buf[0] ? buf : "?";
+}
+
+void format_execute(const char *data, size_t size, std::string &text) {
+    RecordReader r(data, size);
+
+    const uint32_t text_size = r.get<uint32_t>();
+    const uint32_t full_text_size = r.get<uint32_t>();
+    const uint8_t *statement = r.bytes(text_size);
+    const uint32_t count = r.get<uint32_t>();
+    const uint32_t recorded = r.get<uint32_t>();
+    if(!r.ok())
+        return;
+
+    text += "Execute prepared statement: ";
+    text.append(reinterpret_cast<const char*>(statement), text_size);
+    if(text_size < full_text_size)
+        text += " ...";
+
+    if(count > 0) {
+        text += " [";
+        for(uint32_t i = 0; i < recorded; i++) {
+            const uint16_t type = r.get<uint16_t>();
+            const uint8_t kind = r.get<uint8_t>();
+            const uint32_t length = r.get<uint32_t>();
+            const uint32_t value_size = r.get<uint32_t>();
+            const uint8_t *value = r.bytes(value_size);
+            if(!r.ok())
+                break;
+
+            if(i > 0)
+                text += ", ";
+            if(kind == NULL_VALUE)
+                text += "NULL";
+            else if(kind == LONG_DATA)
+                append_quoted(value, value_size, length, text);
+            else
+                format_value(type, value, value_size, length, text);
+        }
+        if(recorded < count)
+            text += (recorded ? ", " : "") + std::string("... ") + std::to_string(count - recorded) + " more";
+        text += ']';
+    }
+
+    text += '\n';
+}
+
+} // namespace
+
+const char *command_name(uint8_t command) {
+    static const char *const names[] = {
+        "COM_SLEEP", "COM_QUIT", "COM_INIT_DB", "COM_QUERY",
+        "COM_FIELD_LIST", "COM_CREATE_DB", "COM_DROP_DB", "COM_REFRESH",
+        "COM_SHUTDOWN", "COM_STATISTICS", "COM_PROCESS_INFO", "COM_CONNECT",
+        "COM_PROCESS_KILL", "COM_DEBUG", "COM_PING", "COM_TIME",
+        "COM_DELAYED_INSERT", "COM_CHANGE_USER", "COM_BINLOG_DUMP", "COM_TABLE_DUMP",
+        "COM_CONNECT_OUT", "COM_REGISTER_SLAVE", "COM_STMT_PREPARE", "COM_STMT_EXECUTE",
+        "COM_STMT_SEND_LONG_DATA", "COM_STMT_CLOSE", "COM_STMT_RESET", "COM_SET_OPTION",
+        "COM_STMT_FETCH", "COM_DAEMON", "COM_BINLOG_DUMP_GTID", "COM_RESET_CONNECTION"
+    };
+
+    return command < sizeof(names) / sizeof(names[0]) ? names[command] : nullptr;
+}
+
 Parser::~Parser(){
+    capture(capture_log::session_close, nullptr, 0);
+    finish_timing();
     prepared_stmts.clear();
 }
 
-bool Parser::parse(const uint8_t *data, size_t size) {
-    auto logger = LoggerRegistry::instance().get("logger");
+void Parser::set_capture(capture_log *capture) {
+    capture_ = capture;
+    if(capture_) {
+        capture_session_ = capture_->new_session();
+        capture_->append(capture_session_, capture_log::session_open, nullptr, 0);
+    }
+}
+
+PreparedStatement *StatementTable::find(uint32_t id) {
+    if(entries_.empty())
+        return nullptr;
 
-    // some magick to skip auth phase
-    if(packets_ < 3)
-    {
-        packets_++;
-        return true;
+    const size_t slot = slot_of(id);
+    return index_[slot] == empty ? nullptr : &entries_[index_[slot]].stmt;
+}
+
+void StatementTable::insert(uint32_t id, PreparedStatement &&stmt) {
+    if((entries_.size() + 1) * 2 > index_.size())
+        rehash(std::max<size_t>(8, index_.size() * 2));
+
+    const size_t slot = slot_of(id);
+    if(index_[slot] != empty) {
+        entries_[index_[slot]].stmt = std::move(stmt);
+        return;
     }
 
-    // command phase
-    size_t offset = 0;
+    index_[slot] = static_cast<uint32_t>(entries_.size());
+    entries_.push_back(Entry{id, std::move(stmt)});
+}
+
+void StatementTable::erase(uint32_t id) {
+    if(entries_.empty())
+        return;
 
-    PacketHeader header = read_header(data, size);
-    offset += 4;
+    const size_t slot = slot_of(id);
+    const uint32_t position = index_[slot];
+    if(position == empty)
+        return;
+    erase_slot(slot);
 
-    if(header.sequence_id == 0) {
-        current_state_ = State::PARSE_QUERY;
+    // the last statement fills the hole
+    if(position + 1 != entries_.size()) {
+        index_[slot_of(entries_.back().id)] = position;
+        entries_[position] = std::move(entries_.back());
     }
+    entries_.pop_back();
+}
 
-    switch(current_state_) {
-    case State::PARSE_QUERY:
-    {
-        auto type = data[offset++];
-        std::string s;
-
-        switch(type) {
-        case COM_QUERY:
-        {
-            s.assign(reinterpret_cast<char*>(const_cast<uint8_t*>(&data[offset])), header.payload_length - 1);
-            logger->log() << "Execute query: " << s << '\n';
-            current_state_ = State::PARSE_QUERY_RESPONSE;
+void StatementTable::clear() {
+    entries_.clear();
+    std::fill(index_.begin(), index_.end(), empty);
+}
+
+size_t StatementTable::slot_of(uint32_t id) const {
+    size_t slot = home(id);
+    while(index_[slot] != empty && entries_[index_[slot]].id != id)
+        slot = (slot + 1) & mask_;
+    return slot;
+}
+
+void StatementTable::erase_slot(size_t slot) {
+    // shift later entries of the probe sequence back into the hole
+    index_[slot] = empty;
+    size_t hole = slot;
+    for(size_t i = (slot + 1) & mask_; index_[i] != empty; i = (i + 1) & mask_) {
+        const size_t h = home(entries_[index_[i]].id);
+        const bool movable = hole <= i ? (h <= hole || h > i) : (h <= hole && h > i);
+        if(movable) {
+            index_[hole] = index_[i];
+            index_[i] = empty;
+            hole = i;
         }
-            break;
-        case COM_STMT_PREPARE:
-            last_stmt_.assign(reinterpret_cast<char*>(const_cast<uint8_t*>(&data[offset])), header.payload_length - 1);
-            logger->log() << "Prepare statement: " << last_stmt_ << '\n';
-            current_state_ = State::PARSE_STMT_RESPONSE;
-            break;
-        case COM_STMT_SEND_LONG_DATA:
-            logger->log() << "COM_STMT_SEND_LONG_DATA\n";
-            current_state_ = State::PARSE_QUERY_RESPONSE;
-            break;
-        case COM_STMT_EXECUTE:
-        {
-            uint32_t stmt_id = read_u4(data+offset);
-            auto stmt = prepared_stmts[stmt_id];
-            offset += 5;
+    }
+}
 
-            logger->log() << "Execute prepared statement: " << stmt.first;
+void StatementTable::rehash(size_t slots) {
+    index_.assign(slots, empty);
+    mask_ = slots - 1;
+    shift_ = 32;
+    for(size_t n = slots; n > 1; n >>= 1)
+        shift_--;
 
-            if(stmt.second > 0) {
-                uint32_t bitmap = (stmt.second + 7) / 8;
-                offset += bitmap;
-                uint32_t bound_flag = data[offset];
-                if (bound_flag == 1) {
+    for(size_t i = 0; i < entries_.size(); i++)
+        index_[slot_of(entries_[i].id)] = static_cast<uint32_t>(i);
+}
 
-                }
-            }
+void Parser::parse_client(const uint8_t *data, size_t size) {
+    capture(capture_log::parse_client, data, size);
+    if(metrics_)
+        metrics_->client_bytes.add(size);
+
+    if(opaque_)
+        return;
+
+    client_.feed(data, size,
+                 [this](uint8_t command, uint8_t sequence_id) { return client_bytes(command, sequence_id); },
+                 [this](const PacketAssembler::Packet &packet) { on_client_packet(packet); });
+}
+
+void Parser::parse_server(const uint8_t *data, size_t size) {
+    capture(capture_log::parse_server, data, size);
+    on_server_data(size);
+
+    if(opaque_)
+        return;
+
+    server_.feed(data, size,
+                 [this](uint8_t, uint8_t) { return response_.done() ? server_bytes() : std::max(server_bytes(), response_head); },
+                 [this](const PacketAssembler::Packet &packet) {
+                     on_server_packet(packet.payload, packet.size);
+                     on_response_packet(packet);
+                 });
+}
+
+void Parser::server_relayed(size_t size) {
+    if(capture_)
+        capture_->append(capture_session_, capture_log::server_relayed, static_cast<uint64_t>(size));
+    on_server_data(size);
+}
+
+void Parser::response_done(uint64_t rows) {
+    if(capture_)
+        capture_->append(capture_session_, capture_log::response_done, rows);
+    if(metrics_)
+        metrics_->rows.add(rows);
+    response_rows_ = rows;
+    finish_timing();
+}
+
+void Parser::on_response_packet(const PacketAssembler::Packet &packet) {
+    if(response_.done() || !response_.on_packet(packet))
+        return;
+
+    current_state_ = State::PARSE_QUERY;
+    if(metrics_) {
+        metrics_->rows.add(response_.rows());
+        response_rows_ = response_.rows();
+        // the chunk with the last packet may hold the start of another response
+        response_bytes_ = response_.bytes();
+        finish_timing();
+    }
+}
+
+void Parser::on_server_data(size_t size) {
+    if(!metrics_)
+        return;
+
+    metrics_->server_bytes.add(size);
+
+    if(!timing_)
+        return;
+
+    response_bytes_ += size;
+    last_server_data_ = clock::now();
+    if(first_byte_pending_) {
+        first_byte_pending_ = false;
+        first_byte_us_ = static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::microseconds>(last_server_data_ - command_start_).count());
+        metrics_->first_byte[timed_kind_].record(first_byte_us_);
+    }
+}
+
+void Parser::start_timing(uint8_t command) {
+    if(!ResponseTracker::has_response(command))
+        return;
+
+    switch(command) {
+    case COM_QUERY:
+        timed_kind_ = traffic_metrics::query;
+        break;
+    case COM_STMT_PREPARE:
+        timed_kind_ = traffic_metrics::prepare;
+        break;
+    case COM_STMT_EXECUTE:
+        timed_kind_ = traffic_metrics::execute;
+        break;
+    default:
+        timed_kind_ = traffic_metrics::other;
+        break;
+    }
+
+    timing_ = true;
+    first_byte_pending_ = true;
+    response_bytes_ = 0;
+    response_rows_ = 0;
+    response_error_ = false;
+    command_start_ = clock::now();
+}
+
+void Parser::finish_timing() {
+    if(!timing_)
+        return;
+    timing_ = false;
+
+    // no response at all, e.g. the connection went away
+    if(first_byte_pending_)
+        return;
+
+    const auto us = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(last_server_data_ - command_start_).count());
+    metrics_->response[timed_kind_].record(us);
+
+    if(digest_pending_) {
+        digest_pending_ = false;
+        metrics_->digests.record(digest_, digest_text_, first_byte_us_, us, response_rows_, response_bytes_,
+                                 response_error_);
+    }
+}
+
+void Parser::set_digest(const uint8_t *text, size_t size) {
+    // reused, the fingerprint is copied out of it
+    thread_local char buffer[digest::max_text + digest::slack];
+
+    const size_t length = digest::normalise(text, size, buffer);
+    digest_text_.assign(buffer, length);
+    digest_ = digest::hash(buffer, length);
+}
+
+void Parser::parse_server_head(const uint8_t *data, size_t size) {
+    capture(capture_log::parse_server_head, data, size);
+    if(opaque_ || size < header_size)
+        return;
+
+    const size_t length = read_u3(data);
+    on_server_packet(data + header_size, std::min(size - header_size, length));
+}
+
+size_t Parser::client_bytes(uint8_t command, uint8_t sequence_id) const {
+    // capabilities and user name of the handshake response
+    if(handshake_)
+        return login_fixed + max_user + 1;
 
-            current_state_ = State::PARSE_STMT_EXECUTE_RESPONSE;
-            logger->log() << '\n';
+    // anything but the first packet of a command, e.g. a LOAD DATA file
+    if(sequence_id != 0)
+        return 0;
+
+    // Packets split between reads are copied as far as this goes, so it is
+    // the longest prefix any consumer looks at.
+    switch(command) {
+    case COM_QUERY:
+        // pooled sessions route and pin by the whole statement, they hand
+        // it over in one piece and nothing is copied
+        if(classify_queries_)
+            return max_payload_length;
+        return statement_bytes();
+    case COM_STMT_PREPARE:
+        return statement_bytes();
+    case COM_STMT_EXECUTE:
+        // command, statement id for the fingerprint
+        return logger_->enabled() ? max_execute_log : 1 + 4;
+    case COM_STMT_CLOSE:
+    case COM_STMT_RESET:
+        // command, statement id
+        return 1 + 4;
+    case COM_STMT_SEND_LONG_DATA:
+        // command, statement id, parameter, the start of the data
+        return 1 + 4 + 2 + max_value_log;
+    default:
+        return 1;
+    }
+}
+
+size_t Parser::statement_bytes() const {
+    // the log cuts longer records, fingerprints are taken of the start
+    const size_t logged = logger_->enabled() ? logger_->max_record() : 0;
+    const size_t digested = metrics_ && metrics_->digests.enabled() ? max_digest_source : 0;
+    return std::max<size_t>(1, std::min<size_t>(std::max(logged, digested), max_payload_length));
+}
+
+size_t Parser::server_bytes() const {
+    if(handshake_)
+        return 2;
+
+    // status, statement id, columns and params count of COM_STMT_PREPARE_OK
+    if(awaiting_response_)
+        return 1 + 4 + 2 + 2;
+
+    return 0;
+}
+
+void Parser::on_client_packet(const PacketAssembler::Packet &packet) {
+    if(metrics_)
+        metrics_->client_packets.add();
+
+    if(handshake_) {
+        // The handshake response is the first client packet, later ones
+        // carry auth data. An SSLRequest is a truncated handshake response,
+        // TLS follows; with compression the packets get another framing.
+        // TLS the proxy terminates puts the response after the SSLRequest.
+        if(packet.sequence_id == (tls_ ? 2 : 1) && packet.size >= 4) {
+            const uint32_t capabilities = read_u4(packet.payload);
+            query_attributes_ = (capabilities & CLIENT_QUERY_ATTRIBUTES) != 0;
+            // clients only ask for what the server offered
+            response_.set_deprecate_eof((capabilities & CLIENT_DEPRECATE_EOF) != 0);
+            if((!tls_ && packet.length == 32 && (capabilities & CLIENT_SSL)) || (capabilities & CLIENT_COMPRESS))
+                opaque_ = true;
+            // a TLS login sends its user name encrypted
+            if((tls_ || !(capabilities & CLIENT_SSL)) && (capabilities & CLIENT_PROTOCOL_41) && packet.size > login_fixed) {
+                const char *name = reinterpret_cast<const char*>(packet.payload + login_fixed);
+                const size_t size = packet.size - login_fixed;
+                const void *end = std::memchr(name, 0, size);
+                user_.assign(name, end ? static_cast<const char*>(end) - name : size);
+            }
+            login_seen_ = true;
         }
-            break;
-        case COM_STMT_CLOSE:
-        {
-            uint32_t stmt_id = read_u4(data+offset);
-            auto stmt = prepared_stmts[stmt_id];
-            logger->log() << "Deallocate prepared statement: " << stmt.first << '\n';
-            prepared_stmts.erase(stmt_id);
+        return;
+    }
+
+    if(packet.sequence_id != 0 || packet.size == 0)
+        return;
+
+    const uint8_t *data = packet.payload;
+    const size_t size = packet.size;
+    // the part of a statement cut off by the limit
+    const char *more = packet.size < packet.length ? "..." : "";
+
+    current_state_ = State::PARSE_QUERY;
+    replica_read_ = false;
+    commands_++;
+    awaiting_response_ = data[0] != COM_STMT_CLOSE && data[0] != COM_STMT_SEND_LONG_DATA && data[0] != COM_QUIT;
+    command_ = data[0];
+    // a command sent before the last response ended restarts the tracking
+    response_.start(command_);
+
+    if(metrics_) {
+        metrics_->commands[command_].add();
+        finish_timing();
+        start_timing(command_);
+        digest_pending_ = false;
+    }
+
+    switch(data[0]) {
+    case COM_QUERY:
+    {
+        const std::string_view text(reinterpret_cast<const char*>(data + 1), size - 1);
+        logger_->log() << "Execute query: " << text << more << '\n';
+        current_state_ = State::PARSE_QUERY_RESPONSE;
+
+        if(classify_queries_) {
+            sql::classify(data + 1, size - 1, query_);
+            if(packet.size < packet.length)
+                query_.effects |= sql::truncated;
+            replica_read_ = query_.read_only();
         }
-            break;
+
+        if(metrics_ && metrics_->digests.enabled()) {
+            set_digest(data + 1, size - 1);
+            digest_pending_ = true;
         }
     }
         break;
-    case State::PARSE_QUERY_RESPONSE:
+    case COM_STMT_PREPARE:
+        last_stmt_.assign(reinterpret_cast<const char*>(data + 1), size - 1);
+        logger_->log() << "Prepare statement: " << last_stmt_ << more << '\n';
+        current_state_ = State::PARSE_STMT_RESPONSE;
+
+        // kept for the executions, preparing is not accounted to it
+        if(metrics_ && metrics_->digests.enabled())
+            set_digest(data + 1, size - 1);
         break;
-    case State::PARSE_STMT_RESPONSE:
+    case COM_STMT_SEND_LONG_DATA:
+        on_long_data(data, size, packet.length);
+        break;
+    case COM_STMT_RESET:
     {
+        if(size < 1 + 4)
+            break;
 
-        int status = data[offset++];
-        if (status == 0) // OK
-        {
-            uint32_t stmt_id = read_u4(data+offset);
-            offset += 4;
+        if(PreparedStatement *stmt = prepared_stmts.find(read_u4(data + 1))) {
+            for(auto &long_data : stmt->long_data)
+                long_data.sent = false;
+        }
+    }
+        break;
+    case COM_STMT_EXECUTE:
+    {
+        if(size < 1 + 4)
+            break;
 
-            uint32_t num_params = read_u2(data+offset+2);
+        const uint32_t stmt_id = read_u4(data + 1);
+        if(PreparedStatement *stmt = prepared_stmts.find(stmt_id)) {
+            log_execute(*stmt, data, size);
 
-            prepared_stmts.emplace(stmt_id, std::make_pair(last_stmt_, num_params));
+            if(metrics_ && metrics_->digests.enabled()) {
+                digest_ = stmt->digest;
+                digest_text_ = stmt->digest_text;
+                digest_pending_ = true;
+            }
         }
+        else
+            logger_->log() << "Execute unknown prepared statement " << stmt_id << '\n';
+
+        current_state_ = State::PARSE_STMT_EXECUTE_RESPONSE;
     }
         break;
-    case State::PARSE_STMT_EXECUTE_RESPONSE:
+    case COM_STMT_CLOSE:
+    {
+        if(size < 1 + 4)
+            break;
+
+        const uint32_t stmt_id = read_u4(data + 1);
+        if(PreparedStatement *stmt = prepared_stmts.find(stmt_id)) {
+            logger_->log() << "Deallocate prepared statement: " << stmt->text << '\n';
+            prepared_stmts.erase(stmt_id);
+        }
+    }
         break;
     }
+}
 
-    return true;
+void Parser::on_server_packet(const uint8_t *payload, size_t size) {
+    if(metrics_)
+        metrics_->server_packets.add();
+
+    if(handshake_) {
+        // greeting, then OK, ERR, auth switch or more auth data until the
+        // client is in; caching_sha2 fast auth 0x01 0x03 is followed by OK
+        if(handshake_packets_++ > 0 && size > 0) {
+            if(payload[0] == OK_PACKET || payload[0] == ERR_PACKET ||
+               (payload[0] == 0x01 && size > 1 && payload[1] == 0x03))
+                handshake_ = false;
+        }
+        return;
+    }
+
+    if(!awaiting_response_)
+        return;
+    awaiting_response_ = false;
+
+    if(metrics_ && size > 0 && payload[0] == ERR_PACKET) {
+        metrics_->errors[command_].add();
+        response_error_ = true;
+    }
+
+    if(current_state_ == State::PARSE_STMT_RESPONSE && size >= 1 + 4 + 2 + 2 && payload[0] == OK_PACKET) {
+        const uint32_t stmt_id = read_u4(payload + 1);
+        const uint32_t num_params = read_u2(payload + 1 + 4 + 2);
+
+        PreparedStatement stmt;
+        stmt.text = last_stmt_;
+        stmt.digest = digest_;
+        stmt.digest_text = digest_text_;
+        stmt.params = static_cast<uint16_t>(num_params);
+        prepared_stmts.insert(stmt_id, std::move(stmt));
+    }
+}
+
+void Parser::on_long_data(const uint8_t *data, size_t size, size_t length) {
+    // command, statement id, parameter, data
+    if(size < 1 + 4 + 2)
+        return;
+
+    PreparedStatement *stmt = prepared_stmts.find(read_u4(data + 1));
+    const uint16_t param = static_cast<uint16_t>(read_u2(data + 1 + 4));
+    if(!stmt || param >= stmt->params)
+        return;
+
+    auto &long_data = stmt->long_data;
+    if(long_data.size() <= param)
+        long_data.resize(stmt->params);
+
+    // chunks add up until the next execute
+    auto &value = long_data[param];
+    if(!value.sent) {
+        value.sent = true;
+        value.length = 0;
+        value.head.clear();
+    }
+
+    const size_t header = 1 + 4 + 2;
+    value.length += length - header;
+    if(value.head.size() < max_value_log)
+        value.head.append(reinterpret_cast<const char*>(data + header),
+                          std::min(size - header, max_value_log - value.head.size()));
 }
 
-PacketHeader Parser::read_header(const uint8_t *data, size_t size)
-{
-    PacketHeader header;
-    header.payload_length = read_u3(data);
-    header.sequence_id = data[3];
-    return header;
+void Parser::log_execute(PreparedStatement &stmt, const uint8_t *data, size_t size) {
+    if(!logger_->enabled())
+        return;
+
+    // reused, the I/O thread doesn't allocate once it has grown
+    thread_local std::string record;
+    RecordWriter w(record);
+
+    const size_t text_size = std::min(stmt.text.size(), max_text_log);
+    w.put<uint32_t>(static_cast<uint32_t>(text_size));
+    w.put<uint32_t>(static_cast<uint32_t>(stmt.text.size()));
+    w.bytes(stmt.text.data(), text_size);
+
+    // command, statement id, flags, iteration count
+    size_t offset = 1 + 4 + 1 + 4;
+    size_t count = stmt.params;
+
+    if(query_attributes_ && size > 5 && (count > 0 || (data[5] & PARAMETER_COUNT_AVAILABLE))) {
+        uint64_t n = 0;
+        const size_t k = offset < size ? read_lenenc(data + offset, size - offset, n) : 0;
+        offset += k;
+        // the count is the client's, a packet which claims more is not
+        // followed any further
+        count = k && n <= stmt.params + max_query_attributes ? static_cast<size_t>(n) : 0;
+    }
+
+    w.put<uint32_t>(static_cast<uint32_t>(count));
+    const size_t recorded_at = w.position();
+    w.put<uint32_t>(0);
+    uint32_t recorded = 0;
+
+    const size_t bitmap = (count + 7) / 8;
+    if(count > 0 && offset + bitmap + 1 <= size) {
+        const uint8_t *nulls = data + offset;
+        offset += bitmap;
+
+        // new parameters bound: a type per parameter, with query
+        // attributes followed by its name
+        if(data[offset++] == 1) {
+            stmt.types.resize(count);
+            size_t bound = 0;
+            while(bound < count && offset + 2 <= size) {
+                const uint16_t type = static_cast<uint16_t>(read_u2(data + offset));
+                size_t next = offset + 2;
+                if(query_attributes_) {
+                    uint64_t n = 0;
+                    const size_t k = read_lenenc(data + next, size - next, n);
+                    if(k == 0 || n > size - next - k)
+                        break;
+                    next += k + static_cast<size_t>(n);
+                }
+                stmt.types[bound++] = type;
+                offset = next;
+            }
+            // the types were cut short, the old ones are no longer bound
+            // and the new ones unknown; values are logged again after the
+            // next complete list
+            if(bound < count)
+                stmt.types.clear();
+        }
+
+        const size_t logged = std::min(count, max_params_log);
+        for(size_t i = 0; i < logged && stmt.types.size() >= count; i++) {
+            const uint16_t type = stmt.types[i];
+
+            if(nulls[i / 8] & (1 << (i % 8))) {
+                w.put<uint16_t>(type);
+                w.put<uint8_t>(NULL_VALUE);
+                w.put<uint32_t>(0);
+                w.put<uint32_t>(0);
+            }
+            else if(i < stmt.long_data.size() && stmt.long_data[i].sent) {
+                // the value came with COM_STMT_SEND_LONG_DATA, not here
+                const auto &value = stmt.long_data[i];
+                w.put<uint16_t>(type);
+                w.put<uint8_t>(LONG_DATA);
+                w.put<uint32_t>(static_cast<uint32_t>(value.length));
+                w.put<uint32_t>(static_cast<uint32_t>(value.head.size()));
+                w.bytes(value.head.data(), value.head.size());
+            }
+            else {
+                size_t prefix = 0, length = 0;
+                if(offset > size || !binary_value(static_cast<uint8_t>(type), data + offset, size - offset, prefix, length))
+                    break;
+
+                // a value the packet was cut in goes into the log with
+                // its start, the ones after it are left out
+                const size_t available = size - offset - prefix;
+                const size_t kept = std::min({length, available, max_value_log});
+                w.put<uint16_t>(type);
+                w.put<uint8_t>(VALUE);
+                w.put<uint32_t>(static_cast<uint32_t>(length));
+                w.put<uint32_t>(static_cast<uint32_t>(kept));
+                w.bytes(data + offset + prefix, kept);
+                if(length > available) {
+                    recorded++;
+                    break;
+                }
+                offset += prefix + length;
+            }
+            recorded++;
+        }
+    }
+
+    // long data is used up by the execute
+    for(auto &value : stmt.long_data)
+        value.sent = false;
+
+    w.patch(recorded_at, recorded);
+    logger_->write_deferred(format_execute, record.data(), record.size());
+}
+
+size_t Parser::peek_size() const {
+    if(opaque_)
+        return 0;
+
+    if(handshake_)
+        return header_size + server_bytes();
+
+    if(current_state_ == State::PARSE_STMT_RESPONSE && awaiting_response_)
+        return header_size + server_bytes();
+
+    // whether the response is an error
+    if(metrics_ && awaiting_response_)
+        return header_size + 1;
+
+    return 0;
 }
 
 } // namespace My
@@ -1,10 +1,18 @@
 #pragma once
 
+#include <chrono>
 #include <cstdint>
 #include <vector>
-#include <unordered_map>
 #include <tuple>
 #include <queue>
+#include <string>
+#include <string_view>
+
+#include "capture.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "protocol.hpp"
+#include "sql.hpp"
 
 namespace db_proxy {
 
@@ -45,6 +53,9 @@ namespace My {
         COM_RESET_CONNECTION    = 0x1f
     };
 
+    // "COM_QUERY" etc., nullptr for an unknown command
+    const char *command_name(uint8_t command);
+
     enum BINARY_FIELD_TYPES {
         MYSQL_TYPE_DECIMAL      = 0x00,
         MYSQL_TYPE_TINY         = 0x01,
@@ -79,9 +90,59 @@ namespace My {
         MYSQL_TYPE_GEOMETRY     = 0xff
     };
 
-    struct PacketHeader {
-        uint32_t payload_length = 0;
-        uint8_t sequence_id = 0;
+    struct PreparedStatement {
+        struct LongData {
+            bool sent = false;
+            size_t length = 0;
+            // only the start is kept for the log
+            std::string head;
+        };
+
+        std::string text;
+        // fingerprint the executions are accounted to
+        uint64_t digest = 0;
+        std::string digest_text;
+        uint16_t params = 0;
+        // parameter types of the last execute, later ones may not resend them
+        std::vector<uint16_t> types;
+        // COM_STMT_SEND_LONG_DATA of the next execute, per parameter
+        std::vector<LongData> long_data;
+    };
+
+    // Prepared statements of a session by id: open addressing with linear
+    // probing over positions in a dense array, like digest_table. A lookup
+    // is a multiply and mostly a single probe, closing a statement moves
+    // the last one into its place instead of freeing a node.
+    class StatementTable {
+    public:
+        // nullptr - no such statement
+        PreparedStatement *find(uint32_t id);
+        // replaces a statement of the same id
+        void insert(uint32_t id, PreparedStatement &&stmt);
+        void erase(uint32_t id);
+        void clear();
+        size_t size() const { return entries_.size(); }
+
+    private:
+        struct Entry {
+            uint32_t id;
+            PreparedStatement stmt;
+        };
+
+        static constexpr uint32_t empty = UINT32_MAX;
+
+        // Fibonacci hashing, ids a server hands out are mostly consecutive
+        size_t home(uint32_t id) const { return static_cast<uint32_t>(id * 2654435769u) >> shift_; }
+        // slot of the index where id is or would be
+        size_t slot_of(uint32_t id) const;
+        void erase_slot(size_t slot);
+        void rehash(size_t slots);
+
+        std::vector<Entry> entries_;
+        // positions in entries_, at most half full
+        std::vector<uint32_t> index_;
+        size_t mask_ = 0;
+        unsigned shift_ = 32;
     };
 
     struct Parser {
@@ -94,10 +155,109 @@ namespace My {
 
         ~Parser();
 
-        bool parse(const uint8_t *data, size_t size);
+        // Feed the bytes of either direction as they arrive, in chunks of
+        // any size. Packets may be split between chunks or share one.
+        void parse_client(const uint8_t *data, size_t size);
+        void parse_server(const uint8_t *data, size_t size);
+
+        // First bytes of a server packet, header included, for relays
+        // whose server bytes otherwise bypass the parser. peek_size() says
+        // how many it needs.
+        void parse_server_head(const uint8_t *data, size_t size);
+
+        // Bytes from the start of the next server chunk the parser has to
+        // see. 0 - the chunk can be relayed without being read at all.
+        size_t peek_size() const;
+
+        // The proxy answered the handshake itself, the first packet seen is
+        // already a command.
+        void skip_handshake() {
+            capture(capture_log::skip_handshake, nullptr, 0);
+            handshake_ = false;
+        }
+
+        // The proxy terminates the TLS the client just asked for, the
+        // handshake response follows in the clear with sequence id 2.
+        void tls_terminated() {
+            capture(capture_log::tls_terminated, nullptr, 0);
+            tls_ = true;
+            opaque_ = false;
+            login_seen_ = false;
+        }
+
+        // The server accepted or refused the login, the client sends
+        // nothing but commands from now on.
+        bool handshake_done() const { return !handshake_; }
+
+        // The handshake response went by, user() won't change any more.
+        bool login_seen() const { return login_seen_; }
+
+        // User name of the handshake response, empty before it and for
+        // TLS logins the proxy does not terminate.
+        const std::string &user() const { return user_; }
+
+        // Commands the client sent so far, for noticing new ones.
+        uint64_t commands() const { return commands_; }
+
+        // The server has not answered the last command completely yet.
+        // Only packets fed to parse_server() end a response.
+        bool response_pending() const { return !response_.done(); }
+
+        // statements prepared and not yet closed
+        size_t prepared_statements() const { return prepared_stmts.size(); }
+
+        // Counters of the session's shard, nullptr - nothing is measured.
+        void set_metrics(traffic_metrics *metrics) { metrics_ = metrics; }
+
+        // Server bytes a relay passes on without parse_server(), e.g.
+        // spliced ones, for traffic and latency accounting.
+        void server_relayed(size_t size);
+
+        // Records the calls feeding the parser as a session of capture from
+        // now on, for db-proxy-replay. nullptr - nothing is captured.
+        void set_capture(capture_log *capture);
+
+        // Classify every COM_QUERY for query() and replica_read().
+        void classify_queries() {
+            capture(capture_log::classify_queries, nullptr, 0);
+            classify_queries_ = true;
+        }
+
+        // The last COM_QUERY as classify_queries() saw it. A statement
+        // longer than the parser looks at is classified by its start and
+        // has sql::truncated set.
+        const sql::classification &query() const { return query_; }
+
+        // The last command is a single SELECT which neither locks rows nor
+        // writes (FOR UPDATE, FOR SHARE, LOCK IN SHARE MODE, INTO), so a
+        // replica can answer it. Only set with classify_queries().
+        bool replica_read() const { return replica_read_; }
+
+        // The relay saw the last packet of the response, which had rows in
+        // its result sets. Server bytes fed to parse_server() are followed
+        // packet by packet instead; for relays that do neither the
+        // response is taken to end with the last server bytes before the
+        // next command.
+        void response_done(uint64_t rows);
 
     private:
-        PacketHeader read_header(const uint8_t *data, size_t size);
+        void capture(capture_log::record_type type, const void *data, size_t size) {
+            if(capture_)
+                capture_->append(capture_session_, type, data, size);
+        }
+        void on_client_packet(const PacketAssembler::Packet &packet);
+        void on_server_packet(const uint8_t *payload, size_t size);
+        void on_response_packet(const PacketAssembler::Packet &packet);
+        // how many payload bytes of a client packet the parser looks at
+        size_t client_bytes(uint8_t command, uint8_t sequence_id) const;
+        size_t statement_bytes() const;
+        size_t server_bytes() const;
+        void on_long_data(const uint8_t *data, size_t size, size_t length);
+        void log_execute(PreparedStatement &stmt, const uint8_t *data, size_t size);
+        void on_server_data(size_t size);
+        void start_timing(uint8_t command);
+        void finish_timing();
+        void set_digest(const uint8_t *text, size_t size);
 
         // read 2-bytes integer
         inline uint32_t read_u2(const uint8_t *data)
@@ -121,10 +281,54 @@ namespace My {
                     (static_cast<uint32_t>(data[3]) << 24);
         }
 
-        std::unordered_map<uint32_t, std::pair<std::string, uint16_t>> prepared_stmts;
+        // looked up once, the registry lookup takes a global lock
+        LoggerPtr logger_ = LoggerRegistry::instance().get("logger");
+        StatementTable prepared_stmts;
         std::string last_stmt_;
-        size_t packets_ = 0;
-        State current_state_;
+        State current_state_ = State::PARSE_QUERY;
+        PacketAssembler client_;
+        PacketAssembler server_;
+        // server packets seen during the handshake
+        size_t handshake_packets_ = 0;
+        bool handshake_ = true;
+        bool login_seen_ = false;
+        std::string user_;
+        uint64_t commands_ = 0;
+        // COM_STMT_EXECUTE carries named parameters after the statement's
+        bool query_attributes_ = false;
+        // TLS or compression, packets can't be followed any more
+        bool opaque_ = false;
+        // the proxy decrypts the client's TLS, see tls_terminated()
+        bool tls_ = false;
+        // the first packet of a response is still to come
+        bool awaiting_response_ = false;
+        // where the response to the current command ends
+        ResponseTracker response_;
+        bool classify_queries_ = false;
+        bool replica_read_ = false;
+        sql::classification query_;
+
+        using clock = std::chrono::steady_clock;
+
+        traffic_metrics *metrics_ = nullptr;
+        // the command being timed, its latency kind and progress
+        uint8_t command_ = 0;
+        traffic_metrics::kind timed_kind_ = traffic_metrics::other;
+        bool timing_ = false;
+        bool first_byte_pending_ = false;
+        clock::time_point command_start_;
+        clock::time_point last_server_data_;
+        uint64_t first_byte_us_ = 0;
+        uint64_t response_bytes_ = 0;
+        uint64_t response_rows_ = 0;
+        bool response_error_ = false;
+        // fingerprint of the command, recorded with its latency if pending
+        uint64_t digest_ = 0;
+        std::string digest_text_;
+        bool digest_pending_ = false;
+
+        capture_log *capture_ = nullptr;
+        uint64_t capture_session_ = 0;
     };
 
 } // namespace My
@@ -0,0 +1,579 @@
+#include <benchmark/benchmark.h>
+
+#include "capture.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "parser.hpp"
+#include "protocol.hpp"
+#include "sql.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Every allocation of the process is counted, the hot paths are supposed
+// to make none once they have warmed up.
+namespace
+{
+    std::atomic<uint64_t> allocations{0};
+}
+
+// None of them is inlined into the callers, where gcc would pair malloc
+// and free with new and delete and warn about the mismatch.
+#if defined(__GNUC__)
+#define DB_PROXY_NOINLINE __attribute__((noinline))
+#else
+#define DB_PROXY_NOINLINE
+#endif
+
+DB_PROXY_NOINLINE void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+DB_PROXY_NOINLINE void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+DB_PROXY_NOINLINE void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace db_proxy
+{
+    namespace
+    {
+        using bytes = std::vector<uint8_t>;
+
+        // Logger which formats everything and writes it nowhere.
+        class discard_logger : public Logger
+        {
+            NullStream null_;
+        public:
+            discard_logger() : Logger(null_) {}
+
+            void write(const char*, size_t size) override
+            {
+                written += size;
+            }
+
+            uint64_t written = 0;
+        };
+
+        // Parsers take the logger registered when they are created.
+        void use_logger(bool enabled)
+        {
+            if (enabled)
+                LoggerRegistry::instance().register_logger("logger", std::make_shared<discard_logger>());
+            else
+                LoggerRegistry::instance().create_null("logger");
+        }
+
+        // Reports allocations per iteration of the measured loop.
+        class allocation_counter
+        {
+        public:
+            explicit allocation_counter(benchmark::State& state)
+                : state_(state), start_(allocations.load(std::memory_order_relaxed))
+            {
+            }
+            ~allocation_counter()
+            {
+                state_.counters["allocs"] = benchmark::Counter(
+                        static_cast<double>(allocations.load(std::memory_order_relaxed) - start_),
+                        benchmark::Counter::kAvgIterations);
+            }
+        private:
+            benchmark::State& state_;
+            uint64_t start_;
+        };
+
+        bytes command(uint8_t cmd, const std::string& argument)
+        {
+            bytes out;
+            out.reserve(My::header_size + 1 + argument.size());
+            My::PacketWriter w(out);
+            w.begin(0);
+            w.int_n<1>(cmd);
+            w.string(argument);
+            w.finish();
+            return out;
+        }
+
+        bytes execute(uint32_t stmt_id, uint32_t value)
+        {
+            bytes out;
+            My::PacketWriter w(out);
+            w.begin(0);
+            w.int_n<1>(My::COM_STMT_EXECUTE);
+            w.int_n<4>(stmt_id);
+            // no cursor, one iteration, no NULLs, types bound, one LONG
+            w.int_n<1>(0);
+            w.int_n<4>(1);
+            w.int_n<1>(0);
+            w.int_n<1>(1);
+            w.int_n<2>(My::MYSQL_TYPE_LONG);
+            w.int_n<4>(value);
+            w.finish();
+            return out;
+        }
+
+        bytes prepare_ok(uint32_t stmt_id, uint16_t params)
+        {
+            bytes out;
+            My::PacketWriter w(out);
+            w.begin(1);
+            w.int_n<1>(My::OK_PACKET);
+            w.int_n<4>(stmt_id);
+            w.int_n<2>(0);
+            w.int_n<2>(params);
+            w.zeros(3);
+            w.finish();
+            // a parameter definition and its EOF
+            for (uint16_t i = 0; i < params; i++)
+            {
+                w.begin(static_cast<uint8_t>(2 + i));
+                w.lenenc(3);
+                w.string("def");
+                w.zeros(6);
+                w.int_n<1>(0x0c);
+                w.zeros(12);
+                w.finish();
+            }
+            if (params > 0)
+            {
+                w.begin(static_cast<uint8_t>(2 + params));
+                w.int_n<1>(My::EOF_PACKET);
+                w.zeros(4);
+                w.finish();
+            }
+            return out;
+        }
+
+        bytes ok(uint8_t sequence_id = 1)
+        {
+            bytes out;
+            My::write_ok(out, sequence_id, My::SERVER_STATUS_AUTOCOMMIT);
+            return out;
+        }
+
+        // one VARCHAR column, EOF framing
+        bytes result_set(size_t rows, size_t row_size)
+        {
+            bytes out;
+            My::PacketWriter w(out);
+            uint8_t sequence_id = 1;
+
+            w.begin(sequence_id++);
+            w.lenenc(1);
+            w.finish();
+
+            w.begin(sequence_id++);
+            w.lenenc(3);
+            w.string("def");
+            w.lenenc(0);
+            w.lenenc(0);
+            w.lenenc(0);
+            w.lenenc(1);
+            w.string("c");
+            w.lenenc(0);
+            w.lenenc(0x0c);
+            w.int_n<2>(33);
+            w.int_n<4>(static_cast<uint32_t>(row_size * 3));
+            w.int_n<1>(My::MYSQL_TYPE_VAR_STRING);
+            w.int_n<2>(0);
+            w.int_n<1>(0);
+            w.zeros(2);
+            w.finish();
+
+            const auto eof = [&]
+            {
+                w.begin(sequence_id++);
+                w.int_n<1>(My::EOF_PACKET);
+                w.int_n<2>(0);
+                w.int_n<2>(My::SERVER_STATUS_AUTOCOMMIT);
+                w.finish();
+            };
+            eof();
+
+            const std::string row(row_size, 'x');
+            for (size_t i = 0; i < rows; i++)
+            {
+                w.begin(sequence_id++);
+                w.lenenc(row.size());
+                w.string(row);
+                w.finish();
+            }
+            eof();
+            return out;
+        }
+
+        struct exchange
+        {
+            bytes request;
+            bytes response;
+        };
+
+        // sysbench oltp_read_write transactions with their responses
+        const std::vector<exchange>& oltp_corpus()
+        {
+            static const std::vector<exchange> corpus = []
+            {
+                std::vector<exchange> c;
+                std::minstd_rand random(42);
+                std::uniform_int_distribution<int> id(1, 1000000);
+                const auto row = result_set(1, 120);
+                const auto range = result_set(100, 120);
+
+                for (int t = 0; t < 64; t++)
+                {
+                    c.push_back({command(My::COM_QUERY, "BEGIN"), ok()});
+                    for (int i = 0; i < 10; i++)
+                        c.push_back({command(My::COM_QUERY, "SELECT c FROM sbtest1 WHERE id=" + std::to_string(id(random))), row});
+                    const int from = id(random);
+                    c.push_back({command(My::COM_QUERY, "SELECT c FROM sbtest1 WHERE id BETWEEN " + std::to_string(from) +
+                                                        " AND " + std::to_string(from + 99) + " ORDER BY c"), range});
+                    c.push_back({command(My::COM_QUERY, "UPDATE sbtest1 SET k=k+1 WHERE id=" + std::to_string(id(random))), ok()});
+                    c.push_back({command(My::COM_QUERY, "COMMIT"), ok()});
+                }
+                return c;
+            }();
+            return corpus;
+        }
+
+        uint64_t corpus_bytes(const std::vector<exchange>& corpus)
+        {
+            uint64_t n = 0;
+            for (const auto& e : corpus)
+                n += e.request.size() + e.response.size();
+            return n;
+        }
+
+        // the bytes in reads of this size, as a relay gets them
+        template<typename F>
+        void chunked(const bytes& data, size_t chunk, F&& f)
+        {
+            for (size_t offset = 0; offset < data.size(); offset += chunk)
+                f(data.data() + offset, std::min(chunk, data.size() - offset));
+        }
+    }
+
+    // Packet boundaries of a large result set read in 16KB chunks.
+    void BM_PacketFramer(benchmark::State& state)
+    {
+        const auto data = result_set(10000, static_cast<size_t>(state.range(0)));
+        My::PacketFramer framer;
+        uint64_t packets = 0;
+
+        allocation_counter allocs(state);
+        for (auto _ : state)
+        {
+            chunked(data, 16 * 1024, [&](const uint8_t* p, size_t n)
+            {
+                framer.feed(p, n, [&](const My::PacketFramer::Packet&) { packets++; });
+            });
+        }
+        benchmark::DoNotOptimize(packets);
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * data.size()));
+    }
+    BENCHMARK(BM_PacketFramer)->Arg(16)->Arg(200)->Arg(4096);
+
+    // The same with the first bytes of every packet assembled, as the
+    // parser reads responses.
+    void BM_PacketAssembler(benchmark::State& state)
+    {
+        const auto data = result_set(10000, static_cast<size_t>(state.range(0)));
+        My::PacketAssembler assembler;
+        uint64_t packets = 0;
+
+        allocation_counter allocs(state);
+        for (auto _ : state)
+        {
+            chunked(data, 16 * 1024, [&](const uint8_t* p, size_t n)
+            {
+                assembler.feed(p, n,
+                               [](uint8_t, uint8_t) { return size_t(22); },
+                               [&](const My::PacketAssembler::Packet&) { packets++; });
+            });
+        }
+        benchmark::DoNotOptimize(packets);
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * data.size()));
+    }
+    BENCHMARK(BM_PacketAssembler)->Arg(16)->Arg(200)->Arg(4096);
+
+    // Command dispatch and response tracking of OLTP traffic.
+    // Args: logging, metrics and digests.
+    void BM_ParseOltp(benchmark::State& state)
+    {
+        const auto& corpus = oltp_corpus();
+        use_logger(state.range(0) != 0);
+        traffic_metrics metrics;
+        metrics.digests.set_capacity(1000);
+
+        My::Parser parser;
+        parser.skip_handshake();
+        if (state.range(1))
+            parser.set_metrics(&metrics);
+
+        // warmed up, buffers have their size
+        for (const auto& e : corpus)
+        {
+            parser.parse_client(e.request.data(), e.request.size());
+            parser.parse_server(e.response.data(), e.response.size());
+        }
+
+        allocation_counter allocs(state);
+        for (auto _ : state)
+        {
+            for (const auto& e : corpus)
+            {
+                parser.parse_client(e.request.data(), e.request.size());
+                parser.parse_server(e.response.data(), e.response.size());
+            }
+        }
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * corpus_bytes(corpus)));
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * corpus.size()));
+    }
+    BENCHMARK(BM_ParseOltp)->Args({0, 0})->Args({1, 0})->Args({0, 1})->Args({1, 1});
+
+    // COM_STMT_EXECUTE among range(0) prepared statements: the statement
+    // lookup and, with range(1), the parameter log record and its formatting.
+    void BM_StmtExecute(benchmark::State& state)
+    {
+        const uint32_t statements = static_cast<uint32_t>(state.range(0));
+        use_logger(state.range(1) != 0);
+
+        My::Parser parser;
+        parser.skip_handshake();
+
+        const auto prepare = command(My::COM_STMT_PREPARE, "SELECT c FROM sbtest1 WHERE id=?");
+        // ids as a server hands them out, some closed in between
+        std::vector<uint32_t> ids;
+        for (uint32_t i = 0; ids.size() < statements; i++)
+        {
+            const uint32_t id = 1 + i * 3;
+            const auto response = prepare_ok(id, 1);
+            parser.parse_client(prepare.data(), prepare.size());
+            parser.parse_server(response.data(), response.size());
+            ids.push_back(id);
+        }
+
+        std::minstd_rand random(42);
+        std::vector<bytes> requests;
+        for (size_t i = 0; i < 1024; i++)
+            requests.push_back(execute(ids[random() % ids.size()], static_cast<uint32_t>(random())));
+        const auto response = result_set(1, 120);
+
+        for (const auto& r : requests)
+        {
+            parser.parse_client(r.data(), r.size());
+            parser.parse_server(response.data(), response.size());
+        }
+
+        allocation_counter allocs(state);
+        for (auto _ : state)
+        {
+            for (const auto& r : requests)
+            {
+                parser.parse_client(r.data(), r.size());
+                parser.parse_server(response.data(), response.size());
+            }
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * requests.size()));
+    }
+    BENCHMARK(BM_StmtExecute)->Args({8, 0})->Args({64, 0})->Args({1024, 0})->Args({8, 1});
+
+    // Prepare and close, the statement table's insert and erase.
+    void BM_StmtPrepareClose(benchmark::State& state)
+    {
+        use_logger(false);
+
+        My::Parser parser;
+        parser.skip_handshake();
+
+        const auto prepare = command(My::COM_STMT_PREPARE, "SELECT c FROM sbtest1 WHERE id=?");
+        // a few statements stay open all the time
+        uint32_t id = 1;
+        for (; id <= 16; id++)
+        {
+            const auto response = prepare_ok(id, 1);
+            parser.parse_client(prepare.data(), prepare.size());
+            parser.parse_server(response.data(), response.size());
+        }
+
+        allocation_counter allocs(state);
+        for (auto _ : state)
+        {
+            state.PauseTiming();
+            const auto response = prepare_ok(id, 1);
+            bytes close;
+            My::PacketWriter w(close);
+            w.begin(0);
+            w.int_n<1>(My::COM_STMT_CLOSE);
+            w.int_n<4>(id++);
+            w.finish();
+            state.ResumeTiming();
+
+            parser.parse_client(prepare.data(), prepare.size());
+            parser.parse_server(response.data(), response.size());
+            parser.parse_client(close.data(), close.size());
+        }
+    }
+    BENCHMARK(BM_StmtPrepareClose);
+
+    // Statement classification as the pooled mode does it for every
+    // COM_QUERY. Arg: 0 - application statements of a few dozen bytes,
+    // 1 - multi-row INSERTs of long strings, as bulk loads send them.
+    void BM_Classify(benchmark::State& state)
+    {
+        std::minstd_rand random(42);
+        std::vector<std::string> queries;
+        if (state.range(0) == 0)
+        {
+            for (int i = 0; i < 64; i++)
+            {
+                const std::string id = std::to_string(random() % 1000000);
+                queries.push_back("SELECT c FROM sbtest1 WHERE id=" + id);
+                queries.push_back("SELECT c FROM sbtest1 WHERE id BETWEEN " + id + " AND " + id + "+99 ORDER BY c");
+                queries.push_back("/* app:orders */ SELECT o.id, o.total, c.name FROM `shop`.`orders` o "
+                                  "JOIN customers c ON c.id = o.customer_id WHERE o.id IN (" + id + ", 2, 3)");
+                queries.push_back("UPDATE sbtest1 SET k=k+1 WHERE id=" + id);
+                queries.push_back("INSERT INTO sbtest1 (id, k, c, pad) VALUES (" + id + ", 1, 'x-" + id + "', 'y')");
+                queries.push_back("SELECT * FROM sbtest1 WHERE id = " + id + " FOR UPDATE");
+                queries.push_back("SET autocommit=1");
+                queries.push_back("COMMIT");
+            }
+        }
+        else
+        {
+            for (int q = 0; q < 16; q++)
+            {
+                std::string text = "INSERT INTO sbtest1 (id, k, c, pad) VALUES ";
+                for (int row = 0; row < 500; row++)
+                {
+                    text += row ? ",(" : "(";
+                    text += std::to_string(random()) + ", " + std::to_string(random() % 1000000) + ", '";
+                    text += std::string(120, static_cast<char>('a' + random() % 26)) + "', '";
+                    text += std::string(60, static_cast<char>('a' + random() % 26)) + "')";
+                }
+                queries.push_back(std::move(text));
+            }
+        }
+
+        uint64_t bytes = 0;
+        for (const auto& q : queries)
+            bytes += q.size();
+
+        sql::classification c;
+        uint64_t read_only = 0;
+
+        allocation_counter allocs(state);
+        for (auto _ : state)
+        {
+            for (const auto& q : queries)
+            {
+                sql::classify(reinterpret_cast<const uint8_t*>(q.data()), q.size(), c);
+                read_only += c.read_only();
+            }
+        }
+        benchmark::DoNotOptimize(read_only);
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * bytes));
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * queries.size()));
+    }
+    BENCHMARK(BM_Classify)->Arg(0)->Arg(1);
+
+    // One query log record, formatted and handed to the logger.
+    void BM_LogQuery(benchmark::State& state)
+    {
+        discard_logger logger;
+        const std::string query(static_cast<size_t>(state.range(0)), 'q');
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(query.data());
+
+        allocation_counter allocs(state);
+        for (auto _ : state)
+        {
+            // what the parser has at hand, the bytes of the packet
+            const std::string_view text(reinterpret_cast<const char*>(data), query.size());
+            logger.log() << "Execute query: " << text << "" << '\n';
+        }
+        benchmark::DoNotOptimize(logger.written);
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * query.size()));
+    }
+    BENCHMARK(BM_LogQuery)->Arg(64)->Arg(1024);
+
+    // Everything of a capture of db-proxy --capture, set by
+    // DB_PROXY_BENCH_CAPTURE.
+    void BM_Replay(benchmark::State& state, const std::string& path)
+    {
+        use_logger(false);
+        capture_reader reader(path);
+        uint64_t bytes = 0;
+
+        allocation_counter allocs(state);
+        for (auto _ : state)
+        {
+            std::unordered_map<uint64_t, std::unique_ptr<My::Parser>> parsers;
+
+            reader.reset();
+            capture_reader::record r;
+            while (reader.next(r))
+            {
+                if (r.type == capture_log::session_open)
+                {
+                    parsers[r.session].reset(new My::Parser);
+                    continue;
+                }
+                auto it = parsers.find(r.session);
+                if (it == parsers.end())
+                    continue;
+                My::Parser* parser = it->second.get();
+                if (r.type == capture_log::session_close)
+                {
+                    parsers.erase(it);
+                    continue;
+                }
+
+                uint64_t value = 0;
+                std::memcpy(&value, r.data, std::min(r.size, sizeof(value)));
+                switch (r.type)
+                {
+                case capture_log::parse_client: parser->parse_client(r.data, r.size); bytes += r.size; break;
+                case capture_log::parse_server: parser->parse_server(r.data, r.size); bytes += r.size; break;
+                case capture_log::parse_server_head: parser->parse_server_head(r.data, r.size); bytes += r.size; break;
+                case capture_log::server_relayed: parser->server_relayed(static_cast<size_t>(value)); break;
+                case capture_log::response_done: parser->response_done(value); break;
+                case capture_log::skip_handshake: parser->skip_handshake(); break;
+                case capture_log::classify_queries: parser->classify_queries(); break;
+                case capture_log::tls_terminated: parser->tls_terminated(); break;
+                default: break;
+                }
+            }
+        }
+        state.SetBytesProcessed(static_cast<int64_t>(bytes));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (const char* path = std::getenv("DB_PROXY_BENCH_CAPTURE"))
+        benchmark::RegisterBenchmark("BM_Replay", db_proxy::BM_Replay, std::string(path));
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
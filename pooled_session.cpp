@@ -0,0 +1,1109 @@
+#include "pooled_session.hpp"
+
+#include <atomic>
+#include <cstring>
+#include <string>
+
+namespace db_proxy
+{
+    namespace
+    {
+        const char native_password[] = "mysql_native_password";
+
+        const uint32_t server_capabilities =
+                My::CLIENT_LONG_PASSWORD | My::CLIENT_LONG_FLAG | My::CLIENT_CONNECT_WITH_DB |
+                My::CLIENT_PROTOCOL_41 | My::CLIENT_TRANSACTIONS | My::CLIENT_SECURE_CONNECTION |
+                My::CLIENT_MULTI_STATEMENTS | My::CLIENT_MULTI_RESULTS | My::CLIENT_PS_MULTI_RESULTS |
+                My::CLIENT_PLUGIN_AUTH | My::CLIENT_CONNECT_ATTRS |
+                My::CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA;
+
+        // 16KB buffers for relaying responses
+        const size_t relay_size_class = 2;
+
+        enum { read_chunk = 4096 };
+
+        enum ErrorCode : uint16_t {
+            ER_CON_COUNT_ERROR    = 1040,
+            ER_ACCESS_DENIED      = 1045,
+            ER_UNKNOWN_ERROR      = 1105,
+            ER_NOT_SUPPORTED_YET  = 1235,
+            ER_UNKNOWN_STMT       = 1243
+        };
+
+        // COM_STMT_EXECUTE flags
+        const uint8_t cursor_type_read_only = 0x01;
+
+        std::atomic<uint32_t> next_connection_id{1};
+
+        // Sequential reader over a received packet payload.
+        struct payload_reader
+        {
+            const uint8_t* data;
+            size_t size;
+            size_t offset;
+
+            bool has(size_t n) const { return offset + n <= size; }
+
+            std::string string_nul()
+            {
+                const size_t begin = offset;
+                while (offset < size && data[offset] != 0)
+                    offset++;
+                std::string s(reinterpret_cast<const char*>(data + begin), offset - begin);
+                if (offset < size)
+                    offset++;
+                return s;
+            }
+
+            std::vector<uint8_t> bytes(size_t n)
+            {
+                n = std::min(n, size - offset);
+                std::vector<uint8_t> v(data + offset, data + offset + n);
+                offset += n;
+                return v;
+            }
+        };
+
+        // Gives packets the proxy answers with the sequence ids of the
+        // command they answer now.
+        void renumber(std::vector<uint8_t>& packets, uint8_t sequence_id)
+        {
+            for (size_t offset = 0; offset + My::header_size <= packets.size(); )
+            {
+                packets[offset + 3] = sequence_id++;
+                offset += My::header_size + static_cast<size_t>(My::read_int<3>(&packets[offset]));
+            }
+        }
+    }
+
+    pooled_session::pooled_session(io_context_pool::shard& shard, net::ip::tcp::socket client_socket,
+                                   backend_group& backends, const pool_options& options,
+                                   query_cache* cache, statement_cache* statements)
+        : client_socket_(std::move(client_socket)),
+          shard_(shard),
+          backends_(backends),
+          options_(options),
+          cache_(cache),
+          statements_(statements),
+          limits_(shard.limits),
+          limit_commands_(shard.limits &&
+                          (shard.limits->options().qps > 0 || shard.limits->options().max_in_flight > 0)),
+          admission_timer_(shard.ios),
+          load_(shard)
+    {
+        parser_.set_capture(shard.capture);
+        parser_.set_metrics(&shard.metrics);
+        // session state pins the backend, reads may go to replicas
+        parser_.classify_queries();
+        // runs on the thread of the leave() which freed the slot
+        waiter_.granted = [this] {
+            net::post(shard_.ios, std::bind(&pooled_session::handle_in_flight_granted, shared_from_this()));
+        };
+    }
+
+    pooled_session::~pooled_session()
+    {
+        // the leave() which granted the last slot may still be returning
+        // from waiter_.granted
+        if (client_)
+            limits_->cancel(*client_, waiter_);
+        if (relay_data_)
+            shard_.buffers.deallocate(relay_data_, relay_size_class);
+    }
+
+    void pooled_session::start()
+    {
+        if (limits_ && limits_->options().by == admission_options::key::ip)
+        {
+            boost::system::error_code ec;
+            if (!admit_session("ip:" + client_socket_.remote_endpoint(ec).address().to_string()))
+            {
+                refuse_session(0);
+                return;
+            }
+        }
+
+        My::make_scramble(scramble_);
+        send_greeting();
+    }
+
+    void pooled_session::send_greeting()
+    {
+        const std::string& version = backends_.primary().server_version();
+
+        client_out_.clear();
+        My::PacketWriter w(client_out_);
+        w.begin(0);
+        w.int_n<1>(10);
+        w.string_nul(version.empty() ? "5.7.0-db-proxy" : version);
+        w.int_n<4>(next_connection_id.fetch_add(1, std::memory_order_relaxed));
+        w.bytes(scramble_, 8);
+        w.int_n<1>(0);
+        w.int_n<2>(server_capabilities & 0xffff);
+        w.int_n<1>(backends_.primary().config().charset);
+        w.int_n<2>(My::SERVER_STATUS_AUTOCOMMIT);
+        w.int_n<2>(server_capabilities >> 16);
+        w.int_n<1>(My::scramble_length + 1);
+        w.zeros(10);
+        w.bytes(scramble_ + 8, My::scramble_length - 8);
+        w.int_n<1>(0);
+        w.string_nul(native_password);
+        w.finish();
+
+        write_client([this] { process_client(); });
+    }
+
+    void pooled_session::read_client()
+    {
+        const size_t used = client_in_.size();
+        client_in_.resize(used + read_chunk);
+
+        client_socket_.async_read_some(
+                    net::buffer(client_in_.data() + used, read_chunk),
+                    std::bind(&pooled_session::handle_client_read,
+                              shared_from_this(),
+                              std::placeholders::_1,
+                              std::placeholders::_2));
+    }
+
+    void pooled_session::handle_client_read(const boost::system::error_code& error, size_t bytes_transferred)
+    {
+        client_in_.resize(client_in_.size() - read_chunk + bytes_transferred);
+
+        if (error)
+        {
+            finish();
+            return;
+        }
+
+        process_client();
+    }
+
+    void pooled_session::process_client()
+    {
+        if (closed_)
+            return;
+
+        // the last command is done with
+        if (in_flight_)
+        {
+            in_flight_ = false;
+            limits_->leave(*client_);
+        }
+
+        if (!next_packet())
+        {
+            read_client();
+            return;
+        }
+
+        switch (phase_)
+        {
+        case phase::handshake:
+            handle_handshake_response();
+            break;
+        case phase::auth_switch:
+            authenticate(std::vector<uint8_t>(command_.begin() + My::header_size, command_.end()));
+            break;
+        case phase::command:
+            if (limit_commands_)
+                admit_command();
+            else
+                execute_command();
+            break;
+        }
+    }
+
+    bool pooled_session::next_packet()
+    {
+        // a logical packet continues while payloads are max_payload_length long
+        size_t offset = 0;
+        for (;;)
+        {
+            if (client_in_.size() < offset + My::header_size)
+                return false;
+
+            const size_t length = static_cast<size_t>(My::read_int<3>(&client_in_[offset]));
+            if (client_in_.size() < offset + My::header_size + length)
+                return false;
+
+            sequence_id_ = client_in_[offset + 3];
+            offset += My::header_size + length;
+            if (length != My::max_payload_length)
+                break;
+        }
+
+        command_.assign(client_in_.begin(), client_in_.begin() + static_cast<std::ptrdiff_t>(offset));
+        client_in_.erase(client_in_.begin(), client_in_.begin() + static_cast<std::ptrdiff_t>(offset));
+        return true;
+    }
+
+    void pooled_session::handle_handshake_response()
+    {
+        payload_reader r{command_.data(), command_.size(), My::header_size};
+
+        // capabilities, max packet size, charset, filler
+        if (!r.has(32))
+        {
+            finish();
+            return;
+        }
+
+        const uint32_t capabilities = static_cast<uint32_t>(My::read_int<4>(r.data + r.offset));
+        charset_ = r.data[r.offset + 8];
+        r.offset += 32;
+
+        if (!(capabilities & My::CLIENT_PROTOCOL_41) || (capabilities & My::CLIENT_SSL))
+        {
+            client_out_.clear();
+            My::write_err(client_out_, static_cast<uint8_t>(sequence_id_ + 1), ER_NOT_SUPPORTED_YET, "08004",
+                          "db-proxy pooled mode needs protocol 4.1 without SSL");
+            write_client([this] { finish(); });
+            return;
+        }
+
+        const std::string user = r.string_nul();
+
+        std::vector<uint8_t> token;
+        if (capabilities & My::CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA)
+        {
+            uint64_t length = 0;
+            r.offset += My::read_lenenc(r.data + r.offset, r.size - r.offset, length);
+            token = r.bytes(static_cast<size_t>(length));
+        }
+        else if ((capabilities & My::CLIENT_SECURE_CONNECTION) && r.has(1))
+        {
+            const size_t length = r.data[r.offset++];
+            token = r.bytes(length);
+        }
+        else
+        {
+            const std::string s = r.string_nul();
+            token.assign(s.begin(), s.end());
+        }
+
+        if (capabilities & My::CLIENT_CONNECT_WITH_DB)
+            schema_ = r.string_nul();
+
+        std::string plugin;
+        if (capabilities & My::CLIENT_PLUGIN_AUTH)
+            plugin = r.string_nul();
+
+        if (user != options_.user)
+        {
+            authenticate(std::vector<uint8_t>(1, 0));
+            return;
+        }
+
+        if (!plugin.empty() && plugin != native_password)
+        {
+            // ask the client to answer the same scramble with mysql_native_password
+            client_out_.clear();
+            My::PacketWriter w(client_out_);
+            w.begin(static_cast<uint8_t>(sequence_id_ + 1));
+            w.int_n<1>(My::EOF_PACKET);
+            w.string_nul(native_password);
+            w.bytes(scramble_, My::scramble_length);
+            w.int_n<1>(0);
+            w.finish();
+
+            phase_ = phase::auth_switch;
+            write_client([this] { process_client(); });
+            return;
+        }
+
+        authenticate(token);
+    }
+
+    void pooled_session::authenticate(const std::vector<uint8_t>& token)
+    {
+        client_out_.clear();
+
+        if (token != My::native_password_token(options_.password, scramble_))
+        {
+            My::write_err(client_out_, static_cast<uint8_t>(sequence_id_ + 1), ER_ACCESS_DENIED, "28000",
+                          "Access denied for user '" + options_.user + "'");
+            write_client([this] { finish(); });
+            return;
+        }
+
+        // every client logs in as the pool user
+        if (limits_ && !client_ && !admit_session("user:" + options_.user))
+        {
+            refuse_session(static_cast<uint8_t>(sequence_id_ + 1));
+            return;
+        }
+
+        phase_ = phase::command;
+        parser_.skip_handshake();
+
+        My::write_ok(client_out_, static_cast<uint8_t>(sequence_id_ + 1), My::SERVER_STATUS_AUTOCOMMIT);
+        write_client([this] { process_client(); });
+    }
+
+    void pooled_session::write_client(std::function<void()> next)
+    {
+        auto self = shared_from_this();
+        net::async_write(client_socket_, net::buffer(client_out_),
+                         [this, self, next](const boost::system::error_code& error, size_t)
+        {
+            if (error)
+                finish();
+            else
+                next();
+        });
+    }
+
+    void pooled_session::execute_command()
+    {
+        const uint8_t command = command_.size() > My::header_size ? command_[My::header_size] : static_cast<uint8_t>(My::COM_SLEEP);
+        const uint8_t* argument = command_.data() + My::header_size + 1;
+        const size_t argument_size = command_.size() > My::header_size ? command_.size() - My::header_size - 1 : 0;
+
+        // left over when the last command failed before reaching a backend
+        statement_.reset();
+
+        switch (command)
+        {
+        case My::COM_QUIT:
+            finish();
+            return;
+        case My::COM_SLEEP:
+        case My::COM_TIME:
+        case My::COM_CONNECT:
+        case My::COM_DELAYED_INSERT:
+        case My::COM_CHANGE_USER:
+        case My::COM_BINLOG_DUMP:
+        case My::COM_TABLE_DUMP:
+        case My::COM_CONNECT_OUT:
+        case My::COM_REGISTER_SLAVE:
+        case My::COM_DAEMON:
+        case My::COM_BINLOG_DUMP_GTID:
+            send_error(ER_NOT_SUPPORTED_YET, "42000", "command is not supported by db-proxy in pooled mode");
+            return;
+        case My::COM_PING:
+            // answered without a backend
+            if (!backend_)
+            {
+                client_out_.clear();
+                My::write_ok(client_out_, static_cast<uint8_t>(sequence_id_ + 1), My::SERVER_STATUS_AUTOCOMMIT);
+                write_client([this] { process_client(); });
+                return;
+            }
+            break;
+        case My::COM_STMT_PREPARE:
+        case My::COM_STMT_EXECUTE:
+        case My::COM_STMT_SEND_LONG_DATA:
+        case My::COM_STMT_CLOSE:
+        case My::COM_STMT_RESET:
+        case My::COM_STMT_FETCH:
+            if (statements_)
+            {
+                execute_statement_command(command);
+                return;
+            }
+            // no backend means no statement, and neither command has a response
+            if ((command == My::COM_STMT_CLOSE || command == My::COM_STMT_SEND_LONG_DATA) && !backend_)
+            {
+                process_client();
+                return;
+            }
+            break;
+        case My::COM_SET_OPTION:
+            pinned_ = true;
+            break;
+        case My::COM_INIT_DB:
+            pending_schema_.assign(argument, argument + argument_size);
+            break;
+        }
+
+        parser_.parse_client(command_.data(), command_.size());
+
+        // session state keeps the backend, and so does a statement too long
+        // to be classified whole
+        if (command == My::COM_QUERY &&
+            (parser_.query().changes_session_state() || parser_.query().has(sql::truncated)))
+            pinned_ = true;
+
+        if (command == My::COM_QUERY && cache_ && serve_from_cache(argument, argument_size))
+            return;
+
+        dispatch_command();
+    }
+
+    void pooled_session::dispatch_command()
+    {
+        if (backend_)
+        {
+            forward_command();
+            return;
+        }
+
+        lender_ = route_to_replica() ? backends_.replica() : nullptr;
+        if (!lender_)
+            lender_ = &backends_.primary();
+        lender_->acquire(std::bind(&pooled_session::handle_acquire,
+                                   shared_from_this(),
+                                   std::placeholders::_1,
+                                   std::placeholders::_2));
+    }
+
+    void pooled_session::handle_acquire(const boost::system::error_code& error,
+                                        backend_pool::connection_ptr backend)
+    {
+        if (closed_)
+        {
+            if (backend)
+                lender_->release(backend, false);
+            return;
+        }
+
+        if (error && lender_ != &backends_.primary())
+        {
+            // a replica which is down should not fail reads the primary can serve
+            lender_ = &backends_.primary();
+            lender_->acquire(std::bind(&pooled_session::handle_acquire,
+                                       shared_from_this(),
+                                       std::placeholders::_1,
+                                       std::placeholders::_2));
+            return;
+        }
+
+        if (error)
+        {
+            send_error(ER_CON_COUNT_ERROR, "08004", "no backend connection available: " + error.message());
+            return;
+        }
+
+        backend_ = std::move(backend);
+        prepare_backend();
+    }
+
+    void pooled_session::prepare_backend()
+    {
+        // Bring the borrowed connection to the client's character set and
+        // schema, which both survive going back to the pool.
+        std::string names;
+        if (charset_ != backend_->charset)
+        {
+            if (const char* name = My::charset_name(charset_))
+                names = std::string("SET NAMES ") + name;
+        }
+
+        const bool change_schema = !schema_.empty() && backend_->schema != schema_;
+
+        if (names.empty() && !change_schema)
+        {
+            forward_command();
+            return;
+        }
+
+        // one step a round trip, SET NAMES first; each marks only what it
+        // changed and looks again
+        const bool init_db = names.empty();
+        auto self = shared_from_this();
+        auto done = [this, self, init_db](const boost::system::error_code& error)
+        {
+            if (error)
+            {
+                const std::string message = backend_->error_message.empty() ? error.message() : backend_->error_message;
+                lender_->discard(backend_);
+                backend_.reset();
+                // e.g. the schema given at login does not exist
+                if (init_db)
+                    schema_.clear();
+                send_error(ER_UNKNOWN_ERROR, "HY000", message);
+                return;
+            }
+
+            if (init_db)
+                backend_->schema = schema_;
+            else
+                backend_->charset = charset_;
+            prepare_backend();
+        };
+
+        if (init_db)
+            backend_->async_command(My::COM_INIT_DB, schema_, done);
+        else
+            backend_->async_command(My::COM_QUERY, names, done);
+    }
+
+    void pooled_session::forward_command()
+    {
+        const uint8_t command = command_[My::header_size];
+
+        if (statements_ && command == My::COM_STMT_PREPARE)
+        {
+            prepare_statement();
+            return;
+        }
+        if (statement_ && !bind_statement())
+            return;
+
+        if (!relay_data_)
+            relay_data_ = shard_.buffers.allocate(relay_size_class);
+        relaying_ = true;
+
+        auto self = shared_from_this();
+        net::async_write(backend_->socket, net::buffer(command_),
+                         [this, self, command](const boost::system::error_code& error, size_t)
+        {
+            if (error)
+            {
+                lender_->discard(backend_);
+                backend_.reset();
+                finish();
+                return;
+            }
+
+            if (!My::ResponseTracker::has_response(command))
+            {
+                after_command();
+                return;
+            }
+
+            tracker_.start(command);
+            first_response_packet_ = true;
+            relay_response();
+        });
+    }
+
+    void pooled_session::relay_response()
+    {
+        backend_->socket.async_read_some(
+                    net::buffer(relay_data_, buffer_pool::class_size(relay_size_class)),
+                    std::bind(&pooled_session::handle_backend_read,
+                              shared_from_this(),
+                              std::placeholders::_1,
+                              std::placeholders::_2));
+    }
+
+    void pooled_session::handle_backend_read(const boost::system::error_code& error, size_t bytes_transferred)
+    {
+        if (error)
+        {
+            // the backend went away in the middle of a response
+            lender_->discard(backend_);
+            backend_.reset();
+            finish();
+            return;
+        }
+
+        parser_.server_relayed(bytes_transferred);
+
+        framer_.feed(relay_data_, bytes_transferred, [this](const My::PacketFramer::Packet& packet)
+        {
+            // the parser only needs the head of the first packet, e.g. the
+            // statement id of COM_STMT_PREPARE_OK
+            if (first_response_packet_)
+                first_response_type_ = packet.head_size ? packet.head[0] : 0;
+            if (first_response_packet_ && parser_.peek_size())
+            {
+                uint8_t head[My::header_size + static_cast<size_t>(My::PacketFramer::max_head)];
+                head[0] = static_cast<uint8_t>(packet.payload_length);
+                head[1] = static_cast<uint8_t>(packet.payload_length >> 8);
+                head[2] = static_cast<uint8_t>(packet.payload_length >> 16);
+                head[3] = packet.sequence_id;
+                std::memcpy(head + My::header_size, packet.head, packet.head_size);
+                parser_.parse_server_head(head, My::header_size + packet.head_size);
+            }
+            first_response_packet_ = false;
+
+            tracker_.on_packet(packet);
+        });
+
+        if (capturing_)
+        {
+            if (capture_.size() + bytes_transferred > cache_->max_entry_size())
+            {
+                capturing_ = false;
+                std::vector<uint8_t>().swap(capture_);
+            }
+            else
+                capture_.insert(capture_.end(), relay_data_, relay_data_ + bytes_transferred);
+        }
+
+        auto self = shared_from_this();
+        net::async_write(client_socket_, net::buffer(relay_data_, bytes_transferred),
+                         [this, self](const boost::system::error_code& error, size_t)
+        {
+            if (error)
+            {
+                finish();
+                return;
+            }
+
+            if (tracker_.done())
+                after_command();
+            else
+                relay_response();
+        });
+    }
+
+    void pooled_session::after_command()
+    {
+        const uint8_t command = command_[My::header_size];
+        relaying_ = false;
+        parser_.response_done(tracker_.rows());
+
+        if (My::ResponseTracker::has_response(command) && !tracker_.error())
+        {
+            in_transaction_ = (tracker_.status() & My::SERVER_STATUS_IN_TRANS) != 0;
+
+            if (command == My::COM_INIT_DB)
+            {
+                schema_ = pending_schema_;
+                backend_->schema = schema_;
+            }
+            else if (command == My::COM_RESET_CONNECTION)
+            {
+                pinned_ = false;
+                backend_->charset = lender_->config().charset;
+                // the reset closed every statement of the connection
+                backend_->statements.clear();
+                client_statements_.clear();
+            }
+        }
+
+        if (capturing_)
+        {
+            // only complete result sets, OK and ERR are not worth a round trip
+            // through the cache
+            if (!tracker_.error() && !in_transaction_ &&
+                first_response_type_ != My::OK_PACKET && first_response_type_ != My::ERR_PACKET)
+                cache_->insert(cache_key_, std::move(capture_));
+            capturing_ = false;
+            capture_.clear();
+        }
+
+        if (options_.mode == pool_mode::transaction && !holds_backend_state())
+        {
+            lender_->release(backend_, false);
+            backend_.reset();
+        }
+
+        shard_.buffers.deallocate(relay_data_, relay_size_class);
+        relay_data_ = nullptr;
+
+        process_client();
+    }
+
+    bool pooled_session::serve_from_cache(const uint8_t* query, size_t size)
+    {
+        // inside a transaction or with changed session state the result may
+        // differ from what other sessions see
+        if (in_transaction_ || pinned_)
+            return false;
+
+        const std::string text = query_cache::normalise(query, size);
+        if (text.empty())
+            return false;
+
+        cache_key_ = query_cache::make_key(schema_, charset_, text);
+
+        auto result = cache_->find(cache_key_);
+        if (!result)
+        {
+            capturing_ = cache_->cacheable(text);
+            return false;
+        }
+
+        // replay the captured packets, renumbered when the client's
+        // sequence differs from the one they were captured with
+        const uint8_t first_sequence_id = static_cast<uint8_t>(sequence_id_ + 1);
+        if ((*result)[3] != first_sequence_id)
+        {
+            client_out_.assign(result->begin(), result->end());
+            renumber(client_out_, first_sequence_id);
+            write_client([this] { process_client(); });
+            return true;
+        }
+
+        auto self = shared_from_this();
+        net::async_write(client_socket_, net::buffer(*result),
+                         [this, self, result](const boost::system::error_code& error, size_t)
+        {
+            if (error)
+                finish();
+            else
+                process_client();
+        });
+        return true;
+    }
+
+    void pooled_session::send_error(uint16_t code, const char* sql_state, const std::string& message)
+    {
+        client_out_.clear();
+        My::write_err(client_out_, static_cast<uint8_t>(sequence_id_ + 1), code, sql_state, message);
+        write_client([this] { process_client(); });
+    }
+
+    bool pooled_session::holds_backend_state() const
+    {
+        // cached statements are prepared again wherever they are executed
+        return in_transaction_ || pinned_ || (!statements_ && parser_.prepared_statements() > 0);
+    }
+
+    bool pooled_session::route_to_replica() const
+    {
+        // a backend held across commands must be the primary, the writes
+        // and state of the session are there
+        return backends_.has_replicas() && options_.mode == pool_mode::transaction &&
+               !holds_backend_state() && parser_.replica_read();
+    }
+
+    void pooled_session::finish()
+    {
+        if (closed_)
+            return;
+        closed_ = true;
+
+        if (backend_)
+        {
+            // a half read response leaves the connection unusable
+            if (relaying_)
+                lender_->discard(backend_);
+            else
+                lender_->release(backend_, holds_backend_state());
+            backend_.reset();
+        }
+
+        if (limits_)
+            release_limits();
+
+        boost::system::error_code ignored;
+        client_socket_.close(ignored);
+    }
+
+    bool pooled_session::admit_session(const std::string& key)
+    {
+        client_ = &limits_->find(key);
+        if (limits_->open_session(*client_))
+        {
+            session_counted_ = true;
+            return true;
+        }
+
+        shard_.metrics.refused_sessions.add();
+        return false;
+    }
+
+    void pooled_session::refuse_session(uint8_t sequence_id)
+    {
+        client_out_.clear();
+        limits_->write_session_error(client_out_, sequence_id);
+        write_client([this] { finish(); });
+    }
+
+    // Commands wait for their turn of the client's rate and for an in flight
+    // slot, which they hold until their response is through. One which
+    // would wait longer than max_wait gets an ERR instead.
+    void pooled_session::admit_command()
+    {
+        const uint8_t command = command_.size() > My::header_size ? command_[My::header_size] : static_cast<uint8_t>(My::COM_SLEEP);
+        if (!My::ResponseTracker::has_response(command))
+        {
+            execute_command();
+            return;
+        }
+
+        const admission::clock::time_point now = admission::clock::now();
+        admission_deadline_ = now + limits_->options().max_wait;
+        delayed_ = false;
+
+        admission::clock::duration wait;
+        if (!limits_->reserve(*client_, 1, now, limits_->options().max_wait, wait))
+            refuse_command();
+        else if (wait > admission::clock::duration::zero())
+            delay_command(now + wait);
+        else
+            enter_command();
+    }
+
+    void pooled_session::enter_command()
+    {
+        if (limits_->enter(*client_, waiter_))
+        {
+            in_flight_ = true;
+            execute_command();
+            return;
+        }
+
+        // the leave() of another command hands its slot over, the timer
+        // only refuses the command at the deadline
+        queued_ = true;
+        delay_command(admission_deadline_);
+    }
+
+    void pooled_session::delay_command(admission::clock::time_point until)
+    {
+        if (!delayed_)
+        {
+            delayed_ = true;
+            shard_.metrics.delayed_commands.add();
+        }
+
+        admission_timer_.expires_at(until);
+        admission_timer_.async_wait(std::bind(&pooled_session::handle_admission_timer,
+                                              shared_from_this(),
+                                              ++admission_wait_,
+                                              std::placeholders::_1));
+    }
+
+    void pooled_session::handle_admission_timer(unsigned wait, const boost::system::error_code& error)
+    {
+        if (error || closed_ || wait != admission_wait_)
+            return;
+
+        if (!queued_)
+        {
+            enter_command();
+            return;
+        }
+
+        // a slot granted meanwhile is on its way to handle_in_flight_granted
+        if (limits_->cancel(*client_, waiter_))
+        {
+            queued_ = false;
+            refuse_command();
+        }
+    }
+
+    void pooled_session::handle_in_flight_granted()
+    {
+        queued_ = false;
+        if (closed_)
+        {
+            limits_->leave(*client_);
+            return;
+        }
+
+        ++admission_wait_;
+        admission_timer_.cancel();
+        in_flight_ = true;
+        execute_command();
+    }
+
+    void pooled_session::refuse_command()
+    {
+        shard_.metrics.refused_commands.add();
+        client_out_.clear();
+        limits_->write_command_error(client_out_, static_cast<uint8_t>(sequence_id_ + 1));
+        write_client([this] { process_client(); });
+    }
+
+    void pooled_session::release_limits()
+    {
+        // a granted slot is left by handle_in_flight_granted
+        if (queued_ && limits_->cancel(*client_, waiter_))
+            queued_ = false;
+        if (in_flight_)
+        {
+            in_flight_ = false;
+            limits_->leave(*client_);
+        }
+        if (session_counted_)
+        {
+            session_counted_ = false;
+            limits_->close_session(*client_);
+        }
+        admission_timer_.cancel();
+    }
+
+    // With the statement cache the ids the client sees are the session's own
+    // and are replaced with the backend's when a command goes out.
+    void pooled_session::execute_statement_command(uint8_t command)
+    {
+        parser_.parse_client(command_.data(), command_.size());
+
+        if (command == My::COM_STMT_PREPARE)
+        {
+            const std::string text(command_.begin() + My::header_size + 1, command_.end());
+            // with state of its own the session may see the text differently
+            // than others, its statements are kept out of the cache
+            if (pinned_)
+                statement_key_ = '\x01' + std::to_string(next_statement_id_);
+            else
+            {
+                statement_key_ = query_cache::make_key(schema_, charset_, text);
+                if (auto statement = statements_->find(statement_key_))
+                {
+                    answer_prepare(statement);
+                    return;
+                }
+            }
+            dispatch_command();
+            return;
+        }
+
+        // command, statement id
+        const bool has_response = My::ResponseTracker::has_response(command);
+        if (command_.size() < My::header_size + 1 + 4)
+        {
+            if (has_response)
+                send_error(ER_UNKNOWN_STMT, "HY000", "Malformed statement command");
+            else
+                process_client();
+            return;
+        }
+
+        const uint32_t id = static_cast<uint32_t>(My::read_int<4>(&command_[My::header_size + 1]));
+        auto it = client_statements_.find(id);
+        if (command == My::COM_STMT_CLOSE)
+        {
+            if (it != client_statements_.end())
+                client_statements_.erase(it);
+            process_client();
+            return;
+        }
+        if (it == client_statements_.end())
+        {
+            if (has_response)
+                send_error(ER_UNKNOWN_STMT, "HY000",
+                           "Unknown prepared statement handler (" + std::to_string(id) + ") given to " +
+                           My::command_name(command));
+            else
+                process_client();
+            return;
+        }
+
+        client_statement& s = it->second;
+        statement_ = s.statement;
+
+        if (command == My::COM_STMT_SEND_LONG_DATA)
+        {
+            // the data waits on the backend for the execute
+            pinned_ = true;
+        }
+        else if (command == My::COM_STMT_EXECUTE && command_.size() > My::header_size + 1 + 4)
+        {
+            // an open cursor is fetched from the same connection
+            if (command_[My::header_size + 1 + 4] & cursor_type_read_only)
+                pinned_ = true;
+
+            // command, id, flags, iteration count, NULL bitmap, new params
+            // bound flag, types. A connection which prepared the statement
+            // after the types were sent has never seen them, so they go
+            // with every execute.
+            const size_t params = s.statement->params;
+            const size_t bound = My::header_size + 1 + 4 + 1 + 4 + (params + 7) / 8;
+            const size_t length = static_cast<size_t>(My::read_int<3>(command_.data()));
+            if (params > 0 && bound < command_.size())
+            {
+                if (command_[bound])
+                    s.types.assign(command_.begin() + static_cast<std::ptrdiff_t>(bound + 1),
+                                   command_.begin() + static_cast<std::ptrdiff_t>(std::min(command_.size(), bound + 1 + 2 * params)));
+                else if (s.types.size() == 2 * params && length + s.types.size() < My::max_payload_length)
+                {
+                    command_[bound] = 1;
+                    command_.insert(command_.begin() + static_cast<std::ptrdiff_t>(bound + 1), s.types.begin(), s.types.end());
+                    const size_t patched = length + s.types.size();
+                    command_[0] = static_cast<uint8_t>(patched);
+                    command_[1] = static_cast<uint8_t>(patched >> 8);
+                    command_[2] = static_cast<uint8_t>(patched >> 16);
+                }
+            }
+        }
+
+        dispatch_command();
+    }
+
+    void pooled_session::prepare_statement()
+    {
+        const std::string text(command_.begin() + My::header_size + 1, command_.end());
+
+        auto self = shared_from_this();
+        backend_->async_prepare(statement_key_, text,
+                                [this, self, text](const boost::system::error_code& error, uint32_t)
+        {
+            if (error)
+            {
+                answer_statement_error();
+                return;
+            }
+
+            auto response = backend_->response;
+            answer_prepare(pinned_ ? statement_cache::make(statement_key_, text, std::move(response))
+                                   : statements_->insert(statement_key_, text, std::move(response)));
+        });
+    }
+
+    // Replaces the client's statement id of the current command with the
+    // one of backend_, preparing the statement there first if it has to.
+    bool pooled_session::bind_statement()
+    {
+        auto it = backend_->statements.find(statement_->key);
+        if (it == backend_->statements.end())
+        {
+            auto self = shared_from_this();
+            backend_->async_prepare(statement_->key, statement_->text,
+                                    [this, self](const boost::system::error_code& error, uint32_t)
+            {
+                if (error)
+                    answer_statement_error();
+                else
+                    forward_command();
+            });
+            return false;
+        }
+
+        const uint32_t id = it->second;
+        for (size_t i = 0; i < 4; i++)
+            command_[My::header_size + 1 + i] = static_cast<uint8_t>(id >> (8 * i));
+        statement_.reset();
+        return true;
+    }
+
+    void pooled_session::answer_prepare(const statement_cache::statement_ptr& statement)
+    {
+        const uint32_t id = next_statement_id_++;
+        client_statements_[id].statement = statement;
+
+        // status, statement id
+        client_out_.assign(statement->response.begin(), statement->response.end());
+        for (size_t i = 0; i < 4; i++)
+            client_out_[My::header_size + 1 + i] = static_cast<uint8_t>(id >> (8 * i));
+
+        answer_statement_command();
+    }
+
+    // The backend refused to prepare a statement: the ERR answers the
+    // client's command, anything else leaves the connection unusable.
+    void pooled_session::answer_statement_error()
+    {
+        const auto& response = backend_->response;
+        if (response.size() <= My::header_size || response[My::header_size] != My::ERR_PACKET)
+        {
+            lender_->discard(backend_);
+            backend_.reset();
+            finish();
+            return;
+        }
+
+        client_out_.assign(response.begin(), response.end());
+        answer_statement_command();
+    }
+
+    // Sends client_out_ as the response to the current command, which never
+    // reached the backend.
+    void pooled_session::answer_statement_command()
+    {
+        renumber(client_out_, static_cast<uint8_t>(sequence_id_ + 1));
+
+        parser_.server_relayed(client_out_.size());
+        parser_.parse_server_head(client_out_.data(),
+                                  std::min(client_out_.size(),
+                                           My::header_size + static_cast<size_t>(My::read_int<3>(client_out_.data()))));
+        parser_.response_done(0);
+
+        statement_.reset();
+        if (backend_ && options_.mode == pool_mode::transaction && !holds_backend_state())
+        {
+            lender_->release(backend_, false);
+            backend_.reset();
+        }
+
+        write_client([this] { process_client(); });
+    }
+}
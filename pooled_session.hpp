@@ -0,0 +1,207 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "backend_pool.hpp"
+#include "io_context_pool.hpp"
+#include "parser.hpp"
+#include "protocol.hpp"
+#include "query_cache.hpp"
+#include "statement_cache.hpp"
+
+namespace net = boost::asio;
+
+namespace db_proxy
+{
+    enum class pool_mode {
+        // a backend is held from login to disconnect, only the handshake is saved
+        session,
+        // a backend is held while a transaction or session state needs it
+        transaction
+    };
+
+    struct pool_options
+    {
+        // backend connections in total, 0 - every client gets its own backend
+        size_t size = 0;
+        std::string user;
+        std::string password;
+        pool_mode mode = pool_mode::transaction;
+        // copies of the backend autocommit reads may go to, host and port
+        std::vector<std::pair<std::string, unsigned short>> replicas;
+        // prepare responses cached per shard, 0 - prepared statements go to
+        // the backend as they are
+        size_t statements = 0;
+    };
+
+    // Client session of the pooled mode. The proxy authenticates the client
+    // itself against the pool credentials and borrows an already logged in
+    // backend connection for each unit of work.
+    //
+    // A backend stays with the client while a transaction is open, while
+    // prepared statements exist on it (unless they are cached, see below)
+    // or once the client changed session state (SET, USE, user variables,
+    // temporary tables, locks). Otherwise it goes back to the pool as soon
+    // as a response is complete, without a reset, since nothing was left
+    // behind on it.
+    //
+    // With replicas a SELECT which neither locks nor writes goes to one of
+    // them when the session holds no backend: in transaction mode, outside
+    // a transaction and without session state. Everything else goes to the
+    // primary.
+    //
+    // With a statement cache the client's prepared statements are the
+    // session's own and hold no backend: a prepare of a text the shard has
+    // seen is answered from the cache, and a statement is prepared on a
+    // backend connection the first time it is executed there, under the id
+    // that connection gave it. Statements are prepared in the schema and
+    // character set the connection is in at that moment, which is the
+    // session's current one rather than the one of the client's prepare.
+    // Closing a statement only forgets it; connections close theirs in bulk
+    // once they have too many.
+    class pooled_session : public std::enable_shared_from_this<pooled_session>
+    {
+    public:
+        using ptr_type = std::shared_ptr<pooled_session>;
+
+        pooled_session(io_context_pool::shard& shard, net::ip::tcp::socket client_socket,
+                       backend_group& backends, const pool_options& options,
+                       query_cache* cache = nullptr, statement_cache* statements = nullptr);
+        ~pooled_session();
+
+        void start();
+
+    private:
+        enum class phase {
+            handshake,
+            auth_switch,
+            command
+        };
+
+        // client side
+        void send_greeting();
+        void read_client();
+        void handle_client_read(const boost::system::error_code& error, size_t bytes_transferred);
+        void process_client();
+        bool next_packet();
+        void handle_handshake_response();
+        void authenticate(const std::vector<uint8_t>& token);
+        void write_client(std::function<void()> next);
+
+        // command phase
+        void execute_command();
+        void handle_acquire(const boost::system::error_code& error, backend_pool::connection_ptr backend);
+        void prepare_backend();
+        void forward_command();
+        void relay_response();
+        void handle_backend_read(const boost::system::error_code& error, size_t bytes_transferred);
+        void after_command();
+        bool serve_from_cache(const uint8_t* query, size_t size);
+        void send_error(uint16_t code, const char* sql_state, const std::string& message);
+        bool holds_backend_state() const;
+        bool route_to_replica() const;
+        void finish();
+
+        // admission control, see session in main.cpp
+        bool admit_session(const std::string& key);
+        void refuse_session(uint8_t sequence_id);
+        void admit_command();
+        void enter_command();
+        void delay_command(admission::clock::time_point until);
+        void handle_admission_timer(unsigned wait, const boost::system::error_code& error);
+        void handle_in_flight_granted();
+        void refuse_command();
+        void release_limits();
+
+        // statement cache
+        void execute_statement_command(uint8_t command);
+        void dispatch_command();
+        void prepare_statement();
+        bool bind_statement();
+        void answer_prepare(const statement_cache::statement_ptr& statement);
+        void answer_statement_error();
+        void answer_statement_command();
+
+        net::ip::tcp::socket client_socket_;
+        io_context_pool::shard& shard_;
+        backend_group& backends_;
+        const pool_options& options_;
+        // nullptr - caching is off
+        query_cache* cache_;
+        // nullptr - prepared statements go to the backend as they are
+        statement_cache* statements_;
+
+        phase phase_ = phase::handshake;
+        uint8_t scramble_[My::scramble_length] = {0};
+        uint8_t sequence_id_ = 0;
+        uint8_t charset_ = 0;
+        std::string schema_;
+        std::string pending_schema_;
+
+        std::vector<uint8_t> client_in_;
+        std::vector<uint8_t> client_out_;
+        // raw bytes of the current command, forwarded as they are
+        std::vector<uint8_t> command_;
+
+        backend_pool::connection_ptr backend_;
+        // the pool backend_ was acquired from
+        backend_pool* lender_ = nullptr;
+        uint8_t* relay_data_ = nullptr;
+        My::PacketFramer framer_;
+        My::ResponseTracker tracker_;
+        bool first_response_packet_ = false;
+        uint8_t first_response_type_ = 0;
+        // a command went to the backend and its response is not complete
+        bool relaying_ = false;
+
+        // the response is collected for the query cache under cache_key_
+        bool capturing_ = false;
+        std::string cache_key_;
+        std::vector<uint8_t> capture_;
+
+        struct client_statement
+        {
+            statement_cache::statement_ptr statement;
+            // parameter types of the last execute which bound them
+            std::vector<uint8_t> types;
+        };
+
+        // the client's statements by the ids the session handed out
+        std::unordered_map<uint32_t, client_statement> client_statements_;
+        uint32_t next_statement_id_ = 1;
+        // the statement the current command goes to the backend with
+        statement_cache::statement_ptr statement_;
+        // key the current COM_STMT_PREPARE is cached under
+        std::string statement_key_;
+
+        bool closed_ = false;
+        bool in_transaction_ = false;
+        bool pinned_ = false;
+
+        // nullptr - clients are not limited
+        admission* limits_;
+        const bool limit_commands_;
+        // nullptr - the session has no client yet
+        admission::client* client_ = nullptr;
+        bool session_counted_ = false;
+        // the current command holds one of the client's in flight slots
+        bool in_flight_ = false;
+        bool delayed_ = false;
+        // the current command is queued for an in flight slot
+        bool queued_ = false;
+        admission::waiter waiter_;
+        // numbers the timer's waits, one that fired late is past
+        unsigned admission_wait_ = 0;
+        admission::clock::time_point admission_deadline_;
+        net::steady_timer admission_timer_;
+
+        io_context_pool::load_guard load_;
+        My::Parser parser_;
+    };
+}
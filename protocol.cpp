@@ -0,0 +1,334 @@
+#include "protocol.hpp"
+#include "parser.hpp"
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <stdexcept>
+
+namespace db_proxy {
+
+namespace My {
+
+size_t read_lenenc(const uint8_t *data, size_t size, uint64_t &value) {
+    if(size == 0)
+        return 0;
+
+    switch(data[0]) {
+    case 0xfc:
+        if(size < 3) return 0;
+        value = read_int<2>(data + 1);
+        return 3;
+    case 0xfd:
+        if(size < 4) return 0;
+        value = read_int<3>(data + 1);
+        return 4;
+    case 0xfe:
+        if(size < 9) return 0;
+        value = read_int<8>(data + 1);
+        return 9;
+    case 0xfb:
+    case 0xff:
+        return 0;
+    default:
+        value = data[0];
+        return 1;
+    }
+}
+
+bool read_status(const uint8_t *payload, size_t size, uint16_t &status) {
+    if(size >= 5 && payload[0] == EOF_PACKET) {
+        status = static_cast<uint16_t>(read_int<2>(payload + 3));
+        return true;
+    }
+
+    if(size == 0 || payload[0] != OK_PACKET)
+        return false;
+
+    // header, affected rows, last insert id, status flags
+    size_t offset = 1;
+    uint64_t skip = 0;
+    for(int i = 0; i < 2; i++) {
+        const size_t n = read_lenenc(payload + offset, size - offset, skip);
+        if(n == 0)
+            return false;
+        offset += n;
+    }
+
+    if(size < offset + 2)
+        return false;
+
+    status = static_cast<uint16_t>(read_int<2>(payload + offset));
+    return true;
+}
+
+void PacketWriter::lenenc(uint64_t v) {
+    if(v < 251) {
+        int_n<1>(v);
+    }
+    else if(v < 0x10000) {
+        int_n<1>(0xfc);
+        int_n<2>(v);
+    }
+    else if(v < 0x1000000) {
+        int_n<1>(0xfd);
+        int_n<3>(v);
+    }
+    else {
+        int_n<1>(0xfe);
+        int_n<8>(v);
+    }
+}
+
+void write_ok(std::vector<uint8_t> &out, uint8_t sequence_id, uint16_t status) {
+    PacketWriter w(out);
+    w.begin(sequence_id);
+    w.int_n<1>(OK_PACKET);
+    w.lenenc(0); // affected rows
+    w.lenenc(0); // last insert id
+    w.int_n<2>(status);
+    w.int_n<2>(0); // warnings
+    w.finish();
+}
+
+void write_err(std::vector<uint8_t> &out, uint8_t sequence_id, uint16_t code,
+               const char *sql_state, const std::string &message) {
+    PacketWriter w(out);
+    w.begin(sequence_id);
+    w.int_n<1>(ERR_PACKET);
+    w.int_n<2>(code);
+    w.int_n<1>('#');
+    w.bytes(sql_state, 5);
+    w.string(message);
+    w.finish();
+}
+
+bool ResponseTracker::has_response(uint8_t command) {
+    return command != COM_QUIT &&
+           command != COM_STMT_CLOSE &&
+           command != COM_STMT_SEND_LONG_DATA;
+}
+
+void ResponseTracker::start(uint8_t command) {
+    command_ = command;
+    error_ = false;
+    remaining_ = 0;
+    rows_ = 0;
+    bytes_ = 0;
+
+    switch(command) {
+    case COM_FIELD_LIST:
+        state_ = State::FIELD_LIST;
+        break;
+    case COM_STATISTICS:
+        state_ = State::SINGLE;
+        break;
+    case COM_STMT_FETCH:
+        state_ = State::ROWS;
+        break;
+    default:
+        state_ = has_response(command) ? State::FIRST : State::DONE;
+        break;
+    }
+}
+
+bool ResponseTracker::on_packet(const PacketFramer::Packet &packet) {
+    bytes_ += header_size + packet.payload_length;
+
+    // the tail of a split payload says nothing about the response
+    if(packet.continuation || state_ == State::DONE)
+        return done();
+
+    return on_payload(packet.head, packet.head_size, packet.payload_length);
+}
+
+bool ResponseTracker::on_packet(const PacketAssembler::Packet &packet) {
+    // a payload of n * max_payload_length bytes ends with an empty packet
+    bytes_ += header_size * (packet.length / max_payload_length + 1) + packet.length;
+
+    if(state_ == State::DONE)
+        return true;
+
+    return on_payload(packet.payload, packet.size, packet.length);
+}
+
+bool ResponseTracker::on_payload(const uint8_t *p, size_t size, size_t length) {
+    const uint8_t type = size > 0 ? p[0] : 0;
+    uint16_t status = status_;
+
+    switch(state_) {
+    case State::FIRST:
+        if(type == ERR_PACKET) {
+            error_ = true;
+            state_ = State::DONE;
+        }
+        else if(command_ == COM_STMT_PREPARE) {
+            // COM_STMT_PREPARE_OK, then parameter and column definitions
+            // each followed by an EOF
+            const uint64_t columns = size >= 7 ? read_int<2>(p + 5) : 0;
+            const uint64_t params = size >= 9 ? read_int<2>(p + 7) : 0;
+            remaining_ = params + columns;
+            if(!deprecate_eof_)
+                remaining_ += (params ? 1 : 0) + (columns ? 1 : 0);
+            state_ = remaining_ ? State::PREPARE_DEFINITIONS : State::DONE;
+        }
+        else if(type == OK_PACKET) {
+            read_status(p, size, status);
+            finish_result(status);
+        }
+        else if(is_terminator(p, size, length)) {
+            read_terminator_status(p, size, status);
+            finish_result(status);
+        }
+        else if(type == LOCAL_INFILE) {
+            // the client sends the file, the server answers with OK or ERR
+            state_ = State::LOCAL_INFILE_RESULT;
+        }
+        else {
+            uint64_t columns = 0;
+            read_lenenc(p, size, columns);
+            remaining_ = columns;
+            if(columns)
+                state_ = State::COLUMNS;
+            else
+                state_ = deprecate_eof_ ? State::ROWS : State::COLUMNS_EOF;
+        }
+        break;
+    case State::PREPARE_DEFINITIONS:
+        if(--remaining_ == 0)
+            state_ = State::DONE;
+        break;
+    case State::FIELD_LIST:
+        if(type == ERR_PACKET) {
+            error_ = true;
+            state_ = State::DONE;
+        }
+        else if(is_terminator(p, size, length)) {
+            read_terminator_status(p, size, status_);
+            state_ = State::DONE;
+        }
+        break;
+    case State::SINGLE:
+        state_ = State::DONE;
+        break;
+    case State::LOCAL_INFILE_RESULT:
+        if(type == ERR_PACKET)
+            error_ = true;
+        else if(read_status(p, size, status))
+            status_ = status;
+        state_ = State::DONE;
+        break;
+    case State::COLUMNS:
+        if(--remaining_ == 0)
+            state_ = deprecate_eof_ ? State::ROWS : State::COLUMNS_EOF;
+        break;
+    case State::COLUMNS_EOF:
+        read_status(p, size, status);
+        // an opened cursor sends no rows until COM_STMT_FETCH
+        if(status & SERVER_STATUS_CURSOR_EXISTS)
+            finish_result(status & ~SERVER_MORE_RESULTS_EXISTS);
+        else
+            state_ = State::ROWS;
+        break;
+    case State::ROWS:
+        // text rows never start with 0xff, binary ones start with 0x00
+        if(type == ERR_PACKET) {
+            error_ = true;
+            state_ = State::DONE;
+        }
+        else if(is_terminator(p, size, length)) {
+            read_terminator_status(p, size, status);
+            // with CLIENT_DEPRECATE_EOF this is where an opened cursor shows
+            if(status & SERVER_STATUS_CURSOR_EXISTS)
+                status &= ~SERVER_MORE_RESULTS_EXISTS;
+            finish_result(status);
+        }
+        else
+            rows_++;
+        break;
+    case State::DONE:
+        break;
+    }
+
+    return done();
+}
+
+bool ResponseTracker::is_terminator(const uint8_t *p, size_t size, size_t length) const {
+    if(size == 0 || p[0] != EOF_PACKET)
+        return false;
+
+    // a row whose first column is 2^24 bytes or longer starts with 0xfe too,
+    // it can't fit into a single packet
+    return deprecate_eof_ ? length < max_payload_length : length < 9;
+}
+
+void ResponseTracker::read_terminator_status(const uint8_t *p, size_t size, uint16_t &status) const {
+    if(!deprecate_eof_) {
+        read_status(p, size, status);
+        return;
+    }
+
+    // OK packet layout behind the 0xfe header
+    uint8_t head[22];
+    const size_t n = std::min(size, sizeof(head));
+    std::memcpy(head, p, n);
+    head[0] = OK_PACKET;
+    read_status(head, n, status);
+}
+
+bool ResponseTracker::finish_result(uint16_t status) {
+    status_ = status;
+    state_ = (status & SERVER_MORE_RESULTS_EXISTS) ? State::FIRST : State::DONE;
+    return done();
+}
+
+std::vector<uint8_t> native_password_token(const std::string &password, const uint8_t *scramble) {
+    if(password.empty())
+        return {};
+
+    unsigned char stage1[EVP_MAX_MD_SIZE];
+    unsigned char stage2[EVP_MAX_MD_SIZE];
+    unsigned char stage3[EVP_MAX_MD_SIZE];
+
+    EVP_Digest(password.data(), password.size(), stage1, nullptr, EVP_sha1(), nullptr);
+    EVP_Digest(stage1, scramble_length, stage2, nullptr, EVP_sha1(), nullptr);
+
+    uint8_t salted[scramble_length * 2];
+    std::memcpy(salted, scramble, scramble_length);
+    std::memcpy(salted + scramble_length, stage2, scramble_length);
+    EVP_Digest(salted, sizeof(salted), stage3, nullptr, EVP_sha1(), nullptr);
+
+    std::vector<uint8_t> token(scramble_length);
+    for(size_t i = 0; i < token.size(); i++)
+        token[i] = stage1[i] ^ stage3[i];
+    return token;
+}
+
+void make_scramble(uint8_t *scramble) {
+    if(RAND_bytes(scramble, scramble_length) != 1)
+        throw std::runtime_error("RAND_bytes failed");
+
+    // the scramble travels as a NUL terminated string
+    for(size_t i = 0; i < scramble_length; i++)
+        scramble[i] = static_cast<uint8_t>(33 + scramble[i] % 94);
+}
+
+const char *charset_name(uint8_t collation) {
+    switch(collation) {
+    case 8:   return "latin1";
+    case 28:  return "gbk";
+    case 33:  return "utf8";
+    case 45:  return "utf8mb4";
+    case 46:  return "utf8mb4 COLLATE utf8mb4_bin";
+    case 63:  return "binary";
+    case 83:  return "utf8 COLLATE utf8_bin";
+    case 192: return "utf8 COLLATE utf8_unicode_ci";
+    case 224: return "utf8mb4 COLLATE utf8mb4_unicode_ci";
+    case 255: return "utf8mb4 COLLATE utf8mb4_0900_ai_ci";
+    default:  return nullptr;
+    }
+}
+
+} // namespace My
+
+} // namespace db_proxy
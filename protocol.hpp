@@ -0,0 +1,392 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace db_proxy {
+
+namespace My {
+
+    enum CapabilityFlags : uint32_t {
+        CLIENT_LONG_PASSWORD                  = 0x00000001,
+        CLIENT_FOUND_ROWS                     = 0x00000002,
+        CLIENT_LONG_FLAG                      = 0x00000004,
+        CLIENT_CONNECT_WITH_DB                = 0x00000008,
+        CLIENT_COMPRESS                       = 0x00000020,
+        CLIENT_LOCAL_FILES                    = 0x00000080,
+        CLIENT_PROTOCOL_41                    = 0x00000200,
+        CLIENT_SSL                            = 0x00000800,
+        CLIENT_TRANSACTIONS                   = 0x00002000,
+        CLIENT_SECURE_CONNECTION              = 0x00008000,
+        CLIENT_MULTI_STATEMENTS               = 0x00010000,
+        CLIENT_MULTI_RESULTS                  = 0x00020000,
+        CLIENT_PS_MULTI_RESULTS               = 0x00040000,
+        CLIENT_PLUGIN_AUTH                    = 0x00080000,
+        CLIENT_CONNECT_ATTRS                  = 0x00100000,
+        CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA = 0x00200000,
+        CLIENT_SESSION_TRACK                  = 0x00800000,
+        CLIENT_DEPRECATE_EOF                  = 0x01000000,
+        CLIENT_ZSTD_COMPRESSION_ALGORITHM     = 0x04000000,
+        CLIENT_QUERY_ATTRIBUTES               = 0x08000000
+    };
+
+    enum StatusFlags : uint16_t {
+        SERVER_STATUS_IN_TRANS          = 0x0001,
+        SERVER_STATUS_AUTOCOMMIT        = 0x0002,
+        SERVER_MORE_RESULTS_EXISTS      = 0x0008,
+        SERVER_STATUS_CURSOR_EXISTS     = 0x0040,
+        SERVER_STATUS_LAST_ROW_SENT     = 0x0080,
+        SERVER_STATUS_IN_TRANS_READONLY = 0x2000
+    };
+
+    enum ResponseType : uint8_t {
+        OK_PACKET          = 0x00,
+        LOCAL_INFILE       = 0xfb,
+        EOF_PACKET         = 0xfe,
+        ERR_PACKET         = 0xff
+    };
+
+    enum { header_size = 4, max_payload_length = 0xffffff, scramble_length = 20 };
+
+    // read little endian integer of N bytes
+    template<size_t N>
+    inline uint64_t read_int(const uint8_t *data)
+    {
+        uint64_t v = 0;
+        for (size_t i = 0; i < N; i++)
+            v |= static_cast<uint64_t>(data[i]) << (8 * i);
+        return v;
+    }
+
+    // Length encoded integer at data[0..size). Returns bytes consumed, 0 if
+    // the buffer is too short or the first byte is not a length prefix.
+    size_t read_lenenc(const uint8_t *data, size_t size, uint64_t &value);
+
+    // EOF packets start with 0xfe and are shorter than 9 bytes, a row with
+    // a huge first column starts with 0xfe as well.
+    inline bool is_eof(const uint8_t *payload, size_t length)
+    {
+        return length > 0 && length < 9 && payload[0] == EOF_PACKET;
+    }
+
+    // Status flags of an OK or EOF packet, needs at most 22 payload bytes.
+    bool read_status(const uint8_t *payload, size_t size, uint16_t &status);
+
+    // Builds protocol packets into an output buffer.
+    class PacketWriter {
+    public:
+        explicit PacketWriter(std::vector<uint8_t> &out) : out_(out) {
+        }
+
+        // opens a packet, its length is filled in by finish()
+        void begin(uint8_t sequence_id) {
+            start_ = out_.size();
+            out_.insert(out_.end(), {0, 0, 0, sequence_id});
+        }
+
+        void finish() {
+            const size_t length = out_.size() - start_ - header_size;
+            out_[start_] = static_cast<uint8_t>(length);
+            out_[start_ + 1] = static_cast<uint8_t>(length >> 8);
+            out_[start_ + 2] = static_cast<uint8_t>(length >> 16);
+        }
+
+        template<size_t N>
+        void int_n(uint64_t v) {
+            for (size_t i = 0; i < N; i++)
+                out_.push_back(static_cast<uint8_t>(v >> (8 * i)));
+        }
+
+        void lenenc(uint64_t v);
+
+        void bytes(const void *data, size_t size) {
+            const uint8_t *p = static_cast<const uint8_t*>(data);
+            out_.insert(out_.end(), p, p + size);
+        }
+
+        void string(const std::string &s) { bytes(s.data(), s.size()); }
+
+        void string_nul(const std::string &s) {
+            string(s);
+            out_.push_back(0);
+        }
+
+        void zeros(size_t n) { out_.insert(out_.end(), n, 0); }
+
+    private:
+        std::vector<uint8_t> &out_;
+        size_t start_ = 0;
+    };
+
+    void write_ok(std::vector<uint8_t> &out, uint8_t sequence_id, uint16_t status);
+    void write_err(std::vector<uint8_t> &out, uint8_t sequence_id, uint16_t code,
+                   const char *sql_state, const std::string &message);
+
+    // Splits a byte stream into packets without copying payloads. Only the
+    // first max_head payload bytes of a packet are kept, which is enough to
+    // classify any response packet, and they are buffered only when they
+    // are split between reads.
+    class PacketFramer {
+    public:
+        enum { max_head = 32 };
+
+        struct Packet {
+            uint32_t payload_length;
+            uint8_t sequence_id;
+            // continues a payload of max_payload_length bytes
+            bool continuation;
+            const uint8_t *head;
+            size_t head_size;
+        };
+
+        // Calls on_packet(const Packet&) for every packet whose head is complete.
+        template<typename F>
+        void feed(const uint8_t *data, size_t size, F &&on_packet) {
+            while (size > 0) {
+                if (header_fill_ < header_size) {
+                    const size_t n = std::min(size, size_t(header_size) - header_fill_);
+                    std::memcpy(header_ + header_fill_, data, n);
+                    header_fill_ += n;
+                    data += n;
+                    size -= n;
+                    if (header_fill_ < header_size)
+                        return;
+
+                    current_.continuation = continued_;
+                    current_.payload_length = static_cast<uint32_t>(read_int<3>(header_));
+                    current_.sequence_id = header_[3];
+                    continued_ = current_.payload_length == max_payload_length;
+                    remaining_ = current_.payload_length;
+                    head_fill_ = 0;
+                    head_wanted_ = std::min<size_t>(remaining_, max_head);
+                    emitted_ = false;
+                }
+
+                if (!emitted_) {
+                    if (head_fill_ == 0 && size >= head_wanted_) {
+                        // whole head inside this read, no copy
+                        emit(data, head_wanted_, on_packet);
+                    }
+                    else {
+                        const size_t n = std::min(size, head_wanted_ - head_fill_);
+                        std::memcpy(head_ + head_fill_, data, n);
+                        head_fill_ += n;
+                        if (head_fill_ == head_wanted_)
+                            emit(head_, head_fill_, on_packet);
+                    }
+                }
+
+                const size_t n = std::min<size_t>(size, remaining_);
+                data += n;
+                size -= n;
+                remaining_ -= n;
+                if (remaining_ == 0)
+                    header_fill_ = 0;
+            }
+        }
+
+        // true between packets
+        bool at_boundary() const { return header_fill_ == 0; }
+
+    private:
+        template<typename F>
+        void emit(const uint8_t *head, size_t head_size, F &&on_packet) {
+            current_.head = head;
+            current_.head_size = head_size;
+            emitted_ = true;
+            on_packet(static_cast<const Packet&>(current_));
+        }
+
+        Packet current_ = {};
+        uint8_t header_[header_size] = {0};
+        uint8_t head_[max_head] = {0};
+        size_t header_fill_ = 0;
+        size_t head_fill_ = 0;
+        size_t head_wanted_ = 0;
+        size_t remaining_ = 0;
+        bool continued_ = false;
+        bool emitted_ = false;
+    };
+
+    // Reassembles whole logical packets from a byte stream, joining the
+    // packets of payloads longer than max_payload_length. A packet which
+    // lies inside one read is handed out in place; only packets split
+    // between reads are copied, and only as many payload bytes as the
+    // caller asked to keep.
+    class PacketAssembler {
+    public:
+        struct Packet {
+            // of the first packet of the payload
+            uint8_t sequence_id;
+            const uint8_t *payload;
+            // payload bytes available, less than length when cut by the limit
+            size_t size;
+            size_t length;
+        };
+
+        // limit(first_byte, sequence_id) returns how many payload bytes of
+        // a packet on_packet(const Packet&) needs to see.
+        template<typename Limit, typename F>
+        void feed(const uint8_t *data, size_t size, Limit &&limit, F &&on_packet) {
+            while (size > 0) {
+                if (header_fill_ == 0 && !continued_ && size >= header_size) {
+                    const size_t length = static_cast<size_t>(read_int<3>(data));
+                    if (length < max_payload_length && size >= header_size + length) {
+                        const size_t keep = length ? std::min(length, limit(data[header_size], data[3])) : 0;
+                        on_packet(static_cast<const Packet&>(Packet{data[3], data + header_size, keep, length}));
+                        data += header_size + length;
+                        size -= header_size + length;
+                        continue;
+                    }
+                }
+
+                if (header_fill_ < header_size) {
+                    const size_t n = std::min(size, size_t(header_size) - header_fill_);
+                    std::memcpy(header_ + header_fill_, data, n);
+                    header_fill_ += n;
+                    data += n;
+                    size -= n;
+                    if (header_fill_ < header_size)
+                        return;
+
+                    const size_t length = static_cast<size_t>(read_int<3>(header_));
+                    if (!continued_) {
+                        sequence_id_ = header_[3];
+                        length_ = 0;
+                        keep_ = unknown;
+                        buffer_.clear();
+                    }
+                    length_ += length;
+                    remaining_ = length;
+                    continued_ = length == max_payload_length;
+                }
+
+                if (remaining_ > 0 && size > 0) {
+                    const size_t n = std::min(size, remaining_);
+                    if (keep_ == unknown)
+                        keep_ = limit(data[0], sequence_id_);
+                    const size_t room = keep_ > buffer_.size() ? keep_ - buffer_.size() : 0;
+                    buffer_.insert(buffer_.end(), data, data + std::min(n, room));
+                    data += n;
+                    size -= n;
+                    remaining_ -= n;
+                }
+
+                if (remaining_ == 0) {
+                    header_fill_ = 0;
+                    if (!continued_)
+                        finish(on_packet);
+                }
+            }
+        }
+
+        // true between packets
+        bool at_boundary() const { return header_fill_ == 0 && !continued_; }
+
+        // Drops a partial packet, e.g. when the stream can't be followed.
+        void reset() {
+            header_fill_ = 0;
+            remaining_ = 0;
+            continued_ = false;
+            buffer_.clear();
+        }
+
+    private:
+        static constexpr size_t unknown = ~size_t(0);
+
+        template<typename F>
+        void finish(F &&on_packet) {
+            on_packet(static_cast<const Packet&>(Packet{sequence_id_, buffer_.data(),
+                                                        std::min(buffer_.size(), length_), length_}));
+            // one huge query shouldn't pin its memory for the session's lifetime
+            if (buffer_.capacity() > (1 << 20))
+                std::vector<uint8_t>().swap(buffer_);
+            buffer_.clear();
+        }
+
+        uint8_t header_[header_size] = {0};
+        size_t header_fill_ = 0;
+        size_t remaining_ = 0;
+        size_t length_ = 0;
+        size_t keep_ = unknown;
+        uint8_t sequence_id_ = 0;
+        bool continued_ = false;
+        std::vector<uint8_t> buffer_;
+    };
+
+    // Follows the server response to one command and tells where it ends:
+    // OK, ERR, result sets of text or binary rows, several of them while
+    // SERVER_MORE_RESULTS_EXISTS is set, with or without the EOF packets
+    // CLIENT_DEPRECATE_EOF drops. Only packet heads are looked at, rows and
+    // response bytes are counted on the way.
+    class ResponseTracker {
+    public:
+        // whether command gets any response at all
+        static bool has_response(uint8_t command);
+
+        // Whether the session negotiated CLIENT_DEPRECATE_EOF: result sets
+        // end with an OK packet headed 0xfe and column definitions with
+        // nothing at all.
+        void set_deprecate_eof(bool on) { deprecate_eof_ = on; }
+
+        void start(uint8_t command);
+
+        // Feeds the next response packet, returns true if it was the last one.
+        bool on_packet(const PacketFramer::Packet &packet);
+        // the same for a whole logical packet, the head needs at most 22 bytes
+        bool on_packet(const PacketAssembler::Packet &packet);
+
+        bool done() const { return state_ == State::DONE; }
+
+        // status flags of the last OK/EOF packet, valid once done()
+        uint16_t status() const { return status_; }
+        bool error() const { return error_; }
+
+        // rows of all result sets and bytes, headers included, so far
+        uint64_t rows() const { return rows_; }
+        uint64_t bytes() const { return bytes_; }
+
+    private:
+        enum class State {
+            FIRST,
+            PREPARE_DEFINITIONS,
+            FIELD_LIST,
+            SINGLE,
+            LOCAL_INFILE_RESULT,
+            COLUMNS,
+            COLUMNS_EOF,
+            ROWS,
+            DONE
+        };
+
+        bool on_payload(const uint8_t *p, size_t size, size_t length);
+        // EOF, or the OK packet which replaces it with CLIENT_DEPRECATE_EOF
+        bool is_terminator(const uint8_t *p, size_t size, size_t length) const;
+        void read_terminator_status(const uint8_t *p, size_t size, uint16_t &status) const;
+        bool finish_result(uint16_t status);
+
+        State state_ = State::DONE;
+        uint8_t command_ = 0;
+        uint64_t remaining_ = 0;
+        uint16_t status_ = 0;
+        bool error_ = false;
+        bool deprecate_eof_ = false;
+        uint64_t rows_ = 0;
+        uint64_t bytes_ = 0;
+    };
+
+    // mysql_native_password: SHA1(password) XOR SHA1(scramble + SHA1(SHA1(password)))
+    std::vector<uint8_t> native_password_token(const std::string &password, const uint8_t *scramble);
+
+    // Random printable scramble of scramble_length bytes.
+    void make_scramble(uint8_t *scramble);
+
+    // Name usable in SET NAMES for a collation id, nullptr if unknown.
+    const char *charset_name(uint8_t collation);
+
+} // namespace My
+
+} // namespace db_proxy
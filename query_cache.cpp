@@ -0,0 +1,146 @@
+#include "query_cache.hpp"
+#include "sql_scan.hpp"
+
+#include <cctype>
+
+namespace db_proxy
+{
+    query_cache::query_cache(const cache_options& options, size_t max_bytes)
+        : ttl_(options.ttl),
+          max_bytes_(max_bytes)
+    {
+        for (const auto& pattern : options.patterns)
+            patterns_.emplace_back(pattern, std::regex::icase | std::regex::optimize);
+    }
+
+    std::string query_cache::normalise(const uint8_t* query, size_t size)
+    {
+        std::string text;
+        text.reserve(size);
+
+        for (size_t i = 0; i < size; i++)
+        {
+            const char c = static_cast<char>(query[i]);
+
+            // quoted text is kept as it is
+            if (c == '\'' || c == '"' || c == '`')
+            {
+                const size_t n = 1 + sql::scan::skip_quoted(query + i + 1, size - i - 1, query[i]);
+                text.append(reinterpret_cast<const char*>(query + i), n);
+                i += n - 1;
+                continue;
+            }
+
+            if (sql::scan::is_space(query[i]))
+            {
+                if (!text.empty() && text.back() != ' ')
+                    text += ' ';
+                continue;
+            }
+
+            // user and system variables make the result session dependent,
+            // a second statement could be anything
+            if (c == '@' || c == ';')
+            {
+                // a trailing ';' is fine
+                size_t rest = i + 1;
+                while (c == ';' && rest < size && sql::scan::is_space(query[rest]))
+                    rest++;
+                if (c == ';' && rest == size)
+                    break;
+                return std::string();
+            }
+
+            text += c;
+        }
+
+        while (!text.empty() && (text.back() == ' ' || text.back() == ';'))
+            text.pop_back();
+
+        auto starts_with_word = [&text](const char* word, size_t at)
+        {
+            size_t i = 0;
+            for (; word[i]; i++)
+            {
+                if (at + i >= text.size() || std::toupper(static_cast<unsigned char>(text[at + i])) != word[i])
+                    return false;
+            }
+            return at + i == text.size() || !std::isalnum(static_cast<unsigned char>(text[at + i]));
+        };
+
+        if (!starts_with_word("SELECT", 0) || starts_with_word("SQL_NO_CACHE", 7))
+            return std::string();
+
+        return text;
+    }
+
+    std::string query_cache::make_key(const std::string& schema, uint8_t charset, const std::string& query)
+    {
+        std::string key;
+        key.reserve(schema.size() + 2 + query.size());
+        key += schema;
+        key += '\0';
+        key += static_cast<char>(charset);
+        key += query;
+        return key;
+    }
+
+    bool query_cache::cacheable(const std::string& query) const
+    {
+        for (const auto& pattern : patterns_)
+        {
+            if (std::regex_search(query, pattern))
+                return true;
+        }
+        return false;
+    }
+
+    query_cache::result_ptr query_cache::find(const std::string& key)
+    {
+        auto it = index_.find(key);
+        if (it == index_.end())
+            return nullptr;
+
+        if (it->second->expires <= clock::now())
+        {
+            erase(it->second);
+            return nullptr;
+        }
+
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->result;
+    }
+
+    void query_cache::insert(const std::string& key, std::vector<uint8_t> result)
+    {
+        const size_t needed = cost(key, result.size());
+        if (needed > max_bytes_)
+            return;
+
+        auto it = index_.find(key);
+        if (it != index_.end())
+            erase(it->second);
+
+        while (bytes_ + needed > max_bytes_)
+            erase(std::prev(lru_.end()));
+
+        lru_.push_front(entry{key,
+                              std::make_shared<const std::vector<uint8_t>>(std::move(result)),
+                              clock::now() + ttl_});
+        index_.emplace(key, lru_.begin());
+        bytes_ += needed;
+    }
+
+    size_t query_cache::cost(const std::string& key, size_t result_size)
+    {
+        // the key is stored twice, plus list, map and shared_ptr nodes
+        return 2 * key.size() + result_size + 128;
+    }
+
+    void query_cache::erase(entry_list::iterator it)
+    {
+        bytes_ -= cost(it->key, it->result->size());
+        index_.erase(it->key);
+        lru_.erase(it);
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <regex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace db_proxy
+{
+    struct cache_options
+    {
+        // memory for cached results of all threads, 0 - no caching
+        size_t max_bytes = 0;
+        std::chrono::milliseconds ttl{1000};
+        // SELECTs whose normalised text matches one of these are cached
+        std::vector<std::string> patterns;
+    };
+
+    // Result cache of one shard for read-only COM_QUERY traffic, keyed by
+    // schema, character set and normalised query text. Entries expire after
+    // the TTL, the least recently used ones make room for new entries.
+    class query_cache
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+        // response packets as the backend sent them, headers included
+        using result_ptr = std::shared_ptr<const std::vector<uint8_t>>;
+
+        query_cache(const cache_options& options, size_t max_bytes);
+
+        query_cache(const query_cache&) = delete;
+        query_cache& operator=(const query_cache&) = delete;
+
+        // Query text with blanks collapsed and the trailing ';' removed.
+        // Empty unless it is a single SELECT which depends on nothing but
+        // the data, i.e. no variables and no SQL_NO_CACHE.
+        static std::string normalise(const uint8_t* query, size_t size);
+
+        static std::string make_key(const std::string& schema, uint8_t charset, const std::string& query);
+
+        // whether a normalised query matches the configured patterns
+        bool cacheable(const std::string& query) const;
+
+        // nullptr on a miss or when the entry has expired
+        result_ptr find(const std::string& key);
+
+        void insert(const std::string& key, std::vector<uint8_t> result);
+
+        // larger results are not worth evicting everything else for
+        size_t max_entry_size() const { return max_bytes_ / 8; }
+
+        size_t entries() const { return index_.size(); }
+
+    private:
+        struct entry
+        {
+            std::string key;
+            result_ptr result;
+            clock::time_point expires;
+        };
+
+        using entry_list = std::list<entry>;
+
+        static size_t cost(const std::string& key, size_t result_size);
+
+        void erase(entry_list::iterator it);
+
+        std::vector<std::regex> patterns_;
+        clock::duration ttl_;
+        size_t max_bytes_;
+        size_t bytes_ = 0;
+        // most recently used first
+        entry_list lru_;
+        std::unordered_map<std::string, entry_list::iterator> index_;
+    };
+}
@@ -0,0 +1,261 @@
+#include "capture.hpp"
+#include "debug.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "parser.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+namespace db_proxy
+{
+    struct replay_options
+    {
+        std::string capture;
+        // parser log, empty - none
+        std::string log;
+        // parsers count into metrics, which are printed at the end
+        bool metrics = false;
+        // print the records instead of replaying them
+        bool dump = false;
+        // only this session, 0 - all of them
+        uint64_t session = 0;
+        size_t repeat = 1;
+    };
+
+    namespace
+    {
+        const char* record_name(capture_log::record_type type)
+        {
+            switch (type)
+            {
+            case capture_log::session_open: return "open";
+            case capture_log::session_close: return "close";
+            case capture_log::parse_client: return "client";
+            case capture_log::parse_server: return "server";
+            case capture_log::parse_server_head: return "server head";
+            case capture_log::server_relayed: return "server relayed";
+            case capture_log::response_done: return "response done";
+            case capture_log::skip_handshake: return "skip handshake";
+            case capture_log::classify_queries: return "classify queries";
+            case capture_log::tls_terminated: return "TLS terminated";
+            }
+            return "unknown";
+        }
+
+        uint64_t read_value(const capture_reader::record& r)
+        {
+            uint64_t value = 0;
+            std::memcpy(&value, r.data, std::min(r.size, sizeof(value)));
+            return value;
+        }
+    }
+
+    void dump(capture_reader& reader, const replay_options& options)
+    {
+        capture_reader::record r;
+        while (reader.next(r))
+        {
+            if (options.session != 0 && r.session != options.session)
+                continue;
+
+            std::cout << std::fixed << std::setprecision(6) << static_cast<double>(r.time) / 1e9
+                      << " session " << r.session << ' ' << record_name(r.type);
+            if (r.type == capture_log::server_relayed || r.type == capture_log::response_done)
+                std::cout << ' ' << read_value(r) << '\n';
+            else if (r.size > 0)
+            {
+                std::cout << ", " << r.size << " bytes\n";
+                Debug::hexdump(std::cout, r.data, r.size);
+            }
+            else
+                std::cout << '\n';
+        }
+    }
+
+    // Feeds every session's records to a parser of its own, in the order
+    // they were captured. Returns the bytes of traffic parsed.
+    uint64_t replay(capture_reader& reader, const replay_options& options, traffic_metrics* metrics,
+                    uint64_t& sessions, uint64_t& records)
+    {
+        std::unordered_map<uint64_t, std::unique_ptr<My::Parser>> parsers;
+        uint64_t bytes = 0;
+
+        capture_reader::record r;
+        while (reader.next(r))
+        {
+            if (options.session != 0 && r.session != options.session)
+                continue;
+            records++;
+
+            if (r.type == capture_log::session_open)
+            {
+                auto& parser = parsers[r.session];
+                parser.reset(new My::Parser);
+                parser->set_metrics(metrics);
+                sessions++;
+                continue;
+            }
+
+            // sessions opened before the capture started aren't in it
+            auto it = parsers.find(r.session);
+            if (it == parsers.end())
+                continue;
+            My::Parser& parser = *it->second;
+
+            switch (r.type)
+            {
+            case capture_log::session_close:
+                parsers.erase(it);
+                break;
+            case capture_log::parse_client:
+                parser.parse_client(r.data, r.size);
+                bytes += r.size;
+                break;
+            case capture_log::parse_server:
+                parser.parse_server(r.data, r.size);
+                bytes += r.size;
+                break;
+            case capture_log::parse_server_head:
+                parser.parse_server_head(r.data, r.size);
+                bytes += r.size;
+                break;
+            case capture_log::server_relayed:
+                parser.server_relayed(static_cast<size_t>(read_value(r)));
+                break;
+            case capture_log::response_done:
+                parser.response_done(read_value(r));
+                break;
+            case capture_log::skip_handshake:
+                parser.skip_handshake();
+                break;
+            case capture_log::classify_queries:
+                parser.classify_queries();
+                break;
+            case capture_log::tls_terminated:
+                parser.tls_terminated();
+                break;
+            default:
+                break;
+            }
+        }
+
+        return bytes;
+    }
+}
+
+class ReplayOptions {
+private:
+    int argc_;
+    char **argv_;
+public:
+    db_proxy::replay_options replay;
+
+    ReplayOptions(int argc, char **argv) : argc_(argc), argv_(argv) {
+    }
+
+    // false - something required is missing
+    bool parse() {
+        for(int i = 1; i < argc_; i++) {
+            std::string arg = argv_[i];
+
+            if(arg == "--log")
+                replay.log = argv_[++i];
+            else if(arg == "--metrics")
+                replay.metrics = true;
+            else if(arg == "--dump")
+                replay.dump = true;
+            else if(arg == "--session")
+                replay.session = std::stoull(argv_[++i]);
+            else if(arg == "--repeat")
+                replay.repeat = static_cast<size_t>(std::max(1, std::stoi(argv_[++i])));
+            else if(arg == "--help")
+                return false;
+            else
+                replay.capture = arg;
+        }
+
+        return !replay.capture.empty();
+    }
+
+    void help() {
+        std::cout << "Usage: " << argv_[0] << " [options] capture" << '\n';
+        std::cout << "  Runs a capture of db-proxy --capture through the parser, no sockets involved\n";
+        std::cout << "  Options:\n";
+        std::cout << "    --log [arg]" << "\t\t Write the parser's log to this file. Default: no log\n";
+        std::cout << "    --metrics" << "\t\t Count metrics and digests as the proxy does and print them at the end\n";
+        std::cout << "    --session [arg]" << "\t Replay only this session\n";
+        std::cout << "    --repeat [arg]" << "\t Replay the capture this many times, for profiling. Default: " << replay.repeat << '\n';
+        std::cout << "    --dump" << "\t\t Print the records instead\n";
+    }
+};
+
+int main(int argc, char** argv)
+{
+    ReplayOptions options(argc, argv);
+
+    if (!options.parse()) {
+        options.help();
+        return EXIT_FAILURE;
+    }
+
+    const auto& replay = options.replay;
+
+    // parsers look their logger up once, when they are created; a
+    // synchronous one keeps the log in replay order
+    if (replay.log.empty())
+        LoggerRegistry::instance().create_null("logger");
+    else
+        LoggerRegistry::instance().create_file("logger", replay.log);
+
+    try
+    {
+        db_proxy::capture_reader reader(replay.capture);
+
+        if (replay.dump)
+        {
+            db_proxy::dump(reader, replay);
+            return EXIT_SUCCESS;
+        }
+
+        std::unique_ptr<db_proxy::traffic_metrics> metrics;
+        if (replay.metrics)
+        {
+            metrics.reset(new db_proxy::traffic_metrics);
+            metrics->digests.set_capacity(1000);
+        }
+
+        uint64_t bytes = 0, sessions = 0, records = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < replay.repeat; i++)
+        {
+            reader.reset();
+            bytes += db_proxy::replay(reader, replay, metrics.get(), sessions, records);
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (metrics)
+        {
+            db_proxy::metrics_snapshot snapshot;
+            snapshot.add(*metrics);
+            snapshot.write(std::cout);
+        }
+
+        std::cerr << sessions << " sessions, " << records << " records, " << bytes << " bytes in "
+                  << std::fixed << std::setprecision(3) << seconds << " s, "
+                  << std::setprecision(1) << (seconds > 0 ? static_cast<double>(bytes) / seconds / (1 << 20) : 0.0)
+                  << " MB/s" << std::endl;
+    }
+    catch(std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#if defined(__linux__)
+
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace db_proxy
+{
+    // Kernel pipe used as the intermediate buffer for splice(2): bytes go
+    // socket -> pipe -> socket without ever being copied into user space.
+    class splice_pipe
+    {
+    public:
+        static constexpr size_t default_capacity = 64 * 1024;
+
+        explicit splice_pipe(size_t capacity = default_capacity)
+        {
+            if (::pipe2(fds_, O_NONBLOCK | O_CLOEXEC) != 0)
+                throw std::system_error(errno, std::generic_category(), "pipe2");
+
+            // best effort, the default pipe size is used when this fails
+            const int size = ::fcntl(fds_[1], F_SETPIPE_SZ, static_cast<int>(capacity));
+            capacity_ = size > 0 ? static_cast<size_t>(size) : default_capacity;
+        }
+
+        ~splice_pipe()
+        {
+            ::close(fds_[0]);
+            ::close(fds_[1]);
+        }
+
+        splice_pipe(const splice_pipe&) = delete;
+        splice_pipe& operator=(const splice_pipe&) = delete;
+
+        size_t capacity() const { return capacity_; }
+
+        // bytes moved into the pipe and not yet drained to the destination
+        size_t pending() const { return pending_; }
+
+        // Moves up to capacity() bytes from the socket into the pipe.
+        // Returns bytes moved, 0 on EOF, -1 with errno set on error.
+        ssize_t fill(int from)
+        {
+            const ssize_t n = ::splice(from, nullptr, fds_[1], nullptr,
+                                       capacity_ - pending_,
+                                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+                pending_ += static_cast<size_t>(n);
+            return n;
+        }
+
+        // Moves pending bytes from the pipe to the socket.
+        // Returns bytes moved, -1 with errno set on error.
+        ssize_t drain(int to)
+        {
+            const ssize_t n = ::splice(fds_[0], nullptr, to, nullptr, pending_,
+                                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+                pending_ -= static_cast<size_t>(n);
+            return n;
+        }
+
+    private:
+        int fds_[2] = {-1, -1};
+        size_t capacity_ = default_capacity;
+        size_t pending_ = 0;
+    };
+}
+
+#endif
@@ -0,0 +1,768 @@
+#include "sql.hpp"
+#include "sql_scan.hpp"
+
+#include <cstring>
+
+namespace db_proxy
+{
+    namespace sql
+    {
+        namespace
+        {
+            using namespace scan;
+
+            // Keywords classify() acts on, and the ones which end a table
+            // name's alias.
+            enum keyword : uint8_t {
+                k_none,
+                k_select, k_insert, k_replace, k_update, k_delete, k_load, k_call, k_do,
+                k_begin, k_start, k_commit, k_rollback, k_savepoint, k_release,
+                k_set, k_use, k_show, k_describe, k_desc, k_explain, k_lock, k_unlock,
+                k_prepare, k_execute, k_deallocate, k_handler,
+                k_create, k_alter, k_drop, k_rename, k_truncate, k_xa, k_with,
+                k_table, k_tables, k_transaction, k_to, k_from, k_join, k_into, k_for, k_share, k_in,
+                k_temporary, k_if, k_not, k_exists, k_low_priority, k_high_priority, k_delayed,
+                k_ignore, k_quick, k_values, k_value, k_dual, k_as, k_read, k_write, k_local,
+                k_last_insert_id, k_found_rows, k_row_count, k_sql_calc_found_rows,
+                k_get_lock, k_release_lock, k_release_all_locks,
+                k_where, k_on, k_using, k_order, k_group, k_having, k_limit, k_union, k_except,
+                k_intersect, k_left, k_right, k_inner, k_outer, k_cross, k_natural, k_straight_join,
+                k_partition, k_window, k_force
+            };
+
+            struct keyword_entry
+            {
+                const char* text;
+                keyword id;
+            };
+
+            constexpr keyword_entry keywords[] = {
+                {"SELECT", k_select}, {"INSERT", k_insert}, {"REPLACE", k_replace}, {"UPDATE", k_update},
+                {"DELETE", k_delete}, {"LOAD", k_load}, {"CALL", k_call}, {"DO", k_do},
+                {"BEGIN", k_begin}, {"START", k_start}, {"COMMIT", k_commit}, {"ROLLBACK", k_rollback},
+                {"SAVEPOINT", k_savepoint}, {"RELEASE", k_release}, {"SET", k_set}, {"USE", k_use},
+                {"SHOW", k_show}, {"DESCRIBE", k_describe}, {"DESC", k_desc}, {"EXPLAIN", k_explain},
+                {"LOCK", k_lock}, {"UNLOCK", k_unlock}, {"PREPARE", k_prepare}, {"EXECUTE", k_execute},
+                {"DEALLOCATE", k_deallocate}, {"HANDLER", k_handler}, {"CREATE", k_create},
+                {"ALTER", k_alter}, {"DROP", k_drop}, {"RENAME", k_rename}, {"TRUNCATE", k_truncate},
+                {"XA", k_xa}, {"WITH", k_with}, {"TABLE", k_table}, {"TABLES", k_tables},
+                {"TRANSACTION", k_transaction}, {"TO", k_to}, {"FROM", k_from}, {"JOIN", k_join},
+                {"INTO", k_into}, {"FOR", k_for}, {"SHARE", k_share}, {"IN", k_in},
+                {"TEMPORARY", k_temporary}, {"IF", k_if}, {"NOT", k_not}, {"EXISTS", k_exists},
+                {"LOW_PRIORITY", k_low_priority}, {"HIGH_PRIORITY", k_high_priority},
+                {"DELAYED", k_delayed}, {"IGNORE", k_ignore}, {"QUICK", k_quick}, {"VALUES", k_values},
+                {"VALUE", k_value}, {"DUAL", k_dual}, {"AS", k_as}, {"READ", k_read}, {"WRITE", k_write},
+                {"LOCAL", k_local}, {"LAST_INSERT_ID", k_last_insert_id}, {"FOUND_ROWS", k_found_rows},
+                {"ROW_COUNT", k_row_count}, {"SQL_CALC_FOUND_ROWS", k_sql_calc_found_rows},
+                {"GET_LOCK", k_get_lock}, {"RELEASE_LOCK", k_release_lock},
+                {"RELEASE_ALL_LOCKS", k_release_all_locks}, {"WHERE", k_where}, {"ON", k_on},
+                {"USING", k_using}, {"ORDER", k_order}, {"GROUP", k_group}, {"HAVING", k_having},
+                {"LIMIT", k_limit}, {"UNION", k_union}, {"EXCEPT", k_except}, {"INTERSECT", k_intersect},
+                {"LEFT", k_left}, {"RIGHT", k_right}, {"INNER", k_inner}, {"OUTER", k_outer},
+                {"CROSS", k_cross}, {"NATURAL", k_natural}, {"STRAIGHT_JOIN", k_straight_join},
+                {"PARTITION", k_partition}, {"WINDOW", k_window}, {"FORCE", k_force}
+            };
+
+            const size_t keyword_count = sizeof(keywords) / sizeof(keywords[0]);
+            const size_t max_keyword = 19;
+
+            // Open addressing on the first and last letter and the length,
+            // case folded: a word usually costs one probe and one compare.
+            struct keyword_table
+            {
+                static const unsigned slots = 256;
+
+                // position in keywords + 1, 0 - empty
+                uint8_t slot[slots];
+                uint8_t length[keyword_count];
+
+                static constexpr unsigned hash(uint8_t first, uint8_t last, size_t n)
+                {
+                    return ((first | 0x20u) * 33u + (last | 0x20u) * 5u + static_cast<unsigned>(n)) & (slots - 1);
+                }
+
+                constexpr keyword_table() : slot(), length()
+                {
+                    for (size_t k = 0; k < keyword_count; k++)
+                    {
+                        const char* text = keywords[k].text;
+                        size_t n = 0;
+                        while (text[n])
+                            n++;
+                        length[k] = static_cast<uint8_t>(n);
+
+                        unsigned h = hash(static_cast<uint8_t>(text[0]), static_cast<uint8_t>(text[n - 1]), n);
+                        while (slot[h])
+                            h = (h + 1) & (slots - 1);
+                        slot[h] = static_cast<uint8_t>(k + 1);
+                    }
+                }
+            };
+
+            constexpr keyword_table keyword_index;
+
+            keyword find_keyword(const uint8_t* p, size_t n)
+            {
+                if (n < 2 || n > max_keyword)
+                    return k_none;
+
+                for (unsigned h = keyword_table::hash(p[0], p[n - 1], n); keyword_index.slot[h];
+                     h = (h + 1) & (keyword_table::slots - 1))
+                {
+                    const size_t k = keyword_index.slot[h] - 1u;
+                    if (keyword_index.length[k] != n)
+                        continue;
+
+                    // keywords are upper case letters and '_', which the
+                    // 0xdf mask leaves alone
+                    const char* text = keywords[k].text;
+                    size_t i = 0;
+                    while (i < n && (p[i] & 0xdf) == static_cast<uint8_t>(text[i]))
+                        i++;
+                    if (i == n)
+                        return keywords[k].id;
+                }
+                return k_none;
+            }
+
+            // where a table name is in the statement
+            enum class table_state {
+                none,
+                // after FROM, JOIN, INTO, ...: a name or a modifier
+                expect,
+                // after a name: a '.', an alias, a ',' and another name
+                after_name,
+                // after schema.
+                dot,
+                // after AS
+                after_as,
+                // after an alias: a ',' and another name
+                after_alias
+            };
+
+            // words which may come between FROM, INTO, TABLE and the like
+            // and the name
+            bool table_modifier(keyword k)
+            {
+                switch (k)
+                {
+                case k_if:
+                case k_not:
+                case k_exists:
+                case k_temporary:
+                case k_low_priority:
+                case k_high_priority:
+                case k_delayed:
+                case k_ignore:
+                case k_quick:
+                case k_into:
+                case k_from:
+                case k_table:
+                case k_tables:
+                    return true;
+                default:
+                    return false;
+                }
+            }
+
+            // words in place of a name which mean there is none
+            bool ends_table_list(keyword k)
+            {
+                switch (k)
+                {
+                case k_select:
+                case k_with:
+                case k_values:
+                case k_value:
+                case k_set:
+                case k_dual:
+                    return true;
+                default:
+                    return false;
+                }
+            }
+
+            bool same_span(const uint8_t* query, uint32_t a, uint32_t b, uint32_t length)
+            {
+                return std::memcmp(query + a, query + b, length) == 0;
+            }
+        }
+
+        bool lexer::next(token& t)
+        {
+            while (i_ < size_)
+            {
+                // tokens are mostly a blank apart, a branch costs less here
+                // than a trip through the switch
+                if (is_space(query_[i_]))
+                {
+                    while (++i_ < size_ && is_space(query_[i_]))
+                        ;
+                    continue;
+                }
+
+                const size_t start = i_;
+                const uint8_t c = query_[i_];
+                const uint8_t next = i_ + 1 < size_ ? query_[i_ + 1] : 0;
+                token_type type = token_type::op;
+
+                switch (classes.of[c])
+                {
+                case c_letter:
+                    type = token_type::word;
+                    i_ += word_length(query_ + i_, size_ - i_);
+                    break;
+                case c_digit:
+                    type = token_type::number;
+                    i_ += number_length(query_ + i_, size_ - i_);
+                    break;
+                case c_quote:
+                    type = token_type::string;
+                    i_ += 1 + skip_quoted(query_ + i_ + 1, size_ - i_ - 1, c);
+                    break;
+                case c_backtick:
+                    type = token_type::quoted_name;
+                    i_ += 1 + skip_quoted(query_ + i_ + 1, size_ - i_ - 1, c);
+                    break;
+                case c_variable:
+                    type = token_type::variable;
+                    i_ += next == '@' ? 2 : 1;
+                    if (i_ < size_ && (classes.of[query_[i_]] == c_quote || classes.of[query_[i_]] == c_backtick))
+                        i_ += 1 + skip_quoted(query_ + i_ + 1, size_ - i_ - 1, query_[i_]);
+                    else
+                    {
+                        // @@session.sql_mode is one variable
+                        for (;;)
+                        {
+                            i_ += word_length(query_ + i_, size_ - i_);
+                            if (i_ + 1 >= size_ || query_[i_] != '.' || !is_word(query_[i_ + 1]))
+                                break;
+                            i_++;
+                        }
+                    }
+                    break;
+                case c_placeholder:
+                    type = token_type::placeholder;
+                    i_++;
+                    break;
+                case c_hash:
+                {
+                    const void* eol = std::memchr(query_ + i_, '\n', size_ - i_);
+                    i_ = eol ? static_cast<size_t>(static_cast<const uint8_t*>(eol) - query_) + 1 : size_;
+                }
+                    continue;
+                case c_open:
+                    type = token_type::open;
+                    i_++;
+                    break;
+                case c_close:
+                    type = token_type::close;
+                    i_++;
+                    break;
+                case c_comma:
+                    type = token_type::comma;
+                    i_++;
+                    break;
+                case c_semicolon:
+                    type = token_type::semicolon;
+                    i_++;
+                    break;
+                case c_dot:
+                    if (classes.of[next] == c_digit)
+                    {
+                        type = token_type::number;
+                        i_ += number_length(query_ + i_, size_ - i_);
+                    }
+                    else
+                    {
+                        type = token_type::dot;
+                        i_++;
+                    }
+                    break;
+                default:
+                    if (c == '-' && next == '-' && (i_ + 2 >= size_ || query_[i_ + 2] <= ' '))
+                    {
+                        const void* eol = std::memchr(query_ + i_, '\n', size_ - i_);
+                        i_ = eol ? static_cast<size_t>(static_cast<const uint8_t*>(eol) - query_) + 1 : size_;
+                        continue;
+                    }
+                    if (c == '*' && next == '/' && in_executable_)
+                    {
+                        in_executable_ = false;
+                        i_ += 2;
+                        continue;
+                    }
+                    if (c == '/' && next == '*')
+                    {
+                        i_ += 2;
+                        // /*! and MariaDB's /*M! with an optional version
+                        const bool mariadb = i_ + 1 < size_ && query_[i_] == 'M' && query_[i_ + 1] == '!';
+                        if (mariadb || (i_ < size_ && query_[i_] == '!'))
+                        {
+                            i_ += mariadb ? 2 : 1;
+                            while (i_ < size_ && classes.of[query_[i_]] == c_digit)
+                                i_++;
+                            in_executable_ = true;
+                            executable_comment_ = true;
+                            continue;
+                        }
+                        while (i_ < size_)
+                        {
+                            const void* star = std::memchr(query_ + i_, '*', size_ - i_);
+                            if (!star)
+                            {
+                                i_ = size_;
+                                break;
+                            }
+                            i_ = static_cast<size_t>(static_cast<const uint8_t*>(star) - query_) + 1;
+                            if (i_ < size_ && query_[i_] == '/')
+                            {
+                                i_++;
+                                break;
+                            }
+                        }
+                        continue;
+                    }
+                    i_++;
+                    break;
+                }
+
+                t.type = type;
+                t.offset = static_cast<uint32_t>(start);
+                t.length = static_cast<uint32_t>(i_ - start);
+                return true;
+            }
+
+            t.type = token_type::end;
+            t.offset = static_cast<uint32_t>(size_);
+            t.length = 0;
+            return false;
+        }
+
+        const char* type_name(statement_type type)
+        {
+            switch (type)
+            {
+            case statement_type::unknown:       return "unknown";
+            case statement_type::select:        return "select";
+            case statement_type::insert:        return "insert";
+            case statement_type::replace:       return "replace";
+            case statement_type::update:        return "update";
+            case statement_type::delete_:       return "delete";
+            case statement_type::load:          return "load";
+            case statement_type::call:          return "call";
+            case statement_type::do_:           return "do";
+            case statement_type::begin:         return "begin";
+            case statement_type::commit:        return "commit";
+            case statement_type::rollback:      return "rollback";
+            case statement_type::savepoint:     return "savepoint";
+            case statement_type::set:           return "set";
+            case statement_type::use:           return "use";
+            case statement_type::show:          return "show";
+            case statement_type::describe:      return "describe";
+            case statement_type::lock_tables:   return "lock_tables";
+            case statement_type::unlock_tables: return "unlock_tables";
+            case statement_type::prepare:       return "prepare";
+            case statement_type::execute:       return "execute";
+            case statement_type::deallocate:    return "deallocate";
+            case statement_type::handler:       return "handler";
+            case statement_type::ddl:           return "ddl";
+            case statement_type::xa:            return "xa";
+            case statement_type::other:         return "other";
+            }
+            return "unknown";
+        }
+
+        bool classification::read_only() const
+        {
+            const uint32_t unsafe = session_state | locking_read | select_into | multiple_statements |
+                                    executable_comment | truncated;
+            return type == statement_type::select && (effects & unsafe) == 0;
+        }
+
+        void classify(const uint8_t* query, size_t size, classification& out)
+        {
+            out = classification();
+
+            lexer lex(query, size);
+            token t;
+            // the statement being read, the first one is the one reported
+            statement_type current = statement_type::unknown;
+            size_t statements = 0;
+            // before the first word of a statement
+            bool at_start = true;
+            // a WITH is waiting for its statement at with_depth
+            bool with = false;
+            size_t with_depth = 0;
+            size_t depth = 0;
+            // of the word before, k_none after anything else
+            keyword prev = k_none;
+
+            table_state tables = table_state::none;
+            // the table name being read, schema.length is 0 without one
+            token schema;
+            token name;
+
+            auto set_type = [&](statement_type type)
+            {
+                current = type;
+                if (statements == 1)
+                    out.type = type;
+            };
+
+            auto commit_table = [&]()
+            {
+                table_ref ref;
+                ref.schema_offset = schema.offset;
+                ref.schema_length = schema.length;
+                ref.name_offset = name.offset;
+                ref.name_length = name.length;
+
+                for (size_t k = 0; k < out.table_count; k++)
+                {
+                    const table_ref& seen = out.tables[k];
+                    if (seen.name_length == ref.name_length && seen.schema_length == ref.schema_length &&
+                        same_span(query, seen.name_offset, ref.name_offset, ref.name_length) &&
+                        same_span(query, seen.schema_offset, ref.schema_offset, ref.schema_length))
+                        return;
+                }
+                if (out.table_count == classification::max_tables)
+                    out.more_tables = true;
+                else
+                    out.tables[out.table_count++] = ref;
+            };
+
+            while (lex.next(t))
+            {
+                // most of a long statement, literals and the commas between
+                // them mean nothing outside a table list
+                if (!at_start && tables == table_state::none &&
+                    (t.type == token_type::string || t.type == token_type::number ||
+                     t.type == token_type::comma || t.type == token_type::op ||
+                     t.type == token_type::placeholder))
+                {
+                    prev = k_none;
+                    continue;
+                }
+
+                const bool named = t.type == token_type::word || t.type == token_type::quoted_name;
+                const keyword k = t.type == token_type::word ? find_keyword(query + t.offset, t.length) : k_none;
+
+                if (t.type == token_type::semicolon)
+                {
+                    if (tables == table_state::after_name || tables == table_state::dot)
+                        commit_table();
+                    tables = table_state::none;
+                    at_start = true;
+                    with = false;
+                    depth = 0;
+                    prev = k_none;
+                    current = statement_type::unknown;
+                    continue;
+                }
+                if (at_start && current == statement_type::unknown && depth == 0 && !with)
+                {
+                    // the first token of a statement
+                    if (++statements > 1)
+                        out.effects |= multiple_statements;
+                    current = statement_type::other;
+                    if (statements == 1)
+                        out.type = statement_type::other;
+                }
+
+                // a table name and its alias
+                switch (tables)
+                {
+                case table_state::none:
+                    break;
+                case table_state::expect:
+                    if (table_modifier(k))
+                        break;
+                    if (named && !ends_table_list(k))
+                    {
+                        schema = token();
+                        name = t;
+                        tables = table_state::after_name;
+                        prev = k;
+                        continue;
+                    }
+                    tables = table_state::none;
+                    break;
+                case table_state::dot:
+                    if (named)
+                    {
+                        schema = name;
+                        name = t;
+                        tables = table_state::after_name;
+                        prev = k;
+                        continue;
+                    }
+                    commit_table();
+                    tables = table_state::none;
+                    break;
+                case table_state::after_name:
+                    if (t.type == token_type::dot && schema.length == 0)
+                    {
+                        tables = table_state::dot;
+                        continue;
+                    }
+                    commit_table();
+                    // fall through
+                case table_state::after_as:
+                case table_state::after_alias:
+                    if (t.type == token_type::comma)
+                    {
+                        tables = table_state::expect;
+                        prev = k_none;
+                        continue;
+                    }
+                    // LOCK TABLES t READ LOCAL, u WRITE
+                    if (k == k_read || k == k_write || k == k_local || k == k_low_priority)
+                    {
+                        tables = table_state::after_alias;
+                        prev = k;
+                        continue;
+                    }
+                    if (k == k_as && tables == table_state::after_name)
+                    {
+                        tables = table_state::after_as;
+                        continue;
+                    }
+                    if (named && k == k_none && tables != table_state::after_alias)
+                    {
+                        tables = table_state::after_alias;
+                        continue;
+                    }
+                    tables = table_state::none;
+                    break;
+                }
+
+                // (SELECT ...) UNION (SELECT ...) starts with its verb all the same
+                if (t.type != token_type::word && t.type != token_type::open)
+                    at_start = false;
+
+                switch (t.type)
+                {
+                case token_type::open:
+                    depth++;
+                    break;
+                case token_type::close:
+                    if (depth > 0)
+                        depth--;
+                    break;
+                case token_type::variable:
+                    // @@system variables are read as they are everywhere
+                    if (t.length < 2 || query[t.offset + 1] != '@')
+                        out.effects |= user_variables;
+                    break;
+                case token_type::word:
+                    if (at_start)
+                    {
+                        at_start = false;
+                        switch (k)
+                        {
+                        case k_select:
+                            set_type(statement_type::select);
+                            break;
+                        case k_table:
+                            // TABLE t, the short SELECT * FROM t
+                            set_type(statement_type::select);
+                            tables = table_state::expect;
+                            break;
+                        case k_insert:
+                            set_type(statement_type::insert);
+                            tables = table_state::expect;
+                            break;
+                        case k_replace:
+                            set_type(statement_type::replace);
+                            tables = table_state::expect;
+                            break;
+                        case k_update:
+                            set_type(statement_type::update);
+                            tables = table_state::expect;
+                            break;
+                        case k_delete:
+                            set_type(statement_type::delete_);
+                            tables = table_state::expect;
+                            break;
+                        case k_load:
+                            set_type(statement_type::load);
+                            break;
+                        case k_call:
+                            set_type(statement_type::call);
+                            break;
+                        case k_do:
+                            set_type(statement_type::do_);
+                            break;
+                        case k_begin:
+                            set_type(statement_type::begin);
+                            break;
+                        case k_commit:
+                            set_type(statement_type::commit);
+                            break;
+                        case k_rollback:
+                            set_type(statement_type::rollback);
+                            break;
+                        case k_savepoint:
+                        case k_release:
+                            set_type(statement_type::savepoint);
+                            break;
+                        case k_set:
+                            set_type(statement_type::set);
+                            out.effects |= sets_variables;
+                            break;
+                        case k_use:
+                            set_type(statement_type::use);
+                            out.effects |= changes_schema;
+                            break;
+                        case k_show:
+                            set_type(statement_type::show);
+                            break;
+                        case k_describe:
+                        case k_desc:
+                            set_type(statement_type::describe);
+                            tables = table_state::expect;
+                            break;
+                        case k_explain:
+                            set_type(statement_type::describe);
+                            break;
+                        case k_lock:
+                            set_type(statement_type::lock_tables);
+                            out.effects |= takes_locks;
+                            break;
+                        case k_unlock:
+                            set_type(statement_type::unlock_tables);
+                            break;
+                        case k_prepare:
+                            set_type(statement_type::prepare);
+                            out.effects |= server_statements;
+                            break;
+                        case k_execute:
+                            set_type(statement_type::execute);
+                            out.effects |= server_statements;
+                            break;
+                        case k_deallocate:
+                            set_type(statement_type::deallocate);
+                            out.effects |= server_statements;
+                            break;
+                        case k_handler:
+                            set_type(statement_type::handler);
+                            out.effects |= server_statements;
+                            tables = table_state::expect;
+                            break;
+                        case k_truncate:
+                            set_type(statement_type::ddl);
+                            tables = table_state::expect;
+                            break;
+                        case k_create:
+                        case k_alter:
+                        case k_drop:
+                        case k_rename:
+                            set_type(statement_type::ddl);
+                            break;
+                        case k_xa:
+                            set_type(statement_type::xa);
+                            break;
+                        case k_with:
+                            // the statement comes after the common table
+                            // expressions, at the same depth
+                            with = true;
+                            with_depth = depth;
+                            break;
+                        default:
+                            break;
+                        }
+                        break;
+                    }
+
+                    switch (k)
+                    {
+                    case k_select:
+                    case k_insert:
+                    case k_replace:
+                    case k_update:
+                    case k_delete:
+                        if (with && depth == with_depth)
+                        {
+                            with = false;
+                            set_type(k == k_select ? statement_type::select
+                                     : k == k_insert ? statement_type::insert
+                                     : k == k_replace ? statement_type::replace
+                                     : k == k_update ? statement_type::update
+                                     : statement_type::delete_);
+                            if (k != k_select)
+                                tables = table_state::expect;
+                        }
+                        else if (k == k_update && prev == k_for)
+                            out.effects |= locking_read;
+                        break;
+                    case k_from:
+                    case k_join:
+                        tables = table_state::expect;
+                        break;
+                    case k_into:
+                        if (current == statement_type::select)
+                            out.effects |= select_into;
+                        else
+                            tables = table_state::expect;
+                        break;
+                    case k_table:
+                    case k_tables:
+                        if (current == statement_type::ddl || current == statement_type::lock_tables ||
+                            current == statement_type::other)
+                            tables = table_state::expect;
+                        break;
+                    case k_share:
+                        if (prev == k_for)
+                            out.effects |= locking_read;
+                        break;
+                    case k_in:
+                        if (prev == k_lock)
+                            out.effects |= locking_read;
+                        break;
+                    case k_temporary:
+                        if (current == statement_type::ddl)
+                            out.effects |= temporary_tables;
+                        break;
+                    case k_prepare:
+                        // DROP PREPARE
+                        if (prev == k_drop)
+                            out.effects |= server_statements;
+                        break;
+                    case k_transaction:
+                        if (prev == k_start && current == statement_type::other)
+                            set_type(statement_type::begin);
+                        break;
+                    case k_to:
+                        if (prev == k_rollback)
+                            set_type(statement_type::savepoint);
+                        break;
+                    case k_last_insert_id:
+                    case k_found_rows:
+                    case k_row_count:
+                    case k_sql_calc_found_rows:
+                        out.effects |= reads_session;
+                        break;
+                    case k_get_lock:
+                    case k_release_lock:
+                    case k_release_all_locks:
+                        out.effects |= takes_locks;
+                        break;
+                    default:
+                        break;
+                    }
+                    break;
+                default:
+                    break;
+                }
+
+                prev = k;
+            }
+
+            if (tables == table_state::after_name || tables == table_state::dot)
+                commit_table();
+            if (lex.executable_comment())
+                out.effects |= executable_comment;
+        }
+    }
+}
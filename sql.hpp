@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace db_proxy
+{
+    // Lexing and classification of statement text, for decisions made on
+    // every COM_QUERY: where it may run and whether it leaves state on the
+    // connection. One pass over the bytes of the packet, no allocation;
+    // what comes out points into the query.
+    namespace sql
+    {
+        enum class token_type : uint8_t {
+            end,
+            // keyword or identifier
+            word,
+            // `identifier`
+            quoted_name,
+            // 'text' or "text"
+            string,
+            number,
+            // @user, @@system or @@session.name
+            variable,
+            placeholder,
+            op,
+            open,
+            close,
+            comma,
+            dot,
+            semicolon
+        };
+
+        struct token
+        {
+            token_type type = token_type::end;
+            // span in the query, quotes included
+            uint32_t offset = 0;
+            uint32_t length = 0;
+        };
+
+        // Splits a query into tokens. Blanks and comments are skipped; the
+        // body of an executable comment, /*! ... */ or /*!50700 ... */, is
+        // code the server runs and is lexed like the rest. Unterminated
+        // quotes and comments end at the end of the query.
+        class lexer
+        {
+        public:
+            lexer(const uint8_t* query, size_t size) : query_(query), size_(size) {}
+
+            // false at the end of the query
+            bool next(token& t);
+
+            // an executable comment was seen so far
+            bool executable_comment() const { return executable_comment_; }
+
+        private:
+            const uint8_t* query_;
+            size_t size_;
+            size_t i_ = 0;
+            bool in_executable_ = false;
+            bool executable_comment_ = false;
+        };
+
+        enum class statement_type : uint8_t {
+            unknown,
+            select,
+            insert,
+            replace,
+            update,
+            delete_,
+            load,
+            call,
+            do_,
+            // BEGIN, START TRANSACTION
+            begin,
+            commit,
+            rollback,
+            // SAVEPOINT, RELEASE SAVEPOINT, ROLLBACK TO
+            savepoint,
+            set,
+            use,
+            show,
+            // DESCRIBE, EXPLAIN
+            describe,
+            lock_tables,
+            unlock_tables,
+            prepare,
+            execute,
+            deallocate,
+            handler,
+            // CREATE, ALTER, DROP, RENAME, TRUNCATE
+            ddl,
+            xa,
+            other
+        };
+
+        const char* type_name(statement_type type);
+
+        enum effect : uint32_t {
+            // SET of variables, names, character set or transaction
+            sets_variables = 1 << 0,
+            // USE
+            changes_schema = 1 << 1,
+            // @user variables are read or assigned
+            user_variables = 1 << 2,
+            // LOCK TABLES, GET_LOCK()
+            takes_locks = 1 << 3,
+            // CREATE or DROP TEMPORARY TABLE
+            temporary_tables = 1 << 4,
+            // PREPARE, EXECUTE, DEALLOCATE, HANDLER
+            server_statements = 1 << 5,
+            // LAST_INSERT_ID(), FOUND_ROWS(), ROW_COUNT(), SQL_CALC_FOUND_ROWS
+            // depend on the statements before them on the connection
+            reads_session = 1 << 6,
+            // FOR UPDATE, FOR SHARE, LOCK IN SHARE MODE
+            locking_read = 1 << 7,
+            // SELECT ... INTO
+            select_into = 1 << 8,
+            // more than one statement
+            multiple_statements = 1 << 9,
+            // the text holds an executable comment
+            executable_comment = 1 << 10,
+            // only the start of the statement was classified
+            truncated = 1 << 11
+        };
+
+        // effects which leave something behind on the connection
+        const uint32_t session_state = sets_variables | changes_schema | user_variables | takes_locks |
+                                       temporary_tables | server_statements | reads_session;
+
+        // A table named by the statement: [schema.]name, spans in the query
+        // with backticks included; schema_length is 0 without a schema.
+        struct table_ref
+        {
+            uint32_t schema_offset = 0;
+            uint32_t schema_length = 0;
+            uint32_t name_offset = 0;
+            uint32_t name_length = 0;
+        };
+
+        struct classification
+        {
+            static const size_t max_tables = 8;
+
+            // of the first statement
+            statement_type type = statement_type::unknown;
+            uint32_t effects = 0;
+            // the first tables after FROM, JOIN, INTO, UPDATE and TABLE,
+            // in subqueries as well
+            table_ref tables[max_tables];
+            uint8_t table_count = 0;
+            // the statement names more tables than fit
+            bool more_tables = false;
+
+            bool has(effect e) const { return (effects & e) != 0; }
+
+            // A single SELECT which neither writes nor locks and depends on
+            // nothing but the data: a replica can answer it. Anything not
+            // understood is not read only.
+            bool read_only() const;
+
+            bool changes_session_state() const { return (effects & session_state) != 0; }
+        };
+
+        // Classifies query[0..size), which must be shorter than 4 GB.
+        void classify(const uint8_t* query, size_t size, classification& out);
+
+        // text of a span of the query
+        inline std::string_view text(const uint8_t* query, uint32_t offset, uint32_t length)
+        {
+            return std::string_view(reinterpret_cast<const char*>(query) + offset, length);
+        }
+    }
+}
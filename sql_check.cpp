@@ -0,0 +1,204 @@
+#include "sql.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <string>
+
+// Table driven checks of sql::lexer and sql::classify, run by ctest. Every
+// row names what the proxy decides on: the statement type, the effects
+// which pin a session to its backend, and whether a replica may answer.
+namespace db_proxy
+{
+    namespace
+    {
+        using namespace sql;
+
+        const char* token_name(token_type type)
+        {
+            switch (type)
+            {
+            case token_type::end:         return "end";
+            case token_type::word:        return "word";
+            case token_type::quoted_name: return "name";
+            case token_type::string:      return "string";
+            case token_type::number:      return "number";
+            case token_type::variable:    return "variable";
+            case token_type::placeholder: return "placeholder";
+            case token_type::op:          return "op";
+            case token_type::open:        return "open";
+            case token_type::close:       return "close";
+            case token_type::comma:       return "comma";
+            case token_type::dot:         return "dot";
+            case token_type::semicolon:   return "semicolon";
+            }
+            return "?";
+        }
+
+        const uint8_t* bytes(const char* text)
+        {
+            return reinterpret_cast<const uint8_t*>(text);
+        }
+
+        // the tokens of query as "type:text", separated by blanks
+        std::string tokens_of(const char* query)
+        {
+            lexer lex(bytes(query), std::strlen(query));
+            std::string out;
+            token t;
+            while (lex.next(t))
+            {
+                if (!out.empty())
+                    out += ' ';
+                out += token_name(t.type);
+                out += ':';
+                out += text(bytes(query), t.offset, t.length);
+            }
+            return out;
+        }
+
+        struct lexer_case
+        {
+            const char* query;
+            const char* tokens;
+        };
+
+        const lexer_case lexer_cases[] = {
+            {"SELECT a, b FROM t", "word:SELECT word:a comma:, word:b word:FROM word:t"},
+            {"select `a b`.c from d", "word:select name:`a b` dot:. word:c word:from word:d"},
+            {"SELECT 'it''s', \"x\\\"y\"", "word:SELECT string:'it''s' comma:, string:\"x\\\"y\""},
+            {"SELECT 1.5e3, ?, @a, @@session.x", "word:SELECT number:1.5e3 comma:, placeholder:? comma:, "
+                                                 "variable:@a comma:, variable:@@session.x"},
+            {"SELECT 1 -- rest\nFROM t # rest\n/* rest */;", "word:SELECT number:1 word:FROM word:t semicolon:;"},
+            {"SELECT 1 /*!50700 , 2 */ /*M! , 3 */", "word:SELECT number:1 comma:, number:2 comma:, number:3"},
+            {"SELECT 1--2", "word:SELECT number:1 op:- op:- number:2"},
+            // unterminated quotes and comments end at the end of the query
+            {"SELECT 'abc", "word:SELECT string:'abc"},
+            {"SELECT \"ab\\", "word:SELECT string:\"ab\\"},
+            {"SELECT `abc", "word:SELECT name:`abc"},
+            {"SELECT 1 /* abc", "word:SELECT number:1"},
+            {"SELECT 1 /* abc *", "word:SELECT number:1"},
+            {"SELECT 1 /*! , 2", "word:SELECT number:1 comma:, number:2"},
+            {"SELECT 1 -- abc", "word:SELECT number:1"},
+            {"/", "op:/"},
+            {"", ""},
+        };
+
+        enum expect : uint8_t {
+            // the statement pins the session to its backend
+            pins = 1 << 0,
+            // a replica may answer it
+            replica = 1 << 1
+        };
+
+        struct classify_case
+        {
+            const char* query;
+            statement_type type;
+            uint8_t expected;
+            // effects which must be set
+            uint32_t effects;
+        };
+
+        const classify_case classify_cases[] = {
+            {"SELECT * FROM t WHERE id = 1", statement_type::select, replica, 0},
+            {"(SELECT 1) UNION (SELECT 2)", statement_type::select, replica, 0},
+            {"INSERT INTO t VALUES (1)", statement_type::insert, 0, 0},
+            {"BEGIN", statement_type::begin, 0, 0},
+            {"USE db", statement_type::use, pins, changes_schema},
+
+            // SET inside an executable comment is code the server runs
+            {"/*!40101 SET NAMES utf8mb4 */", statement_type::set, pins, sets_variables | executable_comment},
+            {"/*! SET @a = 1 */", statement_type::set, pins, sets_variables | user_variables},
+            {"SELECT 1 /*!, @a := 2 */", statement_type::select, pins, user_variables | executable_comment},
+            {"SELECT 1 /*!50700 , FOUND_ROWS() */", statement_type::select, pins, reads_session},
+            {"/*!SELECT*/ 1", statement_type::select, 0, executable_comment},
+
+            // but not inside strings, quoted names or plain comments
+            {"SELECT '@a', 'FOUND_ROWS()'", statement_type::select, replica, 0},
+            {"SELECT \"@a\", \"LAST_INSERT_ID()\" FROM t", statement_type::select, replica, 0},
+            {"SELECT 'it''s @a', 'x\\'@b'", statement_type::select, replica, 0},
+            {"SELECT `@a`, `FOUND_ROWS` FROM t", statement_type::select, replica, 0},
+            {"SELECT 1 /* @a FOUND_ROWS() */ -- SET @b = 1", statement_type::select, replica, 0},
+            {"SELECT 1 # GET_LOCK('x', 1)", statement_type::select, replica, 0},
+            {"SELECT @a", statement_type::select, pins, user_variables},
+            {"SELECT FOUND_ROWS()", statement_type::select, pins, reads_session},
+            {"SELECT SQL_CALC_FOUND_ROWS * FROM t", statement_type::select, pins, reads_session},
+            {"SELECT GET_LOCK('x', 1)", statement_type::select, pins, takes_locks},
+
+            // locking reads and SELECT ... INTO write
+            {"SELECT * FROM t FOR UPDATE", statement_type::select, 0, locking_read},
+            {"SELECT * FROM t WHERE id = 1 FOR SHARE", statement_type::select, 0, locking_read},
+            {"SELECT * FROM t LOCK IN SHARE MODE", statement_type::select, 0, locking_read},
+            {"SELECT a INTO @x FROM t", statement_type::select, pins, select_into | user_variables},
+            {"SELECT * FROM t INTO OUTFILE '/tmp/t'", statement_type::select, 0, select_into},
+            {"SELECT * INTO DUMPFILE '/tmp/t' FROM t", statement_type::select, 0, select_into},
+            {"SELECT 'FOR UPDATE', 'INTO' FROM t", statement_type::select, replica, 0},
+
+            // WITH takes the type of the statement after its common table expressions
+            {"WITH c AS (SELECT 1) SELECT * FROM c", statement_type::select, replica, 0},
+            {"WITH RECURSIVE c (n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM c WHERE n < 3) SELECT * FROM c",
+             statement_type::select, replica, 0},
+            {"WITH a AS (SELECT 1), b AS (SELECT 2) SELECT * FROM a, b", statement_type::select, replica, 0},
+            {"WITH c AS (SELECT id FROM t) UPDATE t JOIN c USING (id) SET x = 1", statement_type::update, 0, 0},
+            {"WITH c AS (SELECT id FROM t) DELETE FROM t WHERE id IN (SELECT id FROM c)",
+             statement_type::delete_, 0, 0},
+            {"WITH c AS (SELECT 1) SELECT * FROM c FOR UPDATE", statement_type::select, 0, locking_read},
+
+            // unterminated quotes and comments
+            {"SELECT 'abc", statement_type::select, replica, 0},
+            {"SELECT 1 /* FOR UPDATE", statement_type::select, replica, 0},
+            {"SELECT 1 /*! FOR UPDATE", statement_type::select, 0, locking_read | executable_comment},
+            {"SELECT `a", statement_type::select, replica, 0},
+            {"SELECT \"@a", statement_type::select, replica, 0},
+            {"SET @a = '", statement_type::set, pins, sets_variables | user_variables},
+
+            {"SELECT 1; SELECT 2", statement_type::select, 0, multiple_statements},
+            {"", statement_type::unknown, 0, 0},
+        };
+
+        int failures = 0;
+
+        void check_lexer(const lexer_case& c)
+        {
+            const std::string tokens = tokens_of(c.query);
+            if (tokens == c.tokens)
+                return;
+
+            failures++;
+            std::printf("lexer: %s\n  expected: %s\n  got:      %s\n", c.query, c.tokens, tokens.c_str());
+        }
+
+        void check_classify(const classify_case& c)
+        {
+            classification out;
+            classify(bytes(c.query), std::strlen(c.query), out);
+
+            const bool pinned = out.changes_session_state();
+            const bool read_only = out.read_only();
+            if (out.type == c.type && pinned == ((c.expected & pins) != 0) &&
+                read_only == ((c.expected & replica) != 0) && (out.effects & c.effects) == c.effects)
+                return;
+
+            failures++;
+            std::printf("classify: %s\n  expected: %s%s%s effects %#x\n  got:      %s%s%s effects %#x\n", c.query,
+                        type_name(c.type), c.expected & pins ? " pins" : "", c.expected & replica ? " replica" : "",
+                        c.effects, type_name(out.type), pinned ? " pins" : "", read_only ? " replica" : "",
+                        out.effects);
+        }
+    }
+}
+
+int main()
+{
+    using namespace db_proxy;
+
+    for (const lexer_case& c : lexer_cases)
+        check_lexer(c);
+    for (const classify_case& c : classify_cases)
+        check_classify(c);
+
+    const size_t total = std::size(lexer_cases) + std::size(classify_cases);
+    std::printf("%zu of %zu checks passed\n", total - static_cast<size_t>(failures), total);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace db_proxy
+{
+    // Byte classes and scanners every reader of statement text shares:
+    // sql::lexer, the digest normaliser and the query cache. One set of
+    // rules for words, numbers and quotes keeps them from disagreeing on
+    // where a token ends.
+    namespace sql
+    {
+        namespace scan
+        {
+            enum char_class : uint8_t {
+                c_other,
+                c_space,
+                // letters, '_', '$' and UTF-8 bytes
+                c_letter,
+                c_digit,
+                c_quote,
+                c_backtick,
+                c_op,
+                c_open,
+                c_close,
+                c_comma,
+                c_dot,
+                c_semicolon,
+                c_hash,
+                c_placeholder,
+                c_variable
+            };
+
+            struct class_table
+            {
+                uint8_t of[256];
+
+                constexpr class_table() : of()
+                {
+                    for (int c = 0; c < 256; c++)
+                    {
+                        const int lower = c | 0x20;
+                        if ((lower >= 'a' && lower <= 'z') || c == '_' || c == '$' || c >= 0x80)
+                            of[c] = c_letter;
+                        else if (c >= '0' && c <= '9')
+                            of[c] = c_digit;
+                    }
+                    for (char c : {' ', '\t', '\n', '\r', '\f', '\v'})
+                        of[static_cast<uint8_t>(c)] = c_space;
+                    for (char c : {'=', '<', '>', '!', '+', '-', '*', '/', '%', '&', '|', '^', '~', ':'})
+                        of[static_cast<uint8_t>(c)] = c_op;
+                    of[static_cast<uint8_t>('\'')] = c_quote;
+                    of[static_cast<uint8_t>('"')] = c_quote;
+                    of[static_cast<uint8_t>('`')] = c_backtick;
+                    of[static_cast<uint8_t>('(')] = c_open;
+                    of[static_cast<uint8_t>(')')] = c_close;
+                    of[static_cast<uint8_t>(',')] = c_comma;
+                    of[static_cast<uint8_t>('.')] = c_dot;
+                    of[static_cast<uint8_t>(';')] = c_semicolon;
+                    of[static_cast<uint8_t>('#')] = c_hash;
+                    of[static_cast<uint8_t>('?')] = c_placeholder;
+                    of[static_cast<uint8_t>('@')] = c_variable;
+                }
+            };
+
+            inline constexpr class_table classes;
+
+            inline bool is_digit(uint8_t c)
+            {
+                return classes.of[c] == c_digit;
+            }
+
+            inline bool is_word(uint8_t c)
+            {
+                return classes.of[c] == c_letter || classes.of[c] == c_digit;
+            }
+
+            inline bool is_space(uint8_t c)
+            {
+                return classes.of[c] == c_space;
+            }
+
+#if defined(__SSE2__)
+            // bit i set - byte i of v belongs to a word
+            inline unsigned word_mask(__m128i v)
+            {
+                const __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+                const __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                                    _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+                const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                                    _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+                // bytes >= 0x80 are negative, UTF-8 counts as a letter
+                const __m128i rest = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')),
+                                                               _mm_cmpeq_epi8(v, _mm_set1_epi8('$'))),
+                                                  _mm_cmplt_epi8(v, _mm_setzero_si128()));
+                return static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), rest)));
+            }
+#endif
+
+            // length of the identifier or keyword at p
+            inline size_t word_length(const uint8_t* p, size_t size)
+            {
+                size_t i = 0;
+#if defined(__SSE2__)
+                while (i + 16 <= size)
+                {
+                    const unsigned mask = word_mask(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)));
+                    if (mask != 0xffff)
+                        return i + static_cast<size_t>(__builtin_ctz(~mask));
+                    i += 16;
+                }
+#endif
+                while (i < size && is_word(p[i]))
+                    i++;
+                return i;
+            }
+
+            // Length of the quoted text at p up to and including the closing
+            // quote. Doubled quotes are part of it, and so are backslash
+            // escapes except in identifiers.
+            inline size_t skip_quoted(const uint8_t* p, size_t size, uint8_t quote)
+            {
+                const uint8_t escape = quote == '`' ? quote : '\\';
+                size_t i = 0;
+                while (i < size)
+                {
+#if defined(__SSE2__)
+                    const __m128i q = _mm_set1_epi8(static_cast<char>(quote));
+                    const __m128i e = _mm_set1_epi8(static_cast<char>(escape));
+                    // 32 bytes a round, long literals are what bulk loads send
+                    while (i + 32 <= size)
+                    {
+                        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+                        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 16));
+                        const unsigned mask =
+                                static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(a, q),
+                                                                                     _mm_cmpeq_epi8(a, e)))) |
+                                static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(b, q),
+                                                                                     _mm_cmpeq_epi8(b, e)))) << 16;
+                        if (mask)
+                        {
+                            i += static_cast<size_t>(__builtin_ctz(mask));
+                            break;
+                        }
+                        i += 32;
+                    }
+                    if (i + 16 <= size)
+                    {
+                        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+                        const unsigned mask = static_cast<unsigned>(
+                                    _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_cmpeq_epi8(v, e))));
+                        i += mask ? static_cast<size_t>(__builtin_ctz(mask)) : 16;
+                    }
+#endif
+                    while (i < size && p[i] != quote && p[i] != escape)
+                        i++;
+                    if (i >= size)
+                        break;
+
+                    if (p[i] != quote)
+                        i += 2;
+                    else if (i + 1 < size && p[i + 1] == quote)
+                        i += 2;
+                    else
+                        return i + 1;
+                }
+                return size;
+            }
+
+            // Length of the number at p, which starts with a digit or '.':
+            // digits, fraction, exponent, 0x and 0b forms.
+            inline size_t number_length(const uint8_t* p, size_t size)
+            {
+                size_t i = 0;
+                for (;;)
+                {
+                    i += word_length(p + i, size - i);
+                    if (i >= size)
+                        break;
+                    if (p[i] == '.')
+                        i++;
+                    else if ((p[i] == '+' || p[i] == '-') && i > 0 && (p[i - 1] | 0x20) == 'e' &&
+                             classes.of[p[0]] != c_letter)
+                        i++;
+                    else
+                        break;
+                }
+                return i;
+            }
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#include "statement_cache.hpp"
+#include "protocol.hpp"
+
+namespace db_proxy
+{
+    statement_cache::statement_cache(size_t max_entries)
+        : max_entries_(max_entries)
+    {
+    }
+
+    statement_cache::statement_ptr statement_cache::find(const std::string& key)
+    {
+        auto it = index_.find(key);
+        if (it == index_.end())
+            return nullptr;
+
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return *it->second;
+    }
+
+    statement_cache::statement_ptr statement_cache::insert(const std::string& key, const std::string& text,
+                                                           std::vector<uint8_t> response)
+    {
+        auto statement = make(key, text, std::move(response));
+        if (max_entries_ == 0)
+            return statement;
+
+        auto it = index_.find(key);
+        if (it != index_.end())
+        {
+            lru_.erase(it->second);
+            index_.erase(it);
+        }
+
+        while (index_.size() >= max_entries_)
+        {
+            index_.erase(lru_.back()->key);
+            lru_.pop_back();
+        }
+
+        lru_.push_front(statement);
+        index_.emplace(key, lru_.begin());
+        return statement;
+    }
+
+    statement_cache::statement_ptr statement_cache::make(const std::string& key, const std::string& text,
+                                                         std::vector<uint8_t> response)
+    {
+        auto statement = std::make_shared<statement_cache::statement>();
+        statement->key = key;
+        statement->text = text;
+        // status, statement id, columns, params
+        if (response.size() >= My::header_size + 1 + 4 + 2 + 2)
+            statement->params = static_cast<uint16_t>(My::read_int<2>(&response[My::header_size + 1 + 4 + 2]));
+        statement->response = std::move(response);
+        return statement;
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace db_proxy
+{
+    // COM_STMT_PREPARE responses of one shard, keyed like query_cache by
+    // schema, character set and statement text. A pooled session answers
+    // a client's prepare of a known text from here without a backend and
+    // hands out an id of its own; the statement is prepared on a backend
+    // connection only when it is executed there for the first time.
+    //
+    // Sessions keep the entries of their statements, so evicting the least
+    // recently used one never invalidates a client's statement.
+    class statement_cache
+    {
+    public:
+        struct statement
+        {
+            std::string key;
+            std::string text;
+            // response packets as the backend sent them, headers included:
+            // PREPARE_OK, then parameter and column definitions
+            std::vector<uint8_t> response;
+            uint16_t params = 0;
+        };
+
+        using statement_ptr = std::shared_ptr<const statement>;
+
+        explicit statement_cache(size_t max_entries);
+
+        statement_cache(const statement_cache&) = delete;
+        statement_cache& operator=(const statement_cache&) = delete;
+
+        // nullptr on a miss
+        statement_ptr find(const std::string& key);
+
+        // response must start with a PREPARE_OK packet
+        statement_ptr insert(const std::string& key, const std::string& text, std::vector<uint8_t> response);
+
+        // A statement kept out of the cache, e.g. for a session whose state
+        // may resolve the text differently than other sessions'.
+        static statement_ptr make(const std::string& key, const std::string& text, std::vector<uint8_t> response);
+
+        size_t entries() const { return index_.size(); }
+
+    private:
+        using entry_list = std::list<statement_ptr>;
+
+        size_t max_entries_;
+        // most recently used first
+        entry_list lru_;
+        std::unordered_map<std::string, entry_list::iterator> index_;
+    };
+}
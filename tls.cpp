@@ -0,0 +1,251 @@
+#include "tls.hpp"
+
+#include "protocol.hpp"
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <stdexcept>
+
+namespace db_proxy
+{
+    namespace
+    {
+        enum ErrorCode : uint16_t {
+            ER_ACCESS_DENIED_ERROR        = 1045,
+            ER_SECURE_TRANSPORT_REQUIRED  = 3159
+        };
+
+        // sessions are only resumed with the context that issued them
+        const unsigned char session_id_context[] = "db-proxy";
+
+        [[noreturn]] void fail(const std::string& what)
+        {
+            char reason[256] = "unknown error";
+            if (const unsigned long e = ERR_get_error())
+                ERR_error_string_n(e, reason, sizeof(reason));
+            ERR_clear_error();
+            throw std::runtime_error(what + ": " + reason);
+        }
+
+        // what both ends of the proxy have in common
+        SSL_CTX* new_context(const SSL_METHOD* method, const tls_options& options)
+        {
+            SSL_CTX* ctx = SSL_CTX_new(method);
+            if (!ctx)
+                fail("SSL_CTX_new");
+
+            SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+            uint64_t flags = SSL_OP_NO_RENEGOTIATION;
+#if defined(SSL_OP_ENABLE_KTLS)
+            // OpenSSL hands the keys to the kernel after the handshake when
+            // the cipher and the kernel allow, and stays in user space when not
+            if (options.ktls)
+                flags |= SSL_OP_ENABLE_KTLS;
+#endif
+#if defined(SSL_OP_IGNORE_UNEXPECTED_EOF)
+            // Clients and servers mostly close after COM_QUIT without
+            // close_notify. That is no truncation, packets carry their length,
+            // and must not cost the session its resumption.
+            flags |= SSL_OP_IGNORE_UNEXPECTED_EOF;
+#endif
+            SSL_CTX_set_options(ctx, flags);
+
+            // Writes take what the socket takes, like the plain relay's, and
+            // are repeated from the ring, where the rest may have moved. An
+            // idle link gives its record buffers back.
+            SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                  SSL_MODE_RELEASE_BUFFERS);
+            return ctx;
+        }
+    }
+
+    tls_connection::~tls_connection()
+    {
+        SSL_free(ssl_);
+    }
+
+    tls_connection::status tls_connection::handshake()
+    {
+        return result(SSL_do_handshake(ssl_));
+    }
+
+    tls_connection::status tls_connection::read(void* data, size_t size, size_t& n)
+    {
+        n = 0;
+        return result(SSL_read_ex(ssl_, data, size, &n));
+    }
+
+    tls_connection::status tls_connection::write(const void* data, size_t size, size_t& n)
+    {
+        n = 0;
+        return result(SSL_write_ex(ssl_, data, size, &n));
+    }
+
+    void tls_connection::shutdown()
+    {
+        if (SSL_is_init_finished(ssl_))
+            SSL_shutdown(ssl_);
+        ERR_clear_error();
+    }
+
+    bool tls_connection::pending() const
+    {
+        return SSL_has_pending(ssl_) == 1;
+    }
+
+    bool tls_connection::resumed() const
+    {
+        return SSL_session_reused(ssl_) == 1;
+    }
+
+    bool tls_connection::kernel_send() const
+    {
+        return BIO_get_ktls_send(SSL_get_wbio(ssl_));
+    }
+
+    bool tls_connection::kernel_receive() const
+    {
+        return BIO_get_ktls_recv(SSL_get_rbio(ssl_));
+    }
+
+    tls_connection::status tls_connection::result(int ret)
+    {
+        if (ret > 0)
+            return done;
+
+        switch (SSL_get_error(ssl_, ret))
+        {
+        case SSL_ERROR_WANT_READ:
+            return want_read;
+        case SSL_ERROR_WANT_WRITE:
+            return want_write;
+        default:
+            // the error queue is the thread's, the next link must not see it
+            ERR_clear_error();
+            return failed;
+        }
+    }
+
+    tls_context::tls_context(const tls_options& options)
+        : options_(options)
+    {
+        try
+        {
+            server_ = new_context(TLS_server_method(), options_);
+
+            // A resumed session skips the key exchange and the certificate.
+            // Tickets keep the session with the client, encrypted with a key
+            // of the process; without them the session cache remembers them
+            // by id. One ticket per handshake, clients reconnect one at a time.
+            if (!options_.tickets)
+                SSL_CTX_set_options(server_, SSL_OP_NO_TICKET);
+            SSL_CTX_set_num_tickets(server_, 1);
+            SSL_CTX_set_session_id_context(server_, session_id_context, sizeof(session_id_context) - 1);
+            if (options_.session_cache > 0)
+            {
+                SSL_CTX_set_session_cache_mode(server_, SSL_SESS_CACHE_SERVER);
+                SSL_CTX_sess_set_cache_size(server_, static_cast<long>(options_.session_cache));
+            }
+            else
+                SSL_CTX_set_session_cache_mode(server_, SSL_SESS_CACHE_OFF);
+
+            if (SSL_CTX_use_certificate_chain_file(server_, options_.certificate.c_str()) != 1)
+                fail("certificate " + options_.certificate);
+            const std::string& key = options_.key.empty() ? options_.certificate : options_.key;
+            if (SSL_CTX_use_PrivateKey_file(server_, key.c_str(), SSL_FILETYPE_PEM) != 1)
+                fail("private key " + key);
+            if (SSL_CTX_check_private_key(server_) != 1)
+                fail("private key " + key);
+
+            if (options_.backend)
+            {
+                client_ = new_context(TLS_client_method(), options_);
+
+                // the sessions the backend issues are kept here, one at a time
+                SSL_CTX_set_app_data(client_, this);
+                SSL_CTX_set_session_cache_mode(client_, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+                SSL_CTX_sess_set_new_cb(client_, &tls_context::new_backend_session);
+
+                if (!options_.backend_ca.empty())
+                {
+                    if (SSL_CTX_load_verify_locations(client_, options_.backend_ca.c_str(), nullptr) != 1)
+                        fail("backend CA " + options_.backend_ca);
+                    SSL_CTX_set_verify(client_, SSL_VERIFY_PEER, nullptr);
+                }
+            }
+        }
+        catch(...)
+        {
+            SSL_CTX_free(client_);
+            SSL_CTX_free(server_);
+            throw;
+        }
+    }
+
+    tls_context::~tls_context()
+    {
+        SSL_SESSION_free(backend_session_);
+        SSL_CTX_free(client_);
+        SSL_CTX_free(server_);
+    }
+
+    std::unique_ptr<tls_connection> tls_context::accept(int fd)
+    {
+        SSL* ssl = SSL_new(server_);
+        if (!ssl)
+            return nullptr;
+
+        std::unique_ptr<tls_connection> connection(new tls_connection(ssl));
+        if (SSL_set_fd(ssl, fd) != 1)
+            return nullptr;
+        SSL_set_accept_state(ssl);
+        return connection;
+    }
+
+    std::unique_ptr<tls_connection> tls_context::connect(int fd, const std::string& host)
+    {
+        SSL* ssl = SSL_new(client_);
+        if (!ssl)
+            return nullptr;
+
+        std::unique_ptr<tls_connection> connection(new tls_connection(ssl));
+        if (SSL_set_fd(ssl, fd) != 1)
+            return nullptr;
+        if (!options_.backend_ca.empty() && SSL_set1_host(ssl, host.c_str()) != 1)
+            return nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (backend_session_)
+                SSL_set_session(ssl, backend_session_);
+        }
+
+        SSL_set_connect_state(ssl);
+        return connection;
+    }
+
+    void tls_context::write_insecure_error(std::vector<uint8_t>& out, uint8_t sequence_id)
+    {
+        My::write_err(out, sequence_id, ER_SECURE_TRANSPORT_REQUIRED, "08004",
+                      "Connections using insecure transport are prohibited by db-proxy");
+    }
+
+    void tls_context::write_cleartext_password_error(std::vector<uint8_t>& out, uint8_t sequence_id)
+    {
+        My::write_err(out, sequence_id, ER_ACCESS_DENIED_ERROR, "28000",
+                      "Access denied: db-proxy doesn't send passwords in the clear to a backend without TLS");
+    }
+
+    int tls_context::new_backend_session(SSL* ssl, SSL_SESSION* session)
+    {
+        tls_context* self = static_cast<tls_context*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+
+        std::lock_guard<std::mutex> lock(self->mutex_);
+        SSL_SESSION_free(self->backend_session_);
+        self->backend_session_ = session;
+        // the session is ours now
+        return 1;
+    }
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_session_st SSL_SESSION;
+
+namespace db_proxy
+{
+    struct tls_options
+    {
+        // PEM certificate chain and key clients are offered, empty - no TLS
+        std::string certificate;
+        std::string key;
+        // sessions kept for resumption by session id, 0 - none
+        size_t session_cache = 20480;
+        // session tickets, stateless resumption with a key of the process
+        bool tickets = true;
+        // the kernel encrypts and decrypts records where it can (kTLS)
+        bool ktls = true;
+        // clients that log in without TLS are refused
+        bool required = false;
+        // TLS to the backend too, plaintext otherwise
+        bool backend = false;
+        // CA file the backend's certificate is verified with, empty - it isn't
+        std::string backend_ca;
+
+        bool enabled() const { return !certificate.empty(); }
+    };
+
+    // One TLS link over a non-blocking socket the session owns. The calls
+    // never block: they say what the socket has to become ready for before
+    // they are worth repeating. A write that has to be repeated must be
+    // repeated with at least the bytes it was given, its buffer may move.
+    class tls_connection
+    {
+    public:
+        enum status {
+            done,
+            want_read,
+            want_write,
+            // the peer closed the link or broke the protocol
+            failed
+        };
+
+        explicit tls_connection(SSL* ssl) : ssl_(ssl) {}
+        ~tls_connection();
+
+        tls_connection(const tls_connection&) = delete;
+        tls_connection& operator=(const tls_connection&) = delete;
+
+        status handshake();
+        // n - bytes read or written, also when it isn't done
+        status read(void* data, size_t size, size_t& n);
+        status write(const void* data, size_t size, size_t& n);
+        // Sends close_notify if the socket takes it at once, which keeps
+        // the session resumable. The socket must still be open.
+        void shutdown();
+
+        // records already received hold data, read() before waiting
+        bool pending() const;
+        // the handshake resumed a session instead of a full key exchange
+        bool resumed() const;
+        // The kernel took over the records of a direction after the
+        // handshake; what the socket sends is then encrypted without
+        // passing through write().
+        bool kernel_send() const;
+        bool kernel_receive() const;
+
+    private:
+        status result(int ret);
+
+        SSL* ssl_;
+    };
+
+    // TLS configuration shared by the sessions of all shards: certificate,
+    // session cache and ticket keys towards the clients, and the last
+    // session of the backend to resume the next link with. OpenSSL locks
+    // the contexts itself.
+    class tls_context
+    {
+    public:
+        // throws std::runtime_error with OpenSSL's reason
+        explicit tls_context(const tls_options& options);
+        ~tls_context();
+
+        tls_context(const tls_context&) = delete;
+        tls_context& operator=(const tls_context&) = delete;
+
+        const tls_options& options() const { return options_; }
+
+        // The proxy's end of a client's link, nullptr when OpenSSL fails.
+        std::unique_ptr<tls_connection> accept(int fd);
+        // The proxy's end of a backend link, host is checked against the
+        // certificate when it is verified.
+        std::unique_ptr<tls_connection> connect(int fd, const std::string& host);
+
+        // ERR of a plaintext login while TLS is required
+        static void write_insecure_error(std::vector<uint8_t>& out, uint8_t sequence_id);
+        // ERR of a login that would send the password in the clear over a
+        // plaintext backend link
+        static void write_cleartext_password_error(std::vector<uint8_t>& out, uint8_t sequence_id);
+
+    private:
+        static int new_backend_session(SSL* ssl, SSL_SESSION* session);
+
+        const tls_options options_;
+        SSL_CTX* server_ = nullptr;
+        SSL_CTX* client_ = nullptr;
+        std::mutex mutex_;
+        // the newest session the backend issued, nullptr - none yet
+        SSL_SESSION* backend_session_ = nullptr;
+    };
+}
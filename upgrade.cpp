@@ -0,0 +1,266 @@
+#include "upgrade.hpp"
+
+#if defined(DB_PROXY_HAS_UPGRADE)
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <system_error>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace db_proxy
+{
+    namespace
+    {
+        const char magic[4] = {'D', 'B', 'P', 'X'};
+
+        // listening sockets of one handoff, one per shard at most
+        const size_t max_sockets = 1024;
+
+        // the new process accepts on the sockets
+        const char ready_message = 'R';
+        // the old process no longer does
+        const char stopped_message = 'S';
+
+        // how long the new process waits for the old one at each step
+        const time_t reply_timeout = 10;
+
+        struct handoff_header
+        {
+            char magic[4];
+            uint32_t count;
+        };
+
+        std::system_error last_error(const std::string& what)
+        {
+            return std::system_error(errno, std::generic_category(), what);
+        }
+
+        sockaddr_un unix_address(const std::string& path)
+        {
+            sockaddr_un address{};
+            if (path.empty() || path.size() >= sizeof(address.sun_path))
+                throw std::runtime_error("upgrade socket path must be 1 to " +
+                                         std::to_string(sizeof(address.sun_path) - 1) + " bytes");
+            address.sun_family = AF_UNIX;
+            std::memcpy(address.sun_path, path.data(), path.size());
+            return address;
+        }
+    }
+
+    takeover::takeover(const std::string& path)
+    {
+        const sockaddr_un address = unix_address(path);
+
+        fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd_ < 0)
+            throw last_error("can't create upgrade socket");
+
+        if (::connect(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+        {
+            const int error = errno;
+            ::close(fd_);
+            fd_ = -1;
+            // no process to take over from, a first start
+            if (error == ENOENT || error == ECONNREFUSED)
+                return;
+            throw std::system_error(error, std::generic_category(), "can't connect to upgrade socket " + path);
+        }
+
+        // a process that accepts but never answers must not keep this one
+        // from starting on its own
+        timeval timeout{reply_timeout, 0};
+        ::setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        handoff_header header{};
+        iovec data{&header, sizeof(header)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * max_sockets)];
+        msghdr message{};
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        int flags = 0;
+#if defined(MSG_CMSG_CLOEXEC)
+        flags |= MSG_CMSG_CLOEXEC;
+#endif
+        ssize_t n;
+        do
+            n = ::recvmsg(fd_, &message, flags);
+        while (n < 0 && errno == EINTR);
+        const int error = errno;
+
+        for (cmsghdr* c = CMSG_FIRSTHDR(&message); c; c = CMSG_NXTHDR(&message, c))
+        {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+                continue;
+            const size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const size_t first = sockets_.size();
+            sockets_.resize(first + count);
+            std::memcpy(sockets_.data() + first, CMSG_DATA(c), count * sizeof(int));
+        }
+
+        const char* failure = nullptr;
+        if (n < 0)
+            failure = "can't receive the listening sockets";
+        else if (static_cast<size_t>(n) != sizeof(header) || std::memcmp(header.magic, magic, sizeof(magic)) != 0)
+            failure = "no db-proxy at the upgrade socket";
+        else if ((message.msg_flags & MSG_CTRUNC) || header.count != sockets_.size() || sockets_.empty())
+            failure = "incomplete listening sockets";
+
+        if (failure)
+        {
+            for (int fd : sockets_)
+                ::close(fd);
+            sockets_.clear();
+            ::close(fd_);
+            fd_ = -1;
+            throw std::system_error(n < 0 ? error : EPROTO, std::generic_category(),
+                                    std::string(failure) + " from " + path);
+        }
+    }
+
+    takeover::~takeover()
+    {
+        // closed before ready(), the old process goes on serving
+        if (fd_ >= 0)
+            ::close(fd_);
+    }
+
+    void takeover::ready()
+    {
+        if (fd_ < 0)
+            return;
+
+        char reply = 0;
+        ssize_t n;
+        do
+            n = ::send(fd_, &ready_message, 1, MSG_NOSIGNAL);
+        while (n < 0 && errno == EINTR);
+        if (n == 1)
+        {
+            do
+                n = ::recv(fd_, &reply, 1, 0);
+            while (n < 0 && errno == EINTR);
+        }
+
+        // both accept on the sockets for a while, nothing is lost by that
+        if (n != 1 || reply != stopped_message)
+            std::cerr << "Upgrade: the old process did not confirm, it may still accept" << std::endl;
+
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+    upgrade_listener::upgrade_listener(net::io_context& ios, const std::string& path,
+                                       sockets_function sockets, std::function<void()> handed_over)
+        : acceptor_(ios),
+          peer_(ios),
+          sockets_(std::move(sockets)),
+          handed_over_(std::move(handed_over))
+    {
+        unix_address(path);
+        // a socket file left by a process that exited, or by the one just
+        // taken over from, which no longer accepts on it
+        ::unlink(path.c_str());
+
+        const net::local::stream_protocol::endpoint endpoint(path);
+        acceptor_.open(endpoint.protocol());
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+    }
+
+    void upgrade_listener::start()
+    {
+        acceptor_.async_accept(peer_, std::bind(&upgrade_listener::handle_accept, this, std::placeholders::_1));
+    }
+
+    void upgrade_listener::handle_accept(const boost::system::error_code& error)
+    {
+        if (error)
+        {
+            if (error != net::error::operation_aborted)
+                std::cerr << "upgrade: " << error.message() << std::endl;
+            return;
+        }
+
+        const std::vector<int> sockets = sockets_();
+        if (sockets.empty() || sockets.size() > max_sockets)
+        {
+            abort("no listening sockets to hand over");
+            return;
+        }
+
+        handoff_header header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.count = static_cast<uint32_t>(sockets.size());
+
+        iovec data{&header, sizeof(header)};
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * sockets.size()));
+        msghdr message{};
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = control.size();
+
+        cmsghdr* c = CMSG_FIRSTHDR(&message);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * sockets.size());
+        std::memcpy(CMSG_DATA(c), sockets.data(), sizeof(int) * sockets.size());
+
+        // a few bytes into an empty socket buffer, it doesn't block
+        ssize_t n;
+        do
+            n = ::sendmsg(peer_.native_handle(), &message, MSG_NOSIGNAL);
+        while (n < 0 && errno == EINTR);
+        if (n != static_cast<ssize_t>(sizeof(header)))
+        {
+            abort(std::string("can't send the listening sockets: ") + std::strerror(errno));
+            return;
+        }
+
+        net::async_read(peer_, net::buffer(&message_, 1),
+                        std::bind(&upgrade_listener::handle_ready, this, std::placeholders::_1));
+    }
+
+    void upgrade_listener::handle_ready(const boost::system::error_code& error)
+    {
+        if (error || message_ != ready_message)
+        {
+            abort("the new process did not start");
+            return;
+        }
+
+        // The new process unlinks the path and listens there for the next
+        // upgrade once it has the reply, the path is not unlinked here.
+        boost::system::error_code ignored;
+        acceptor_.close(ignored);
+        handed_over_();
+
+        net::write(peer_, net::buffer(&stopped_message, 1), ignored);
+        peer_.close(ignored);
+    }
+
+    void upgrade_listener::abort(const std::string& reason)
+    {
+        std::cerr << "Upgrade aborted, " << reason << ", still serving" << std::endl;
+
+        boost::system::error_code ignored;
+        peer_.close(ignored);
+        start();
+    }
+}
+
+#endif
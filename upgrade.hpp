@@ -0,0 +1,82 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS) && !defined(_WIN32)
+#define DB_PROXY_HAS_UPGRADE 1
+#endif
+
+#if defined(DB_PROXY_HAS_UPGRADE)
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace net = boost::asio;
+
+namespace db_proxy
+{
+    // Binary upgrade over a Unix socket. The running process listens on it;
+    // a new process started with the same path connects and receives the
+    // listening sockets with SCM_RIGHTS. Both accept on them until the new
+    // one is ready, then the old one stops accepting, confirms and drains
+    // its sessions. The sockets stay open throughout, so connections waiting
+    // in the backlog are never refused.
+
+    // The new process's end.
+    class takeover
+    {
+    public:
+        // Connects to the process listening at path and receives its
+        // sockets, none when nothing listens there. Throws std::system_error
+        // when the handoff fails.
+        explicit takeover(const std::string& path);
+        ~takeover();
+
+        takeover(const takeover&) = delete;
+        takeover& operator=(const takeover&) = delete;
+
+        // bound and listening, they belong to the caller
+        const std::vector<int>& sockets() const { return sockets_; }
+
+        // Tells the old process that the sockets are accepted on here and
+        // waits until it stopped accepting. Without the call, e.g. when the
+        // new process fails to start, the old one keeps serving.
+        void ready();
+
+    private:
+        int fd_ = -1;
+        std::vector<int> sockets_;
+    };
+
+    // The running process's end, on the main io_context.
+    class upgrade_listener
+    {
+    public:
+        // the listening sockets to hand over
+        using sockets_function = std::function<std::vector<int>()>;
+
+        // Replaces whatever is left at path. handed_over is called once the
+        // new process is ready and must stop accepting.
+        upgrade_listener(net::io_context& ios, const std::string& path,
+                         sockets_function sockets, std::function<void()> handed_over);
+
+        upgrade_listener(const upgrade_listener&) = delete;
+        upgrade_listener& operator=(const upgrade_listener&) = delete;
+
+        void start();
+
+    private:
+        void handle_accept(const boost::system::error_code& error);
+        void handle_ready(const boost::system::error_code& error);
+        void abort(const std::string& reason);
+
+        net::local::stream_protocol::acceptor acceptor_;
+        net::local::stream_protocol::socket peer_;
+        sockets_function sockets_;
+        std::function<void()> handed_over_;
+        char message_ = 0;
+    };
+}
+
+#endif
@@ -0,0 +1,371 @@
+#include "uring.hpp"
+
+#if defined(DB_PROXY_HAS_IO_URING)
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace db_proxy
+{
+    namespace
+    {
+        // buffer group the receive buffers are provided as
+        const uint16_t buffer_group = 0;
+
+        int io_uring_setup(unsigned entries, io_uring_params* params)
+        {
+            return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+        }
+
+        int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+        {
+            return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+        }
+
+        int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned args)
+        {
+            return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, args));
+        }
+
+        void* map(size_t size, int fd, off_t offset)
+        {
+            void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+            if (p == MAP_FAILED)
+                throw std::system_error(errno, std::generic_category(), "io_uring mmap");
+            return p;
+        }
+
+        void* map_anonymous(size_t size)
+        {
+            void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+                throw std::system_error(errno, std::generic_category(), "mmap");
+            return p;
+        }
+
+        template<typename T>
+        T* at(void* base, unsigned offset)
+        {
+            return reinterpret_cast<T*>(static_cast<uint8_t*>(base) + offset);
+        }
+
+        unsigned round_up_pow2(unsigned n)
+        {
+            unsigned p = 1;
+            while (p < n)
+                p <<= 1;
+            return p;
+        }
+    }
+
+    uring::uring(net::io_context& ios, unsigned entries, unsigned buffers)
+        : ios_(ios), event_(ios)
+    {
+        // provided buffer ids are 16 bit
+        buffer_count_ = round_up_pow2(std::min(std::max(buffers, 1u), 32768u));
+
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        // a multishot receive completes once per chunk
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = std::max(entries, buffer_count_) * 2;
+
+        fd_ = io_uring_setup(entries, &params);
+        if (fd_ < 0)
+            throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+
+        try
+        {
+            if (!(params.features & IORING_FEAT_NODROP))
+                throw std::system_error(ENOTSUP, std::generic_category(), "io_uring without IORING_FEAT_NODROP");
+
+            sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            if (params.features & IORING_FEAT_SINGLE_MMAP)
+                sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+            sq_ring_ = map(sq_ring_size_, fd_, IORING_OFF_SQ_RING);
+            cq_ring_ = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring_
+                                                                   : map(cq_ring_size_, fd_, IORING_OFF_CQ_RING);
+            sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+            sqes_ = static_cast<io_uring_sqe*>(map(sqes_size_, fd_, IORING_OFF_SQES));
+
+            sq_head_ = at<unsigned>(sq_ring_, params.sq_off.head);
+            sq_tail_ = at<unsigned>(sq_ring_, params.sq_off.tail);
+            sq_flags_ = at<unsigned>(sq_ring_, params.sq_off.flags);
+            sq_array_ = at<unsigned>(sq_ring_, params.sq_off.array);
+            sq_mask_ = *at<unsigned>(sq_ring_, params.sq_off.ring_mask);
+            sq_entries_ = params.sq_entries;
+            cq_head_ = at<unsigned>(cq_ring_, params.cq_off.head);
+            cq_tail_ = at<unsigned>(cq_ring_, params.cq_off.tail);
+            cqes_ = at<io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+            cq_mask_ = *at<unsigned>(cq_ring_, params.cq_off.ring_mask);
+
+            // one registered region, every buffer of it is also provided
+            buffers_size_ = size_t(buffer_count_) * buffer_size;
+            buffers_ = static_cast<uint8_t*>(map_anonymous(buffers_size_));
+
+            iovec region;
+            region.iov_base = buffers_;
+            region.iov_len = buffers_size_;
+            if (io_uring_register(fd_, IORING_REGISTER_BUFFERS, &region, 1) < 0)
+                throw std::system_error(errno, std::generic_category(), "io_uring register buffers");
+
+            buffer_ring_size_ = buffer_count_ * sizeof(io_uring_buf);
+            buffer_ring_ = static_cast<io_uring_buf_ring*>(map_anonymous(buffer_ring_size_));
+
+            io_uring_buf_reg reg;
+            std::memset(&reg, 0, sizeof(reg));
+            reg.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+            reg.ring_entries = buffer_count_;
+            reg.bgid = buffer_group;
+            if (io_uring_register(fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+                throw std::system_error(errno, std::generic_category(), "io_uring register buffer ring");
+
+            for (unsigned i = 0; i < buffer_count_; i++)
+                recycle(static_cast<uint16_t>(i));
+
+            event_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (event_fd_ < 0)
+                throw std::system_error(errno, std::generic_category(), "eventfd");
+            event_.assign(event_fd_);
+            if (io_uring_register(fd_, IORING_REGISTER_EVENTFD, &event_fd_, 1) < 0)
+                throw std::system_error(errno, std::generic_category(), "io_uring register eventfd");
+        }
+        catch (...)
+        {
+            release();
+            throw;
+        }
+
+        wait();
+    }
+
+    uring::~uring()
+    {
+        release();
+    }
+
+    void uring::release()
+    {
+        // closing the ring cancels whatever is still in flight, the
+        // handlers of those operations are destroyed with operations_
+        if (fd_ >= 0)
+            ::close(fd_);
+        fd_ = -1;
+
+        if (buffer_ring_)
+            ::munmap(buffer_ring_, buffer_ring_size_);
+        if (buffers_)
+            ::munmap(buffers_, buffers_size_);
+        if (sqes_)
+            ::munmap(sqes_, sqes_size_);
+        if (cq_ring_ && cq_ring_ != sq_ring_)
+            ::munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_)
+            ::munmap(sq_ring_, sq_ring_size_);
+        buffer_ring_ = nullptr;
+        buffers_ = nullptr;
+        sqes_ = nullptr;
+        cq_ring_ = sq_ring_ = nullptr;
+    }
+
+    uint64_t uring::receive(int fd, handler h)
+    {
+        io_uring_sqe* sqe = next_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = buffer_group;
+        sqe->user_data = reinterpret_cast<uint64_t>(start(std::move(h)));
+        return sqe->user_data;
+    }
+
+    void uring::send(int fd, const uint8_t* data, size_t size, handler h)
+    {
+        io_uring_sqe* sqe = next_sqe();
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->len = static_cast<uint32_t>(size);
+        sqe->buf_index = 0;
+        sqe->user_data = reinterpret_cast<uint64_t>(start(std::move(h)));
+    }
+
+    void uring::cancel(uint64_t operation)
+    {
+        io_uring_sqe* sqe = next_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = operation;
+        // the cancel's own completion is not reported
+        sqe->user_data = 0;
+    }
+
+    void uring::recycle(uint16_t id)
+    {
+        // not buffer_ring_->bufs: in C++ the empty struct of the header's
+        // flexible array member shifts it off the start of the ring
+        io_uring_buf& b = reinterpret_cast<io_uring_buf*>(buffer_ring_)[buffer_tail_ & (buffer_count_ - 1)];
+        b.addr = reinterpret_cast<uint64_t>(buffer(id));
+        b.len = buffer_size;
+        b.bid = id;
+        buffer_tail_++;
+        __atomic_store_n(&buffer_ring_->tail, buffer_tail_, __ATOMIC_RELEASE);
+
+        if (!buffer_waiters_.empty())
+        {
+            net::post(ios_, std::move(buffer_waiters_.back()));
+            buffer_waiters_.pop_back();
+        }
+    }
+
+    void uring::wait_buffer(std::function<void()> h)
+    {
+        buffer_waiters_.push_back(std::move(h));
+    }
+
+    io_uring_sqe* uring::next_sqe()
+    {
+        unsigned tail = *sq_tail_;
+        if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_)
+        {
+            // the queue is full of this turn's requests, hand them over early
+            submit();
+            tail = *sq_tail_;
+        }
+
+        const unsigned index = tail & sq_mask_;
+        io_uring_sqe* sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        pending_++;
+
+        schedule_submit();
+        return sqe;
+    }
+
+    uring::operation* uring::start(handler h)
+    {
+        operation* op;
+        if (!free_.empty())
+        {
+            op = free_.back();
+            free_.pop_back();
+        }
+        else
+        {
+            operations_.emplace_back(new operation);
+            op = operations_.back().get();
+        }
+
+        op->h = std::move(h);
+        return op;
+    }
+
+    void uring::submit()
+    {
+        submit_scheduled_ = false;
+
+        while (pending_ > 0)
+        {
+            const int n = io_uring_enter(fd_, pending_, 0, 0);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                // EAGAIN/EBUSY: out of kernel resources or completions
+                // backing up, they are reaped before the next try
+                if (errno == EAGAIN || errno == EBUSY)
+                {
+                    schedule_submit();
+                    return;
+                }
+                throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+            }
+            pending_ -= static_cast<unsigned>(n);
+        }
+    }
+
+    void uring::schedule_submit()
+    {
+        // one io_uring_enter for everything queued by the handlers that run
+        // before it
+        if (!submit_scheduled_)
+        {
+            submit_scheduled_ = true;
+            net::post(ios_, [this] { if (submit_scheduled_) submit(); });
+        }
+    }
+
+    void uring::wait()
+    {
+        event_.async_wait(net::posix::stream_descriptor::wait_read,
+                          std::bind(&uring::handle_completions,
+                                    this,
+                                    std::placeholders::_1));
+    }
+
+    void uring::handle_completions(const boost::system::error_code& error)
+    {
+        if (error)
+            return;
+
+        uint64_t signals;
+        if (::read(event_fd_, &signals, sizeof(signals)) < 0 && errno != EAGAIN)
+            throw std::system_error(errno, std::generic_category(), "eventfd read");
+
+        for (;;)
+        {
+            unsigned head = *cq_head_;
+            const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            if (head == tail)
+            {
+                // completions the kernel kept back while the queue was full
+                if (__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)
+                {
+                    io_uring_enter(fd_, 0, 0, IORING_ENTER_GETEVENTS);
+                    continue;
+                }
+                break;
+            }
+
+            for (; head != tail; head++)
+            {
+                const io_uring_cqe cqe = cqes_[head & cq_mask_];
+                // the slot may be reused by completions of the handler
+                __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+
+                if (cqe.user_data == 0)
+                    continue;
+
+                operation* op = reinterpret_cast<operation*>(cqe.user_data);
+                if (cqe.flags & IORING_CQE_F_MORE)
+                {
+                    op->h(cqe.res, cqe.flags);
+                    continue;
+                }
+
+                handler h = std::move(op->h);
+                op->h = nullptr;
+                free_.push_back(op);
+                h(cqe.res, cqe.flags);
+            }
+        }
+
+        submit();
+        wait();
+    }
+}
+
+#endif
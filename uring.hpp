@@ -0,0 +1,135 @@
+#pragma once
+
+namespace db_proxy
+{
+    class uring;
+}
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// multishot receive into a ring of provided buffers, Linux 6.0
+#if defined(IORING_RECV_MULTISHOT)
+#define DB_PROXY_HAS_IO_URING 1
+#endif
+#endif
+#endif
+
+#if defined(DB_PROXY_HAS_IO_URING)
+
+#include <boost/asio.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace net = boost::asio;
+
+namespace db_proxy
+{
+    // io_uring instance of one shard, driven from the shard's io_context:
+    // the ring signals completions through an eventfd the io_context waits
+    // on, and everything queued while handlers run goes to the kernel in
+    // one io_uring_enter. Receives pick their buffers from a pool that is
+    // both registered with the ring and provided to it, so a multishot
+    // receive keeps reading without a new request per chunk and the chunk
+    // is written out of the same registered buffer.
+    //
+    // All calls are made from the shard's thread.
+    class uring
+    {
+    public:
+        // result - bytes or -errno; flags - of the completion, a multishot
+        // operation is done with the first one without IORING_CQE_F_MORE
+        using handler = std::function<void(int result, uint32_t flags)>;
+
+        enum { buffer_size = 16 * 1024 };
+
+        // entries - submission queue size; buffers - receive buffers,
+        // rounded up to a power of two. Throws std::system_error when the
+        // kernel has no io_uring or lacks a feature.
+        uring(net::io_context& ios, unsigned entries, unsigned buffers);
+        ~uring();
+
+        uring(const uring&) = delete;
+        uring& operator=(const uring&) = delete;
+
+        // Receives from fd into pool buffers, one completion per chunk, until
+        // cancelled, EOF, an error or -ENOBUFS when the pool runs dry.
+        // Returns the id to cancel it with.
+        uint64_t receive(int fd, handler h);
+
+        // Writes data[0..size) of a pool buffer to fd, possibly short.
+        void send(int fd, const uint8_t* data, size_t size, handler h);
+
+        // Stops a multishot receive, its last completion follows.
+        void cancel(uint64_t operation);
+
+        // buffer of a receive completion
+        static uint16_t buffer_id(uint32_t flags) { return static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT); }
+        uint8_t* buffer(uint16_t id) { return buffers_ + size_t(id) * buffer_size; }
+
+        // Gives a received buffer back to the kernel.
+        void recycle(uint16_t id);
+
+        // Runs h once a buffer has been recycled, for receives that ended
+        // with -ENOBUFS.
+        void wait_buffer(std::function<void()> h);
+
+    private:
+        struct operation
+        {
+            handler h;
+        };
+
+        void release();
+        io_uring_sqe* next_sqe();
+        operation* start(handler h);
+        void submit();
+        void schedule_submit();
+        void wait();
+        void handle_completions(const boost::system::error_code& error);
+
+        net::io_context& ios_;
+        int fd_ = -1;
+        int event_fd_ = -1;
+        net::posix::stream_descriptor event_;
+
+        // submission and completion rings shared with the kernel
+        void* sq_ring_ = nullptr;
+        size_t sq_ring_size_ = 0;
+        void* cq_ring_ = nullptr;
+        size_t cq_ring_size_ = 0;
+        io_uring_sqe* sqes_ = nullptr;
+        size_t sqes_size_ = 0;
+        unsigned* sq_head_ = nullptr;
+        unsigned* sq_tail_ = nullptr;
+        unsigned* sq_flags_ = nullptr;
+        unsigned* sq_array_ = nullptr;
+        unsigned sq_mask_ = 0;
+        unsigned sq_entries_ = 0;
+        unsigned* cq_head_ = nullptr;
+        unsigned* cq_tail_ = nullptr;
+        io_uring_cqe* cqes_ = nullptr;
+        unsigned cq_mask_ = 0;
+        // queued and not yet submitted
+        unsigned pending_ = 0;
+        bool submit_scheduled_ = false;
+
+        // receive buffers and the ring they are provided through
+        uint8_t* buffers_ = nullptr;
+        size_t buffers_size_ = 0;
+        io_uring_buf_ring* buffer_ring_ = nullptr;
+        size_t buffer_ring_size_ = 0;
+        unsigned buffer_count_ = 0;
+        uint16_t buffer_tail_ = 0;
+        std::vector<std::function<void()>> buffer_waiters_;
+
+        // user_data of an SQE points to its operation, they are reused
+        std::vector<std::unique_ptr<operation>> operations_;
+        std::vector<operation*> free_;
+    };
+}
+
+#endif